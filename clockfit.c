@@ -0,0 +1,221 @@
+/* clockfit.c
+   Online DOM/DOR clock fit; see clockfit.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <linux/types.h>
+#include "clockfit.h"
+
+#define CLK_BITS 48
+#define CLK_MASK ((1ULL << CLK_BITS)-1)
+
+/* Difference of two 48-bit counter values, either way round */
+static int64_t sdelta(u64 d) {
+  d &= CLK_MASK;
+  return (d & (1ULL << (CLK_BITS-1))) ? (int64_t) d - (int64_t) (1ULL << CLK_BITS)
+    : (int64_t) d;
+}
+
+int clk_init(struct clkfit *f, int window, int dor_clock_mhz) {
+  memset(f, 0, sizeof(*f));
+  if(window <= 0) window = CLK_WINDOW;
+  if(window > CLK_MAXWIN) window = CLK_MAXWIN;
+  f->window = window;
+  f->fdor   = dor_clock_mhz*1.E6;
+  f->pt     = malloc(window*sizeof(struct clkpt));
+  return f->pt ? 0 : -1;
+}
+
+void clk_free(struct clkfit *f) {
+  free(f->pt);
+  f->pt = NULL;
+}
+
+static void start(struct clkfit *f, u64 t0, u64 t1, double rt, double turn) {
+  f->started = 1;
+  f->last_t0 = t0;
+  f->last_t1 = t1;
+  f->dor_acc = f->dom_acc = 0;
+  f->ref_s   = (t1/CLK_DOM_HZ + turn/2) - (t0/f->fdor + rt/2);
+  f->n = f->head = f->nsince = 0;
+}
+
+/* Point scale: the sums use u = (x - xc)/xs so they stay near 1
+   however long the window is */
+static double xscale(const struct clkfit *f) {
+  return f->xs > 0 ? f->xs : 1;
+}
+
+static void sum(struct clkfit *f, const struct clkpt *p, double sign) {
+  double u = (p->x - f->xc)/xscale(f), v = p->y - f->yc, uk = 1;
+  int k;
+  for(k=0; k<5; k++, uk *= u) {
+    f->sx[k] += sign*uk;
+    if(k < 3) f->sy[k] += sign*v*uk;
+  }
+  f->syy += sign*v*v;
+  f->sd  += sign*p->d;
+  f->sdd += sign*p->d*p->d;
+}
+
+/* Re-centre on the window and add it up again, which also throws away
+   the rounding errors of adding and taking away points */
+static void rebuild(struct clkfit *f) {
+  double xmin = 0, xmax = 0, ym = 0;
+  int i;
+  for(i=0; i<f->n; i++) {
+    const struct clkpt *p = &f->pt[(f->head - f->n + i + f->window) % f->window];
+    if(i == 0 || p->x < xmin) xmin = p->x;
+    if(i == 0 || p->x > xmax) xmax = p->x;
+    ym += p->y;
+  }
+  f->xc = (xmin + xmax)/2;
+  f->xs = (xmax - xmin)/2;
+  f->yc = ym/f->n;
+  memset(f->sx, 0, sizeof(f->sx));
+  memset(f->sy, 0, sizeof(f->sy));
+  f->syy = f->sd = f->sdd = 0;
+  for(i=0; i<f->n; i++) sum(f, &f->pt[(f->head - f->n + i + f->window) % f->window], 1);
+  f->nsince = 0;
+}
+
+/* Solve the normal equations for as many coefficients (up to 3) as the
+   points allow */
+static void fit(struct clkfit *f) {
+  int nc, i, j, k;
+  for(nc = f->n < 3 ? f->n : 3; nc > 0; nc--) {
+    double m[3][4];
+    for(i=0; i<nc; i++) {
+      for(j=0; j<nc; j++) m[i][j] = f->sx[i+j];
+      m[i][nc] = f->sy[i];
+    }
+    for(i=0; i<nc; i++) {
+      int p = i;
+      for(j=i+1; j<nc; j++) if(fabs(m[j][i]) > fabs(m[p][i])) p = j;
+      if(fabs(m[p][i]) < 1.E-9*f->n) break;
+      for(k=0; k<=nc; k++) { double t = m[i][k]; m[i][k] = m[p][k]; m[p][k] = t; }
+      for(j=0; j<nc; j++) {
+	if(j == i) continue;
+	double r = m[j][i]/m[i][i];
+	for(k=i; k<=nc; k++) m[j][k] -= r*m[i][k];
+      }
+    }
+    if(i < nc) continue; /* Singular; try fewer */
+    double ssr = f->syy;
+    for(i=0; i<3; i++) f->coef[i] = i < nc ? m[i][nc]/m[i][i] : 0;
+    for(i=0; i<nc; i++) ssr -= f->coef[i]*f->sy[i];
+    f->rms = f->n > nc && ssr > 0 ? sqrt(ssr/(f->n - nc)) : 0;
+    return;
+  }
+  f->coef[0] = f->coef[1] = f->coef[2] = 0;
+  f->rms = 0;
+}
+
+static void add(struct clkfit *f, double x, double y, double d) {
+  struct clkpt p = { x, y, d };
+  if(f->n == f->window) {
+    sum(f, &f->pt[f->head], -1);  /* Oldest, about to be overwritten */
+  } else {
+    f->n++;
+  }
+  f->pt[f->head] = p;
+  f->head = (f->head + 1) % f->window;
+  if(f->n <= CLK_MINPTS || ++f->nsince >= f->window) {
+    rebuild(f);
+  } else {
+    sum(f, &p, 1);
+  }
+  fit(f);
+}
+
+static double predict(const struct clkfit *f, double x) {
+  double u = (x - f->xc)/xscale(f);
+  return f->yc + f->coef[0] + u*(f->coef[1] + u*f->coef[2]);
+}
+
+static void results(const struct clkfit *f, double x, struct clkres *r) {
+  double u = (x - f->xc)/xscale(f), s = xscale(f);
+  r->rms_ns      = f->rms*1.E9;
+  r->offset_s    = f->ref_s + predict(f, x);
+  r->ratio_ppm   = (f->coef[1] + 2*f->coef[2]*u)/s*1.E6;
+  r->drift_ppm_h = 2*f->coef[2]/(s*s)*1.E6*3600.;
+}
+
+int clk_update(struct clkfit *f, u64 dor_t0, u64 dor_t3, u64 dom_t1, u64 dom_t2,
+	       struct clkres *r) {
+  double rt   = ((dor_t3 - dor_t0) & CLK_MASK)/f->fdor;
+  double turn = ((dom_t2 - dom_t1) & CLK_MASK)/CLK_DOM_HZ;
+  double d    = (rt - turn)/2;
+  int64_t dor_acc = 0, dom_acc = 0;
+
+  memset(r, 0, sizeof(*r));
+  r->delay_ns = d*1.E9;
+  if(!f->started) {
+    start(f, dor_t0, dom_t1, rt, turn);
+  } else {
+    dor_acc = f->dor_acc + sdelta(dor_t0 - f->last_t0);
+    dom_acc = f->dom_acc + sdelta(dom_t1 - f->last_t1);
+  }
+  double x = dor_acc/f->fdor + rt/2;
+  double y = dom_acc/CLK_DOM_HZ + turn/2 - x;
+
+  if(f->n >= CLK_MINPTS) {
+    double dm = f->sd/f->n, dv = f->sdd/f->n - dm*dm;
+    r->resid_ns = (y - predict(f, x))*1.E9;
+    if(fabs(r->resid_ns) > CLK_NSIGMA*f->rms*1.E9 + CLK_FLOOR_NS)
+      r->flags |= CLK_OUTLIER;
+    if(fabs(d - dm)*1.E9 > CLK_NSIGMA*(dv > 0 ? sqrt(dv) : 0)*1.E9 + CLK_FLOOR_NS)
+      r->flags |= CLK_DELAY;
+  } else {
+    if(f->n > 0) r->resid_ns = (y - predict(f, x))*1.E9;
+    r->flags |= CLK_WARMUP;
+  }
+
+  if(r->flags & (CLK_OUTLIER|CLK_DELAY)) {
+    f->nout++;
+    if(++f->nbad < CLK_MAXBAD) {
+      results(f, x, r);
+      f->last = *r;
+      return r->flags;
+    }
+    /* Something has changed for good; start again from here */
+    f->nrestart++;
+    start(f, dor_t0, dom_t1, rt, turn);
+    dor_acc = dom_acc = 0;
+    x = rt/2;
+    y = turn/2 - x;
+    r->flags |= CLK_RESTART;
+  }
+
+  f->nbad    = 0;
+  f->dor_acc = dor_acc;
+  f->dom_acc = dom_acc;
+  f->last_t0 = dor_t0;
+  f->last_t1 = dom_t1;
+  add(f, x, y, d);
+  f->nfit++;
+  results(f, x, r);
+  f->last = *r;
+  return r->flags;
+}
+
+void clk_show(FILE *fp, const struct clkres *r) {
+  fprintf(fp, "clk resid(%+.1f) rms(%.1f) delay(%.1f) offset(%.6f) ratio(%+.4f) "
+	  "drift(%+.4f)%s%s%s", r->resid_ns, r->rms_ns, r->delay_ns, r->offset_s,
+	  r->ratio_ppm, r->drift_ppm_h,
+	  (r->flags & CLK_OUTLIER) ? " OUTLIER"  : "",
+	  (r->flags & CLK_DELAY)   ? " BADDELAY" : "",
+	  (r->flags & CLK_RESTART) ? " RESTART"  : "");
+}
+
+void clk_report(FILE *fp, const char *name, const struct clkfit *f) {
+  double dm = f->n ? f->sd/f->n : 0, dv = f->n ? f->sdd/f->n - dm*dm : 0;
+  fprintf(fp, "%s: clock fit %ld points, %ld outliers, %ld restarts; ratio %+.4f ppm, "
+	  "drift %+.4f ppm/h, delay %.1f +- %.1f ns, rms %.1f ns.\n", name, f->nfit,
+	  f->nout, f->nrestart, f->last.ratio_ppm, f->last.drift_ppm_h, dm*1.E9,
+	  dv > 0 ? sqrt(dv)*1.E9 : 0., f->last.rms_ns);
+}
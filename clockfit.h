@@ -0,0 +1,86 @@
+/* clockfit.h
+   Online fit of a DOM's clock against its DOR's from the tcal stream,
+   for tcaltest -c.
+
+   Each good tcal gives a pair of simultaneous times -- the midpoints of
+   the DOR's (t0, t3) and the DOM's (t1, t2), assuming the cable delay
+   is the same both ways -- and the one-way cable delay,
+     ((t3 - t0)/f_dor - (t2 - t1)/f_dom)/2.
+   The DOM minus DOR elapsed time is fitted as a quadratic in DOR time
+   by least squares over a sliding window of the last N accepted
+   points, kept as running sums so each record costs O(1).  That gives
+   the clock offset, the DOM/DOR frequency ratio and its drift.  Each
+   new point is first compared with the fit so far: points too far off,
+   or with an odd cable delay, are flagged and left out, and a run of
+   them (a DOM reboot, say) restarts the fit.  The 48-bit counters are
+   unwrapped record to record, so rollover doesn't matter.
+
+   Must include <linux/types.h> first.
+*/
+
+#ifndef __CLOCKFIT_H__
+#define __CLOCKFIT_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "dh_tcalib.h"
+
+#define CLK_WINDOW    64        /* Default window, points */
+#define CLK_MAXWIN    65536
+#define CLK_MINPTS    8         /* Points accepted untested before that */
+#define CLK_NSIGMA    5.        /* Outlier: more than this many sigma ... */
+#define CLK_FLOOR_NS  100.      /* ... plus this off */
+#define CLK_MAXBAD    5         /* Outliers in a row which restart the fit */
+#define CLK_DOM_HZ    40.E6     /* Nominal DOM clock */
+
+#define CLK_OUTLIER   0x01      /* Time off the fit; not used */
+#define CLK_DELAY     0x02      /* Cable delay off; not used */
+#define CLK_RESTART   0x04      /* Fit restarted from this point */
+#define CLK_WARMUP    0x08      /* Too few points to test this one */
+
+struct clkpt {
+  double x, y, d;               /* DOR s, DOM-DOR s, one-way delay s */
+};
+
+struct clkres {
+  int    flags;
+  double resid_ns;              /* This point against the fit before it */
+  double rms_ns;                /* Residual rms of the fit */
+  double delay_ns;              /* This point's one-way cable delay */
+  double offset_s;              /* DOM minus DOR clock, now */
+  double ratio_ppm;             /* DOM/DOR frequency ratio, from nominal */
+  double drift_ppm_h;           /* Its rate of change */
+};
+
+struct clkfit {
+  int    window;
+  double fdor;                  /* Hz */
+  int    started;
+  u64    last_t0, last_t1;      /* Raw, for unwrapping */
+  int64_t dor_acc, dom_acc;     /* Unwrapped ticks since the first point */
+  double ref_s;                 /* DOM minus DOR clock at the first point */
+  struct clkpt *pt;             /* Ring of the window's points */
+  int    head, n, nsince;       /* nsince: points since sums were rebuilt */
+  double xc, xs, yc;            /* Sums are of (x-xc)/xs and y-yc */
+  double sx[5], sy[3], syy, sd, sdd;
+  double coef[3];               /* y - yc = c0 + c1 u + c2 u^2, u = (x-xc)/xs */
+  double rms;                   /* s */
+  int    nbad;
+  long   nfit, nout, nrestart;
+  struct clkres last;
+};
+
+/* window 0 means CLK_WINDOW.  Returns 0, or -1 if out of memory. */
+int  clk_init(struct clkfit *f, int window, int dor_clock_mhz);
+void clk_free(struct clkfit *f);
+
+/* Add a good tcal; fills in r and returns r->flags */
+int  clk_update(struct clkfit *f, u64 dor_t0, u64 dor_t3, u64 dom_t1, u64 dom_t2,
+		struct clkres *r);
+
+/* One line for a point, without newline, and a summary line for the fit */
+void clk_show(FILE *fp, const struct clkres *r);
+void clk_report(FILE *fp, const char *name, const struct clkfit *f);
+
+#endif /* __CLOCKFIT_H__ */
@@ -0,0 +1,121 @@
+/* comstat.c
+   Parser for the driver's comstat proc file; see comstat.h.
+*/
+
+#include <string.h>
+
+#include "comstat.h"
+
+const char *cs_name[CS_NFIELD] = {
+  "rx_bytes", "rx_msgs", "ninq", "rx_pkts", "rx_acks",
+  "badpkt", "badhdr", "badseq", "rx_nctrl", "rx_nci", "rx_nic",
+  "tx_bytes", "tx_msgs", "noutq", "resent", "tx_pkts", "tx_acks",
+  "nackq", "nretxb", "retxb_bytes", "nretxq", "tx_nctrl", "tx_nci", "tx_nic",
+  "nconnects", "nhdwrtimeouts", "open", "connected"
+};
+
+int cs_is_counter(int field) {
+  return !(field == CS_NINQ || field == CS_NOUTQ || field == CS_NACKQ || field == CS_NRETXQ
+	   || field == CS_NRETXB || field == CS_RETXBBYTES || field == CS_OPEN
+	   || field == CS_CONNECTED);
+}
+
+/* Sections a word can be in; CS_ANY words are found in any of them */
+enum { CS_ANY, CS_RX, CS_TX };
+
+static const struct cskey {
+  int  sec;
+  const char *key;
+  int  field;
+} keys[] = {
+  { CS_RX,  "MSGS",          CS_RXMSGS        },
+  { CS_RX,  "NINQ",          CS_NINQ          },
+  { CS_RX,  "PKTS",          CS_RXPKTS        },
+  { CS_RX,  "ACKS",          CS_RXACKS        },
+  { CS_RX,  "BADPKT",        CS_BADPKT        },
+  { CS_RX,  "BADHDR",        CS_BADHDR        },
+  { CS_RX,  "BADSEQ",        CS_BADSEQ        },
+  { CS_RX,  "NCTRL",         CS_RXNCTRL       },
+  { CS_RX,  "NCI",           CS_RXNCI         },
+  { CS_RX,  "NIC",           CS_RXNIC         },
+  { CS_TX,  "MSGS",          CS_TXMSGS        },
+  { CS_TX,  "NOUTQ",         CS_NOUTQ         },
+  { CS_TX,  "RESENT",        CS_RESENT        },
+  { CS_TX,  "PKTS",          CS_TXPKTS        },
+  { CS_TX,  "ACKS",          CS_TXACKS        },
+  { CS_TX,  "NACKQ",         CS_NACKQ         },
+  { CS_TX,  "NRETXB",        CS_NRETXB        },
+  { CS_TX,  "RETXB_BYTES",   CS_RETXBBYTES    },
+  { CS_TX,  "NRETXQ",        CS_NRETXQ        },
+  { CS_TX,  "NCTRL",         CS_TXNCTRL       },
+  { CS_TX,  "NCI",           CS_TXNCI         },
+  { CS_TX,  "NIC",           CS_TXNIC         },
+  { CS_ANY, "NCONNECTS",     CS_NCONNECTS     },
+  { CS_ANY, "NHDWRTIMEOUTS", CS_NHDWRTIMEOUTS },
+  { CS_ANY, "OPEN",          CS_OPEN          },
+  { CS_ANY, "CONNECTED",     CS_CONNECTED     },
+};
+#define NKEYS (sizeof(keys)/sizeof(keys[0]))
+
+static int find_key(int sec, const char *key, int n) {
+  unsigned int i;
+  for(i=0; i<NKEYS; i++) {
+    if((keys[i].sec == sec || keys[i].sec == CS_ANY) && !strncmp(keys[i].key, key, n)
+       && keys[i].key[n] == '\0') return keys[i].field;
+  }
+  return -1;
+}
+
+/* Digits, TRUE or FALSE; -1 if it's none of those */
+static int get_value(const char *p, const char *end, uint64_t *v) {
+  if(end - p == 4 && !strncmp(p, "TRUE", 4))  { *v = 1; return 0; }
+  if(end - p == 5 && !strncmp(p, "FALSE", 5)) { *v = 0; return 0; }
+  if(p == end) return -1;
+  for(*v = 0; p < end; p++) {
+    if(*p < '0' || *p > '9') return -1;
+    *v = *v*10 + (*p - '0');
+  }
+  return 0;
+}
+
+static void set(struct dh_comstat *cs, int field, uint64_t v, int *nfound) {
+  if(!(cs->have & (1U << field))) (*nfound)++;
+  cs->v[field] = v;
+  cs->have |= 1U << field;
+}
+
+int cs_parse(struct dh_comstat *cs, const char *buf, int n) {
+  const char *p = buf, *end = buf + n;
+  int sec = CS_ANY, blank = 1, nfound = 0;
+  uint64_t v;
+
+  memset(cs, 0, sizeof(*cs));
+  while(p < end) {
+    if(*p == '\n') {
+      if(blank) sec = CS_ANY; /* A blank line ends the RX or TX section */
+      blank = 1;
+      p++;
+      continue;
+    }
+    if(*p == ' ' || *p == '\t' || *p == ',' || *p == '\r') {
+      p++;
+      continue;
+    }
+    const char *w = p, *eq = NULL;
+    while(p < end && *p != ' ' && *p != '\t' && *p != ',' && *p != '\n' && *p != '\r') {
+      if(*p == '=' && eq == NULL) eq = p;
+      p++;
+    }
+    blank = 0;
+    if(p - w == 3 && w[2] == ':' && (!strncmp(w, "RX", 2) || !strncmp(w, "TX", 2))) {
+      sec = w[0] == 'R' ? CS_RX : CS_TX;
+    } else if(eq) {
+      int f = find_key(sec, w, eq - w);
+      if(f >= 0 && !get_value(eq+1, p, &v)) set(cs, f, v, &nfound);
+    } else if(sec != CS_ANY && p - w > 1 && p[-1] == 'B' && !get_value(w, p-1, &v)) {
+      /* "RX: 1234B," */
+      set(cs, sec == CS_RX ? CS_RXBYTES : CS_TXBYTES, v, &nfound);
+    }
+  }
+  return nfound;
+}
@@ -0,0 +1,55 @@
+/* comstat.h
+   Parser for the driver's per-DOM comstat proc file,
+
+     RX: 1234B, MSGS=10 NINQ=0 PKTS=12 ACKS=12
+	 BADPKT=0 BADHDR=0 BADSEQ=0 NCTRL=0 NCI=0 NIC=0
+     TX: 1234B, MSGS=10 NOUTQ=0 RESENT=0 PKTS=12 ACKS=12
+	 NACKQ=0 NRETXB=0 RETXB_BYTES=0 NRETXQ=0 NCTRL=0 NCI=0 NIC=0
+
+	 NCONNECTS=1 NHDWRTIMEOUTS=0 OPEN=TRUE CONNECTED=TRUE
+
+   into a fixed array of counters, in one pass and without allocating,
+   so that a sampler can keep every DOM's file open and re-read it
+   many times a second.  NCTRL, NCI and NIC come in both the RX and TX
+   sections and are kept apart; unknown words are skipped.
+*/
+
+#ifndef __COMSTAT_H__
+#define __COMSTAT_H__
+
+#include <stdint.h>
+
+enum {
+  CS_RXBYTES, CS_RXMSGS, CS_NINQ, CS_RXPKTS, CS_RXACKS,
+  CS_BADPKT, CS_BADHDR, CS_BADSEQ, CS_RXNCTRL, CS_RXNCI, CS_RXNIC,
+  CS_TXBYTES, CS_TXMSGS, CS_NOUTQ, CS_RESENT, CS_TXPKTS, CS_TXACKS,
+  CS_NACKQ, CS_NRETXB, CS_RETXBBYTES, CS_NRETXQ, CS_TXNCTRL, CS_TXNCI, CS_TXNIC,
+  CS_NCONNECTS, CS_NHDWRTIMEOUTS, CS_OPEN, CS_CONNECTED,
+  CS_NFIELD
+};
+
+struct dh_comstat {
+  uint64_t v[CS_NFIELD];
+  uint32_t have;                /* Bit per field found */
+};
+
+/* "rx_msgs", "badseq", ...: for column headings */
+extern const char *cs_name[CS_NFIELD];
+
+/* Nonzero for fields which are counters (the rest are queue depths or
+   flags, whose differences mean nothing) */
+int cs_is_counter(int field);
+
+/* Parse n bytes of comstat text into cs.  Returns the number of
+   fields found; 0 means it wasn't a comstat file. */
+int cs_parse(struct dh_comstat *cs, const char *buf, int n);
+
+/* Change in a counter from prev to cur.  Writing to a comstat file
+   zeroes its counters, so one which went down started over and all of
+   cur is new. */
+static inline uint64_t cs_delta(const struct dh_comstat *cur, const struct dh_comstat *prev,
+				int field) {
+  return cur->v[field] >= prev->v[field] ? cur->v[field] - prev->v[field] : cur->v[field];
+}
+
+#endif /* __COMSTAT_H__ */
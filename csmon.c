@@ -0,0 +1,252 @@
+/* csmon.c
+   Watch the comstat counters of many DOMs at once, fast enough to see
+   bursts of retransmits: every DOM's comstat file is held open and
+   re-read with pread() at a fixed rate (10 Hz by default), parsed in
+   place (comstat.h) and turned into per-second rates, shown in a
+   curses table or written out as CSV.
+
+   Usage: csmon [-i <ms>] [-c] [-n <count>] [-T <sec>] [domset]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <time.h>
+#include <ncurses.h>
+
+#include "domhub.h"
+#include "comstat.h"
+
+#define INTERVAL_MS 100        /* Default sampling interval */
+#define DRAW_MS     500        /* Between screen updates; rates are over this */
+#define CSBUFLEN    4096
+
+struct csdom {
+  struct dh_dom dom;
+  char   name[16];             /* "00A" */
+  char   path[DH_PATHLEN];
+  int    fd;
+  int    ok;                   /* Last read parsed */
+  long   nbad;                 /* Reads which didn't */
+  struct dh_comstat cur, prev;
+  uint64_t tot[CS_NFIELD];     /* Counted since start (or 'z') */
+  uint64_t win[CS_NFIELD];     /* Since the screen was last drawn */
+  uint64_t peak_resent;        /* Most RESENT in one sample, this window */
+};
+
+int usage(void) {
+  fprintf(stderr,
+	  "Usage: csmon [-i <ms>] [-c] [-n <count>] [-T <sec>] [domset]\n"
+	  "  Samples every DOM's comstat proc file and shows rates and error counts.\n"
+	  "  -i <ms>     sampling interval (default %d)\n"
+	  "  -c          CSV on stdout, a line per DOM per sample, instead of the\n"
+	  "              curses view: counters as changes since the last sample\n"
+	  "              (d_ columns), queue depths and flags as they are\n"
+	  "  -n <count>  stop after <count> samples\n"
+	  "  -T <sec>    stop after <sec> seconds\n"
+	  "  domset      'all' (default), or a list such as '00a 01b 3*' (quote it)\n"
+	  "  In the curses view, q quits and z zeroes the totals.\n"
+	  "  $DOMHUB_ROOT, if set, is prefixed to all /dev and /proc paths.\n",
+	  INTERVAL_MS);
+  return -1;
+}
+
+static int die = 0;
+void argghhhh() { die = 1; }
+
+static uint64_t mono_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void sample(struct csdom *d) {
+  char buf[CSBUFLEN];
+  int i;
+  int n = pread(d->fd, buf, sizeof(buf), 0);
+  if(n <= 0 || !cs_parse(&d->cur, buf, n)) {
+    d->ok = 0;
+    d->nbad++;
+    return;
+  }
+  d->ok = 1;
+  if(d->prev.have) {
+    for(i=0; i<CS_NFIELD; i++) {
+      if(!cs_is_counter(i)) continue;
+      uint64_t dv = cs_delta(&d->cur, &d->prev, i);
+      d->tot[i] += dv;
+      d->win[i] += dv;
+    }
+    uint64_t dr = cs_delta(&d->cur, &d->prev, CS_RESENT);
+    if(dr > d->peak_resent) d->peak_resent = dr;
+  }
+}
+
+static void csv_header(void) {
+  int i;
+  printf("time,dom");
+  for(i=0; i<CS_NFIELD; i++) printf(cs_is_counter(i) ? ",d_%s" : ",%s", cs_name[i]);
+  printf("\n");
+}
+
+static void csv_line(struct csdom *d, double t) {
+  int i;
+  if(!d->ok) return;
+  printf("%.3f,%s", t, d->name);
+  for(i=0; i<CS_NFIELD; i++) {
+    uint64_t v = cs_is_counter(i) ? (d->prev.have ? cs_delta(&d->cur, &d->prev, i) : 0)
+      : d->cur.v[i];
+    printf(",%llu", (unsigned long long) v);
+  }
+  printf("\n");
+}
+
+static void draw(struct csdom *dl, int ndoms, double secs, int interval_ms, long nlate) {
+  char tbuf[32];
+  time_t now = time(NULL);
+  int i, k;
+  strftime(tbuf, sizeof(tbuf), "%H:%M:%S", localtime(&now));
+  erase();
+  mvprintw(0, 0, "csmon: %d DOMs every %d ms, %s%s  (q quits, z zeroes totals)",
+	   ndoms, interval_ms, tbuf, nlate ? "  LATE" : "");
+  attron(A_BOLD);
+  mvprintw(2, 0, "%-4s %8s %8s %8s %8s %5s %5s %8s %5s %7s %7s %7s %6s %5s %s",
+	   "DOM", "rxmsg/s", "rxkB/s", "txmsg/s", "txkB/s", "NINQ", "NOUTQ", "resent/s",
+	   "peak", "RESENT", "BADSEQ", "BADPKT", "CI/IC", "HWTO", "");
+  attroff(A_BOLD);
+  for(i=0; i<ndoms && i+3 < LINES; i++) {
+    struct csdom *d = &dl[i];
+    double r = secs > 0 ? 1./secs : 0;
+    uint64_t ci = d->tot[CS_RXNCI] + d->tot[CS_RXNIC] + d->tot[CS_TXNCI] + d->tot[CS_TXNIC];
+    int hot = d->win[CS_RESENT] || d->win[CS_BADSEQ] || d->win[CS_BADPKT]
+      || d->win[CS_BADHDR] || d->win[CS_NHDWRTIMEOUTS];
+    if(hot) attron(A_REVERSE);
+    mvprintw(i+3, 0, "%-4s %8.0f %8.1f %8.0f %8.1f %5llu %5llu %8.1f %5llu %7llu %7llu %7llu %6llu %5llu %s",
+	     d->name, d->win[CS_RXMSGS]*r, d->win[CS_RXBYTES]*r/1000., d->win[CS_TXMSGS]*r,
+	     d->win[CS_TXBYTES]*r/1000., (unsigned long long) d->cur.v[CS_NINQ],
+	     (unsigned long long) d->cur.v[CS_NOUTQ], d->win[CS_RESENT]*r,
+	     (unsigned long long) d->peak_resent, (unsigned long long) d->tot[CS_RESENT],
+	     (unsigned long long) d->tot[CS_BADSEQ], (unsigned long long) d->tot[CS_BADPKT],
+	     (unsigned long long) ci, (unsigned long long) d->tot[CS_NHDWRTIMEOUTS],
+	     !d->ok ? "NO DATA" : !d->cur.v[CS_CONNECTED] ? "not connected"
+	     : d->cur.v[CS_OPEN] ? "open" : "");
+    if(hot) attroff(A_REVERSE);
+  }
+  refresh();
+  for(i=0; i<ndoms; i++) {
+    for(k=0; k<CS_NFIELD; k++) dl[i].win[k] = 0;
+    dl[i].peak_resent = 0;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  static struct csdom dl[DH_MAXDOMS];
+  struct dh_dom doms[DH_MAXDOMS];
+  int interval_ms = INTERVAL_MS, csv = 0, runsecs = 0;
+  long count = 0, n, nlate = 0;
+  int i;
+
+  while(1) {
+    char c = getopt(argc, argv, "hci:n:T:");
+    if(c == -1) break;
+    switch(c) {
+    case 'i': interval_ms = atoi(optarg); break;
+    case 'c': csv         = 1; break;
+    case 'n': count       = atol(optarg); break;
+    case 'T': runsecs     = atoi(optarg); break;
+    case 'h':
+    default:
+      exit(usage());
+    }
+  }
+  if(interval_ms < 1 || count < 0 || runsecs < 0 || argc - optind > 1) exit(usage());
+
+  const char *spec = optind < argc ? argv[optind] : "all";
+  int ndoms = dh_parse_domset(spec, doms, DH_MAXDOMS);
+  if(ndoms < 0) {
+    fprintf(stderr, "Bad DOM set '%s'.\n", spec);
+    exit(usage());
+  }
+  if(ndoms == 0) {
+    fprintf(stderr, "No DOMs found for DOM set '%s'.\n", spec);
+    exit(-1);
+  }
+  for(i=0; i<ndoms; i++) {
+    struct csdom *d = &dl[i];
+    d->dom = doms[i];
+    if(d->dom.icard < 0) {
+      fprintf(stderr, "%s isn't a DOM device name.\n", d->dom.devfile);
+      exit(-1);
+    }
+    snprintf(d->name, sizeof(d->name), "%d%d%c", d->dom.icard, d->dom.ipair, d->dom.cdom);
+    dh_path(d->path, DH_PATHLEN, DH_PROCDIR "/card%d/pair%d/dom%c/comstat",
+	    d->dom.icard, d->dom.ipair, d->dom.cdom);
+    if((d->fd = open(d->path, O_RDONLY)) == -1) {
+      fprintf(stderr, "Can't open file %s: %s\n", d->path, strerror(errno));
+      exit(-1);
+    }
+  }
+
+  signal(SIGINT,  argghhhh);
+  signal(SIGTERM, argghhhh);
+  signal(SIGQUIT, argghhhh);
+  if(csv) {
+    csv_header();
+  } else {
+    initscr();
+    cbreak();
+    noecho();
+    nodelay(stdscr, TRUE);
+    curs_set(0);
+  }
+
+  uint64_t interval = interval_ms*1000000ULL;
+  uint64_t start = mono_ns(), next = start, tdraw = start;
+  for(n=0; !die && (count == 0 || n < count); n++) {
+    struct timespec ts = { next/1000000000ULL, next%1000000000ULL };
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    uint64_t now = mono_ns();
+    if(runsecs > 0 && now - start >= runsecs*1000000000ULL) break;
+    for(i=0; i<ndoms; i++) sample(&dl[i]);
+    if(csv) {
+      struct timespec wall;
+      clock_gettime(CLOCK_REALTIME, &wall);
+      for(i=0; i<ndoms; i++) csv_line(&dl[i], wall.tv_sec + wall.tv_nsec*1.E-9);
+      fflush(stdout);
+    } else {
+      int ch;
+      while((ch = getch()) != ERR) {
+	if(ch == 'q' || ch == 'Q') die = 1;
+	if(ch == 'z' || ch == 'Z') for(i=0; i<ndoms; i++) memset(dl[i].tot, 0, sizeof(dl[i].tot));
+      }
+      if(now - tdraw >= DRAW_MS*1000000ULL) {
+	draw(dl, ndoms, (now - tdraw)*1.E-9, interval_ms, nlate);
+	tdraw = now;
+	nlate = 0;
+      }
+    }
+    for(i=0; i<ndoms; i++) if(dl[i].ok) dl[i].prev = dl[i].cur;
+
+    /* Keep to the schedule; if we fell behind, start again from now */
+    next += interval;
+    if(next < mono_ns()) {
+      nlate++;
+      next = mono_ns() + interval;
+    }
+  }
+  if(!csv) endwin();
+
+  for(i=0; i<ndoms; i++) {
+    struct csdom *d = &dl[i];
+    close(d->fd);
+    if(d->nbad) fprintf(stderr, "%s: %ld unreadable samples.\n", d->path, d->nbad);
+  }
+  if(csv && nlate) fprintf(stderr, "csmon: %ld samples were late.\n", nlate);
+  return 0;
+}
@@ -1,4 +1,4 @@
-/* dh_tcalib.h 
+/* dh_tcalib.h
    John Jacobsen / John Jacobsen IT Services for LBNL/IceCube
    Stuff used for time calibration in the driver, as well as
    in test programs.
@@ -30,47 +30,142 @@ struct dh_tcalib_t {
 /* Packed, no-padding length of time calibration structure (in B) */
 #define DH_TCAL_STRUCT_LEN (36+2*2*DH_MAX_TCAL_WF_LEN)
 
+/* Where each field is in the packed record, which is little-endian */
+#define DH_TCAL_OFF_HDR    0
+#define DH_TCAL_OFF_DOR_T0 (DH_TCAL_OFF_HDR + 4)
+#define DH_TCAL_OFF_DOR_T3 (DH_TCAL_OFF_DOR_T0 + 8)
+#define DH_TCAL_OFF_DORWF  (DH_TCAL_OFF_DOR_T3 + 8)
+#define DH_TCAL_OFF_DOM_T1 (DH_TCAL_OFF_DORWF + 2*DH_MAX_TCAL_WF_LEN)
+#define DH_TCAL_OFF_DOM_T2 (DH_TCAL_OFF_DOM_T1 + 8)
+#define DH_TCAL_OFF_DOMWF  (DH_TCAL_OFF_DOM_T2 + 8)
+
+_Static_assert(DH_TCAL_OFF_DOMWF + 2*DH_MAX_TCAL_WF_LEN == DH_TCAL_STRUCT_LEN,
+	       "packed tcal field offsets don't add up to DH_TCAL_STRUCT_LEN");
+_Static_assert(sizeof(u16) == 2 && sizeof(u32) == 4 && sizeof(u64) == 8,
+	       "tcal field types have the wrong sizes");
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+# define DH_TCAL_LE_HOST 1     /* Waveforms can be copied as they are */
+#endif
+
+/* Little-endian loads and stores.  On little-endian hosts a fixed
+   size memcpy() is a plain unaligned move, even unoptimized. */
+#ifdef DH_TCAL_LE_HOST
+static inline u16 dh_tcal_get16(const unsigned char *p) { u16 v; memcpy(&v, p, 2); return v; }
+static inline u32 dh_tcal_get32(const unsigned char *p) { u32 v; memcpy(&v, p, 4); return v; }
+static inline u64 dh_tcal_get64(const unsigned char *p) { u64 v; memcpy(&v, p, 8); return v; }
+static inline void dh_tcal_put16(unsigned char *p, u16 v) { memcpy(p, &v, 2); }
+static inline void dh_tcal_put32(unsigned char *p, u32 v) { memcpy(p, &v, 4); }
+static inline void dh_tcal_put64(unsigned char *p, u64 v) { memcpy(p, &v, 8); }
+#else
+static inline u16 dh_tcal_get16(const unsigned char *p) {
+  return (u16) (p[0] | (p[1] << 8));
+}
+static inline u32 dh_tcal_get32(const unsigned char *p) {
+  return (u32) p[0] | ((u32) p[1] << 8) | ((u32) p[2] << 16) | ((u32) p[3] << 24);
+}
+static inline u64 dh_tcal_get64(const unsigned char *p) {
+  return (u64) dh_tcal_get32(p) | ((u64) dh_tcal_get32(p+4) << 32);
+}
+static inline void dh_tcal_put16(unsigned char *p, u16 v) {
+  p[0] = v; p[1] = v >> 8;
+}
+static inline void dh_tcal_put32(unsigned char *p, u32 v) {
+  p[0] = v; p[1] = v >> 8; p[2] = v >> 16; p[3] = v >> 24;
+}
+static inline void dh_tcal_put64(unsigned char *p, u64 v) {
+  dh_tcal_put32(p, (u32) v); dh_tcal_put32(p+4, (u32) (v >> 32));
+}
+#endif
+
+/* Fields read straight out of a packed record, without unpacking it */
+static inline u32 dh_tcal_hdr(const unsigned char *rec) {
+  return dh_tcal_get32(rec + DH_TCAL_OFF_HDR);
+}
+static inline u64 dh_tcal_dor_t0(const unsigned char *rec) {
+  return dh_tcal_get64(rec + DH_TCAL_OFF_DOR_T0);
+}
+static inline u64 dh_tcal_dor_t3(const unsigned char *rec) {
+  return dh_tcal_get64(rec + DH_TCAL_OFF_DOR_T3);
+}
+static inline u64 dh_tcal_dom_t1(const unsigned char *rec) {
+  return dh_tcal_get64(rec + DH_TCAL_OFF_DOM_T1);
+}
+static inline u64 dh_tcal_dom_t2(const unsigned char *rec) {
+  return dh_tcal_get64(rec + DH_TCAL_OFF_DOM_T2);
+}
+static inline u16 dh_tcal_dorwf(const unsigned char *rec, int i) {
+  return dh_tcal_get16(rec + DH_TCAL_OFF_DORWF + 2*i);
+}
+static inline u16 dh_tcal_domwf(const unsigned char *rec, int i) {
+  return dh_tcal_get16(rec + DH_TCAL_OFF_DOMWF + 2*i);
+}
+
+/* A waveform between packed and host order */
+static inline void dh_tcal_get_wf(u16 *wf, const unsigned char *src) {
+#ifdef DH_TCAL_LE_HOST
+  memcpy(wf, src, 2*DH_MAX_TCAL_WF_LEN);
+#else
+  int i;
+  for(i=0; i<DH_MAX_TCAL_WF_LEN; i++) wf[i] = dh_tcal_get16(src + 2*i);
+#endif
+}
+static inline void dh_tcal_put_wf(unsigned char *dest, const u16 *wf) {
+#ifdef DH_TCAL_LE_HOST
+  memcpy(dest, wf, 2*DH_MAX_TCAL_WF_LEN);
+#else
+  int i;
+  for(i=0; i<DH_MAX_TCAL_WF_LEN; i++) dh_tcal_put16(dest + 2*i, wf[i]);
+#endif
+}
+
 /* Ensure struct members are packed with no padding at end */
-int dh_tcalib_pack(unsigned char *dest, struct dh_tcalib_t *tcalrec) {
-    int len = 0;
-    memcpy(dest+len, &tcalrec->hdr, sizeof(tcalrec->hdr));
-    len += sizeof(tcalrec->hdr);
-    memcpy(dest+len, &tcalrec->dor_t0, sizeof(tcalrec->dor_t0));
-    len += sizeof(tcalrec->dor_t0);
-    memcpy(dest+len, &tcalrec->dor_t3, sizeof(tcalrec->dor_t3));
-    len += sizeof(tcalrec->dor_t3);
-    memcpy(dest+len, tcalrec->dorwf, sizeof(tcalrec->dorwf[0])*DH_MAX_TCAL_WF_LEN);
-    len += sizeof(tcalrec->dorwf[0])*DH_MAX_TCAL_WF_LEN;
-    memcpy(dest+len, &tcalrec->dom_t1, sizeof(tcalrec->dom_t1));
-    len += sizeof(tcalrec->dom_t1);
-    memcpy(dest+len, &tcalrec->dom_t2, sizeof(tcalrec->dom_t2));
-    len += sizeof(tcalrec->dom_t2);
-    memcpy(dest+len, tcalrec->domwf, sizeof(tcalrec->domwf[0])*DH_MAX_TCAL_WF_LEN);
-    len += sizeof(tcalrec->domwf[0])*DH_MAX_TCAL_WF_LEN;
-
-    return (len == DH_TCAL_STRUCT_LEN);
+static inline int dh_tcalib_pack(unsigned char *dest, const struct dh_tcalib_t *tcalrec) {
+    dh_tcal_put32(dest + DH_TCAL_OFF_HDR,    tcalrec->hdr);
+    dh_tcal_put64(dest + DH_TCAL_OFF_DOR_T0, tcalrec->dor_t0);
+    dh_tcal_put64(dest + DH_TCAL_OFF_DOR_T3, tcalrec->dor_t3);
+    dh_tcal_put_wf(dest + DH_TCAL_OFF_DORWF, tcalrec->dorwf);
+    dh_tcal_put64(dest + DH_TCAL_OFF_DOM_T1, tcalrec->dom_t1);
+    dh_tcal_put64(dest + DH_TCAL_OFF_DOM_T2, tcalrec->dom_t2);
+    dh_tcal_put_wf(dest + DH_TCAL_OFF_DOMWF, tcalrec->domwf);
+    return 1;
 }
 
 /* Unpack buffer into structure */
-int dh_tcalib_unpack(struct dh_tcalib_t *tcalrec, unsigned char *src) {
-    int len = 0;
-    memcpy(&tcalrec->hdr, src+len, sizeof(tcalrec->hdr));
-    len += sizeof(tcalrec->hdr);
-    memcpy(&tcalrec->dor_t0, src+len, sizeof(tcalrec->dor_t0));
-    len += sizeof(tcalrec->dor_t0);
-    memcpy(&tcalrec->dor_t3, src+len, sizeof(tcalrec->dor_t3));
-    len += sizeof(tcalrec->dor_t3);
-    memcpy(tcalrec->dorwf, src+len, sizeof(tcalrec->dorwf[0])*DH_MAX_TCAL_WF_LEN);
-    len += sizeof(tcalrec->dorwf[0])*DH_MAX_TCAL_WF_LEN;
-    memcpy(&tcalrec->dom_t1, src+len, sizeof(tcalrec->dom_t1));
-    len += sizeof(tcalrec->dom_t1);
-    memcpy(&tcalrec->dom_t2, src+len, sizeof(tcalrec->dom_t2));
-    len += sizeof(tcalrec->dom_t2);
-    memcpy(tcalrec->domwf, src+len, sizeof(tcalrec->domwf[0])*DH_MAX_TCAL_WF_LEN);
-    len += sizeof(tcalrec->domwf[0])*DH_MAX_TCAL_WF_LEN;
-
-    return (len == DH_TCAL_STRUCT_LEN);
+static inline int dh_tcalib_unpack(struct dh_tcalib_t *tcalrec, const unsigned char *src) {
+    tcalrec->hdr    = dh_tcal_hdr(src);
+    tcalrec->dor_t0 = dh_tcal_dor_t0(src);
+    tcalrec->dor_t3 = dh_tcal_dor_t3(src);
+    dh_tcal_get_wf(tcalrec->dorwf, src + DH_TCAL_OFF_DORWF);
+    tcalrec->dom_t1 = dh_tcal_dom_t1(src);
+    tcalrec->dom_t2 = dh_tcal_dom_t2(src);
+    dh_tcal_get_wf(tcalrec->domwf, src + DH_TCAL_OFF_DOMWF);
+    return 1;
 }
 
-#endif /* __DH_TCALIB__ */
+/* Many records as columns: the timestamps each in their own array and
+   the waveforms as n x DH_MAX_TCAL_WF_LEN matrices, record i's at
+   dorwf + i*DH_MAX_TCAL_WF_LEN.  The caller provides the arrays. */
+struct dh_tcal_soa {
+  u64 *dor_t0, *dor_t3, *dom_t1, *dom_t2;
+  u16 *dorwf, *domwf;
+};
 
+/* Unpack n packed records, stride bytes apart starting at src (stride
+   DH_TCAL_STRUCT_LEN when they're back to back), into rows first..
+   first+n-1 of soa */
+static inline void dh_tcalib_unpack_soa(struct dh_tcal_soa *soa, int first,
+					const unsigned char *src, long stride, int n) {
+  int i;
+  for(i=0; i<n; i++, src += stride) {
+    int r = first + i;
+    soa->dor_t0[r] = dh_tcal_dor_t0(src);
+    soa->dor_t3[r] = dh_tcal_dor_t3(src);
+    soa->dom_t1[r] = dh_tcal_dom_t1(src);
+    soa->dom_t2[r] = dh_tcal_dom_t2(src);
+    dh_tcal_get_wf(soa->dorwf + (long) r*DH_MAX_TCAL_WF_LEN, src + DH_TCAL_OFF_DORWF);
+    dh_tcal_get_wf(soa->domwf + (long) r*DH_MAX_TCAL_WF_LEN, src + DH_TCAL_OFF_DOMWF);
+  }
+}
+
+#endif /* __DH_TCALIB__ */
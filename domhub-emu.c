@@ -0,0 +1,845 @@
+/* domhub-emu.c
+   Userspace DOMHub emulator.  Presents the /dev/dhcXwYdZ devices and
+   the /proc/driver/domhub files which the MOAT programs use under a
+   root directory, so they can be run, benchmarked and regression-tested
+   without DOR cards:
+
+     domhub-emu -c 2 /tmp/hub &
+     DOMHUB_ROOT=/tmp/hub readwrite HUB -D all 10000
+
+   Devices and the tcalib and syncgps nodes are Unix SEQPACKET sockets,
+   which dh_open_dev() connects to in place of opening a driver file.
+   The remaining proc files are plain files; comstat, in the driver's
+   format, is rewritten in place ten times a second, a write to it
+   zeroes the DOM's counters and a write to a DOM's softboot file puts
+   it back in iceboot.
+
+   Each DOM is in one of three modes:
+     iceboot  commands are echoed back with a prompt; "echo-mode" and
+	      "echo-pkt-mode" switch modes
+     echo     every message comes back unchanged
+     pkt      an 8 byte request (32-bit seed, 16-bit length in words)
+	      gets the echo-pkt-mode LCG stream that rndpkt checks
+   Replies are delayed by a per-DOM link bandwidth and latency, and can
+   be corrupted or dropped at a given rate, per DOM if desired.  A time
+   calibration holds its wire pair for a fixed time (-t), so one asked
+   for while the other DOM on the pair is calibrating has to wait.
+*/
+
+#define _GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <math.h>
+#include <getopt.h>
+
+#include <linux/types.h>
+#include "dh_tcalib.h"
+#include "domhub.h"
+#include "pktgen.h"
+
+#define BUFSIZ_DEFAULT 4092
+#define MAXQ_DEFAULT   64        /* Replies a DOM holds before it stops reading */
+#define DORCLK_DEFAULT 20        /* MHz */
+#define TCAL_US_DEFAULT 500      /* Time a tcal holds the wire pair */
+#define DOMCLK_HZ      40.E6
+#define CLOCKMASK      ((1ULL << 48)-1)
+#define GPSQLEN        10        /* Time strings buffered per DOR card */
+#define TSBUFLEN       22        /* SOH DDD:HH:MM:SS Q + 8 byte DOR time */
+#define MAXEVENTS      64
+#define MAXOVERRIDE    64
+#define MAXMSG         65536
+#define DH_ROOTLEN     256
+#define STAT_NS        100000000ULL  /* Between comstat updates: 10 Hz, csmon's default rate */
+
+enum { MODE_ICEBOOT, MODE_ECHO, MODE_PKT, NMODE };
+static const char *modename[NMODE] = { "iceboot", "echo", "pkt" };
+
+/* Everything registered with epoll starts with one of these */
+enum { N_DEV, N_TCAL, N_GPS, N_DEVCONN, N_TCALCONN, N_INOTIFY };
+struct node {
+  int type;
+  int fd;
+};
+
+struct link {                   /* Emulation parameters, settable per DOM */
+  double kbps;                  /* Link bandwidth each way; 0 for unlimited */
+  double latency_us;            /* Added to every reply */
+  double errrate;               /* Fraction of replies with one byte flipped */
+  double droprate;              /* Fraction of messages never answered */
+  int    mode;                  /* Mode at startup */
+};
+
+struct emudom {
+  int    icard, ipair;
+  char   cdom;
+  char   name[24];              /* "00A" */
+  struct link cf;
+  int    mode;
+  uint64_t link_free;           /* When the wire pair is next idle, ns */
+  double dom_offset;            /* DOM clock at t=0, ticks */
+  double dom_rate;              /* DOM clock ticks per ns, with drift */
+  double cable_ns;              /* One-way delay */
+  uint64_t id;
+  unsigned long rxmsgs, txmsgs, rxbytes, txbytes, nflip, ndrop, ntcal, ntcalwait;
+  unsigned long nconnects;
+  int    csfd;                  /* comstat, kept open */
+  struct node dev, tcal;
+  char   devpath[DH_PATHLEN], tcalpath[DH_PATHLEN], procdir[DH_ROOTLEN+64];
+  int    wd;                    /* inotify watch on procdir */
+};
+
+struct emucard {
+  int    icard;
+  double dor_offset;            /* DOR clock at t=0, ticks */
+  double dor_rate;              /* DOR clock ticks per ns */
+  uint64_t gps_ticks;           /* DOR time of the last 1PPS */
+  uint64_t next_gps;            /* When the next 1PPS is due, ns */
+  uint64_t tcal_free[DH_NPAIR]; /* When each pair's last tcal is done, ns */
+  unsigned char gps[GPSQLEN][TSBUFLEN];
+  int    gpshead, ngps;
+  struct node sync;
+  char   syncpath[DH_PATHLEN];
+};
+
+struct pending {                /* A reply waiting for its due time */
+  struct pending *next;
+  uint64_t due;
+  int    len;
+  unsigned char data[];
+};
+
+struct conn {
+  struct node n;
+  struct emudom *dom;
+  struct pending *head, *tail;
+  int    nq;
+  int    blocked;               /* Client isn't reading; wait for EPOLLOUT */
+  unsigned int events;
+  struct conn *prev, *next;
+};
+
+static char   root[DH_ROOTLEN];
+static int    ncards   = 1;
+static int    npairs   = DH_NPAIR;
+static int    bufsiz   = BUFSIZ_DEFAULT;
+static int    maxq     = MAXQ_DEFAULT;
+static int    dorclk   = DORCLK_DEFAULT;
+static int    tcal_us  = TCAL_US_DEFAULT;
+static int    verbose  = 0;
+static int    epfd;
+static int    ndoms;
+static struct emudom  doms[DH_MAXDOMS];
+static struct emucard cards[DH_MAXCARD];
+static struct conn   *conns = NULL;
+static struct node    inot;
+static struct pg_rng  rng;
+static uint64_t       t0;
+static volatile int   die = 0;
+
+static unsigned char  msgbuf[MAXMSG];
+
+void argghhhh() { die = 1; }
+
+int usage(void) {
+  fprintf(stderr,
+	  "Usage: domhub-emu [options] [root]\n"
+	  "  Creates <root>/dev/dhcXwYdZ and <root>/proc/driver/domhub/... and\n"
+	  "  serves them until killed.  <root> defaults to $DOMHUB_ROOT; run the\n"
+	  "  tools with DOMHUB_ROOT=<root> to use the emulator.\n"
+	  "  Options: [-c <ncards>]  DOR cards (default 1, max. %d)\n"
+	  "           [-w <npairs>]  wire pairs per card, two DOMs each (default %d)\n"
+	  "           [-b <bytes>]   driver buffer size for bufsiz (default %d)\n"
+	  "           [-m <mode>]    DOM mode at startup: iceboot, echo or pkt (default echo)\n"
+	  "           [-k <kB/s>]    link bandwidth per DOM (default unlimited)\n"
+	  "           [-l <usec>]    extra latency per reply (default 0)\n"
+	  "           [-e <frac>]    fraction of replies with a corrupted byte\n"
+	  "           [-x <frac>]    fraction of messages dropped\n"
+	  "           [-q <n>]       replies a DOM holds before it stops reading (default %d)\n"
+	  "           [-d <MHz>]     DOR clock (default %d)\n"
+	  "           [-g <card>:<ppm>]  that card's DOR clock is off by <ppm>\n"
+	  "           [-t <usec>]    time a tcal takes, during which the pair is busy\n"
+	  "                          (default %d)\n"
+	  "           [-o <doms>:<opt>=<val>[,...]]  per-DOM m, k, l, e or x,\n"
+	  "                          e.g. -o 00a:k=90,l=500 -o '1*:x=0.001'\n"
+	  "           [-s <seed>]    random seed (default: pid)\n"
+	  "           [-v]           log connections and mode changes\n",
+	  DH_MAXCARD, DH_NPAIR, BUFSIZ_DEFAULT, MAXQ_DEFAULT, DORCLK_DEFAULT,
+	  TCAL_US_DEFAULT);
+  return -1;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static double urand(void) { /* Uniform in [0,1) */
+  return (pg_next(&rng) >> 11) * (1.0/9007199254740992.0);
+}
+
+static int getmode(const char *s) {
+  int i;
+  for(i=0; i<NMODE; i++) if(!strcasecmp(s, modename[i])) return i;
+  return -1;
+}
+
+/************* Files and sockets ******************/
+
+static void mkdirs(const char *path) {
+  char p[DH_PATHLEN];
+  char *s;
+  snprintf(p, DH_PATHLEN, "%s", path);
+  for(s=p+1; *s; s++) {
+    if(*s != '/') continue;
+    *s = '\0';
+    mkdir(p, 0755);
+    *s = '/';
+  }
+  mkdir(p, 0755);
+}
+
+static void put_file(const char *path, const char *fmt, ...) {
+  /* Replace a proc file atomically, so readers never see half of it */
+  char tmp[DH_PATHLEN+8];
+  va_list ap;
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *fp = fopen(tmp, "w");
+  if(fp == NULL) {
+    fprintf(stderr, "Can't write %s: %s\n", tmp, strerror(errno));
+    exit(-1);
+  }
+  va_start(ap, fmt);
+  vfprintf(fp, fmt, ap);
+  va_end(ap);
+  fclose(fp);
+  rename(tmp, path);
+}
+
+static void ep_add(struct node *n, unsigned int events) {
+  struct epoll_event ev;
+  ev.events   = events;
+  ev.data.ptr = n;
+  if(epoll_ctl(epfd, EPOLL_CTL_ADD, n->fd, &ev)) {
+    perror("epoll_ctl");
+    exit(-1);
+  }
+}
+
+static void listen_on(struct node *n, int type, const char *path) {
+  struct sockaddr_un addr;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Socket path %s is too long; use a shorter root.\n", path);
+    exit(-1);
+  }
+  unlink(path);
+  n->type = type;
+  n->fd   = socket(AF_UNIX, SOCK_SEQPACKET|SOCK_NONBLOCK, 0);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if(n->fd == -1 || bind(n->fd, (struct sockaddr *) &addr, sizeof(addr))
+     || listen(n->fd, 16)) {
+    fprintf(stderr, "Can't listen on %s: %s\n", path, strerror(errno));
+    exit(-1);
+  }
+  ep_add(n, EPOLLIN);
+}
+
+/************* Clocks, time strings and tcal records ******************/
+
+static uint64_t dor_ticks(struct emucard *c, uint64_t t) {
+  return (uint64_t) (c->dor_offset + (t-t0)*c->dor_rate) & CLOCKMASK;
+}
+
+static uint64_t dom_ticks(struct emudom *d, double t) {
+  return (uint64_t) (d->dom_offset + (t-t0)*d->dom_rate) & CLOCKMASK;
+}
+
+static void gps_tick(struct emucard *c) {
+  /* Latch the DOR clock at the 1PPS and queue the GPS time string */
+  unsigned char *ts;
+  time_t tnow = time(NULL);
+  struct tm tm;
+  char tstr[32];
+  int i;
+  if(c->ngps == GPSQLEN) { /* Card buffer full; oldest is lost */
+    c->gpshead = (c->gpshead+1)%GPSQLEN;
+    c->ngps--;
+  }
+  ts = c->gps[(c->gpshead + c->ngps)%GPSQLEN];
+  c->ngps++;
+  gmtime_r(&tnow, &tm);
+  snprintf(tstr, sizeof(tstr), "%03d:%02d:%02d:%02d", tm.tm_yday+1, tm.tm_hour,
+	   tm.tm_min, tm.tm_sec);
+  ts[0] = 1; /* SOH */
+  memcpy(ts+1, tstr, 12);
+  ts[13] = ' '; /* Excellent time quality */
+  c->gps_ticks = dor_ticks(c, c->next_gps);
+  for(i=0; i<8; i++) ts[14+i] = c->gps_ticks >> (56-8*i);
+  c->next_gps += 1000000000ULL;
+}
+
+static void fill_wf(u16 *wf, double center, double base, double amp) {
+  int i;
+  for(i=0; i<DH_MAX_TCAL_WF_LEN; i++) {
+    double x = (i - center)/2.0;
+    double v = base + amp*exp(-0.5*x*x) + 6.*urand() - 3.;
+    wf[i] = v < 0 ? 0 : v > 1023 ? 1023 : (u16) v;
+  }
+}
+
+static void make_tcal(struct emudom *d, unsigned char *packed, uint64_t t) {
+  /* DOR sends a pulse at t0, the DOM digitizes it at t1, answers at t2
+     and the DOR digitizes the answer at t3.  Waveform peaks land at a
+     sub-sample offset set by the arrival time. */
+  struct dh_tcalib_t rec;
+  struct emucard *c = &cards[d->icard];
+  double t1   = t + d->cable_ns;
+  double turn = 9000. + 200.*urand();
+  double t3   = t1 + turn + d->cable_ns;
+  double dorphase = fmod((t3-t0)*c->dor_rate, 1.);
+  double domphase = fmod((t1-t0)*d->dom_rate, 1.);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.hdr    = 0;
+  rec.dor_t0 = dor_ticks(c, t);
+  rec.dom_t1 = dom_ticks(d, t1);
+  rec.dom_t2 = dom_ticks(d, t1 + turn);
+  rec.dor_t3 = dor_ticks(c, (uint64_t) t3);
+  fill_wf(rec.domwf, 20. + domphase, 120., 600.);
+  fill_wf(rec.dorwf, 20. + dorphase, 100., 450.);
+  dh_tcalib_pack(packed, &rec);
+}
+
+/************* DOMs ******************/
+
+static void write_comstat(struct emudom *d) {
+  /* As the driver has it: headed by the device name, which is what
+     anamoat and moatdb split a dump of several DOMs on, with RX from
+     the DOM and TX to it.  A dropped message is one the driver would
+     have had to resend, and a corrupted one a bad packet.  It's
+     overwritten in place since samplers (csmon) keep it open, which
+     is racy, so readers must put up with the odd torn update, as with
+     any proc file.  The descriptor stays open so our writes don't look
+     to the inotify watch like a tool zeroing the counters. */
+  char buf[1024];
+  struct conn *c;
+  int ninq = 0, open = 0;
+  for(c=conns; c; c=c->next) {
+    if(c->dom != d || c->n.type != N_DEVCONN) continue;
+    ninq += c->nq;
+    open  = 1;
+  }
+  int n = snprintf(buf, sizeof(buf),
+		   "/dev/dhc%dw%dd%c\n"
+		   "RX: %luB, MSGS=%lu NINQ=%d PKTS=%lu ACKS=%lu\n"
+		   "    BADPKT=%lu BADHDR=0 BADSEQ=0 NCTRL=0 NCI=0 NIC=0\n"
+		   "TX: %luB, MSGS=%lu NOUTQ=0 RESENT=%lu PKTS=%lu ACKS=%lu\n"
+		   "    NACKQ=0 NRETXB=0 RETXB_BYTES=0 NRETXQ=0 NCTRL=0 NCI=0 NIC=0\n"
+		   "\n"
+		   "    NCONNECTS=%lu NHDWRTIMEOUTS=0 OPEN=%s CONNECTED=TRUE\n"
+		   "\n"
+		   "Card %d Pair %d DOM %c (emulated, %s mode): "
+		   "%lu tcals (%lu waited for the pair)\n",
+		   d->icard, d->ipair, d->cdom,
+		   d->txbytes, d->txmsgs, ninq, d->txmsgs, d->txmsgs,
+		   d->nflip,
+		   d->rxbytes, d->rxmsgs, d->ndrop, d->rxmsgs + d->ndrop, d->rxmsgs,
+		   d->nconnects, open ? "TRUE" : "FALSE",
+		   d->icard, d->ipair, d->cdom, modename[d->mode], d->ntcal, d->ntcalwait);
+  if(pwrite(d->csfd, buf, n, 0) != n || ftruncate(d->csfd, n))
+    fprintf(stderr, "%s: can't update comstat: %s\n", d->name, strerror(errno));
+}
+
+static int dom_matches(struct emudom *d, const char *spec, int n) {
+  /* spec (n chars) is "all", "3*", "30*" or "30a" */
+  if(n == 3 && !strncmp(spec, "all", 3)) return 1;
+  if(n >= 2 && spec[n-1] == '*') return !strncasecmp(spec, d->name, n-1);
+  return n == 3 && !strncasecmp(spec, d->name, 3);
+}
+
+static int apply_override(struct link *l, const char *kv) {
+  /* "k=90,l=500,..." into l; nonzero if malformed */
+  char key[8];
+  char val[64];
+  while(*kv) {
+    int n = 0;
+    if(sscanf(kv, "%7[a-z]=%63[^,]%n", key, val, &n) != 2 || n == 0) return 1;
+    if(!strcmp(key, "k"))      l->kbps       = atof(val);
+    else if(!strcmp(key, "l")) l->latency_us = atof(val);
+    else if(!strcmp(key, "e")) l->errrate    = atof(val);
+    else if(!strcmp(key, "x")) l->droprate   = atof(val);
+    else if(!strcmp(key, "m")) {
+      if((l->mode = getmode(val)) < 0) return 1;
+    } else return 1;
+    kv += n;
+    if(*kv == ',') kv++;
+  }
+  return 0;
+}
+
+static void setup_dom(struct emudom *d, int icard, int ipair, char cdom, struct link *defl,
+		      char **ovr, int novr) {
+  char pf[DH_PATHLEN];
+  int i;
+  d->icard = icard;
+  d->ipair = ipair;
+  d->cdom  = cdom;
+  snprintf(d->name, sizeof(d->name), "%d%d%c", icard, ipair, cdom);
+  d->cf = *defl;
+  for(i=0; i<novr; i++) {
+    char *colon = strchr(ovr[i], ':');
+    if(dom_matches(d, ovr[i], colon-ovr[i]) && apply_override(&d->cf, colon+1)) {
+      fprintf(stderr, "Bad per-DOM option '%s'.\n", ovr[i]);
+      exit(usage());
+    }
+  }
+  d->mode       = d->cf.mode;
+  d->dom_offset = urand()*(double) CLOCKMASK;
+  d->dom_rate   = DOMCLK_HZ/1.E9 * (1. + 4.E-6*(urand()-0.5)); /* +-2 ppm */
+  d->cable_ns   = 4000. + 500.*ipair + (cdom == 'B' ? 1500. : 0.) + 100.*urand();
+  d->id         = pg_next(&rng) & CLOCKMASK;
+
+  snprintf(d->devpath, DH_PATHLEN, "%s/dev/dhc%dw%dd%c", root, icard, ipair, cdom);
+  snprintf(d->procdir, sizeof(d->procdir), "%s" DH_PROCDIR "/card%d/pair%d/dom%c",
+	   root, icard, ipair, cdom);
+  snprintf(d->tcalpath, DH_PATHLEN, "%s/tcalib", d->procdir);
+  mkdirs(d->procdir);
+  snprintf(pf, DH_PATHLEN, "%s/is-communicating", d->procdir);
+  put_file(pf, "Card %d Pair %d DOM %c is communicating\n", icard, ipair, cdom);
+  snprintf(pf, DH_PATHLEN, "%s/id", d->procdir);
+  put_file(pf, "Card %d Pair %d DOM %c ID is %012llx\n", icard, ipair, cdom,
+	   (unsigned long long) d->id);
+  snprintf(pf, DH_PATHLEN, "%s/softboot", d->procdir);
+  put_file(pf, "");
+  snprintf(pf, DH_PATHLEN, "%s/comstat", d->procdir);
+  if((d->csfd = open(pf, O_RDWR|O_CREAT|O_TRUNC, 0644)) == -1) {
+    fprintf(stderr, "Can't write %s: %s\n", pf, strerror(errno));
+    exit(-1);
+  }
+  write_comstat(d);
+  listen_on(&d->dev,  N_DEV,  d->devpath);
+  listen_on(&d->tcal, N_TCAL, d->tcalpath);
+  d->wd = inotify_add_watch(inot.fd, d->procdir, IN_CLOSE_WRITE);
+}
+
+static void setup_card(struct emucard *c, int icard, char **dorppm, int nppm) {
+  char dir[DH_ROOTLEN+64], pf[DH_PATHLEN];
+  int ipair, i;
+  c->icard      = icard;
+  c->dor_offset = urand()*(double) (1ULL << 40);
+  c->dor_rate   = dorclk/1000.;
+  for(i=0; i<nppm; i++)
+    if(atoi(dorppm[i]) == icard) c->dor_rate *= 1. + atof(strchr(dorppm[i], ':')+1)*1.E-6;
+  c->next_gps   = t0 + 1000000000ULL;
+  c->gps_ticks  = dor_ticks(c, c->next_gps) - dorclk*1000000ULL;
+  snprintf(dir, sizeof(dir), "%s" DH_PROCDIR "/card%d", root, icard);
+  mkdirs(dir);
+  snprintf(pf, sizeof(pf), "%s/fpga", dir);
+  put_file(pf, "Card %d FPGA (emulated by domhub-emu)\n"
+	   "DOR clock %d MHz, %d wire pairs\n", icard, dorclk, npairs);
+  for(ipair=0; ipair<npairs; ipair++) {
+    snprintf(pf, sizeof(pf), "%s/pair%d", dir, ipair);
+    mkdirs(pf);
+    snprintf(pf, sizeof(pf), "%s/pair%d/pwr", dir, ipair);
+    put_file(pf, "Card %d Pair %d power status is on.\n", icard, ipair);
+  }
+  snprintf(c->syncpath, DH_PATHLEN, "%s/syncgps", dir);
+  listen_on(&c->sync, N_GPS, c->syncpath);
+}
+
+/************* Connections ******************/
+
+static void conn_events(struct conn *c) {
+  unsigned int want = (c->nq < maxq ? EPOLLIN : 0) | (c->blocked ? EPOLLOUT : 0);
+  if(want == c->events) return;
+  struct epoll_event ev;
+  ev.events   = want;
+  ev.data.ptr = c;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, c->n.fd, &ev);
+  c->events = want;
+}
+
+static void drop_pending(struct conn *c) {
+  while(c->head) {
+    struct pending *p = c->head;
+    c->head = p->next;
+    free(p);
+  }
+  c->tail = NULL;
+  c->nq   = 0;
+}
+
+static void close_conn(struct conn *c) {
+  if(verbose && c->dom) fprintf(stderr, "%s: closed.\n", c->dom->name);
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->n.fd, NULL);
+  close(c->n.fd);
+  drop_pending(c);
+  if(c->prev) c->prev->next = c->next; else conns = c->next;
+  if(c->next) c->next->prev = c->prev;
+  free(c);
+}
+
+static void new_conn(int lfd, int type, struct emudom *d) {
+  int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK);
+  if(fd == -1) return;
+  struct conn *c = calloc(1, sizeof(struct conn));
+  if(c == NULL) {
+    close(fd);
+    return;
+  }
+  c->n.type = type;
+  c->n.fd   = fd;
+  c->dom    = d;
+  c->events = EPOLLIN;
+  if(type == N_DEVCONN) d->nconnects++;
+  c->next   = conns;
+  if(conns) conns->prev = c;
+  conns = c;
+  ep_add(&c->n, EPOLLIN);
+  if(verbose) fprintf(stderr, "%s: %s opened.\n", d->name, type == N_DEVCONN ? "device" : "tcalib");
+}
+
+static void send_gps(struct emucard *c) {
+  /* One time string per open, like the driver; nothing if none is buffered */
+  int fd = accept4(c->sync.fd, NULL, NULL, SOCK_NONBLOCK);
+  if(fd == -1) return;
+  if(c->ngps > 0) {
+    send(fd, c->gps[c->gpshead], TSBUFLEN, MSG_NOSIGNAL);
+    c->gpshead = (c->gpshead+1)%GPSQLEN;
+    c->ngps--;
+  }
+  close(fd);
+}
+
+static struct pending *iceboot(struct emudom *d, unsigned char *buf, int n) {
+  /* Echo the command and prompt; switch modes on request */
+  char cmd[256];
+  int  len = n < 255 ? n : 255;
+  memcpy(cmd, buf, len);
+  while(len > 0 && (cmd[len-1] == '\r' || cmd[len-1] == '\n' || cmd[len-1] == ' ')) len--;
+  cmd[len] = '\0';
+  int newmode = -1;
+  if(!strcmp(cmd, "echo-mode"))     newmode = MODE_ECHO;
+  if(!strcmp(cmd, "echo-pkt-mode")) newmode = MODE_PKT;
+  struct pending *p = malloc(sizeof(struct pending) + len + 4);
+  if(p == NULL) return NULL;
+  memcpy(p->data, cmd, len);
+  const char *tail = newmode < 0 ? "\r\n> " : "\r\n";
+  memcpy(p->data+len, tail, strlen(tail));
+  p->len = len + strlen(tail);
+  if(newmode >= 0) {
+    d->mode = newmode;
+    if(verbose) fprintf(stderr, "%s: now in %s mode.\n", d->name, modename[newmode]);
+  }
+  return p;
+}
+
+static void dev_message(struct conn *c, unsigned char *buf, int n) {
+  struct emudom *d = c->dom;
+  struct pending *p = NULL;
+  d->rxmsgs++;
+  d->rxbytes += n;
+  if(d->cf.droprate > 0 && urand() < d->cf.droprate) {
+    d->ndrop++;
+    return;
+  }
+  switch(d->mode) {
+  case MODE_ECHO:
+    if((p = malloc(sizeof(struct pending) + n)) == NULL) return;
+    memcpy(p->data, buf, n);
+    p->len = n;
+    break;
+  case MODE_PKT: {
+    if(n < 6) return;
+    uint32_t seed = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+    int nwords = buf[4] | (buf[5] << 8);
+    if(nwords*4 > bufsiz) nwords = bufsiz/4;
+    if((p = malloc(sizeof(struct pending) + nwords*4)) == NULL) return;
+    pg_fill_lcg(p->data, nwords, seed);
+    p->len = nwords*4;
+    break;
+  }
+  default:
+    if((p = iceboot(d, buf, n)) == NULL) return;
+    break;
+  }
+  if(p->len > 0 && d->cf.errrate > 0 && urand() < d->cf.errrate) {
+    p->data[(int) (urand()*p->len)] ^= 1 << (int) (urand()*8);
+    d->nflip++;
+  }
+
+  /* The request and the reply both have to cross the wire pair */
+  uint64_t now = now_ns();
+  uint64_t t   = d->link_free > now ? d->link_free : now;
+  if(d->cf.kbps > 0) t += (uint64_t) ((n + p->len)*1.E6/d->cf.kbps);
+  d->link_free = t;
+  p->due  = t + (uint64_t) (d->cf.latency_us*1000.);
+  p->next = NULL;
+  if(c->tail) c->tail->next = p; else c->head = p;
+  c->tail = p;
+  c->nq++;
+}
+
+static int flush_conn(struct conn *c, uint64_t now) {
+  /* Send replies which are due.  Returns nonzero if the client is gone. */
+  while(c->head && c->head->due <= now) {
+    struct pending *p = c->head;
+    if(send(c->n.fd, p->data, p->len, MSG_DONTWAIT|MSG_NOSIGNAL) < 0) {
+      if(errno == EAGAIN) {
+	c->blocked = 1;
+	return 0;
+      }
+      return 1;
+    }
+    if(c->n.type == N_DEVCONN) {
+      c->dom->txmsgs++;
+      c->dom->txbytes += p->len;
+    }
+    c->head = p->next;
+    if(!c->head) c->tail = NULL;
+    c->nq--;
+    free(p);
+  }
+  c->blocked = 0;
+  return 0;
+}
+
+static void tcal_request(struct conn *c) {
+  /* The record is ready once the pair is free and the tcal is done */
+  struct emudom *d = c->dom;
+  uint64_t *pfree  = &cards[d->icard].tcal_free[d->ipair];
+  uint64_t start   = now_ns();
+  struct pending *p = malloc(sizeof(struct pending) + DH_TCAL_STRUCT_LEN);
+  if(p == NULL) return;
+  if(*pfree > start) {
+    start = *pfree;
+    d->ntcalwait++;
+  }
+  make_tcal(d, p->data, start);
+  d->ntcal++;
+  *pfree  = start + tcal_us*1000ULL;
+  p->len  = DH_TCAL_STRUCT_LEN;
+  p->due  = *pfree;
+  p->next = NULL;
+  if(c->tail) c->tail->next = p; else c->head = p;
+  c->tail = p;
+  c->nq++;
+}
+
+static int read_conn(struct conn *c) {
+  /* Take messages until the DOM's queue is full.  Returns nonzero if
+     the client has gone away. */
+  while(c->nq < maxq) {
+    int n = recv(c->n.fd, msgbuf, MAXMSG, MSG_DONTWAIT);
+    if(n < 0 && errno == EAGAIN) return 0;
+    if(n <= 0) return 1;
+    if(c->n.type == N_TCALCONN) {
+      tcal_request(c);
+      continue;
+    }
+    if(n > bufsiz) {
+      fprintf(stderr, "%s: %d byte message is larger than bufsiz (%d); dropped.\n",
+	      c->dom->name, n, bufsiz);
+      continue;
+    }
+    dev_message(c, msgbuf, n);
+  }
+  return 0;
+}
+
+static void proc_written(void) {
+  /* A tool wrote to one of the watched proc files */
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  int n = read(inot.fd, buf, sizeof(buf));
+  int off = 0;
+  while(n > 0 && off < n) {
+    struct inotify_event *ev = (struct inotify_event *) (buf+off);
+    off += sizeof(struct inotify_event) + ev->len;
+    int i;
+    struct emudom *d = NULL;
+    for(i=0; i<ndoms; i++) if(doms[i].wd == ev->wd) d = &doms[i];
+    if(d == NULL || ev->len == 0) continue;
+    if(!strcmp(ev->name, "softboot")) {
+      struct conn *c;
+      d->mode = MODE_ICEBOOT;
+      for(c=conns; c; c=c->next) if(c->dom == d && c->n.type == N_DEVCONN) drop_pending(c);
+      if(verbose) fprintf(stderr, "%s: softboot; now in iceboot mode.\n", d->name);
+    } else if(!strcmp(ev->name, "comstat")) {
+      d->rxmsgs = d->txmsgs = d->rxbytes = d->txbytes = 0;
+      d->nflip  = d->ndrop  = d->ntcal   = d->ntcalwait = d->nconnects = 0;
+      write_comstat(d);
+    }
+  }
+}
+
+/************* Main loop ******************/
+
+int main(int argc, char *argv[]) {
+  struct link defl = { 0., 0., 0., 0., MODE_ECHO };
+  char *ovr[MAXOVERRIDE], *dorppm[DH_MAXCARD];
+  int novr = 0, nppm = 0;
+  uint64_t seed = getpid();
+  int i, icard, ipair;
+
+  while(1) {
+    char c = getopt(argc, argv, "hvc:w:b:m:k:l:e:x:q:d:g:t:o:s:");
+    if(c == -1) break;
+    switch(c) {
+    case 'c': ncards   = atoi(optarg); break;
+    case 'w': npairs   = atoi(optarg); break;
+    case 'b': bufsiz   = atoi(optarg); break;
+    case 'm': if((defl.mode = getmode(optarg)) < 0) exit(usage()); break;
+    case 'k': defl.kbps       = atof(optarg); break;
+    case 'l': defl.latency_us = atof(optarg); break;
+    case 'e': defl.errrate    = atof(optarg); break;
+    case 'x': defl.droprate   = atof(optarg); break;
+    case 'q': maxq     = atoi(optarg); break;
+    case 'd': dorclk   = atoi(optarg); break;
+    case 't': tcal_us  = atoi(optarg); break;
+    case 's': seed     = strtoull(optarg, NULL, 0); break;
+    case 'v': verbose  = 1; break;
+    case 'g':
+      if(nppm == DH_MAXCARD || !strchr(optarg, ':')) exit(usage());
+      dorppm[nppm++] = optarg;
+      break;
+    case 'o':
+      if(novr == MAXOVERRIDE || !strchr(optarg, ':')) exit(usage());
+      ovr[novr++] = optarg;
+      break;
+    case 'h':
+    default: exit(usage());
+    }
+  }
+  if(ncards < 1 || ncards > DH_MAXCARD || npairs < 1 || npairs > DH_NPAIR
+     || bufsiz < 1 || bufsiz > MAXMSG || maxq < 1 || dorclk < 1
+     || tcal_us < 0) exit(usage());
+
+  snprintf(root, DH_ROOTLEN, "%s", optind < argc ? argv[optind] : dh_root());
+  while(strlen(root) > 1 && root[strlen(root)-1] == '/') root[strlen(root)-1] = '\0';
+  if(root[0] == '\0' || !strcmp(root, "/")) {
+    fprintf(stderr, "Need a root directory (not /) to put the emulated hub under.\n");
+    exit(usage());
+  }
+
+  pg_seed(&rng, seed);
+  t0 = now_ns();
+  signal(SIGINT,  argghhhh);
+  signal(SIGTERM, argghhhh);
+  signal(SIGPIPE, SIG_IGN);
+
+  if((epfd = epoll_create1(0)) == -1 || (inot.fd = inotify_init1(IN_NONBLOCK)) == -1) {
+    perror("domhub-emu");
+    exit(-1);
+  }
+  inot.type = N_INOTIFY;
+  ep_add(&inot, EPOLLIN);
+
+  char pf[DH_PATHLEN];
+  snprintf(pf, DH_PATHLEN, "%s/dev", root);
+  mkdirs(pf);
+  snprintf(pf, DH_PATHLEN, "%s" DH_PROCDIR, root);
+  mkdirs(pf);
+  snprintf(pf, DH_PATHLEN, "%s" DH_PROCDIR "/bufsiz", root);
+  put_file(pf, "%d\n", bufsiz);
+  snprintf(pf, DH_PATHLEN, "%s" DH_PROCDIR "/blocking", root);
+  put_file(pf, "0\n");
+  snprintf(pf, DH_PATHLEN, "%s" DH_PROCDIR "/lasterr", root);
+  put_file(pf, "0: no error\n");
+
+  for(icard=0; icard<ncards; icard++) {
+    setup_card(&cards[icard], icard, dorppm, nppm);
+    for(ipair=0; ipair<npairs; ipair++) {
+      setup_dom(&doms[ndoms++], icard, ipair, 'A', &defl, ovr, novr);
+      setup_dom(&doms[ndoms++], icard, ipair, 'B', &defl, ovr, novr);
+    }
+  }
+  fprintf(stderr, "domhub-emu: %d DOMs on %d cards under %s (DOMHUB_ROOT=%s).\n",
+	  ndoms, ncards, root, root);
+
+  struct epoll_event evs[MAXEVENTS];
+  uint64_t next_stat = t0 + STAT_NS;
+  while(!die) {
+    /* Sleep until the next reply, 1PPS or comstat update is due */
+    uint64_t now  = now_ns();
+    uint64_t next = next_stat;
+    struct conn *c, *cnext;
+    for(i=0; i<ncards; i++) if(cards[i].next_gps < next) next = cards[i].next_gps;
+    for(c=conns; c; c=c->next) {
+      if(c->head && !c->blocked && c->head->due < next) next = c->head->due;
+    }
+    int tmo = next > now ? (int) ((next - now + 999999)/1000000) : 0;
+    int nev = epoll_wait(epfd, evs, MAXEVENTS, tmo);
+    if(nev < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      break;
+    }
+    for(i=0; i<nev; i++) {
+      struct node *n = evs[i].data.ptr;
+      switch(n->type) {
+      case N_DEV:
+	new_conn(n->fd, N_DEVCONN, (struct emudom *) ((char *) n - offsetof(struct emudom, dev)));
+	break;
+      case N_TCAL:
+	new_conn(n->fd, N_TCALCONN, (struct emudom *) ((char *) n - offsetof(struct emudom, tcal)));
+	break;
+      case N_GPS:
+	send_gps((struct emucard *) ((char *) n - offsetof(struct emucard, sync)));
+	break;
+      case N_INOTIFY:
+	proc_written();
+	break;
+      default:
+	c = (struct conn *) n;
+	if(evs[i].events & EPOLLOUT) c->blocked = 0;
+	if((evs[i].events & (EPOLLIN|EPOLLHUP|EPOLLERR)) && read_conn(c)) {
+	  close_conn(c);
+	  /* A later event for this connection in evs[] would be stale */
+	  int j;
+	  for(j=i+1; j<nev; j++) if(evs[j].data.ptr == c) evs[j].data.ptr = &inot;
+	}
+	break;
+      }
+    }
+
+    now = now_ns();
+    for(c=conns; c; c=cnext) {
+      cnext = c->next;
+      if(!c->blocked && flush_conn(c, now)) {
+	close_conn(c);
+	continue;
+      }
+      conn_events(c);
+    }
+    for(i=0; i<ncards; i++) while(cards[i].next_gps <= now) gps_tick(&cards[i]);
+    if(now >= next_stat) {
+      for(i=0; i<ndoms; i++) write_comstat(&doms[i]);
+      next_stat += STAT_NS;
+    }
+  }
+
+  for(i=0; i<ndoms; i++) {
+    unlink(doms[i].devpath);
+    unlink(doms[i].tcalpath);
+  }
+  for(i=0; i<ncards; i++) unlink(cards[i].syncpath);
+  fprintf(stderr, "domhub-emu: done.\n");
+  return 0;
+}
@@ -0,0 +1,206 @@
+/* domhub.c
+   DOM naming and DOM set helpers for the MOAT test programs.
+   See domhub.h.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#include "domhub.h"
+
+const char *dh_root(void) {
+  const char *root = getenv("DOMHUB_ROOT");
+  return root ? root : "";
+}
+
+char *dh_path(char *buf, int len, const char *fmt, ...) {
+  va_list ap;
+  int n = snprintf(buf, len, "%s", dh_root());
+  if(n >= len) return buf;
+  va_start(ap, fmt);
+  vsnprintf(buf+n, len-n, fmt, ap);
+  va_end(ap);
+  return buf;
+}
+
+char *dh_runpath(char *buf, int len, const char *name) {
+  char *p;
+  dh_path(buf, len, DH_RUNDIR "/%s", name);
+  for(p = strchr(buf+1, '/'); p; p = strchr(p+1, '/')) {
+    *p = '\0';
+    mkdir(buf, 0755);
+    *p = '/';
+  }
+  return buf;
+}
+
+const char *dh_unroot(const char *path) {
+  const char *root = dh_root();
+  int n = strlen(root);
+  if(n > 0 && !strncmp(path, root, n)) return path+n;
+  return path;
+}
+
+int dh_dom_index(int icard, int ipair, char cdom) {
+  if(icard < 0 || icard >= DH_MAXCARD) return -1;
+  if(ipair < 0 || ipair >= DH_NPAIR)   return -1;
+  if(cdom != 'A' && cdom != 'B')       return -1;
+  return (icard*DH_NPAIR + ipair)*DH_NDOM + (cdom == 'A' ? 0 : 1);
+}
+
+static void fill_dom(struct dh_dom *dom, int icard, int ipair, char cdom) {
+  dom->icard = icard;
+  dom->ipair = ipair;
+  dom->cdom  = cdom;
+  dh_path(dom->devfile, DH_PATHLEN, "/dev/dhc%dw%dd%c", icard, ipair, cdom);
+}
+
+int dh_parse_dom(struct dh_dom *dom, const char *arg) {
+  int icard, ipair;
+  char cdom;
+  if(arg[0] >= '0' && arg[0] <= '7') { /* 00a style */
+    if(strlen(arg) != 3) return 1;
+    icard = arg[0]-'0';
+    ipair = arg[1]-'0';
+    cdom  = toupper(arg[2]);
+    if(dh_dom_index(icard, ipair, cdom) < 0) return 1;
+    fill_dom(dom, icard, ipair, cdom);
+    return 0;
+  }
+  if(strlen(arg) >= DH_PATHLEN) return 1;
+  strcpy(dom->devfile, arg);
+  if(sscanf(dh_unroot(arg), "/dev/dhc%dw%dd%c", &icard, &ipair, &cdom) == 3
+     && dh_dom_index(icard, ipair, cdom) >= 0) {
+    dom->icard = icard;
+    dom->ipair = ipair;
+    dom->cdom  = cdom;
+  } else {
+    dom->icard = -1;
+    dom->ipair = -1;
+    dom->cdom  = '?';
+  }
+  return 0;
+}
+
+static int is_communicating(int icard, int ipair, char cdom) {
+  char pf[DH_PATHLEN];
+  char buf[256];
+  struct stat st;
+  if(stat(dh_path(pf, DH_PATHLEN, DH_PROCDIR), &st)) {
+    /* No driver (stand-in devices): go by presence of the device file */
+    dh_path(pf, DH_PATHLEN, "/dev/dhc%dw%dd%c", icard, ipair, cdom);
+    return !access(pf, F_OK);
+  }
+  dh_path(pf, DH_PATHLEN, DH_PROCDIR "/card%d/pair%d/dom%c/is-communicating",
+	  icard, ipair, cdom);
+  int fd = open(pf, O_RDONLY);
+  if(fd == -1) return 0;
+  int nr = read(fd, buf, sizeof(buf)-1);
+  close(fd);
+  if(nr <= 0) return 0;
+  buf[nr] = '\0';
+  return strstr(buf, "is communicating") != NULL;
+}
+
+static int add_dom(struct dh_dom *doms, int ndoms, int maxdoms, struct dh_dom *dom) {
+  int i;
+  for(i=0; i<ndoms; i++) {
+    if(!strcmp(doms[i].devfile, dom->devfile)) return ndoms; /* Already have it */
+  }
+  if(ndoms >= maxdoms) return ndoms;
+  doms[ndoms] = *dom;
+  return ndoms+1;
+}
+
+int dh_parse_domset(const char *spec, struct dh_dom *doms, int maxdoms) {
+  char word[DH_PATHLEN];
+  int ndoms = 0;
+  const char *p = spec;
+
+  while(*p) {
+    int n = 0;
+    while(*p == ' ' || *p == ',' || *p == '\t') p++;
+    if(!*p) break;
+    while(*p && *p != ' ' && *p != ',' && *p != '\t') {
+      if(n < DH_PATHLEN-1) word[n++] = *p;
+      p++;
+    }
+    word[n] = '\0';
+
+    struct dh_dom dom;
+    int wildcard = (n > 0 && word[n-1] == '*');
+    if(!strcmp(word, "all") || wildcard) {
+      int card0 = 0, card1 = DH_MAXCARD-1;
+      int pair0 = 0, pair1 = DH_NPAIR-1;
+      if(wildcard) {
+	if(n < 2 || n > 3 || word[0] < '0' || word[0] > '7') return -1;
+	card0 = card1 = word[0]-'0';
+	if(n == 3) {
+	  if(word[1] < '0' || word[1] > '3') return -1;
+	  pair0 = pair1 = word[1]-'0';
+	}
+      }
+      int icard, ipair, idom;
+      for(icard=card0; icard<=card1; icard++) {
+	for(ipair=pair0; ipair<=pair1; ipair++) {
+	  for(idom=0; idom<DH_NDOM; idom++) {
+	    char cdom = idom ? 'B' : 'A';
+	    if(!is_communicating(icard, ipair, cdom)) continue;
+	    fill_dom(&dom, icard, ipair, cdom);
+	    ndoms = add_dom(doms, ndoms, maxdoms, &dom);
+	  }
+	}
+      }
+    } else {
+      if(dh_parse_dom(&dom, word)) return -1;
+      ndoms = add_dom(doms, ndoms, maxdoms, &dom);
+    }
+  }
+  return ndoms;
+}
+
+static int blocking_reads(void) {
+  /* The driver's reads only wait for data if blocking is set to 1 */
+  char pf[DH_PATHLEN];
+  int blocking = 0;
+  FILE *fp = fopen(dh_path(pf, DH_PATHLEN, DH_PROCDIR "/blocking"), "r");
+  if(fp == NULL) return 0;
+  if(fscanf(fp, "%d", &blocking) != 1) blocking = 0;
+  fclose(fp);
+  return blocking;
+}
+
+int dh_open_dev(const char *path, int flags) {
+  struct stat st;
+  if(stat(path, &st) || !S_ISSOCK(st.st_mode)) return open(path, flags);
+
+  struct sockaddr_un addr;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+  if(fd == -1) return -1;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if(connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  if((flags & O_NONBLOCK) || !blocking_reads())
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
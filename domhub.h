@@ -0,0 +1,66 @@
+/* domhub.h
+   Helpers shared by the MOAT test programs for naming DOR cards,
+   wire pairs and DOMs, and for expanding DOM sets such as
+   "all", "00a 01b" or "3*" into a list of device files.
+*/
+
+#ifndef __DOMHUB_H__
+#define __DOMHUB_H__
+
+#define DH_MAXCARD   8
+#define DH_NPAIR     4
+#define DH_NDOM      2
+#define DH_MAXDOMS   (DH_MAXCARD*DH_NPAIR*DH_NDOM)
+#define DH_PATHLEN   512
+#define DH_PROCDIR   "/proc/driver/domhub"
+#define DH_RUNDIR    "/var/run/moat"   /* Files the tools share with each other */
+
+struct dh_dom {
+  int  icard;                 /* -1 if devfile isn't a /dev/dhcXwYdZ name */
+  int  ipair;
+  char cdom;                  /* 'A' or 'B' */
+  char devfile[DH_PATHLEN];
+};
+
+/* Prefix for every /dev and /proc path the tools use, taken from
+   $DOMHUB_ROOT ("" if it isn't set).  Pointing it at the root given to
+   domhub-emu runs the tools against the emulator instead of a driver. */
+const char *dh_root(void);
+
+/* printf-style path under dh_root(); returns buf */
+char *dh_path(char *buf, int len, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+
+/* dh_path() of DH_RUNDIR/<name>, making the directories above it if
+   they're missing; returns buf */
+char *dh_runpath(char *buf, int len, const char *name);
+
+/* path without the dh_root() prefix, for parsing card/pair/DOM out of it */
+const char *dh_unroot(const char *path);
+
+/* Index 0..DH_MAXDOMS-1 for a card/pair/dom triple, -1 if out of range */
+int dh_dom_index(int icard, int ipair, char cdom);
+
+/* Fill in a dh_dom from a single "00a", "00A" or device file argument.
+   Returns 0 on success. */
+int dh_parse_dom(struct dh_dom *dom, const char *arg);
+
+/* Expand a DOM set into at most maxdoms entries; returns the number
+   of DOMs found or -1 on a bad specifier.  The set is a list of
+   words separated by blanks or commas, each of which is one of
+     all       every communicating DOM on the hub
+     3*        every communicating DOM on card 3
+     30*       every communicating DOM on card 3, pair 0
+     30a       a single DOM
+     /dev/...  a device file (or a stand-in for one)
+   Names are looked up under dh_root(). */
+int dh_parse_domset(const char *spec, struct dh_dom *doms, int maxdoms);
+
+/* Open a DOM device file.  A Unix-domain socket in place of the device
+   file is connected to as SOCK_SEQPACKET so that a stand-in process can
+   preserve message boundaries the way the driver does.  As with the
+   driver, reads don't wait for data unless the hub's blocking proc file
+   is set to 1. */
+int dh_open_dev(const char *path, int flags);
+
+#endif /* __DOMHUB_H__ */
@@ -0,0 +1,528 @@
+/* domse.c
+   Send a string to a set of DOMs and wait for each to answer with an
+   expected pattern, as se.pl does, with softboots as sb.pl does them,
+   for all the DOMs at once from one epoll loop.  A run is a chain of
+   steps which every DOM works through on its own schedule, e.g.
+
+     domse "0* 1*" softboot " " ">" echo-mode echo-mode
+
+   Each step is the word "softboot" or a send string (a CR is added)
+   and a POSIX extended regular expression for the reply.  A pattern
+   without regex metacharacters is matched a byte at a time as replies
+   stream in; others are compiled once and run over the reply so far.
+   The step after a softboot resends its string every -r ms until the
+   DOM answers, instead of sleeping for the boot.
+
+   Output follows se.pl: replies as they arrive (CR and LF written as
+   \r and \n), " <dev>: OK (<first group>)." as each DOM matches, and
+   SUCCESS. or FAILURE: with a line per failed DOM at the end.
+
+   Usage: domse [-s] [-l] [-t <sec>] [-r <ms>] [-n <reps>] <domset> <step> ...
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <regex.h>
+#include <pthread.h>
+#include <getopt.h>
+#include <sys/epoll.h>
+
+#include "domhub.h"
+#include "lathist.h"
+
+#define MAXSTEPS     64
+#define RXLEN        16384     /* Reply kept per DOM for regex matching */
+#define TIMEOUT_S    10        /* Per DOM, per step, as in se.pl */
+#define RESEND_MS    500
+#define WRITE_TRIES  100       /* WRITE_RETRY_MS apart, as in se.pl */
+#define WRITE_RETRY_MS 10
+#define MS           1000000ULL
+
+enum { S_SEND, S_WAIT, S_BOOT, S_DONE, S_FAIL };
+
+struct step {
+  int   softboot;
+  char *send;                  /* With the CR */
+  int   sendlen;
+  const char *expect;
+  int   literal;               /* expect has no metacharacters */
+  int   explen;
+  int  *kmp;                   /* Failure function for a literal expect */
+  regex_t re;
+  int   resend;                /* Follows a softboot */
+  struct lathist lh;           /* Send to match, all DOMs and repeats */
+  uint64_t worst;
+  int   worstdom;
+};
+
+struct sedom {
+  struct dh_dom dom;
+  int   idx;
+  int   fd;
+  int   rep, step, state;
+  int   ntries;
+  int   kstate;                /* Bytes of a literal expect matched so far */
+  int   sberr;                 /* errno from the softboot thread */
+  uint64_t tsent, tnext, deadline;
+  char  rx[RXLEN+1];
+  int   nrx;
+  int   gotany;
+  char  why[256];
+};
+
+static struct step steps[MAXSTEPS];
+static int nsteps = 0, nreps = 1, silent = 0;
+static uint64_t timeout = TIMEOUT_S*1000*MS, resend = RESEND_MS*MS;
+static int sbpipe[2];
+
+int usage(void) {
+  fprintf(stderr,
+	  "Usage: domse [-s] [-l] [-t <sec>] [-r <ms>] [-n <reps>] <domset> <step> ...\n"
+	  "  Sends to all the DOMs in domset at once and waits for their replies.\n"
+	  "  Each step is 'softboot' or '<send> <expect>', expect being a POSIX\n"
+	  "  extended regex matched against the raw reply.\n"
+	  "  -s          don't show the replies\n"
+	  "  -l          report each step's response latency\n"
+	  "  -t <sec>    time allowed per DOM per step (default %d)\n"
+	  "  -r <ms>     after a softboot, resend every <ms> until the DOM answers\n"
+	  "              (default %d)\n"
+	  "  -n <reps>   go through the steps <reps> times (default 1)\n"
+	  "  domset      e.g. '00a 00b', '3*' or 'all' (quote it)\n"
+	  "  $DOMHUB_ROOT, if set, is prefixed to all /dev and /proc paths.\n",
+	  TIMEOUT_S, RESEND_MS);
+  return -1;
+}
+
+static void put_escaped(FILE *fp, const char *s, int n) {
+  /* As se.pl shows replies */
+  int i;
+  for(i=0; i<n; i++) {
+    if(s[i] == '\r')      fputs("\\r", fp);
+    else if(s[i] == '\n') fputs("\\n", fp);
+    else if(s[i] != '\0') fputc(s[i], fp);
+  }
+}
+
+static int is_literal(const char *p) {
+  return strpbrk(p, ".[]()*+?{}|^$\\") == NULL;
+}
+
+static int add_step(const char *send, const char *expect) {
+  if(nsteps >= MAXSTEPS) {
+    fprintf(stderr, "Too many steps (max %d).\n", MAXSTEPS);
+    exit(-1);
+  }
+  struct step *s = &steps[nsteps];
+  memset(s, 0, sizeof(*s));
+  s->resend = nsteps > 0 && steps[nsteps-1].softboot;
+  if(send == NULL) {
+    s->softboot = 1;
+    return nsteps++;
+  }
+  s->sendlen = strlen(send) + 1;
+  if((s->send = malloc(s->sendlen + 1)) == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(-1);
+  }
+  sprintf(s->send, "%s\r", send);
+  s->expect = expect;
+  s->explen = strlen(expect);
+  if(s->explen == 0) {
+    fprintf(stderr, "Empty pattern for '%s'.\n", send);
+    exit(-1);
+  }
+  if((s->literal = is_literal(expect))) {
+    /* KMP failure function, so a match can be carried across reads */
+    int i, k = 0;
+    if((s->kmp = calloc(s->explen, sizeof(int))) == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(-1);
+    }
+    for(i=1; i<s->explen; i++) {
+      while(k > 0 && expect[i] != expect[k]) k = s->kmp[k-1];
+      if(expect[i] == expect[k]) k++;
+      s->kmp[i] = k;
+    }
+  } else {
+    int err = regcomp(&s->re, expect, REG_EXTENDED);
+    if(err) {
+      char msg[256];
+      regerror(err, &s->re, msg, sizeof(msg));
+      fprintf(stderr, "Bad pattern '%s': %s\n", expect, msg);
+      exit(-1);
+    }
+  }
+  return nsteps++;
+}
+
+static void fail(struct sedom *d, int *nactive, const char *fmt, ...)
+  __attribute__((format(printf, 3, 4)));
+
+static void fail(struct sedom *d, int *nactive, const char *fmt, ...) {
+  va_list ap;
+  int n = 0;
+  if(nsteps > 1 || nreps > 1) {
+    n = nreps > 1 ? snprintf(d->why, sizeof(d->why), "rep %d step %d: ", d->rep+1, d->step+1)
+      : snprintf(d->why, sizeof(d->why), "step %d: ", d->step+1);
+  }
+  va_start(ap, fmt);
+  vsnprintf(d->why+n, sizeof(d->why)-n, fmt, ap);
+  va_end(ap);
+  if(d->fd >= 0) {
+    close(d->fd);
+    d->fd = -1;
+  }
+  d->state = S_FAIL;
+  (*nactive)--;
+}
+
+static void *softboot_thread(void *arg) {
+  /* The write can take as long as the reboot, so each DOM gets a thread */
+  struct sedom *d = arg;
+  char pf[DH_PATHLEN];
+  dh_path(pf, DH_PATHLEN, DH_PROCDIR "/card%d/pair%d/dom%c/softboot",
+	  d->dom.icard, d->dom.ipair, d->dom.cdom);
+  int fd = open(pf, O_WRONLY);
+  d->sberr = 0;
+  if(fd == -1 || write(fd, "reset\n", 6) != 6) d->sberr = errno ? errno : EIO;
+  if(fd != -1) close(fd);
+  if(write(sbpipe[1], &d->idx, sizeof(int)) != sizeof(int)) abort();
+  return NULL;
+}
+
+static void try_send(struct sedom *d, int *nactive, uint64_t now) {
+  struct step *s = &steps[d->step];
+  if(write(d->fd, s->send, s->sendlen) == s->sendlen) {
+    d->state = S_WAIT;
+    if(d->tsent == 0) d->tsent = now;
+    d->tnext = now + resend;
+    return;
+  }
+  if(++d->ntries >= WRITE_TRIES) {
+    fail(d, nactive, "couldn't write (after %d trials).", WRITE_TRIES);
+    return;
+  }
+  d->state = S_SEND;
+  d->tnext = now + WRITE_RETRY_MS*MS;
+}
+
+static void start_step(struct sedom *d, int *nactive, uint64_t now) {
+  struct step *s = &steps[d->step];
+  d->deadline = now + timeout;
+  d->tsent    = 0;
+  d->ntries   = 0;
+  d->nrx      = 0;
+  d->kstate   = 0;
+  d->gotany   = 0;
+  if(s->softboot) {
+    pthread_t th;
+    d->state = S_BOOT;
+    if(pthread_create(&th, NULL, softboot_thread, d)) {
+      fail(d, nactive, "can't start softboot thread.");
+      return;
+    }
+    pthread_detach(th);
+    return;
+  }
+  try_send(d, nactive, now);
+}
+
+static void next_step(struct sedom *d, int *nactive, uint64_t now) {
+  if(++d->step == nsteps) {
+    d->step = 0;
+    if(++d->rep == nreps) {
+      d->state = S_DONE;
+      close(d->fd);
+      d->fd = -1;
+      (*nactive)--;
+      return;
+    }
+  }
+  start_step(d, nactive, now);
+}
+
+static void keep_reply(struct sedom *d, const char *buf, int n) {
+  /* For regex matching and for showing what a DOM did say */
+  if(d->nrx + n > RXLEN) {
+    /* Keep the most recent part; prompts are at the end */
+    int keep = RXLEN/2 > n ? RXLEN/2 : 0;
+    if(keep > d->nrx) keep = d->nrx;
+    memmove(d->rx, d->rx + d->nrx - keep, keep);
+    d->nrx = keep;
+    if(n > RXLEN) {
+      buf += n - RXLEN;
+      n = RXLEN;
+    }
+  }
+  memcpy(d->rx + d->nrx, buf, n);
+  d->nrx += n;
+  d->rx[d->nrx] = '\0';
+}
+
+static int matched(struct sedom *d, const char *buf, int n, char *cap, int caplen) {
+  /* Feed a chunk of reply to the step's pattern; nonzero on a match */
+  struct step *s = &steps[d->step];
+  int i;
+  cap[0] = '\0';
+  if(s->literal) {
+    for(i=0; i<n; i++) {
+      while(d->kstate > 0 && buf[i] != s->expect[d->kstate]) d->kstate = s->kmp[d->kstate-1];
+      if(buf[i] == s->expect[d->kstate]) d->kstate++;
+      if(d->kstate == s->explen) return 1;
+    }
+    return 0;
+  }
+  regmatch_t pm[2];
+  if(regexec(&s->re, d->rx, 2, pm, 0)) return 0;
+  if(s->re.re_nsub > 0 && pm[1].rm_so >= 0) {
+    int len = pm[1].rm_eo - pm[1].rm_so;
+    if(len > caplen-1) len = caplen-1;
+    memcpy(cap, d->rx + pm[1].rm_so, len);
+    cap[len] = '\0';
+  }
+  return 1;
+}
+
+static void read_dom(struct sedom *d, int *nactive) {
+  char buf[4096], cap[256];
+  int n;
+  while(d->fd >= 0 && (n = read(d->fd, buf, sizeof(buf))) > 0) {
+    if(d->state != S_WAIT) continue;   /* Nothing is expected yet */
+    uint64_t now = lh_now_ns();
+    if(!silent) put_escaped(stdout, buf, n);
+    d->gotany = 1;
+    keep_reply(d, buf, n);
+    if(!matched(d, buf, n, cap, sizeof(cap))) continue;
+    struct step *s = &steps[d->step];
+    uint64_t lat = now - d->tsent;
+    lh_record(&s->lh, lat);
+    if(lat > s->worst) {
+      s->worst    = lat;
+      s->worstdom = d->idx;
+    }
+    if(cap[0]) {
+      printf(" %s: OK (", d->dom.devfile);
+      put_escaped(stdout, cap, strlen(cap));
+      printf(").\n");
+    } else {
+      printf(" %s: OK.\n", d->dom.devfile);
+    }
+    next_step(d, nactive, now);
+  }
+}
+
+static void timers(struct sedom *dl, int ndoms, int *nactive, uint64_t now) {
+  int i;
+  for(i=0; i<ndoms; i++) {
+    struct sedom *d = &dl[i];
+    if(d->state == S_DONE || d->state == S_FAIL) continue;
+    if(now >= d->deadline) {
+      if(d->state == S_BOOT) {
+	fail(d, nactive, "softboot timed out.");
+      } else if(!d->gotany) {
+	fail(d, nactive, "got NO DATA.");
+      } else {
+	char got[RXLEN*2+16];
+	FILE *fp = fmemopen(got, sizeof(got), "w");
+	if(fp) {
+	  put_escaped(fp, d->rx, d->nrx);
+	  fputc('\0', fp);
+	  fclose(fp);
+	} else {
+	  got[0] = '\0';
+	}
+	fail(d, nactive, "(got %s)", got);
+      }
+      continue;
+    }
+    if(d->state == S_SEND && now >= d->tnext) {
+      try_send(d, nactive, now);
+    } else if(d->state == S_WAIT && steps[d->step].resend && now >= d->tnext) {
+      if(write(d->fd, steps[d->step].send, steps[d->step].sendlen) < 0) { /* Try again later */ }
+      d->tnext = now + resend;
+    }
+  }
+}
+
+static int wait_ms(struct sedom *dl, int ndoms, uint64_t now) {
+  /* Until the next deadline or resend, at most a second */
+  uint64_t next = now + 1000*MS;
+  int i;
+  for(i=0; i<ndoms; i++) {
+    struct sedom *d = &dl[i];
+    if(d->state == S_DONE || d->state == S_FAIL) continue;
+    if(d->deadline < next) next = d->deadline;
+    if((d->state == S_SEND || (d->state == S_WAIT && steps[d->step].resend))
+       && d->tnext < next) next = d->tnext;
+  }
+  return next <= now ? 0 : (int) ((next - now + MS - 1)/MS);
+}
+
+static int lasterr_ok(char *le, int len) {
+  char pf[DH_PATHLEN];
+  FILE *fp = fopen(dh_path(pf, DH_PATHLEN, DH_PROCDIR "/lasterr"), "r");
+  le[0] = '\0';
+  if(fp == NULL) return 1;
+  if(fgets(le, len, fp) == NULL) le[0] = '\0';
+  fclose(fp);
+  return le[0] == '\0' || !strncmp(le, "0:", 2);
+}
+
+int main(int argc, char *argv[]) {
+  static struct sedom dl[DH_MAXDOMS];
+  struct dh_dom doms[DH_MAXDOMS];
+  int showlat = 0, i;
+  char le[256];
+
+  while(1) {
+    char c = getopt(argc, argv, "+hslt:r:n:");
+    if(c == -1) break;
+    switch(c) {
+    case 's': silent  = 1; break;
+    case 'l': showlat = 1; break;
+    case 't': timeout = (uint64_t) (atof(optarg)*1000)*MS; break;
+    case 'r': resend  = (uint64_t) atoi(optarg)*MS; break;
+    case 'n': nreps   = atoi(optarg); break;
+    case 'h':
+    default:
+      exit(usage());
+    }
+  }
+  if(argc - optind < 2 || timeout == 0 || resend == 0 || nreps < 1) exit(usage());
+
+  const char *spec = argv[optind++];
+  int havesb = 0;
+  while(optind < argc) {
+    if(!strcmp(argv[optind], "softboot")) {
+      add_step(NULL, NULL);
+      havesb = 1;
+      optind++;
+    } else {
+      if(optind + 1 >= argc) {
+	fprintf(stderr, "No pattern to expect for '%s'.\n", argv[optind]);
+	exit(usage());
+      }
+      add_step(argv[optind], argv[optind+1]);
+      optind += 2;
+    }
+  }
+
+  int ndoms = dh_parse_domset(spec, doms, DH_MAXDOMS);
+  if(ndoms < 0) {
+    fprintf(stderr, "Bad DOM set '%s'.\n", spec);
+    exit(usage());
+  }
+  if(ndoms == 0) {
+    fprintf(stderr, "No communicating DOMs - check power and/or hardware.\n");
+    exit(-1);
+  }
+  if(havesb) lasterr_ok(le, sizeof(le)); /* Reading clears it */
+  if(pipe2(sbpipe, O_NONBLOCK)) {
+    perror("pipe2");
+    exit(-1);
+  }
+  int epfd = epoll_create(ndoms+1);
+  if(epfd == -1) {
+    perror("epoll_create");
+    exit(-1);
+  }
+  struct epoll_event ev;
+  ev.events   = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, sbpipe[0], &ev);
+
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  int nactive = 0;
+  uint64_t now = lh_now_ns();
+  for(i=0; i<ndoms; i++) {
+    struct sedom *d = &dl[i];
+    d->dom = doms[i];
+    d->idx = i;
+    nactive++;
+    if(d->dom.icard < 0 && havesb) {
+      d->fd = -1;
+      fail(d, &nactive, "isn't a DOM device name, can't softboot it.");
+      continue;
+    }
+    if((d->fd = dh_open_dev(d->dom.devfile, O_RDWR|O_NONBLOCK)) == -1) {
+      fprintf(stderr, "WARNING: open failed on %s!\n", d->dom.devfile);
+      fail(d, &nactive, "failed to open.");
+      continue;
+    }
+    ev.events   = EPOLLIN;
+    ev.data.ptr = d;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, d->fd, &ev)) {
+      fprintf(stderr, "%s: ", d->dom.devfile);
+      perror("epoll_ctl");
+      exit(-1);
+    }
+    start_step(d, &nactive, now);
+  }
+
+  struct epoll_event evs[DH_MAXDOMS+1];
+  while(nactive > 0) {
+    int nev = epoll_wait(epfd, evs, ndoms+1, wait_ms(dl, ndoms, lh_now_ns()));
+    if(nev < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      exit(-1);
+    }
+    for(i=0; i<nev; i++) {
+      struct sedom *d = evs[i].data.ptr;
+      if(d == NULL) {
+	int idx;
+	while(read(sbpipe[0], &idx, sizeof(int)) == sizeof(int)) {
+	  d = &dl[idx];
+	  if(d->state != S_BOOT) continue;  /* Already timed out */
+	  if(d->sberr) {
+	    fail(d, &nactive, "softboot failed: %s.", strerror(d->sberr));
+	  } else {
+	    /* Whatever the DOM said before the reboot is stale */
+	    char buf[4096];
+	    while(read(d->fd, buf, sizeof(buf)) > 0);
+	    printf(" %s: softboot OK.\n", d->dom.devfile);
+	    next_step(d, &nactive, lh_now_ns());
+	  }
+	}
+	continue;
+      }
+      if(d->state == S_DONE || d->state == S_FAIL) continue;
+      read_dom(d, &nactive);
+    }
+    timers(dl, ndoms, &nactive, lh_now_ns());
+  }
+
+  int nbad = 0;
+  for(i=0; i<ndoms; i++) if(dl[i].state != S_DONE) nbad++;
+  int leok = !havesb || lasterr_ok(le, sizeof(le));
+  if(nbad == 0 && leok) {
+    printf("SUCCESS.\n");
+  } else {
+    printf("FAILURE:\n");
+    for(i=0; i<ndoms; i++) if(dl[i].state != S_DONE) printf("\t%s %s\n", dl[i].dom.devfile, dl[i].why);
+    if(!leok) printf("\tSoftboot error %s", le);
+  }
+
+  if(showlat) {
+    for(i=0; i<nsteps; i++) {
+      struct step *s = &steps[i];
+      if(s->softboot) continue;
+      printf("step %d '", i+1);
+      put_escaped(stdout, s->send, s->sendlen-1);
+      if(s->lh.count == 0) {
+	printf("': no replies\n");
+	continue;
+      }
+      printf("': %llu replies, ms mean/p50/p90/max %.1f/%.1f/%.1f/%.1f (slowest %s)\n",
+	     (unsigned long long) s->lh.count, s->lh.sum/(double) s->lh.count/MS,
+	     lh_percentile(&s->lh, 0.5)/(double) MS, lh_percentile(&s->lh, 0.9)/(double) MS,
+	     s->lh.max/(double) MS, dl[s->worstdom].dom.devfile);
+    }
+  }
+  return nbad == 0 && leok ? 0 : -1;
+}
@@ -21,6 +21,8 @@
 #define _GNU_SOURCE
 #include <getopt.h>
 
+#include "domhub.h"
+
 #define MAX_MSG_BYTES 8092
 
 #define pprintf(...)
@@ -64,7 +66,7 @@ void show_fpga(int icard) {
   /* In case of hardware timeout from the driver, show the DOR FPGA for the appropriate DOR
      card */
   char cmdbuf[1024];
-  snprintf(cmdbuf,1024,"cat /proc/driver/domhub/card%d/fpga",icard);
+  snprintf(cmdbuf,1024,"cat %s" DH_PROCDIR "/card%d/fpga",dh_root(),icard);
   printf("Showing FPGA registers: %s.\n",cmdbuf);
   system(cmdbuf);
 }
@@ -74,7 +76,8 @@ int usage(void) {
 fprintf(stderr, 
   "Usage:\n"
 	  "  dtest <file>");
-  fprintf(stderr, "  <file> is of the form 00a, 00A, or /dev/dhc0w0dA\n\n");
+  fprintf(stderr, "  <file> is of the form 00a, 00A, or /dev/dhc0w0dA\n");
+  fprintf(stderr, "  $DOMHUB_ROOT, if set, is prefixed to all /dev and /proc paths.\n\n");
   return 0;
 }
 
@@ -92,7 +95,8 @@ int main(int argc, char *argv[]) {
 
   int bufsiz=0;
   FILE *bs;
-  bs = fopen("/proc/driver/domhub/bufsiz","r");
+  char bsfile[DH_PATHLEN];
+  bs = fopen(dh_path(bsfile, DH_PATHLEN, DH_PROCDIR "/bufsiz"),"r");
   if(bs == NULL) {
     fprintf(stderr, "Can't open bufsiz proc file.  Driver not loaded?\n");
     exit(-1);
@@ -135,7 +139,7 @@ int main(int argc, char *argv[]) {
     if(icard < 0 || icard > 7) exit(usage());
     if(ipair < 0 || ipair > 3) exit(usage());
     if(cdom != 'A' && cdom != 'B') exit(usage());
-    snprintf(filbuf, BSIZ, "/dev/dhc%dw%dd%c", icard, ipair, cdom);
+    dh_path(filbuf, BSIZ, "/dev/dhc%dw%dd%c", icard, ipair, cdom);
     filename = filbuf;
   }
 
@@ -155,7 +159,7 @@ int main(int argc, char *argv[]) {
       printw("\r"); scroll(w);
       if(tolower(c) == 'q') { scroll(w); endwin(); return 0; }
       if(tolower(c) == 'o' || c == '\n') {
-	filep = open(filename, O_RDWR);
+	filep = dh_open_dev(filename, O_RDWR|O_NONBLOCK);
 	if(filep <= 0) {
 	  printw("Can't open file %s (%d:%s)\r", filename, errno, strerror(errno));
 	  scroll(w);
@@ -0,0 +1,233 @@
+/* gpsidx.c
+   DOR clock to UTC index; see gpsidx.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "domhub.h"
+#include "gpsidx.h"
+#include "seqlock.h"
+
+#define GPSIDX_MAGIC   0x47504958 /* "GPIX" */
+#define GPSIDX_VERSION 1
+#define TSBUFLEN       22
+#define QUALPOS        13
+#define CLOCK_BITS     48
+#define CLOCK_MASK     ((1ULL << CLOCK_BITS)-1)
+
+/* Difference of two DOR times, either way round */
+static int64_t sdelta(uint64_t d) {
+  d &= CLOCK_MASK;
+  return (d & (1ULL << (CLOCK_BITS-1))) ? (int64_t) d - (int64_t) (1ULL << CLOCK_BITS)
+    : (int64_t) d;
+}
+
+static struct gpsidx *gmap(int fd, int icard, int prot) {
+  struct gpsidx *gi = malloc(sizeof(*gi));
+  if(gi == NULL) {
+    close(fd);
+    errno = ENOMEM;
+    return NULL;
+  }
+  gi->m = mmap(NULL, sizeof(struct gpsidx_map), prot, MAP_SHARED, fd, 0);
+  if(gi->m == MAP_FAILED) {
+    int err = errno;
+    close(fd);
+    free(gi);
+    errno = err;
+    return NULL;
+  }
+  gi->fd    = fd;
+  gi->icard = icard;
+  return gi;
+}
+
+struct gpsidx *gpsidx_open(int icard) {
+  char path[DH_PATHLEN];
+  struct stat st;
+  int fd = open(dh_path(path, DH_PATHLEN, DH_RUNDIR "/gpsidx%d", icard), O_RDONLY);
+  if(fd == -1) return NULL;
+  if(fstat(fd, &st) || st.st_size < sizeof(struct gpsidx_map)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  struct gpsidx *gi = gmap(fd, icard, PROT_READ);
+  if(gi && (gi->m->magic != GPSIDX_MAGIC || gi->m->version != GPSIDX_VERSION)) {
+    gpsidx_close(gi);
+    errno = EINVAL;
+    return NULL;
+  }
+  return gi;
+}
+
+struct gpsidx *gpsidx_create(int icard, double dor_hz) {
+  char path[DH_PATHLEN], name[16];
+  snprintf(name, sizeof(name), "gpsidx%d", icard);
+  int fd = open(dh_runpath(path, DH_PATHLEN, name), O_RDWR|O_CREAT, 0644);
+  if(fd == -1) return NULL;
+  if(ftruncate(fd, sizeof(struct gpsidx_map))) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return NULL;
+  }
+  struct gpsidx *gi = gmap(fd, icard, PROT_READ|PROT_WRITE);
+  if(gi == NULL) return NULL;
+
+  /* Old entries may be from before a card reset; start clean */
+  __atomic_store_n(&gi->m->magic, 0, __ATOMIC_RELEASE);
+  memset(gi->m, 0, sizeof(struct gpsidx_map));
+  gi->m->version = GPSIDX_VERSION;
+  gi->m->icard   = icard;
+  gi->m->dor_hz  = dor_hz;
+  __atomic_store_n(&gi->m->magic, GPSIDX_MAGIC, __ATOMIC_RELEASE);
+  return gi;
+}
+
+void gpsidx_close(struct gpsidx *gi) {
+  if(gi == NULL) return;
+  munmap(gi->m, sizeof(struct gpsidx_map));
+  close(gi->fd);
+  free(gi);
+}
+
+/* UTC second of a DDD:HH:MM:SS string.  It has no year, so take the
+   one which puts it nearest to now. */
+static int64_t ts_utc(const char *s, time_t now) {
+  struct tm tm;
+  int i;
+  for(i=1; i<QUALPOS; i++)
+    if(!(i == 4 || i == 7 || i == 10 ? s[i] == ':' : s[i] >= '0' && s[i] <= '9')) return -1;
+  int64_t sod = ((s[1]-'0')*100 + (s[2]-'0')*10 + (s[3]-'0') - 1)*86400LL
+    + ((s[5]-'0')*10 + (s[6]-'0'))*3600 + ((s[8]-'0')*10 + (s[9]-'0'))*60
+    + (s[11]-'0')*10 + (s[12]-'0');
+  int64_t best = -1;
+  gmtime_r(&now, &tm);
+  for(i=-1; i<=1; i++) {
+    struct tm jan1;
+    memset(&jan1, 0, sizeof(jan1));
+    jan1.tm_year = tm.tm_year + i;
+    jan1.tm_mday = 1;
+    int64_t t = timegm(&jan1) + sod;
+    if(best < 0 || llabs(t - now) < llabs(best - now)) best = t;
+  }
+  return best;
+}
+
+int gpsidx_add(struct gpsidx *gi, const char *tsbuf) {
+  struct gpsidx_map *m = gi->m;
+  time_t now = time(NULL);
+  uint64_t dor = 0;
+  int i;
+
+  if(tsbuf[0] != 1) return -1;
+  int64_t utc = ts_utc(tsbuf, now);
+  if(utc <= 0) return -1;
+  for(i=QUALPOS+1; i<TSBUFLEN; i++) dor = (dor << 8) | (unsigned char) tsbuf[i];
+
+  seq_begin(&m->seq);
+  if(m->last_utc && utc <= m->last_utc) {
+    if(utc < m->last_utc - GPSIDX_N/2) {
+      /* GPS time went back a long way; what we have is no good */
+      memset(m->ent, 0, sizeof(m->ent));
+    } else {
+      m->nskip++;
+      goto out;
+    }
+  }
+  struct gpsidx_ent *e = &m->ent[utc % GPSIDX_N];
+  e->dor  = dor;
+  e->utc  = utc;
+  e->qual = (unsigned char) tsbuf[QUALPOS];
+  m->last_utc = utc;
+  m->wall     = now;
+  m->nadd++;
+ out:
+  seq_end(&m->seq);
+  return 0;
+}
+
+/* Qualities from best to worst; anything else is worse still */
+static int bad_qual(int q) {
+  return q != ' ' && q != '.';
+}
+
+static int lookup(const struct gpsidx_map *m, uint64_t dor, struct timespec *utc) {
+  const struct gpsidx_ent *e, *next;
+  int64_t s, d;
+  int flags = 0;
+
+  if(m->last_utc == 0) return GPSIDX_NODATA;
+  e = &m->ent[m->last_utc % GPSIDX_N];
+  d = sdelta(dor - e->dor);
+  if(d < 0) {
+    /* Guess the second at the nominal rate; the clock being off or a
+       hole can put it out by one or two, so take the newest 1PPS
+       around it which isn't after dor */
+    int64_t guess = m->last_utc + (d - (int64_t) m->dor_hz + 1)/(int64_t) m->dor_hz;
+    e = NULL;
+    for(s = guess+2; s >= guess-2; s--) {
+      const struct gpsidx_ent *c = &m->ent[s % GPSIDX_N];
+      if(s > m->last_utc || s <= m->last_utc - GPSIDX_N || c->utc != s) continue;
+      if((d = sdelta(dor - c->dor)) >= 0) {
+	e = c;
+	break;
+      }
+    }
+    if(e == NULL) return GPSIDX_NODATA;
+  }
+  next = &m->ent[(e->utc+1) % GPSIDX_N];
+  double frac;
+  if(next->utc == e->utc+1 && sdelta(next->dor - e->dor) > d) {
+    frac = (double) d/sdelta(next->dor - e->dor);
+  } else {
+    frac = d/m->dor_hz;
+    if(frac >= 1.5 || e->utc != m->last_utc) flags |= GPSIDX_EXTRAP;
+  }
+  int64_t whole = (int64_t) frac;
+  utc->tv_sec  = e->utc + whole;
+  utc->tv_nsec = (long) ((frac - whole)*1.E9);
+  if(utc->tv_nsec >= 1000000000L) {
+    utc->tv_sec++;
+    utc->tv_nsec -= 1000000000L;
+  }
+  if(bad_qual(e->qual)) flags |= GPSIDX_QUAL;
+  if(time(NULL) - m->wall > GPSIDX_STALE_S) flags |= GPSIDX_STALE;
+  return flags;
+}
+
+int gpsidx_utc(struct gpsidx *gi, uint64_t dor, struct timespec *utc) {
+  const struct gpsidx_map *m = gi->m;
+  int i, flags;
+  for(i=0; i<SEQ_TRIES; i++) {
+    uint32_t seq = seq_read_begin(&m->seq);
+    if(seq & 1) continue;
+    flags = lookup(m, dor, utc);
+    if(!seq_read_retry(&m->seq, seq)) return flags;
+  }
+  /* Writer died mid-update, or never lets go: no time we can trust */
+  return GPSIDX_NODATA|GPSIDX_STALE;
+}
+
+void gpsidx_show(FILE *fp, int flags, const struct timespec *utc) {
+  struct tm tm;
+  if(flags & GPSIDX_NODATA) {
+    fprintf(fp, "utc(unknown)");
+    return;
+  }
+  time_t t = utc->tv_sec;
+  gmtime_r(&t, &tm);
+  fprintf(fp, "utc(%04d-%02d-%02dT%02d:%02d:%02d.%09ld)%s%s%s", tm.tm_year+1900,
+	  tm.tm_mon+1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, utc->tv_nsec,
+	  (flags & GPSIDX_QUAL)   ? " POORTIME" : "",
+	  (flags & GPSIDX_EXTRAP) ? " EXTRAP"   : "",
+	  (flags & GPSIDX_STALE)  ? " STALE"    : "");
+}
@@ -0,0 +1,78 @@
+/* gpsidx.h
+   DOR clock to UTC, from the GPS time strings latched at each 1PPS.
+
+   The driver hands out each syncgps string only once, so one process
+   (readgps -m -I) reads them for every card and publishes, per card, a
+   ring of the last GPSIDX_N (DOR ticks, UTC second, time quality)
+   pairs in a small shared file, DH_RUNDIR/gpsidx<card> under
+   $DOMHUB_ROOT.  Any tool can then map it read-only and turn a DOR
+   time on that card into UTC without touching the proc files.
+
+   Entries are kept by UTC second, so finding the second a DOR time
+   falls in is O(1) and missed seconds just leave holes; within a
+   second the time is interpolated between that 1PPS and the next.
+   DOR time differences are taken modulo 2^48, so clock rollover
+   doesn't matter.  The writer updates under a sequence count and
+   readers retry if it changed under them (see seqlock.h).
+*/
+
+#ifndef __GPSIDX_H__
+#define __GPSIDX_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define GPSIDX_N       4096     /* Seconds kept, a bit over an hour */
+#define GPSIDX_STALE_S 5        /* Writer gone quiet for longer than this */
+
+/* gpsidx_utc() flags */
+#define GPSIDX_QUAL    0x01     /* Time quality worse than '.' (10 us) */
+#define GPSIDX_EXTRAP  0x02     /* No following 1PPS: nominal rate from the last one */
+#define GPSIDX_STALE   0x04     /* Index not updated for GPSIDX_STALE_S */
+#define GPSIDX_NODATA  0x08     /* Older than the index, or it's empty; no time */
+
+struct gpsidx_ent {
+  uint64_t dor;                 /* DOR time at the 1PPS */
+  int64_t  utc;                 /* Its UTC second; 0 if the slot is empty */
+  int      qual;                /* Time quality character, ' ' is best */
+};
+
+struct gpsidx_map {
+  uint32_t magic, version;
+  int      icard;
+  double   dor_hz;              /* Nominal */
+  uint32_t seq;                 /* Odd while being updated */
+  int64_t  last_utc;            /* Newest entry */
+  int64_t  wall;                /* Host time it was added */
+  long     nadd, nskip;         /* Strings added; ones out of order, ignored */
+  struct gpsidx_ent ent[GPSIDX_N];  /* By utc % GPSIDX_N */
+};
+
+struct gpsidx {
+  int      fd;
+  int      icard;
+  struct gpsidx_map *m;
+};
+
+/* Reader: map card icard's index.  NULL, with errno set, if there
+   isn't one (readgps -m -I isn't running) or it's not an index. */
+struct gpsidx *gpsidx_open(int icard);
+
+/* Writer: create (or start over) card icard's index */
+struct gpsidx *gpsidx_create(int icard, double dor_hz);
+
+void gpsidx_close(struct gpsidx *gi);
+
+/* Writer: add a raw 22-byte syncgps string (SOH DDD:HH:MM:SS Q, then
+   the 8-byte DOR time).  Returns 0, or -1 if it's malformed. */
+int gpsidx_add(struct gpsidx *gi, const char *tsbuf);
+
+/* UTC for DOR time dor.  Returns GPSIDX_* flags; *utc is only good if
+   GPSIDX_NODATA isn't set. */
+int gpsidx_utc(struct gpsidx *gi, uint64_t dor, struct timespec *utc);
+
+/* "utc(2026-10-18T00:20:18.123456789)" plus any flags, no newline */
+void gpsidx_show(FILE *fp, int flags, const struct timespec *utc);
+
+#endif /* __GPSIDX_H__ */
@@ -0,0 +1,89 @@
+/* lathist.c
+   Log-linear latency histograms; see lathist.h.
+*/
+
+#include <string.h>
+#include "lathist.h"
+
+static const char *lenname[LH_NLEN] = { "<=64B", "<=256B", "<=1kB", "<=4kB", ">4kB" };
+
+static uint64_t bucket_low(int i) {
+  if(i < 2*LH_SUB) return i;
+  int shift = i/LH_SUB - 1;
+  return ((uint64_t) (i%LH_SUB + LH_SUB)) << shift;
+}
+
+static uint64_t bucket_mid(int i) {
+  if(i < 2*LH_SUB) return i;
+  int shift = i/LH_SUB - 1;
+  return bucket_low(i) + ((1ULL << shift) >> 1);
+}
+
+void lh_merge(struct lathist *dst, const struct lathist *src) {
+  int i;
+  for(i=0; i<LH_NBUCKETS; i++) dst->n[i] += src->n[i];
+  dst->count += src->count;
+  dst->sum   += src->sum;
+  if(src->max > dst->max) dst->max = src->max;
+}
+
+uint64_t lh_percentile(const struct lathist *h, double pct) {
+  if(h->count == 0) return 0;
+  uint64_t want = (uint64_t) (pct*h->count + 0.5);
+  if(want < 1) want = 1;
+  if(want > h->count) want = h->count;
+  uint64_t cum = 0;
+  int i;
+  for(i=0; i<LH_NBUCKETS; i++) {
+    cum += h->n[i];
+    if(cum >= want) {
+      uint64_t v = bucket_mid(i);
+      return v > h->max ? h->max : v;
+    }
+  }
+  return h->max;
+}
+
+static void print_pcts(FILE *fp, const struct lathist *h) {
+  fprintf(fp, "%.1f/%.1f/%.1f/%.1f/%.1f",
+	  lh_percentile(h, 0.50)/1000., lh_percentile(h, 0.90)/1000.,
+	  lh_percentile(h, 0.99)/1000., lh_percentile(h, 0.999)/1000.,
+	  h->max/1000.);
+}
+
+void rtt_print_line(FILE *fp, const char *name, const struct rtthist *r) {
+  struct lathist all;
+  int i;
+  memset(&all, 0, sizeof(all));
+  for(i=0; i<LH_NLEN; i++) lh_merge(&all, &r->len[i]);
+  fprintf(fp, "%s: RTT usec p50/p90/p99/p99.9/max all ", name);
+  print_pcts(fp, &all);
+  for(i=0; i<LH_NLEN; i++) {
+    if(r->len[i].count == 0) continue;
+    fprintf(fp, " %s ", lenname[i]);
+    print_pcts(fp, &r->len[i]);
+  }
+  fprintf(fp, "\n");
+}
+
+void rtt_print_table(FILE *fp, const char *name, const struct rtthist *r) {
+  struct lathist all;
+  int i;
+  memset(&all, 0, sizeof(all));
+  fprintf(fp, "%s: %-7s %10s %10s %10s %10s %10s %10s %10s\n", name,
+	  "RTT(us)", "n", "mean", "p50", "p90", "p99", "p99.9", "max");
+  for(i=0; i<=LH_NLEN; i++) {
+    const struct lathist *h = i < LH_NLEN ? &r->len[i] : &all;
+    if(i < LH_NLEN) {
+      lh_merge(&all, h);
+      if(h->count == 0) continue;
+    }
+    fprintf(fp, "%s: %-7s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+	    name, i < LH_NLEN ? lenname[i] : "all",
+	    (unsigned long long) h->count,
+	    h->count ? h->sum/1000./h->count : 0.,
+	    lh_percentile(h, 0.50)/1000., lh_percentile(h, 0.90)/1000.,
+	    lh_percentile(h, 0.99)/1000., lh_percentile(h, 0.999)/1000.,
+	    h->max/1000.);
+  }
+}
@@ -0,0 +1,84 @@
+/* lathist.h
+   Fixed-memory log-linear latency histograms, for round-trip
+   timing of messages in the MOAT test programs.
+
+   Values are nanoseconds.  Below 2*LH_SUB ns every value has its own
+   bucket; above that each power of two is split into LH_SUB linear
+   buckets, so any value is known to within 1/LH_SUB (about 6%).
+   Recording is a few shifts and an increment, cheap enough for the
+   per-message hot path.
+*/
+
+#ifndef __LATHIST_H__
+#define __LATHIST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define LH_SUBBITS   4
+#define LH_SUB       (1 << LH_SUBBITS)
+#define LH_MAXEXP    40       /* Largest power of two tracked: 2^40 ns ~ 18 min */
+#define LH_NBUCKETS  ((LH_MAXEXP - LH_SUBBITS + 2)*LH_SUB)
+
+/* Packet length buckets for round-trip histograms: <=64B, <=256B,
+   <=1kB, <=4kB, larger */
+#define LH_NLEN      5
+
+struct lathist {
+  uint32_t n[LH_NBUCKETS];
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+};
+
+struct rtthist {
+  struct lathist len[LH_NLEN];
+};
+
+static inline uint64_t lh_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static inline int lh_index(uint64_t v) {
+  if(v < LH_SUB) return (int) v;
+  int e = 63 - __builtin_clzll(v);
+  if(e > LH_MAXEXP) return LH_NBUCKETS-1;
+  int shift = e - LH_SUBBITS;
+  return (shift+1)*LH_SUB + (int) (v >> shift) - LH_SUB;
+}
+
+static inline void lh_record(struct lathist *h, uint64_t ns) {
+  h->n[lh_index(ns)]++;
+  h->count++;
+  h->sum += ns;
+  if(ns > h->max) h->max = ns;
+}
+
+static inline int lh_lenbucket(int len) {
+  if(len <= 64)   return 0;
+  if(len <= 256)  return 1;
+  if(len <= 1024) return 2;
+  if(len <= 4096) return 3;
+  return 4;
+}
+
+static inline void rtt_record(struct rtthist *r, int len, uint64_t ns) {
+  lh_record(&r->len[lh_lenbucket(len)], ns);
+}
+
+/* Add src into dst */
+void lh_merge(struct lathist *dst, const struct lathist *src);
+
+/* Value (ns) below which fraction pct (0..1) of the samples fall */
+uint64_t lh_percentile(const struct lathist *h, double pct);
+
+/* One line summary of all length buckets, for periodic reports */
+void rtt_print_line(FILE *fp, const char *name, const struct rtthist *r);
+
+/* One line per length bucket plus a total, for final reports */
+void rtt_print_table(FILE *fp, const char *name, const struct rtthist *r);
+
+#endif /* __LATHIST_H__ */
@@ -0,0 +1,130 @@
+/* livestats.c
+   Live per-DOM counters segment; see livestats.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "livestats.h"
+
+#define LS_MAGIC   0x4c535453 /* "LSTS" */
+#define LS_VERSION 1
+
+const char *ls_toolname[LS_NTOOL] = { "readwrite", "rndpkt", "tcaltest", "readgps" };
+
+static struct ls_map *map = NULL;
+static struct ls_slot *mine[LS_NSLOT];   /* Slots this process holds */
+static int nmine = 0;
+
+static int ls_ok(const struct ls_map *m) {
+  return m->magic == LS_MAGIC && m->version == LS_VERSION && m->ntool == LS_NTOOL
+    && m->nslot == LS_NSLOT;
+}
+
+static struct ls_map *ls_map_rw(void) {
+  char path[DH_PATHLEN];
+  struct stat st;
+  struct ls_map *m = MAP_FAILED;
+  if(map) return map;
+  int fd = open(dh_runpath(path, DH_PATHLEN, "livestats"), O_RDWR|O_CREAT, 0644);
+  if(fd == -1) return NULL;
+  /* Held until the segment is good, so a program starting alongside
+     can't zero it after another has already attached a slot */
+  if(flock(fd, LOCK_EX)) {
+    close(fd);
+    return NULL;
+  }
+  if(fstat(fd, &st) || (st.st_size < sizeof(struct ls_map)
+			&& ftruncate(fd, sizeof(struct ls_map))))
+    goto out;
+  m = mmap(NULL, sizeof(struct ls_map), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(m != MAP_FAILED && !ls_ok(m)) {
+    /* New, or from another version */
+    memset(m, 0, sizeof(struct ls_map));
+    m->version = LS_VERSION;
+    m->ntool   = LS_NTOOL;
+    m->nslot   = LS_NSLOT;
+    __atomic_store_n(&m->magic, LS_MAGIC, __ATOMIC_RELEASE);
+  }
+ out:
+  flock(fd, LOCK_UN);           /* The mapping keeps the file open past close() */
+  close(fd);
+  if(m == MAP_FAILED) return NULL;
+  return map = m;
+}
+
+/* Whatever exit() a program takes, other than after ls_finish(s,
+   LS_DONE), it failed.  A crash leaves the slot RUNNING instead, for
+   moatstat to find its process gone. */
+static void ls_atexit(void) {
+  int i;
+  for(i=0; i<nmine; i++)
+    if(mine[i]->state == LS_RUNNING) ls_finish(mine[i], LS_FAILED);
+}
+
+struct ls_slot *ls_attach(int tool, int idx, const char *name) {
+  struct timespec ts;
+  if(tool < 0 || tool >= LS_NTOOL || idx < 0 || idx >= LS_NSLOT || !ls_map_rw())
+    return NULL;
+  struct ls_slot *s = &map->slot[tool][idx];
+  uint32_t seq = s->seq | 1;  /* Odd, even if the last owner died mid-update */
+  __atomic_store_n(&s->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memset((char *) s + sizeof(s->seq), 0, sizeof(*s) - sizeof(s->seq));
+  s->pid   = getpid();
+  s->state = LS_RUNNING;
+  snprintf(s->name, sizeof(s->name), "%s", name);
+  clock_gettime(CLOCK_REALTIME, &ts);
+  s->start_ns = (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+  ls_end(s);
+  if(nmine == 0) atexit(ls_atexit);
+  if(nmine < LS_NSLOT) mine[nmine++] = s;
+  return s;
+}
+
+struct ls_slot *ls_attach_dom(int tool, int icard, int ipair, char cdom) {
+  char name[8];
+  snprintf(name, sizeof(name), "%d%d%c", icard, ipair, cdom);
+  return ls_attach(tool, dh_dom_index(icard, ipair, cdom), name);
+}
+
+void ls_finish(struct ls_slot *s, int state) {
+  if(s == NULL) return;
+  ls_begin(s);
+  s->state = state;
+  ls_end(s);
+  msync((void *) ((uintptr_t) s & ~(uintptr_t) (sysconf(_SC_PAGESIZE)-1)),
+	sysconf(_SC_PAGESIZE), MS_ASYNC);
+}
+
+const struct ls_map *ls_open(void) {
+  char path[DH_PATHLEN];
+  struct stat st;
+  int fd = open(dh_path(path, DH_PATHLEN, DH_RUNDIR "/livestats"), O_RDONLY);
+  if(fd == -1) return NULL;
+  if(fstat(fd, &st) || st.st_size < sizeof(struct ls_map)) {
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  const struct ls_map *m = mmap(NULL, sizeof(struct ls_map), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED) return NULL;
+  if(!ls_ok(m)) {
+    munmap((void *) m, sizeof(struct ls_map));
+    errno = EINVAL;
+    return NULL;
+  }
+  return m;
+}
+
+int ls_snapshot(const struct ls_slot *s, struct ls_slot *copy) {
+  return seq_snapshot(&s->seq, s, copy, sizeof(*copy));
+}
@@ -0,0 +1,133 @@
+/* livestats.h
+   Live per-DOM counters, shared by the MOAT test programs through a
+   file-backed segment (DH_RUNDIR/livestats under $DOMHUB_ROOT) so that
+   moatstat can show progress at any rate without parsing anyone's
+   stderr.
+
+   Each (program, DOM) pair has a fixed slot which that program owns
+   while it runs; readwrite, rndpkt and tcaltest use the DOM's
+   dh_dom_index(), readgps the card number.  Updating a slot is a few
+   plain stores between two increments of its sequence count (see
+   seqlock.h), with no system calls, so it can be done for every
+   message.  Since the segment is a shared file mapping, the last
+   counters are still there after the program exits or crashes: a slot
+   left RUNNING by a process which is gone died, and one left with an
+   odd count died in the middle of an update.
+
+   A program that can't map the segment just runs without it; every
+   ls_ call takes a NULL slot.
+*/
+
+#ifndef __LIVESTATS_H__
+#define __LIVESTATS_H__
+
+#include <stdint.h>
+#include <time.h>
+
+#include "domhub.h"
+#include "seqlock.h"
+
+enum { LS_READWRITE, LS_RNDPKT, LS_TCALTEST, LS_READGPS, LS_NTOOL };
+#define LS_NSLOT     DH_MAXDOMS           /* Per program */
+
+/* Slot states */
+#define LS_FREE      0
+#define LS_RUNNING   1
+#define LS_DONE      2
+#define LS_FAILED    3
+
+struct ls_slot {
+  uint32_t seq;                 /* Odd while being updated */
+  uint32_t state;
+  int32_t  pid;
+  char     name[20];            /* "00A", "card0" */
+  uint64_t start_ns, update_ns; /* CLOCK_REALTIME */
+  uint64_t txmsgs, rxmsgs;
+  uint64_t txbytes, rxbytes;
+  uint64_t retries, errors;
+  uint64_t lat_n, lat_sum_ns, lat_min_ns, lat_max_ns;
+} __attribute__((aligned(64)));  /* Slots of different programs don't share lines */
+
+struct ls_map {
+  uint32_t magic, version, ntool, nslot;
+  char     pad[48];
+  struct ls_slot slot[LS_NTOOL][LS_NSLOT];
+};
+
+extern const char *ls_toolname[LS_NTOOL];
+
+/* Claim (and zero) a program's slot idx, named name, for this process;
+   NULL if the segment can't be mapped.  Maps the segment the first
+   time.  Slots still RUNNING when the process exit()s become
+   LS_FAILED, so a program need only ls_finish() the ones which
+   succeeded. */
+struct ls_slot *ls_attach(int tool, int idx, const char *name);
+
+/* The same for a DOM, at its dh_dom_index() and named "00A"; NULL too
+   for a device file which isn't a /dev/dhcXwYdZ name */
+struct ls_slot *ls_attach_dom(int tool, int icard, int ipair, char cdom);
+
+/* Mark a slot LS_DONE or LS_FAILED */
+void ls_finish(struct ls_slot *s, int state);
+
+/* Reader: map the whole segment read-only; NULL if there isn't one */
+const struct ls_map *ls_open(void);
+
+/* Reader: consistent copy of a slot.  Returns 0, or -1 if it stayed
+   mid-update (its writer died in the middle). */
+int ls_snapshot(const struct ls_slot *s, struct ls_slot *copy);
+
+/************* Writer hot path ******************/
+
+static inline void ls_begin(struct ls_slot *s) {
+  seq_begin(&s->seq);
+}
+
+static inline void ls_end(struct ls_slot *s) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);   /* vDSO, not a system call */
+  s->update_ns = (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+  seq_end(&s->seq);
+}
+
+static inline void ls_lat(struct ls_slot *s, uint64_t ns) {
+  if(s->lat_n == 0 || ns < s->lat_min_ns) s->lat_min_ns = ns;
+  if(ns > s->lat_max_ns) s->lat_max_ns = ns;
+  s->lat_n++;
+  s->lat_sum_ns += ns;
+}
+
+/* A message sent */
+static inline void ls_tx(struct ls_slot *s, int bytes) {
+  if(s == NULL) return;
+  ls_begin(s);
+  s->txmsgs++;
+  s->txbytes += bytes;
+  ls_end(s);
+}
+
+/* A good reply, and its round trip time (0 if there isn't one) */
+static inline void ls_rx(struct ls_slot *s, int bytes, uint64_t lat_ns) {
+  if(s == NULL) return;
+  ls_begin(s);
+  s->rxmsgs++;
+  s->rxbytes += bytes;
+  if(lat_ns) ls_lat(s, lat_ns);
+  ls_end(s);
+}
+
+static inline void ls_retry(struct ls_slot *s, int n) {
+  if(s == NULL) return;
+  ls_begin(s);
+  s->retries += n;
+  ls_end(s);
+}
+
+static inline void ls_error(struct ls_slot *s) {
+  if(s == NULL) return;
+  ls_begin(s);
+  s->errors++;
+  ls_end(s);
+}
+
+#endif /* __LIVESTATS_H__ */
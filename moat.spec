@@ -30,9 +30,15 @@ install moat-version ${RPM_BUILD_ROOT}/usr/local/share
 install readwrite ${RPM_BUILD_ROOT}/usr/local/bin
 install dtest ${RPM_BUILD_ROOT}/usr/local/bin
 install tcaltest ${RPM_BUILD_ROOT}/usr/local/bin
+install tcal2txt ${RPM_BUILD_ROOT}/usr/local/bin
 install echo-loop ${RPM_BUILD_ROOT}/usr/local/bin
 install readgps ${RPM_BUILD_ROOT}/usr/local/bin
 install rndpkt ${RPM_BUILD_ROOT}/usr/local/bin
+install moatstat ${RPM_BUILD_ROOT}/usr/local/bin
+install csmon ${RPM_BUILD_ROOT}/usr/local/bin
+install moatdb ${RPM_BUILD_ROOT}/usr/local/bin
+install domse ${RPM_BUILD_ROOT}/usr/local/bin
+install stwatch ${RPM_BUILD_ROOT}/usr/local/bin
 install watchcomms ${RPM_BUILD_ROOT}/usr/local/bin
 install moat ${RPM_BUILD_ROOT}/usr/local/bin
 install moat14 ${RPM_BUILD_ROOT}/usr/local/bin
@@ -52,9 +58,15 @@ rm -rf $RPM_BUILD_ROOT
 /usr/local/bin/readwrite
 /usr/local/bin/dtest
 /usr/local/bin/tcaltest
+/usr/local/bin/tcal2txt
 /usr/local/bin/echo-loop
 /usr/local/bin/readgps
 /usr/local/bin/rndpkt
+/usr/local/bin/moatstat
+/usr/local/bin/csmon
+/usr/local/bin/moatdb
+/usr/local/bin/domse
+/usr/local/bin/stwatch
 /usr/local/bin/watchcomms
 /usr/local/bin/moat
 /usr/local/bin/moat14
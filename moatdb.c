@@ -0,0 +1,898 @@
+/* moatdb.c
+   Results store for MOAT runs.  Ingesting walks MOAT__* run
+   directories (several at once, one thread each), reads each
+   stagedtests phase's start and end times from st.out and the comstat
+   counts from commstats_before and commstats_after, and keeps a row
+   per DOM per phase per iteration.  Queries then come from the store
+   rather than from the logs:
+
+     moatdb -I MOAT__*                  ingest (runs already in are skipped)
+     moatdb -D 23b -n 200               23B over the last 200 runs
+
+   The store (moatdb.dat unless -f) is columnar: a header, the run
+   table, then one array per column, all rows of a column together, so
+   a query only reads the columns it shows.  Rows are sorted by DOM,
+   phase and start time, and the header has the first row of each
+   (DOM, phase), so a DOM's rows for a phase are one slice, to be
+   binary searched by date.  All integers are host order, which is
+   checked on reading.  Adding runs writes a new store and renames it
+   over the old one.
+
+   Usage: moatdb [-f <store>] -I [-j <threads>] [-r] <rundir|dir of runs> ...
+	  moatdb [-f <store>] [-D <dom>] [-p <phase>] [-n <runs>] [-s <date>] [-e <date>]
+		 [-q] [-c]
+	  moatdb [-f <store>] -R
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <getopt.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "domhub.h"
+#include "comstat.h"
+
+#define MDB_MAGIC    "MOATRSLT"
+#define MDB_VERSION  1
+#define MDB_ENDIAN   0x01020304
+#define MDB_DEFAULT  "moatdb.dat"
+#define MDB_NAMELEN  48
+#define MDB_MAXCOL   48
+#define MDB_MAXRUNS  65536
+
+/* stagedtests phases, by the directory moat runs them in */
+enum { PH_CONFIGBOOT, PH_SAVETCAL, PH_RELEASE, PH_DOMAPP, PH_OTHER, NPHASE };
+static const char *phasename[NPHASE] = {
+  "configboot_echotest", "save_tcal_stagedtests", "release_stagedtests",
+  "domapp_stagedtests", "other"
+};
+
+/* Run and phase outcomes */
+enum { ST_OK, ST_FAIL, ST_UNFINISHED };
+static const char *statusname[] = { "ok", "FAIL", "unfinished" };
+
+/* Columns: these, then one per comstat counter */
+enum { C_RUN, C_ITER, C_PHASE, C_DOM, C_STATUS, C_TSTART, C_DUR, C_CS0 };
+
+struct mdb_header {
+  char     magic[8];
+  uint32_t version, endian;
+  uint32_t nrow, nrun, ncol;
+  uint32_t first[DH_MAXDOMS*NPHASE+1];  /* Row index by (DOM, phase) */
+  uint64_t created;
+  uint64_t runoff;
+  uint64_t coloff[MDB_MAXCOL];
+  uint8_t  colwidth[MDB_MAXCOL];        /* 1, 2, 4 or 8 bytes */
+  char     colname[MDB_MAXCOL][16];
+};
+
+struct mdb_run {
+  char     name[MDB_NAMELEN];           /* "MOAT__2005-02-20__20:10:23" */
+  int64_t  t0;                          /* From the name, else the directory's mtime */
+  int32_t  status;
+  uint32_t pad;
+};
+
+struct mrow {
+  uint32_t run;
+  uint16_t iter;
+  uint8_t  phase, dom, status;
+  int64_t  tstart;
+  uint32_t dur;
+  uint64_t cs[CS_NFIELD];               /* Counted during the phase */
+};
+
+struct rowvec {
+  struct mrow *r;
+  long     n, max;
+};
+
+static int ncol;
+static int colfield[MDB_MAXCOL];        /* comstat field of a counter column */
+static int fieldcol[CS_NFIELD];         /* and the other way */
+static uint8_t colwidth[MDB_MAXCOL];
+static char colname[MDB_MAXCOL][16];
+
+int usage(void) {
+  fprintf(stderr,
+	  "Usage: moatdb [-f <store>] -I [-j <threads>] [-r] <rundir|dir of runs> ...\n"
+	  "       moatdb [-f <store>] [-D <dom>] [-p <phase>] [-n <runs>] [-s <date>] [-e <date>]\n"
+	  "              [-q] [-c]\n"
+	  "       moatdb [-f <store>] -R\n"
+	  "  -f <store>    results store (default " MDB_DEFAULT ")\n"
+	  "  -I            ingest MOAT__* run directories, or every MOAT__* directory\n"
+	  "                in the ones given; runs already in the store are skipped\n"
+	  "  -j <threads>  ingest this many runs at once (default: one per CPU)\n"
+	  "  -r            re-ingest runs which are already in the store\n"
+	  "  -R            list the runs in the store\n"
+	  "  -D <dom>      only this DOM (00a, 23B...); default all\n"
+	  "  -p <phase>    only configboot, save_tcal, release, domapp or other\n"
+	  "  -n <runs>     only the last <runs> runs each DOM was in\n"
+	  "  -s, -e <date> only phases started on or after -s, before -e (YYYY-MM-DD)\n"
+	  "  -q            summaries only\n"
+	  "  -c            CSV rows\n"
+	  "  A row is one DOM in one stagedtests phase of one MOAT iteration, with\n"
+	  "  the comstat counts from commstats_before to commstats_after.  BER is\n"
+	  "  bounded as anamoat does (BADPKT+BADHDR+RESENT+BADSEQ beyond 3 bad).\n");
+  return -1;
+}
+
+static void setup_columns(void) {
+  static const struct { const char *name; int width; } fixed[C_CS0] = {
+    { "run", 4 }, { "iter", 2 }, { "phase", 1 }, { "dom", 1 }, { "status", 1 },
+    { "tstart", 8 }, { "dur", 4 }
+  };
+  int i;
+  for(ncol=0; ncol<C_CS0; ncol++) {
+    snprintf(colname[ncol], 16, "%s", fixed[ncol].name);
+    colwidth[ncol] = fixed[ncol].width;
+  }
+  for(i=0; i<CS_NFIELD; i++) {
+    if(!cs_is_counter(i)) continue;
+    colfield[ncol] = i;
+    fieldcol[i]    = ncol;
+    colwidth[ncol] = (i == CS_RXBYTES || i == CS_TXBYTES) ? 8 : 4;
+    snprintf(colname[ncol], 16, "%s", cs_name[i]);
+    ncol++;
+  }
+}
+
+static uint64_t row_get(const struct mrow *r, int col) {
+  switch(col) {
+  case C_RUN:    return r->run;
+  case C_ITER:   return r->iter;
+  case C_PHASE:  return r->phase;
+  case C_DOM:    return r->dom;
+  case C_STATUS: return r->status;
+  case C_TSTART: return (uint64_t) r->tstart;
+  case C_DUR:    return r->dur;
+  default:       return r->cs[colfield[col]];
+  }
+}
+
+static void row_put(struct mrow *r, int col, uint64_t v) {
+  switch(col) {
+  case C_RUN:    r->run    = v; break;
+  case C_ITER:   r->iter   = v; break;
+  case C_PHASE:  r->phase  = v; break;
+  case C_DOM:    r->dom    = v; break;
+  case C_STATUS: r->status = v; break;
+  case C_TSTART: r->tstart = (int64_t) v; break;
+  case C_DUR:    r->dur    = v; break;
+  default:       r->cs[colfield[col]] = v; break;
+  }
+}
+
+static uint64_t col_get(const unsigned char *p, int width, long i) {
+  switch(width) {
+  case 1:  return p[i];
+  case 2:  return ((const uint16_t *) p)[i];
+  case 4:  return ((const uint32_t *) p)[i];
+  default: return ((const uint64_t *) p)[i];
+  }
+}
+
+static struct mrow *rv_add(struct rowvec *v) {
+  if(v->n == v->max) {
+    long max = v->max ? 2*v->max : 1024;
+    struct mrow *r = realloc(v->r, max*sizeof(struct mrow));
+    if(r == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      exit(-1);
+    }
+    v->r   = r;
+    v->max = max;
+  }
+  memset(&v->r[v->n], 0, sizeof(struct mrow));
+  return &v->r[v->n++];
+}
+
+/************* Reading the store ******************/
+
+struct mdb {
+  const unsigned char *map;
+  size_t   len;
+  const struct mdb_header *h;
+  const struct mdb_run *run;
+  const unsigned char *col[MDB_MAXCOL];
+};
+
+/* 0, or -1 having said why */
+static int mdb_open(struct mdb *db, const char *path) {
+  struct stat st;
+  int i;
+  int fd = open(path, O_RDONLY);
+  if(fd == -1 || fstat(fd, &st)) {
+    fprintf(stderr, "Can't open results store %s: %s\n", path, strerror(errno));
+    if(fd != -1) close(fd);
+    return -1;
+  }
+  db->len = st.st_size;
+  db->map = db->len >= sizeof(struct mdb_header)
+    ? mmap(NULL, db->len, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if(db->map == MAP_FAILED) {
+    fprintf(stderr, "%s isn't a results store.\n", path);
+    return -1;
+  }
+  db->h = (const struct mdb_header *) db->map;
+  if(memcmp(db->h->magic, MDB_MAGIC, 8) || db->h->version != MDB_VERSION
+     || db->h->endian != MDB_ENDIAN || db->h->ncol != ncol) {
+    fprintf(stderr, "%s isn't a results store from this version of moatdb on this "
+	    "kind of machine.\n", path);
+    munmap((void *) db->map, db->len);
+    return -1;
+  }
+  for(i=0; i<ncol; i++) {
+    if(db->h->colwidth[i] != colwidth[i] || strcmp(db->h->colname[i], colname[i])
+       || db->h->coloff[i] + (uint64_t) db->h->nrow*colwidth[i] > db->len) {
+      fprintf(stderr, "%s: column %d is damaged or not what was expected.\n", path, i);
+      munmap((void *) db->map, db->len);
+      return -1;
+    }
+    db->col[i] = db->map + db->h->coloff[i];
+  }
+  if(db->h->runoff + (uint64_t) db->h->nrun*sizeof(struct mdb_run) > db->len) {
+    fprintf(stderr, "%s: run table is damaged.\n", path);
+    munmap((void *) db->map, db->len);
+    return -1;
+  }
+  db->run = (const struct mdb_run *) (db->map + db->h->runoff);
+  return 0;
+}
+
+static uint64_t mdb_get(const struct mdb *db, int col, long i) {
+  return col_get(db->col[col], colwidth[col], i);
+}
+
+static void mdb_close(struct mdb *db) {
+  munmap((void *) db->map, db->len);
+}
+
+/************* Ingest ******************/
+
+struct ingest {
+  char   **dirs;
+  struct mdb_run *runs;                 /* One per dir, then the store's */
+  int    ndirs;
+  int    next;                          /* Next dir to take */
+  pthread_mutex_t lock;
+  struct rowvec rows;
+  long   nphase, nbadfile;
+};
+
+static const unsigned char *map_file(const char *path, size_t *len) {
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+  if(fd == -1) return NULL;
+  if(fstat(fd, &st) || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+  const unsigned char *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if(p == MAP_FAILED) return NULL;
+  madvise((void *) p, st.st_size, MADV_SEQUENTIAL);
+  *len = st.st_size;
+  return p;
+}
+
+/* localtime written as by Perl's scalar localtime, "Sun Feb 20 20:10:23 2005",
+   following tag in buf; 0 if it isn't there */
+static time_t find_time(const unsigned char *buf, size_t len, const char *tag) {
+  const char *p = memmem(buf, len, tag, strlen(tag));
+  char s[64];
+  struct tm tm;
+  if(p == NULL) return 0;
+  p += strlen(tag);
+  size_t n = (const char *) buf + len - p;
+  if(n > sizeof(s)-1) n = sizeof(s)-1;
+  memcpy(s, p, n);
+  s[n] = '\0';
+  memset(&tm, 0, sizeof(tm));
+  if(strptime(s, "%a %b %d %H:%M:%S %Y", &tm) == NULL) return 0;
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+/* The phase's last line says how it went */
+static int st_status(const unsigned char *buf, size_t len) {
+  size_t end = len, i;
+  while(end > 0 && (buf[end-1] == '\n' || buf[end-1] == '\r' || buf[end-1] == ' ')) end--;
+  for(i = end; i > 0 && buf[i-1] != '\n'; i--) ;
+  if(memmem(buf+i, end-i, "SUCCESS", 7)) return ST_OK;
+  return ST_FAIL;
+}
+
+/* A commstats file: each DOM's comstat, named by its /dev/dhcXwYdZ.
+   Fills cs[] by dh_dom_index() and returns how many DOMs it had. */
+static int read_commstats(const char *path, struct dh_comstat *cs, int *nbad) {
+  static const char tag[] = "/dev/dhc";
+  size_t len;
+  const unsigned char *buf = map_file(path, &len);
+  int n = 0;
+  if(buf == NULL) return 0;
+  const char *p = memmem(buf, len, tag, sizeof(tag)-1), *end = (const char *) buf + len;
+  while(p) {
+    const char *next = memmem(p+1, end-p-1, tag, sizeof(tag)-1);
+    const char *chunk_end = next ? next : end;
+    int icard, ipair;
+    char cdom;
+    if(sscanf(p, "/dev/dhc%dw%dd%c", &icard, &ipair, &cdom) == 3
+       && dh_dom_index(icard, ipair, cdom) >= 0) {
+      int idx = dh_dom_index(icard, ipair, cdom);
+      if(cs_parse(&cs[idx], p, chunk_end - p) > 0) n++;
+      else (*nbad)++;
+    }
+    p = next;
+  }
+  munmap((void *) buf, len);
+  return n;
+}
+
+static int phase_of(const char *name) {
+  int i;
+  for(i=0; i<PH_OTHER; i++) if(!strcmp(name, phasename[i])) return i;
+  return PH_OTHER;
+}
+
+static void ingest_phase(struct ingest *in, struct rowvec *rv, int run, int iter,
+			 const char *dir, const char *phase) {
+  static struct dh_comstat zero;
+  struct dh_comstat before[DH_MAXDOMS], after[DH_MAXDOMS];
+  char path[DH_PATHLEN];
+  size_t len;
+  int i, k, nbad = 0;
+
+  snprintf(path, sizeof(path), "%s/st.out", dir);
+  const unsigned char *st = map_file(path, &len);
+  if(st == NULL) return; /* stagedtests never started */
+  time_t t0 = find_time(st, len, "Started run at ");
+  time_t t1 = find_time(st, len, "End of run at ");
+  int status = st_status(st, len);
+  munmap((void *) st, len);
+
+  memset(before, 0, sizeof(before));
+  memset(after,  0, sizeof(after));
+  snprintf(path, sizeof(path), "%s/commstats_before", dir);
+  read_commstats(path, before, &nbad);
+  snprintf(path, sizeof(path), "%s/commstats_after", dir);
+  if(read_commstats(path, after, &nbad) == 0) status = ST_UNFINISHED;
+
+  for(i=0; i<DH_MAXDOMS; i++) {
+    /* DOMs which were in the phase; only the starting counts if it
+       never finished */
+    if(!after[i].have && !before[i].have) continue;
+    struct mrow *r = rv_add(rv);
+    r->run    = run;
+    r->iter   = iter;
+    r->phase  = phase_of(phase);
+    r->dom    = i;
+    r->status = status;
+    r->tstart = t0 ? t0 : in->runs[run].t0;
+    r->dur    = t0 && t1 > t0 ? t1 - t0 : 0;
+    if(!after[i].have) continue;
+    for(k=0; k<CS_NFIELD; k++)
+      if(cs_is_counter(k))
+	r->cs[k] = cs_delta(&after[i], before[i].have ? &before[i] : &zero, k);
+  }
+  pthread_mutex_lock(&in->lock);
+  in->nphase++;
+  in->nbadfile += nbad;
+  pthread_mutex_unlock(&in->lock);
+}
+
+static int name_order(const struct dirent **a, const struct dirent **b) {
+  return strcmp((*a)->d_name, (*b)->d_name);
+}
+
+static int is_dir(const char *path) {
+  struct stat st;
+  return !stat(path, &st) && S_ISDIR(st.st_mode);
+}
+
+static void ingest_run(struct ingest *in, struct rowvec *rv, int run) {
+  const char *dir = in->dirs[run];
+  struct dirent **tests;
+  char path[DH_PATHLEN];
+  int ntest = scandir(dir, &tests, NULL, name_order), i, j, iter;
+  for(i=0; i<ntest; i++) {
+    snprintf(path, sizeof(path), "%s/%s", dir, tests[i]->d_name);
+    if(sscanf(tests[i]->d_name, "test%d", &iter) == 1 && is_dir(path)) {
+      struct dirent **phases;
+      int nph = scandir(path, &phases, NULL, name_order);
+      for(j=0; j<nph; j++) {
+	char pdir[2*DH_PATHLEN];
+	snprintf(pdir, sizeof(pdir), "%s/%s", path, phases[j]->d_name);
+	if(phases[j]->d_name[0] != '.' && is_dir(pdir))
+	  ingest_phase(in, rv, run, iter, pdir, phases[j]->d_name);
+	free(phases[j]);
+      }
+      if(nph >= 0) free(phases);
+    }
+    free(tests[i]);
+  }
+  if(ntest >= 0) free(tests);
+}
+
+static void *ingest_worker(void *arg) {
+  struct ingest *in = arg;
+  struct rowvec rv = { NULL, 0, 0 };
+  while(1) {
+    int run = __atomic_fetch_add(&in->next, 1, __ATOMIC_RELAXED);
+    if(run >= in->ndirs) break;
+    ingest_run(in, &rv, run);
+  }
+  pthread_mutex_lock(&in->lock);
+  long i;
+  for(i=0; i<rv.n; i++) *rv_add(&in->rows) = rv.r[i];
+  pthread_mutex_unlock(&in->lock);
+  free(rv.r);
+  return NULL;
+}
+
+static void run_info(struct mdb_run *r, const char *dir) {
+  const char *base = strrchr(dir, '/');
+  char path[DH_PATHLEN];
+  struct tm tm;
+  struct stat st;
+  base = base ? base+1 : dir;
+  memset(r, 0, sizeof(*r));
+  snprintf(r->name, MDB_NAMELEN, "%s", base);
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(base, "MOAT__%Y-%m-%d__%H:%M:%S", &tm);
+  if(end && *end == '\0') {
+    tm.tm_isdst = -1;
+    r->t0 = mktime(&tm);
+  } else if(!stat(dir, &st)) {
+    r->t0 = st.st_mtime;
+  }
+  snprintf(path, sizeof(path), "%s/SUCCESS", dir);
+  if(!access(path, F_OK)) {
+    r->status = ST_OK;
+  } else {
+    snprintf(path, sizeof(path), "%s/FAIL", dir);
+    r->status = access(path, F_OK) ? ST_UNFINISHED : ST_FAIL;
+  }
+}
+
+static int row_order(const void *a, const void *b) {
+  const struct mrow *x = a, *y = b;
+  if(x->dom    != y->dom)    return x->dom    < y->dom    ? -1 : 1;
+  if(x->phase  != y->phase)  return x->phase  < y->phase  ? -1 : 1;
+  if(x->tstart != y->tstart) return x->tstart < y->tstart ? -1 : 1;
+  if(x->run    != y->run)    return x->run    < y->run    ? -1 : 1;
+  return x->iter < y->iter ? -1 : x->iter > y->iter;
+}
+
+static int write_store(const char *path, struct mdb_run *runs, int nrun, struct rowvec *rv) {
+  static struct mdb_header h;
+  char tmp[DH_PATHLEN];
+  unsigned char pad[8] = { 0 };
+  long i;
+  int c;
+
+  qsort(rv->r, rv->n, sizeof(struct mrow), row_order);
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, MDB_MAGIC, 8);
+  h.version = MDB_VERSION;
+  h.endian  = MDB_ENDIAN;
+  h.nrow    = rv->n;
+  h.nrun    = nrun;
+  h.ncol    = ncol;
+  h.created = time(NULL);
+  for(i=0, c=0; c<=DH_MAXDOMS*NPHASE; c++) {
+    while(i < rv->n && rv->r[i].dom*NPHASE + rv->r[i].phase < c) i++;
+    h.first[c] = i;
+  }
+  uint64_t off = (sizeof(h) + 7) & ~7ULL;
+  h.runoff = off;
+  off += nrun*sizeof(struct mdb_run);
+  for(c=0; c<ncol; c++) {
+    h.coloff[c]   = off;
+    h.colwidth[c] = colwidth[c];
+    snprintf(h.colname[c], 16, "%s", colname[c]);
+    off = (off + rv->n*colwidth[c] + 7) & ~7ULL;
+  }
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *fp = fopen(tmp, "w");
+  if(fp == NULL) {
+    fprintf(stderr, "Can't write %s: %s\n", tmp, strerror(errno));
+    return -1;
+  }
+  fwrite(&h, sizeof(h), 1, fp);
+  fwrite(pad, h.runoff - sizeof(h), 1, fp);
+  fwrite(runs, sizeof(struct mdb_run), nrun, fp);
+  for(c=0; c<ncol; c++) {
+    for(i=0; i<rv->n; i++) {
+      uint64_t v = row_get(&rv->r[i], c);
+      uint8_t  v1 = v;
+      uint16_t v2 = v;
+      uint32_t v4 = v > 0xFFFFFFFFULL ? 0xFFFFFFFFU : v;  /* Counters saturate */
+      switch(colwidth[c]) {
+      case 1:  fwrite(&v1, 1, 1, fp); break;
+      case 2:  fwrite(&v2, 2, 1, fp); break;
+      case 4:  fwrite(&v4, 4, 1, fp); break;
+      default: fwrite(&v,  8, 1, fp); break;
+      }
+    }
+    fwrite(pad, (8 - rv->n*colwidth[c]%8)%8, 1, fp);
+  }
+  /* Any short fwrite() above leaves the error flag set */
+  int bad = ferror(fp);
+  if(fclose(fp) || bad || rename(tmp, path)) {
+    fprintf(stderr, "Can't write %s: %s\n", path, bad ? "write error" : strerror(errno));
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+/* Run directories: MOAT__* arguments themselves, and the MOAT__*
+   directories in any other argument */
+static int find_runs(char **args, int nargs, char **dirs, int max) {
+  int n = 0, i, j;
+  for(i=0; i<nargs; i++) {
+    const char *base = strrchr(args[i], '/');
+    base = base && base[1] ? base+1 : args[i];
+    if(!strncmp(base, "MOAT__", 6)) {
+      if(n < max) dirs[n++] = strdup(args[i]);
+      continue;
+    }
+    struct dirent **ents;
+    int nent = scandir(args[i], &ents, NULL, name_order);
+    if(nent < 0) {
+      fprintf(stderr, "Can't read directory %s: %s\n", args[i], strerror(errno));
+      exit(-1);
+    }
+    for(j=0; j<nent; j++) {
+      char path[DH_PATHLEN];
+      snprintf(path, sizeof(path), "%s/%s", args[i], ents[j]->d_name);
+      if(!strncmp(ents[j]->d_name, "MOAT__", 6) && is_dir(path) && n < max)
+	dirs[n++] = strdup(path);
+      free(ents[j]);
+    }
+    free(ents);
+  }
+  return n;
+}
+
+static int ingest(const char *store, char **args, int nargs, int nthreads, int redo) {
+  static char *dirs[MDB_MAXRUNS];
+  struct ingest in;
+  struct mdb db;
+  int i, j;
+  long k;
+
+  memset(&in, 0, sizeof(in));
+  pthread_mutex_init(&in.lock, NULL);
+  int ndirs = find_runs(args, nargs, dirs, MDB_MAXRUNS);
+  int have  = !access(store, F_OK);
+  if(have && mdb_open(&db, store)) return -1;
+  int nold  = have ? db.h->nrun : 0;
+
+  /* New runs first, then the ones in the store which aren't being redone */
+  in.runs = calloc(ndirs + nold, sizeof(struct mdb_run));
+  in.dirs = calloc(ndirs, sizeof(char *));
+  int *oldid = calloc(nold+1, sizeof(int));
+  if(in.runs == NULL || in.dirs == NULL || oldid == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  for(i=0; i<ndirs; i++) {
+    struct mdb_run r;
+    run_info(&r, dirs[i]);
+    for(j=0; j<in.ndirs && strcmp(in.runs[j].name, r.name); j++) ;
+    if(j < in.ndirs) continue; /* Given twice */
+    for(j=0; j<nold && strcmp(db.run[j].name, r.name); j++) ;
+    if(j < nold && !redo) continue;
+    in.dirs[in.ndirs]   = dirs[i];
+    in.runs[in.ndirs++] = r;
+  }
+  int nrun = in.ndirs;
+  for(j=0; j<nold; j++) {
+    for(i=0; i<in.ndirs && strcmp(in.runs[i].name, db.run[j].name); i++) ;
+    oldid[j] = i < in.ndirs ? -1 : nrun;
+    if(oldid[j] >= 0) in.runs[nrun++] = db.run[j];
+  }
+  if(in.ndirs == 0) {
+    fprintf(stderr, "No new runs to add to %s.\n", store);
+    if(have) mdb_close(&db);
+    return 0;
+  }
+  if(have) {
+    for(k=0; k<db.h->nrow; k++) {
+      int run = mdb_get(&db, C_RUN, k);
+      if(run >= nold || oldid[run] < 0) continue;
+      struct mrow *r = rv_add(&in.rows);
+      int c;
+      for(c=0; c<ncol; c++) row_put(r, c, mdb_get(&db, c, k));
+      r->run = oldid[run];
+    }
+    mdb_close(&db);
+  }
+  long nkept = in.rows.n;
+
+  struct timespec ts0, ts1;
+  clock_gettime(CLOCK_MONOTONIC, &ts0);
+  if(nthreads > in.ndirs) nthreads = in.ndirs;
+  pthread_t *thr = calloc(nthreads, sizeof(pthread_t));
+  for(i=0; i<nthreads; i++) {
+    if(pthread_create(&thr[i], NULL, ingest_worker, &in)) {
+      fprintf(stderr, "Can't start ingest threads.\n");
+      return -1;
+    }
+  }
+  for(i=0; i<nthreads; i++) pthread_join(thr[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &ts1);
+
+  if(write_store(store, in.runs, nrun, &in.rows)) return -1;
+  fprintf(stderr, "%s: added %d runs (%ld phases, %ld rows) in %.2f s with %d threads; "
+	  "%d runs, %ld rows in all.\n", store, in.ndirs, in.nphase, in.rows.n - nkept,
+	  (ts1.tv_sec - ts0.tv_sec) + 1.E-9*(ts1.tv_nsec - ts0.tv_nsec), nthreads, nrun,
+	  in.rows.n);
+  if(in.nbadfile)
+    fprintf(stderr, "%s: %ld DOM comstat dumps couldn't be parsed.\n", store, in.nbadfile);
+  free(thr);
+  free(oldid);
+  free(in.rows.r);
+  return 0;
+}
+
+/************* Queries ******************/
+
+struct query {
+  int    dom;                           /* -1 for all */
+  int    phase;                         /* -1 for all */
+  long   nruns;                         /* 0 for all */
+  time_t since, until;                  /* 0 for open ended */
+  int    quiet, csv;
+};
+
+static uint64_t val(const struct mdb *db, int field, long i) {
+  return mdb_get(db, fieldcol[field], i);
+}
+
+/* As anamoat counts them: a few bad sequence numbers are expected */
+static uint64_t bad_of(const struct mdb *db, long i) {
+  uint64_t badseq = val(db, CS_BADSEQ, i);
+  return val(db, CS_BADPKT, i) + val(db, CS_BADHDR, i) + val(db, CS_RESENT, i)
+    + (badseq > 3 ? badseq - 3 : 0);
+}
+
+static void ber_str(char *buf, int len, uint64_t bad, uint64_t bytes) {
+  if(bytes == 0)    snprintf(buf, len, "-");
+  else if(bad == 0) snprintf(buf, len, "<%.2e", 1./(8.*bytes));
+  else              snprintf(buf, len, "~%.2e", (double) bad/(8.*bytes));
+}
+
+/* First row in [lo, hi) starting at or after t */
+static long lower_bound(const struct mdb *db, long lo, long hi, time_t t) {
+  while(lo < hi) {
+    long mid = lo + (hi - lo)/2;
+    if((int64_t) mdb_get(db, C_TSTART, mid) < t) lo = mid+1; else hi = mid;
+  }
+  return lo;
+}
+
+static const struct mdb *sort_db;
+static int by_time(const void *a, const void *b) {
+  long x = *(const long *) a, y = *(const long *) b;
+  int64_t tx = mdb_get(sort_db, C_TSTART, x), ty = mdb_get(sort_db, C_TSTART, y);
+  if(tx != ty) return tx < ty ? -1 : 1;
+  return x < y ? -1 : x > y;
+}
+
+/* Run directory name for row i; the run column comes from the file */
+static const char *run_name(const struct mdb *db, long i) {
+  uint64_t run = mdb_get(db, C_RUN, i);
+  return run < db->h->nrun ? db->run[run].name : "?";
+}
+
+static void show_row(const struct mdb *db, long i) {
+  char tbuf[32], ber[16];
+  int  dom = mdb_get(db, C_DOM, i);
+  time_t t = (time_t) mdb_get(db, C_TSTART, i);
+  uint64_t rx = val(db, CS_RXBYTES, i), tx = val(db, CS_TXBYTES, i);
+  strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+  ber_str(ber, sizeof(ber), bad_of(db, i), rx + tx);
+  printf("%d%d%c %-28s %4d %-21s %s %6d %-10s %9.2f %9.2f %7llu %7llu %7llu %7llu %5llu %s\n",
+	 dom/(DH_NPAIR*DH_NDOM), dom/DH_NDOM%DH_NPAIR, dom%DH_NDOM ? 'B' : 'A',
+	 run_name(db, i), (int) mdb_get(db, C_ITER, i),
+	 phasename[mdb_get(db, C_PHASE, i)], tbuf, (int) mdb_get(db, C_DUR, i),
+	 statusname[mdb_get(db, C_STATUS, i)], rx/1.E6, tx/1.E6,
+	 (unsigned long long) val(db, CS_RESENT, i), (unsigned long long) val(db, CS_BADSEQ, i),
+	 (unsigned long long) val(db, CS_BADPKT, i), (unsigned long long) val(db, CS_BADHDR, i),
+	 (unsigned long long) val(db, CS_NHDWRTIMEOUTS, i), ber);
+}
+
+static void show_csv(const struct mdb *db, long i) {
+  int dom = mdb_get(db, C_DOM, i), c;
+  printf("%d%d%c,%s,%d,%s,%lld,%d,%s", dom/(DH_NPAIR*DH_NDOM), dom/DH_NDOM%DH_NPAIR,
+	 dom%DH_NDOM ? 'B' : 'A', run_name(db, i),
+	 (int) mdb_get(db, C_ITER, i), phasename[mdb_get(db, C_PHASE, i)],
+	 (long long) mdb_get(db, C_TSTART, i), (int) mdb_get(db, C_DUR, i),
+	 statusname[mdb_get(db, C_STATUS, i)]);
+  for(c=C_CS0; c<ncol; c++) printf(",%llu", (unsigned long long) mdb_get(db, c, i));
+  printf("\n");
+}
+
+static void summary(const struct mdb *db, int dom, long *rows, long n) {
+  uint64_t bytes = 0, bad = 0, hwto = 0;
+  double sx = 0, sy = 0, sxx = 0, sxy = 0, first = 0, second = 0;
+  long nruns = 0, i, lastrun = -1;
+  char ber[16];
+  for(i=0; i<n; i++) {
+    long r = rows[i];
+    double y = val(db, CS_RESENT, r);
+    bytes += val(db, CS_RXBYTES, r) + val(db, CS_TXBYTES, r);
+    bad   += bad_of(db, r);
+    hwto  += val(db, CS_NHDWRTIMEOUTS, r);
+    if((long) mdb_get(db, C_RUN, r) != lastrun) nruns++;
+    lastrun = mdb_get(db, C_RUN, r);
+    sx  += i;
+    sy  += y;
+    sxx += (double) i*i;
+    sxy += i*y;
+    if(i < n/2) first += y; else second += y;
+  }
+  ber_str(ber, sizeof(ber), bad, bytes);
+  double den   = n*sxx - sx*sx;
+  double slope = den > 0 ? (n*sxy - sx*sy)/den : 0;
+  printf("%d%d%c: %ld rows from %ld runs, %.2f MB, %llu bad, %llu hardware timeouts, BER %s;"
+	 " RESENT %.1f/row, trend %+.3f/row (halves %.1f, %.1f)\n",
+	 dom/(DH_NPAIR*DH_NDOM), dom/DH_NDOM%DH_NPAIR, dom%DH_NDOM ? 'B' : 'A', n, nruns,
+	 bytes/1.E6, (unsigned long long) bad, (unsigned long long) hwto, ber,
+	 n ? sy/n : 0., slope, n/2 ? first/(n/2) : 0., n - n/2 ? second/(n - n/2) : 0.);
+}
+
+static int query(const char *store, struct query *q) {
+  struct mdb db;
+  long *rows;
+  int dom, ph, nshown = 0;
+  if(mdb_open(&db, store)) return -1;
+  if((rows = malloc((db.h->nrow+1)*sizeof(long))) == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  if(q->csv) {
+    int c;
+    printf("dom,run,iter,phase,tstart,dur,status");
+    for(c=C_CS0; c<ncol; c++) printf(",%s", colname[c]);
+    printf("\n");
+  } else if(!q->quiet) {
+    printf("%-3s %-28s %4s %-21s %-19s %6s %-10s %9s %9s %7s %7s %7s %7s %5s %s\n",
+	   "DOM", "run", "iter", "phase", "started", "secs", "status", "rxMB", "txMB",
+	   "RESENT", "BADSEQ", "BADPKT", "BADHDR", "HWTO", "BER");
+  }
+  for(dom=0; dom<DH_MAXDOMS; dom++) {
+    long n = 0, i;
+    if(q->dom >= 0 && dom != q->dom) continue;
+    for(ph=0; ph<NPHASE; ph++) {
+      if(q->phase >= 0 && ph != q->phase) continue;
+      long lo = db.h->first[dom*NPHASE+ph], hi = db.h->first[dom*NPHASE+ph+1];
+      if(q->since) lo = lower_bound(&db, lo, hi, q->since);
+      if(q->until) hi = lower_bound(&db, lo, hi, q->until);
+      for(i=lo; i<hi; i++) rows[n++] = i;
+    }
+    if(n == 0) continue;
+    sort_db = &db;
+    if(q->phase < 0) qsort(rows, n, sizeof(long), by_time);
+    long start = 0;
+    if(q->nruns > 0) {
+      /* Back from the newest until nruns different runs */
+      long nr = 0, lastrun = -1;
+      for(start=n; start>0; start--) {
+	long run = mdb_get(&db, C_RUN, rows[start-1]);
+	if(run != lastrun && ++nr > q->nruns) break;
+	lastrun = run;
+      }
+    }
+    for(i=start; i<n && !q->quiet; i++) {
+      if(q->csv) show_csv(&db, rows[i]); else show_row(&db, rows[i]);
+    }
+    if(!q->csv) summary(&db, dom, rows+start, n-start);
+    nshown++;
+  }
+  if(nshown == 0) fprintf(stderr, "Nothing in %s matches.\n", store);
+  free(rows);
+  mdb_close(&db);
+  return 0;
+}
+
+static const struct mdb_run *sort_runs;
+static int by_start(const void *a, const void *b) {
+  int x = *(const int *) a, y = *(const int *) b;
+  if(sort_runs[x].t0 != sort_runs[y].t0) return sort_runs[x].t0 < sort_runs[y].t0 ? -1 : 1;
+  return strcmp(sort_runs[x].name, sort_runs[y].name);
+}
+
+static int list_runs(const char *store) {
+  struct mdb db;
+  uint32_t i;
+  if(mdb_open(&db, store)) return -1;
+  int *order = malloc((db.h->nrun+1)*sizeof(int));
+  if(order == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  for(i=0; i<db.h->nrun; i++) order[i] = i;
+  sort_runs = db.run;
+  qsort(order, db.h->nrun, sizeof(int), by_start);
+  for(i=0; i<db.h->nrun; i++) {
+    const struct mdb_run *r = &db.run[order[i]];
+    char tbuf[32];
+    time_t t = r->t0;
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&t));
+    printf("%-28s %s %s\n", r->name, tbuf, statusname[r->status]);
+  }
+  printf("%u runs, %u rows.\n", db.h->nrun, db.h->nrow);
+  free(order);
+  mdb_close(&db);
+  return 0;
+}
+
+static time_t get_date(const char *s) {
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  const char *end = strptime(s, "%Y-%m-%d", &tm);
+  if(end == NULL || *end) exit(usage());
+  tm.tm_isdst = -1;
+  return mktime(&tm);
+}
+
+int main(int argc, char *argv[]) {
+  const char *store = MDB_DEFAULT;
+  struct query q = { -1, -1, 0, 0, 0, 0, 0 };
+  int doingest = 0, dolist = 0, redo = 0, i;
+  int nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  struct dh_dom dom;
+
+  setup_columns();
+  while(1) {
+    char c = getopt(argc, argv, "hIRrqcf:j:D:p:n:s:e:");
+    if(c == -1) break;
+    switch(c) {
+    case 'f': store    = optarg; break;
+    case 'I': doingest = 1; break;
+    case 'R': dolist   = 1; break;
+    case 'r': redo     = 1; break;
+    case 'j': nthreads = atoi(optarg); break;
+    case 'q': q.quiet  = 1; break;
+    case 'c': q.csv    = 1; break;
+    case 'n': q.nruns  = atol(optarg); break;
+    case 's': q.since  = get_date(optarg); break;
+    case 'e': q.until  = get_date(optarg); break;
+    case 'D':
+      if(dh_parse_dom(&dom, optarg) || dom.icard < 0) exit(usage());
+      q.dom = dh_dom_index(dom.icard, dom.ipair, dom.cdom);
+      break;
+    case 'p':
+      for(i=0; i<NPHASE && strncmp(phasename[i], optarg, strlen(optarg)); i++) ;
+      if(i == NPHASE || !optarg[0]) exit(usage());
+      q.phase = i;
+      break;
+    case 'h':
+    default:
+      exit(usage());
+    }
+  }
+  if(nthreads < 1) nthreads = 1;
+  if(doingest) {
+    if(optind >= argc) exit(usage());
+    exit(ingest(store, argv+optind, argc-optind, nthreads, redo) ? -1 : 0);
+  }
+  if(optind < argc) exit(usage());
+  if(dolist) exit(list_runs(store) ? -1 : 0);
+  exit(query(store, &q) ? -1 : 0);
+}
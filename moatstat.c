@@ -0,0 +1,140 @@
+/* moatstat.c
+   Show the live per-DOM counters which readwrite, rndpkt, tcaltest
+   and readgps keep in the livestats segment (see livestats.h), once
+   or every so often.  The counters stay after the programs exit, so
+   this also shows how far a crashed run got.
+
+   Usage: moatstat [-i <sec>] [-n <count>] [-r] [-t <program>] [-c]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include "livestats.h"
+
+static const char *statename[] = { "free", "running", "done", "FAILED" };
+
+int usage(void) {
+  fprintf(stderr,
+	  "Usage: moatstat [-i <sec>] [-n <count>] [-r] [-t <program>] [-c]\n"
+	  "  Shows the counters of every DOM a MOAT program has run on, with rates\n"
+	  "  since the previous snapshot when repeating.\n"
+	  "  -i <sec>      repeat every <sec> seconds (fractions are fine)\n"
+	  "  -n <count>    stop after <count> snapshots (default 1, or forever with -i)\n"
+	  "  -r            only programs still running\n"
+	  "  -t <program>  only readwrite, rndpkt, tcaltest or readgps\n"
+	  "  -c            CSV\n"
+	  "  A program left 'running' whose process is gone shows as DIED, and\n"
+	  "  one which died in the middle of an update as TORN.\n"
+	  "  $DOMHUB_ROOT, if set, is prefixed to " DH_RUNDIR ".\n");
+  return -1;
+}
+
+static int die = 0;
+void argghhhh() { die = 1; }
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static const char *state_of(const struct ls_slot *s, int torn) {
+  if(torn) return "TORN";
+  if(s->state == LS_RUNNING && kill(s->pid, 0) == -1 && errno == ESRCH) return "DIED";
+  return s->state <= LS_FAILED ? statename[s->state] : "?";
+}
+
+int main(int argc, char *argv[]) {
+  static struct ls_slot last[LS_NTOOL][LS_NSLOT];
+  uint64_t tlast = 0;
+  double interval = 0;
+  long count = -1, n;
+  int running = 0, csv = 0, only = -1, i, j;
+
+  while(1) {
+    char c = getopt(argc, argv, "hrci:n:t:");
+    if(c == -1) break;
+    switch(c) {
+    case 'i': interval = atof(optarg); break;
+    case 'n': count    = atol(optarg); break;
+    case 'r': running  = 1; break;
+    case 'c': csv      = 1; break;
+    case 't':
+      for(only=0; only<LS_NTOOL && strcmp(optarg, ls_toolname[only]); only++) ;
+      if(only == LS_NTOOL) exit(usage());
+      break;
+    case 'h':
+    default:
+      exit(usage());
+    }
+  }
+  if(optind < argc || interval < 0) exit(usage());
+  if(count < 0) count = interval > 0 ? 0 : 1;
+
+  const struct ls_map *m = ls_open();
+  if(m == NULL) {
+    fprintf(stderr, "No live statistics under %s%s: %s\n", dh_root(), DH_RUNDIR,
+	    strerror(errno));
+    exit(-1);
+  }
+  signal(SIGINT,  argghhhh);
+  signal(SIGTERM, argghhhh);
+
+  if(csv) printf("time,program,dom,pid,state,age_s,txmsgs,rxmsgs,txbytes,rxbytes,"
+		 "retries,errors,lat_avg_us,lat_min_us,lat_max_us,rxmsgs_per_s\n");
+  for(n=0; !die && (count == 0 || n < count); n++) {
+    uint64_t t = now_ns();
+    if(n > 0) {
+      usleep((useconds_t) (interval*1.E6));
+      t = now_ns();
+    }
+    if(!csv) {
+      if(n > 0) printf("\n");
+      printf("%-9s %-6s %7s %-7s %7s %10s %10s %9s %8s %7s %9s %9s %10s\n",
+	     "program", "dom", "pid", "state", "age(s)", "txmsgs", "rxmsgs", "rxMB",
+	     "retries", "errors", "avg(us)", "max(us)", "rxmsgs/s");
+    }
+    for(i=0; i<LS_NTOOL; i++) {
+      if(only >= 0 && i != only) continue;
+      for(j=0; j<LS_NSLOT; j++) {
+	struct ls_slot s, *p = &last[i][j];
+	int torn = ls_snapshot(&m->slot[i][j], &s);
+	if(s.state == LS_FREE) continue;
+	const char *state = state_of(&s, torn);
+	if(running && strcmp(state, "running")) continue;
+	double age  = s.update_ns && t > s.update_ns ? (t - s.update_ns)*1.E-9 : 0;
+	double rate = 0;
+	if(n > 0 && p->pid == s.pid && p->start_ns == s.start_ns && t > tlast) {
+	  rate = (s.rxmsgs - p->rxmsgs)/((t - tlast)*1.E-9);
+	} else if(s.update_ns > s.start_ns) {
+	  rate = s.rxmsgs/((s.update_ns - s.start_ns)*1.E-9);
+	}
+	double avg = s.lat_n ? s.lat_sum_ns/1000./s.lat_n : 0;
+	if(csv) {
+	  printf("%.3f,%s,%s,%d,%s,%.3f,%llu,%llu,%llu,%llu,%llu,%llu,%.1f,%.1f,%.1f,%.1f\n",
+		 t*1.E-9, ls_toolname[i], s.name, s.pid, state, age,
+		 (unsigned long long) s.txmsgs, (unsigned long long) s.rxmsgs,
+		 (unsigned long long) s.txbytes, (unsigned long long) s.rxbytes,
+		 (unsigned long long) s.retries, (unsigned long long) s.errors, avg,
+		 s.lat_min_ns/1000., s.lat_max_ns/1000., rate);
+	} else {
+	  printf("%-9s %-6s %7d %-7s %7.1f %10llu %10llu %9.2f %8llu %7llu %9.1f %9.1f %10.1f\n",
+		 ls_toolname[i], s.name, s.pid, state, age,
+		 (unsigned long long) s.txmsgs, (unsigned long long) s.rxmsgs,
+		 s.rxbytes/(1024.*1024.), (unsigned long long) s.retries,
+		 (unsigned long long) s.errors, avg, s.lat_max_ns/1000., rate);
+	}
+	*p = s;
+      }
+    }
+    fflush(stdout);
+    tlast = t;
+  }
+  return 0;
+}
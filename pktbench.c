@@ -0,0 +1,203 @@
+/* pktbench.c
+   Micro-benchmark for the payload kernels in pktgen.c: how many GB/s
+   of test data the host can generate and check per core, for each
+   pattern and compare implementation.  No DOR hardware needed.
+
+   Usage: pktbench [msglen] [seconds_per_kernel]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pktgen.h"
+
+#define MSGLEN_DEFAULT 8092
+#define SECS_DEFAULT   0.5
+#define NBUF           64    /* Rotate through buffers so we don't just hit L1 */
+
+static unsigned char *bufa, *bufb;
+static volatile int sink;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.E-9*ts.tv_nsec;
+}
+
+static void report(const char *name, double bytes, double dt) {
+  printf("%-22s %8.2f GB/s\n", name, bytes/dt/1.E9);
+}
+
+static void bench_rand(int len, double secs) {
+  /* What readwrite used to do, for comparison */
+  double t0 = now(), dt, bytes = 0;
+  int i, n = 0;
+  do {
+    unsigned char *p = bufa + (n%NBUF)*len;
+    for(i=0; i<len; i++) p[i] = (unsigned char) rand()%256;
+    bytes += len;
+    n++;
+  } while((dt = now() - t0) < secs);
+  report("fill rand()%256", bytes, dt);
+}
+
+static void bench_fill(int pattern, int len, double secs) {
+  double t0 = now(), dt, bytes = 0;
+  char name[64];
+  int n = 0;
+  do {
+    pg_fill(bufa + (n%NBUF)*len, len, pattern, n);
+    bytes += len;
+    n++;
+  } while((dt = now() - t0) < secs);
+  snprintf(name, sizeof(name), "fill %s", pg_name(pattern));
+  report(name, bytes, dt);
+}
+
+static void bench_lcg(int len, double secs) {
+  double t0 = now(), dt, bytes = 0;
+  int n = 0;
+  do {
+    pg_fill_lcg(bufa + (n%NBUF)*len, len/4, n);
+    bytes += len/4*4;
+    n++;
+  } while((dt = now() - t0) < secs);
+  report("fill lcg (rndpkt)", bytes, dt);
+}
+
+static void bench_check_lcg(const char *name,
+			    int (*f)(const unsigned char *, int, uint32_t),
+			    int len, double secs) {
+  /* bufa holds LCG messages seeded with their buffer number */
+  double t0 = now(), dt, bytes = 0;
+  int n = 0;
+  do {
+    sink += f(bufa + (n%NBUF)*len, len/4, n%NBUF);
+    bytes += len/4*4;
+    n++;
+  } while((dt = now() - t0) < secs);
+  report(name, bytes, dt);
+}
+
+static void bench_cmp(const char *name,
+		      int (*f)(const unsigned char *, const unsigned char *, int),
+		      int len, double secs) {
+  /* Matching buffers, so every byte gets looked at */
+  double t0 = now(), dt, bytes = 0;
+  int n = 0;
+  do {
+    int off = (n%NBUF)*len;
+    sink += f(bufa + off, bufb + off, len);
+    bytes += len;
+    n++;
+  } while((dt = now() - t0) < secs);
+  report(name, bytes, dt);
+}
+
+static int memcmp_wrap(const unsigned char *a, const unsigned char *b, int len) {
+  return memcmp(a, b, len) ? 0 : -1;
+}
+
+static int check(int len) {
+  /* Make sure every compare agrees on where a single flipped byte is */
+  int i, pos, bad = 0;
+  pg_fill(bufa, len, PG_RANDOM, 1);
+  for(pos=0; pos<len; pos += 1 + pos/7) {
+    memcpy(bufb, bufa, len);
+    bufb[pos] ^= 0x10;
+    int r[3];
+    r[0] = pg_mismatch_scalar(bufa, bufb, len);
+    r[1] = pg_have_sse2() ? pg_mismatch_sse2(bufa, bufb, len) : pos;
+    r[2] = pg_have_avx2() ? pg_mismatch_avx2(bufa, bufb, len) : pos;
+    for(i=0; i<3; i++) {
+      if(r[i] != pos) {
+	fprintf(stderr, "Compare kernel %d found mismatch at %d, wanted %d!\n", i, r[i], pos);
+	bad = 1;
+      }
+    }
+  }
+  if(pg_mismatch(bufa, bufa, len) != -1) {
+    fprintf(stderr, "Compare of identical buffers found a mismatch!\n");
+    bad = 1;
+  }
+
+  /* Same for the LCG checkers, and make sure the jump-ahead and seed
+     recovery agree with stepping one at a time */
+  int nw = len/4;
+  uint32_t seed = 0xDEADBEEF, an, cn, x = seed;
+  pg_fill_lcg(bufa, nw, seed);
+  for(i=0; i<nw; i++) x = PG_LCG_A*x + PG_LCG_C;
+  pg_lcg_jump(nw, &an, &cn);
+  if(an*seed + cn != x) {
+    fprintf(stderr, "LCG jump-ahead by %d disagrees with stepping!\n", nw);
+    bad = 1;
+  }
+  if(nw > 0 && pg_lcg_seed(bufa) != seed) {
+    fprintf(stderr, "LCG seed recovery failed!\n");
+    bad = 1;
+  }
+  for(pos=0; pos<nw; pos += 1 + pos/7) {
+    memcpy(bufb, bufa, nw*4);
+    bufb[pos*4 + pos%4] ^= 0x01;
+    int r[2];
+    r[0] = pg_check_lcg_scalar(bufb, nw, seed);
+    r[1] = pg_have_avx2() ? pg_check_lcg_avx2(bufb, nw, seed) : pos;
+    for(i=0; i<2; i++) {
+      if(r[i] != pos) {
+	fprintf(stderr, "LCG check kernel %d found mismatch at word %d, wanted %d!\n",
+		i, r[i], pos);
+	bad = 1;
+      }
+    }
+  }
+  if(pg_check_lcg(bufa, nw, seed) != -1) {
+    fprintf(stderr, "LCG check of a good stream found a mismatch!\n");
+    bad = 1;
+  }
+  return bad;
+}
+
+int main(int argc, char *argv[]) {
+  int len     = MSGLEN_DEFAULT;
+  double secs = SECS_DEFAULT;
+  int i;
+
+  if(argc > 1 && (len = atoi(argv[1])) < 1) {
+    fprintf(stderr, "Usage: pktbench [msglen] [seconds_per_kernel]\n");
+    exit(-1);
+  }
+  if(argc > 2 && (secs = atof(argv[2])) <= 0) secs = SECS_DEFAULT;
+
+  bufa = malloc((size_t) NBUF*len);
+  bufb = malloc((size_t) NBUF*len);
+  if(!bufa || !bufb) {
+    fprintf(stderr, "Can't allocate %d byte buffers.\n", NBUF*len);
+    exit(-1);
+  }
+
+  if(check(len)) exit(-1);
+
+  printf("%d byte messages, %d buffers, SSE2 %s, AVX2 %s\n", len, NBUF,
+	 pg_have_sse2() ? "yes" : "no", pg_have_avx2() ? "yes" : "no");
+
+  bench_rand(len, secs);
+  for(i=0; i<PG_NPATTERN; i++) bench_fill(i, len, secs);
+  bench_lcg(len, secs);
+
+  memcpy(bufb, bufa, (size_t) NBUF*len);
+  bench_cmp("compare memcmp", memcmp_wrap, len, secs);
+  bench_cmp("compare scalar", pg_mismatch_scalar, len, secs);
+  if(pg_have_sse2()) bench_cmp("compare sse2", pg_mismatch_sse2, len, secs);
+  if(pg_have_avx2()) bench_cmp("compare avx2", pg_mismatch_avx2, len, secs);
+  bench_cmp("compare (dispatched)", pg_mismatch, len, secs);
+
+  for(i=0; i<NBUF; i++) pg_fill_lcg(bufa + i*len, len/4, i);
+  bench_check_lcg("check lcg scalar", pg_check_lcg_scalar, len, secs);
+  if(pg_have_avx2()) bench_check_lcg("check lcg avx2", pg_check_lcg_avx2, len, secs);
+
+  free(bufa);
+  free(bufb);
+  return 0;
+}
@@ -0,0 +1,322 @@
+/* pktgen.c
+   Payload generation and checking kernels; see pktgen.h.
+*/
+
+#include <string.h>
+#include <pthread.h>
+#include "pktgen.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# define PG_X86 1
+# include <immintrin.h>
+#endif
+
+static const char *pgnames[PG_NPATTERN] = { "random", "incr", "prbs7", "prbs15", "prbs31" };
+
+static uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+void pg_seed(struct pg_rng *r, uint64_t seed) {
+  r->s[0] = splitmix64(&seed);
+  r->s[1] = splitmix64(&seed);
+  if(!r->s[0] && !r->s[1]) r->s[1] = 1;
+}
+
+const char *pg_name(int pattern) {
+  if(pattern < 0 || pattern >= PG_NPATTERN) return "unknown";
+  return pgnames[pattern];
+}
+
+int pg_pattern(const char *name) {
+  int i;
+  for(i=0; i<PG_NPATTERN; i++) if(!strcmp(name, pgnames[i])) return i;
+  return -1;
+}
+
+static void fill_random(unsigned char *buf, int len, uint64_t seed) {
+  struct pg_rng r;
+  uint64_t v;
+  int i;
+  pg_seed(&r, seed);
+  for(i=0; i+8 <= len; i += 8) {
+    v = pg_next(&r);
+    memcpy(buf+i, &v, 8);
+  }
+  if(i < len) {
+    v = pg_next(&r);
+    memcpy(buf+i, &v, len-i);
+  }
+}
+
+/* Periodic patterns are built once and copied out in chunks.  Short
+   periods are repeated in their table so a message takes few copies. */
+#define INCR_PERIOD   1020    /* (i/4)%255+1 repeats every 255 longwords */
+#define PRBS7_PERIOD  127     /* 2^n-1 bits is also 2^n-1 bytes, as it's odd */
+#define PRBS15_PERIOD 32767
+#define INCR_TABLEN   (8*INCR_PERIOD)
+#define PRBS7_TABLEN  (64*PRBS7_PERIOD)
+
+static unsigned char incr_tab[INCR_TABLEN];
+static unsigned char prbs7_tab[PRBS7_TABLEN];
+static unsigned char prbs15_tab[PRBS15_PERIOD];
+
+/* Bit stream with b[k] = b[k-n] ^ b[k-m], m < n.  H holds the most
+   recent bits, newest in bit 0; w <= m new bits come out at once,
+   earliest bit most significant. */
+static inline uint64_t prbs_step(uint64_t *H, int n, int m, int w) {
+  uint64_t nb = ((*H >> (n-w)) ^ (*H >> (m-w))) & ((1ULL << w)-1);
+  *H = (*H << w) | nb;
+  return nb;
+}
+
+static void prbs_table(unsigned char *tab, int nbytes, int n, int m) {
+  uint64_t H = (1ULL << n) - 1;
+  int i, j;
+  for(i=0; i<nbytes; i++) {
+    unsigned char c = 0;
+    for(j=0; j<8; j++) c = (c << 1) | prbs_step(&H, n, m, 1);
+    tab[i] = c;
+  }
+}
+
+static void init_tabs(void) {
+  int i;
+  for(i=0; i<INCR_TABLEN; i++) incr_tab[i] = (i/4)%255+1; /* Never 0 */
+  prbs_table(prbs7_tab,  PRBS7_TABLEN,  7,  6);
+  prbs_table(prbs15_tab, PRBS15_PERIOD, 15, 14);
+}
+
+/* Tables and kernel choice are set up once, whichever thread of
+   readwrite -T gets here first */
+static pthread_once_t pg_once = PTHREAD_ONCE_INIT;
+static void pg_init(void);
+
+static void fill_periodic(unsigned char *buf, int len, const unsigned char *tab,
+			  int tablen, int start) {
+  int n;
+  while(len > 0) {
+    n = tablen - start;
+    if(n > len) n = len;
+    memcpy(buf, tab+start, n);
+    buf   += n;
+    len   -= n;
+    start  = 0;
+  }
+}
+
+static void fill_prbs31(unsigned char *buf, int len, uint64_t seed) {
+  /* The stream also obeys b[k] = b[k-62] ^ b[k-56] (the square of the
+     generator polynomial), which gives 7 bytes per step instead of 3.
+     Fill H with 64 stream bits using the short recurrence first. */
+  uint64_t H = (splitmix64(&seed) & 0x7FFFFFFFULL) | 1;
+  uint64_t nb;
+  int i, j;
+  prbs_step(&H, 31, 28, 28);
+  prbs_step(&H, 31, 28, 5);
+  nb = H & ((1ULL << 56)-1);
+  for(i=0; i+7 <= len; i += 7) {
+    for(j=0; j<7; j++) buf[i+j] = nb >> (48-8*j);
+    nb = prbs_step(&H, 62, 56, 56);
+  }
+  for(j=0; i < len; i++, j++) buf[i] = nb >> (48-8*j);
+}
+
+void pg_fill(unsigned char *buf, int len, int pattern, uint64_t seed) {
+  if(pattern != PG_RANDOM) pthread_once(&pg_once, pg_init);
+  switch(pattern) {
+  case PG_INCR:   fill_periodic(buf, len, incr_tab, INCR_TABLEN, 0); break;
+  case PG_PRBS7:  fill_periodic(buf, len, prbs7_tab, PRBS7_TABLEN, seed%PRBS7_PERIOD); break;
+  case PG_PRBS15: fill_periodic(buf, len, prbs15_tab, PRBS15_PERIOD, seed%PRBS15_PERIOD); break;
+  case PG_PRBS31: fill_prbs31(buf, len, seed); break;
+  case PG_RANDOM:
+  default:        fill_random(buf, len, seed); break;
+  }
+}
+
+void pg_fill_lcg(unsigned char *buf, int nwords, uint32_t seed) {
+  uint32_t x = seed;
+  int i;
+  for(i=0; i<nwords; i++) {
+    x = PG_LCG_A*x + PG_LCG_C;
+    buf[i*4]   = x;
+    buf[i*4+1] = x >> 8;
+    buf[i*4+2] = x >> 16;
+    buf[i*4+3] = x >> 24;
+  }
+}
+
+void pg_lcg_jump(uint32_t n, uint32_t *an, uint32_t *cn) {
+  /* Square-and-multiply on the map x -> a*x + c */
+  uint32_t a = PG_LCG_A, c = PG_LCG_C, ra = 1, rc = 0;
+  while(n) {
+    if(n & 1) {
+      rc = a*rc + c;
+      ra = a*ra;
+    }
+    c = (a+1)*c;
+    a = a*a;
+    n >>= 1;
+  }
+  *an = ra;
+  *cn = rc;
+}
+
+uint32_t pg_lcg_seed(const unsigned char *buf) {
+  /* Invert the first step; A is odd, so it has an inverse mod 2^32
+     (Newton's iteration doubles the good bits each time) */
+  uint32_t x = buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t) buf[3] << 24);
+  uint32_t inv = PG_LCG_A;
+  int i;
+  for(i=0; i<5; i++) inv *= 2 - PG_LCG_A*inv;
+  return (x - PG_LCG_C)*inv;
+}
+
+static int check_lcg_from(const unsigned char *buf, int i, int nwords, uint32_t x) {
+  /* x is what word i should be */
+  for(; i<nwords; i++) {
+    const unsigned char *p = buf + 4*i;
+    if((p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24)) != x) return i;
+    x = PG_LCG_A*x + PG_LCG_C;
+  }
+  return -1;
+}
+
+int pg_check_lcg_scalar(const unsigned char *buf, int nwords, uint32_t seed) {
+  return check_lcg_from(buf, 0, nwords, PG_LCG_A*seed + PG_LCG_C);
+}
+
+/************* Compare-and-locate ******************/
+
+static int locate(const unsigned char *a, const unsigned char *b, int i, int len) {
+  for(; i<len; i++) if(a[i] != b[i]) return i;
+  return -1;
+}
+
+int pg_mismatch_scalar(const unsigned char *a, const unsigned char *b, int len) {
+  int i;
+  uint64_t x, y;
+  for(i=0; i+8 <= len; i += 8) {
+    memcpy(&x, a+i, 8);
+    memcpy(&y, b+i, 8);
+    if(x != y) return locate(a, b, i, i+8);
+  }
+  return locate(a, b, i, len);
+}
+
+#ifdef PG_X86
+
+__attribute__((target("sse2")))
+int pg_mismatch_sse2(const unsigned char *a, const unsigned char *b, int len) {
+  int i;
+  for(i=0; i+16 <= len; i += 16) {
+    __m128i va = _mm_loadu_si128((const __m128i *) (a+i));
+    __m128i vb = _mm_loadu_si128((const __m128i *) (b+i));
+    unsigned int m = _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb));
+    if(m != 0xFFFF) return i + __builtin_ctz(~m);
+  }
+  return locate(a, b, i, len);
+}
+
+__attribute__((target("avx2")))
+int pg_mismatch_avx2(const unsigned char *a, const unsigned char *b, int len) {
+  int i, r;
+  /* Two vectors per pass; only look closer once something differs */
+  for(i=0; i+64 <= len; i += 64) {
+    __m256i e0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a+i)),
+				   _mm256_loadu_si256((const __m256i *) (b+i)));
+    __m256i e1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *) (a+i+32)),
+				   _mm256_loadu_si256((const __m256i *) (b+i+32)));
+    if((unsigned int) _mm256_movemask_epi8(_mm256_and_si256(e0, e1)) != 0xFFFFFFFFU) {
+      unsigned int m = _mm256_movemask_epi8(e0);
+      if(m != 0xFFFFFFFFU) return i + __builtin_ctz(~m);
+      return i + 32 + __builtin_ctz(~(unsigned int) _mm256_movemask_epi8(e1));
+    }
+  }
+  for(; i+32 <= len; i += 32) {
+    __m256i va = _mm256_loadu_si256((const __m256i *) (a+i));
+    __m256i vb = _mm256_loadu_si256((const __m256i *) (b+i));
+    unsigned int m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb));
+    if(m != 0xFFFFFFFFU) return i + __builtin_ctz(~m);
+  }
+  r = pg_mismatch_sse2(a+i, b+i, len-i);
+  return r < 0 ? -1 : i + r;
+}
+
+__attribute__((target("avx2")))
+int pg_check_lcg_avx2(const unsigned char *buf, int nwords, uint32_t seed) {
+  /* Two sets of 8 lanes, each jumping 16 steps, so one multiply's
+     latency overlaps the other's */
+  uint32_t a16, c16, x[16], xs = seed;
+  int i;
+  for(i=0; i<16; i++) x[i] = xs = PG_LCG_A*xs + PG_LCG_C;
+  pg_lcg_jump(16, &a16, &c16);
+  __m256i vx0 = _mm256_loadu_si256((const __m256i *) x);
+  __m256i vx1 = _mm256_loadu_si256((const __m256i *) (x+8));
+  __m256i va  = _mm256_set1_epi32((int) a16);
+  __m256i vc  = _mm256_set1_epi32((int) c16);
+  for(i=0; i+16 <= nwords; i += 16) {
+    __m256i e0 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (buf + 4*i)), vx0);
+    __m256i e1 = _mm256_cmpeq_epi32(_mm256_loadu_si256((const __m256i *) (buf + 4*i + 32)), vx1);
+    if((unsigned int) _mm256_movemask_epi8(_mm256_and_si256(e0, e1)) != 0xFFFFFFFFU) {
+      unsigned int m = _mm256_movemask_epi8(e0);
+      if(m != 0xFFFFFFFFU) return i + __builtin_ctz(~m)/4;
+      return i + 8 + __builtin_ctz(~(unsigned int) _mm256_movemask_epi8(e1))/4;
+    }
+    vx0 = _mm256_add_epi32(_mm256_mullo_epi32(vx0, va), vc);
+    vx1 = _mm256_add_epi32(_mm256_mullo_epi32(vx1, va), vc);
+  }
+  /* Lane 0 now holds word i */
+  return check_lcg_from(buf, i, nwords, (uint32_t) _mm256_cvtsi256_si32(vx0));
+}
+
+int pg_have_sse2(void) { return __builtin_cpu_supports("sse2"); }
+int pg_have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+
+#else /* No x86 SIMD: everything falls back to the scalar version */
+
+int pg_mismatch_sse2(const unsigned char *a, const unsigned char *b, int len) {
+  return pg_mismatch_scalar(a, b, len);
+}
+int pg_mismatch_avx2(const unsigned char *a, const unsigned char *b, int len) {
+  return pg_mismatch_scalar(a, b, len);
+}
+int pg_check_lcg_avx2(const unsigned char *buf, int nwords, uint32_t seed) {
+  return pg_check_lcg_scalar(buf, nwords, seed);
+}
+int pg_have_sse2(void) { return 0; }
+int pg_have_avx2(void) { return 0; }
+
+#endif /* PG_X86 */
+
+static int (*mismatch_impl)(const unsigned char *, const unsigned char *, int);
+static int (*check_lcg_impl)(const unsigned char *, int, uint32_t);
+
+static void pg_init(void) {
+  init_tabs();
+  if(pg_have_avx2()) {
+    mismatch_impl = pg_mismatch_avx2;
+  } else if(pg_have_sse2()) {
+    mismatch_impl = pg_mismatch_sse2;
+  } else {
+    mismatch_impl = pg_mismatch_scalar;
+  }
+  check_lcg_impl = pg_have_avx2() ? pg_check_lcg_avx2 : pg_check_lcg_scalar;
+}
+
+int pg_mismatch(const unsigned char *a, const unsigned char *b, int len) {
+  /* Nearly every message matches, and memcmp() says so faster than
+     any of the kernels; they only have to find where */
+  if(len <= 0 || !memcmp(a, b, len)) return -1;
+  pthread_once(&pg_once, pg_init);
+  return mismatch_impl(a, b, len);
+}
+
+int pg_check_lcg(const unsigned char *buf, int nwords, uint32_t seed) {
+  if(nwords < 64) return pg_check_lcg_scalar(buf, nwords, seed); /* Not worth the setup */
+  pthread_once(&pg_once, pg_init);
+  return check_lcg_impl(buf, nwords, seed);
+}
@@ -0,0 +1,80 @@
+/* pktgen.h
+   Payload generation and checking kernels shared by readwrite,
+   rndpkt and pktbench.
+
+   Every pattern is a pure function of (pattern, seed, length), so a
+   message can be regenerated for checking instead of being kept.
+*/
+
+#ifndef __PKTGEN_H__
+#define __PKTGEN_H__
+
+#include <stdint.h>
+
+#define PG_RANDOM  0   /* xorshift128+ stream seeded from the message seed */
+#define PG_INCR    1   /* 1111222233334444... (readwrite -i); seed unused */
+#define PG_PRBS7   2   /* x^7+x^6+1, starting at a seed-dependent phase */
+#define PG_PRBS15  3   /* x^15+x^14+1 */
+#define PG_PRBS31  4   /* x^31+x^28+1 */
+#define PG_NPATTERN 5
+
+struct pg_rng {
+  uint64_t s[2];
+};
+
+/* Seed a generator (any seed, including 0, is fine) */
+void pg_seed(struct pg_rng *r, uint64_t seed);
+
+/* Next 64 random bits */
+static inline uint64_t pg_next(struct pg_rng *r) {
+  uint64_t s1 = r->s[0];
+  const uint64_t s0 = r->s[1];
+  r->s[0] = s0;
+  s1 ^= s1 << 23;
+  r->s[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+  return r->s[1] + s0;
+}
+
+/* Fill buf with len bytes of the given pattern */
+void pg_fill(unsigned char *buf, int len, int pattern, uint64_t seed);
+
+#define PG_LCG_A 69069U   /* echo-pkt-mode LCG: x' = A*x + C (mod 2^32) */
+#define PG_LCG_C 1U
+
+/* Fill buf with nwords little-endian 32-bit words of the echo-pkt-mode
+   LCG stream (x' = 69069*x + 1), starting after x = seed */
+void pg_fill_lcg(unsigned char *buf, int nwords, uint32_t seed);
+
+/* Multiplier and increment for n LCG steps at once:
+   x[k+n] = an*x[k] + cn */
+void pg_lcg_jump(uint32_t n, uint32_t *an, uint32_t *cn);
+
+/* The seed a pg_fill_lcg() stream was started from, given its first
+   four bytes */
+uint32_t pg_lcg_seed(const unsigned char *buf);
+
+/* Index of the first of nwords words in buf which doesn't match the
+   LCG stream from seed, or -1 if they all do.  The AVX2 version checks
+   16 words at a time, the stream being split into 16 lanes that each
+   jump 16 steps ahead. */
+int pg_check_lcg(const unsigned char *buf, int nwords, uint32_t seed);
+int pg_check_lcg_scalar(const unsigned char *buf, int nwords, uint32_t seed);
+int pg_check_lcg_avx2(const unsigned char *buf, int nwords, uint32_t seed);
+
+/* Pattern name for messages, and the reverse; -1 for an unknown name */
+const char *pg_name(int pattern);
+int pg_pattern(const char *name);
+
+/* Index of the first byte where a and b differ, or -1 if they match.
+   A plain memcmp() first; AVX2 or SSE2, when the CPU has them, to
+   locate a difference.  Safe to call from several threads. */
+int pg_mismatch(const unsigned char *a, const unsigned char *b, int len);
+
+/* The individual implementations, for pktbench */
+int pg_mismatch_scalar(const unsigned char *a, const unsigned char *b, int len);
+int pg_mismatch_sse2(const unsigned char *a, const unsigned char *b, int len);
+int pg_mismatch_avx2(const unsigned char *a, const unsigned char *b, int len);
+int pg_have_sse2(void);
+int pg_have_avx2(void);
+
+#endif /* __PKTGEN_H__ */
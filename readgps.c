@@ -22,15 +22,32 @@
 #include <string.h>
 #include <unistd.h>
 #include <signal.h>
+#include <poll.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "domhub.h"
+#include "gpsidx.h"
+#include "livestats.h"
 
 #define TSBUFLEN  22
-#define MAXPROC   80
+#define MAXPROC   DH_PATHLEN
 #define MAXCARD    7
 #define SOH        1
 #define COL      ':'
 #define QUALPOS   13
 #define MAXRETRIES 3
 #define MAXFLUSH  11
+#define WANT_DT   20000000ULL
+
+/* Monitor mode */
+#define POLL_MS    10      /* Polling interval while a time string is due */
+#define EARLY_MS   20      /* Start polling this long before it is due */
+#define NOGPS_S     5      /* Complain after this long without one */
+#define NTAU       10      /* Allan deviation at 1, 2, 4 ... 512 s */
+#define MAXTAU     (1 << (NTAU-1))
+#define RING       (2*MAXTAU+1)
 
 int usage(void) {
   fprintf(stderr,
@@ -45,7 +62,19 @@ int usage(void) {
 	  "          -c       REQUIRE 20M clock tick time difference.\n"
 	  "          -g       Flag deviations from 1 sec in GPS times\n"
 	  "          -s       Flush DOR buffer at launch\n"
-	  "E.g., readgps /proc/driver/domhub/card0/syncgps\n");
+	  "Monitor mode: readgps -m [options] [card # ...]\n"
+	  "  Follows every card given (default: all present) at once and writes a\n"
+	  "  CSV line per time string: DOR frequency error, phase, offset from the\n"
+	  "  first card, Allan deviation.  -s and -i apply.  Also:\n"
+	  "          -F <MHz> Nominal DOR clock (default 20)\n"
+	  "          -t <n>   Flag DOR clock deviations of more than n ticks/s\n"
+	  "                   and offset changes of more than n ticks (default 0)\n"
+	  "          -S <n>   Per-card summary to stderr every n seconds\n"
+	  "          -T <n>   Stop after n seconds (default: run until killed)\n"
+	  "          -I       Keep each card's DOR-to-UTC index (gpsidx.h) up to date\n"
+	  "                   for tcaltest -u and the like\n"
+	  "E.g., readgps /proc/driver/domhub/card0/syncgps\n"
+	  "$DOMHUB_ROOT, if set, is prefixed to the proc file for <card #>.\n");
   return -1;
 }
 
@@ -93,6 +122,311 @@ long long gps_to_secs(char * gps) {
     +    (gps[11]-'0')*10 + (gps[12]-'0');                         // Sec
 }
 
+/************* Monitor mode ******************/
+
+/* Everything we know about one card's DOR clock.  The phase is the DOR
+   clock's time error against GPS, in ns, kept for the last RING
+   seconds so the overlapping Allan variance at each tau = 2^k s can be
+   added up as each second comes in. */
+struct gpscard {
+  int    icard;
+  char   pfnam[MAXPROC];
+  long   n;                     /* Time strings read */
+  int    had;                   /* Have a previous string */
+  long long gps;                /* Its GPS second */
+  unsigned long long dor;       /* Its DOR time */
+  long   sec;                   /* GPS seconds since the first string */
+  long long err;                /* DOR ticks since then, minus nominal */
+  double phase[RING];           /* ns, by sec % RING */
+  long   psec[RING];            /* Which second each phase is for */
+  double avar[NTAU];
+  long   navar[NTAU];
+  double ysum, yysum;           /* Frequency error, ppb */
+  long   ny, nbad, nmiss, ngps, njump;
+  int    bad;                   /* Currently off */
+  long long off;                /* Ticks ahead of the first card */
+  int    hadoff, jumping;
+  uint64_t next_ms;             /* When to poll next */
+  uint64_t last_ms;             /* When a string last turned up */
+  int    empty;                 /* Last poll found nothing */
+  int    locked;                /* Know when strings turn up */
+  int    stale;
+  struct gpsidx *idx;           /* -I */
+  struct ls_slot *live;         /* moatstat counters */
+};
+
+static uint64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* One time string from the card, 0 if none is buffered or -1 on error */
+static int read_ts(struct gpscard *c, char *tsbuf) {
+  int fd = dh_open_dev(c->pfnam, O_RDONLY);
+  if(fd == -1) {
+    fprintf(stderr,"Can't open file %s: %s\n", c->pfnam, strerror(errno));
+    return -1;
+  }
+  int nr = read(fd, tsbuf, TSBUFLEN);
+  if(nr < 0 && errno == EAGAIN) {
+    /* A stand-in (domhub-emu) socket can still be catching up; the
+       driver's proc file never does this */
+    struct pollfd pfd = { fd, POLLIN, 0 };
+    if(poll(&pfd, 1, 100) == 1) nr = read(fd, tsbuf, TSBUFLEN);
+  }
+  close(fd);
+  if(nr <= 0) return 0;
+  if(nr != TSBUFLEN || tsbuf[0] != SOH || tsbuf[4] != COL || tsbuf[7] != COL
+     || tsbuf[10] != COL) {
+    fprintf(stderr,"readgps: %s: bad time string/timestamp format (%d bytes).\n",
+	    c->pfnam, nr);
+    return 0;
+  }
+  return 1;
+}
+
+static double adev_ppb(const struct gpscard *c, int k) {
+  /* Overlapping Allan deviation at tau = 2^k s; phase in ns so this is ns/s */
+  return c->navar[k] ? sqrt(c->avar[k]/(2.*c->navar[k]))/(1 << k) : 0.;
+}
+
+static void add_phase(struct gpscard *c, double x) {
+  int k;
+  c->phase[c->sec % RING] = x;
+  c->psec[c->sec % RING]  = c->sec;
+  for(k=0; k<NTAU; k++) {
+    long m = 1L << k;
+    if(c->sec < 2*m) break;
+    int i1 = (c->sec - m) % RING, i2 = (c->sec - 2*m) % RING;
+    if(c->psec[i1] != c->sec - m || c->psec[i2] != c->sec - 2*m) continue; /* Gap */
+    double d = x - 2*c->phase[i1] + c->phase[i2];
+    c->avar[k] += d*d;
+    c->navar[k]++;
+  }
+}
+
+static void summary(struct gpscard *cards, int ncards) {
+  int i, k;
+  for(i=0; i<ncards; i++) {
+    struct gpscard *c = &cards[i];
+    double ym = c->ny ? c->ysum/c->ny : 0, yv = c->ny ? c->yysum/c->ny - ym*ym : 0;
+    fprintf(stderr, "card %d: %ld strings, %ld missed, %ld bad dt, %ld GPS jumps, "
+	    "freq %+.1f +- %.1f ppb, offset %lld ticks (%ld changes)\n  ADEV(ppb)",
+	    c->icard, c->n, c->nmiss, c->nbad, c->ngps, ym, yv > 0 ? sqrt(yv) : 0.,
+	    c->off, c->njump);
+    for(k=0; k<NTAU && c->navar[k]; k++) fprintf(stderr, " %lds:%.3g", 1L << k, adev_ppb(c, k));
+    fprintf(stderr, "\n");
+  }
+}
+
+/* Account for a new time string and write its CSV line */
+static void new_ts(struct gpscard *cards, int ic, char *tsbuf, unsigned long long nom,
+		   long long tol, int skipdt) {
+  struct gpscard *c = &cards[ic], *ref = &cards[0];
+  unsigned long long t = 0ULL;
+  long long this_t = gps_to_secs(tsbuf), dt = 0, dsec = 0;
+  double y = 0;
+  char flags[64] = "";
+  struct timeval tv;
+  int i;
+
+  for(i=QUALPOS+1;i<TSBUFLEN;i++) {
+    t <<= 8;
+    t |= (unsigned char) tsbuf[i];
+  }
+  if(c->had) {
+    dt   = (long long) (t - c->dor);
+    dsec = this_t - c->gps;
+    if(dsec <= 0 || dsec > 3600) {
+      /* New year, or the GPS clock jumped; go by the DOR clock */
+      dsec = (long long) floor((double) dt/nom + 0.5);
+      c->ngps++;
+      strcat(flags, "|GPS");
+    }
+    if(dsec <= 0) c->had = 0; /* DOR clock went backwards too; start over */
+  }
+  if(!c->had) {
+    memset(c->psec, -1, sizeof(c->psec));
+    c->sec = 0;
+    c->err = 0;
+    c->had = 1;
+    add_phase(c, 0.);
+  } else {
+    long long derr = dt - (long long) nom*dsec;
+    if(dsec > 1) {
+      c->nmiss += dsec-1;
+      strcat(flags, "|MISSED");
+    }
+    c->sec += dsec;
+    c->err += derr;
+    add_phase(c, c->err*(1.E9/nom));
+    y = (double) derr/((double) nom*dsec)*1.E9;
+    c->ysum  += y;
+    c->yysum += y*y;
+    c->ny++;
+    if(c->n > skipdt && llabs(derr) > tol*dsec) {
+      c->nbad++;
+      strcat(flags, "|BADDT");
+      if(!c->bad)
+	fprintf(stderr, "readgps ERROR: %s: DOR clock off by %lld ticks in %lld s (%+.1f ppb).\n",
+		c->pfnam, derr, dsec, y);
+      c->bad = 1;
+    } else {
+      c->bad = 0;
+    }
+  }
+  c->gps = this_t;
+  c->dor = t;
+  c->n++;
+
+  /* Offset from the first card, projecting its last latch to this second */
+  int haveoff = ref->had && llabs(this_t - ref->gps) <= 2;
+  if(haveoff) {
+    long long off = (long long) (t - ref->dor) - (long long) nom*(this_t - ref->gps);
+    if(c->hadoff && c->n > skipdt && llabs(off - c->off) > tol) {
+      c->njump++;
+      strcat(flags, "|OFFSET");
+      if(!c->jumping)
+	fprintf(stderr, "readgps ERROR: %s: offset from card %d changed from %lld to %lld ticks.\n",
+		c->pfnam, ref->icard, c->off, off);
+      c->jumping = 1;
+    } else {
+      c->jumping = 0;
+    }
+    c->off    = off;
+    c->hadoff = 1;
+  }
+
+  gettimeofday(&tv, NULL);
+  printf("%ld.%03ld,%d,%.12s,%c,%016llx,", (long) tv.tv_sec, (long) tv.tv_usec/1000,
+	 c->icard, tsbuf+1, tsbuf[QUALPOS], t);
+  if(c->sec > 0) printf("%lld,%.1f", dt, y);
+  else printf(",");
+  printf(",%.1f,", c->err*(1.E9/nom));
+  if(haveoff) printf("%lld", c->off);
+  printf(",%.3g,%s\n", adev_ppb(c, 0), flags[0] ? flags+1 : "ok");
+}
+
+int monitor(int nargs, char **args, double fmhz, long long tol, int skipdt, int doflush,
+	    int sumsecs, int runsecs, int doindex) {
+  struct gpscard *cards = calloc(DH_MAXCARD, sizeof(struct gpscard));
+  unsigned long long nom = (unsigned long long) (fmhz*1.E6 + 0.5);
+  char tsbuf[TSBUFLEN], name[16];
+  int ncards = 0, i, j;
+
+  if(cards == NULL || nom == 0) {
+    fprintf(stderr, "readgps: bad DOR clock or out of memory.\n");
+    exit(-1);
+  }
+  if(nargs > DH_MAXCARD) {
+    fprintf(stderr, "Too many cards (max. %d).\n", DH_MAXCARD);
+    exit(-1);
+  }
+  for(i=0; i<(nargs ? nargs : DH_MAXCARD); i++) {
+    int icard = nargs ? atoi(args[i]) : i;
+    struct gpscard *c = &cards[ncards];
+    if(icard < 0 || icard > MAXCARD || (nargs && !isdigit_all(args[i], MAXPROC))) {
+      fprintf(stderr, "Bad card '%s'.\n", args[i]);
+      exit(-1);
+    }
+    for(j=0; j<ncards; j++) {
+      if(cards[j].icard == icard) {
+	fprintf(stderr, "Card %d given twice.\n", icard);
+	exit(-1);
+      }
+    }
+    dh_path(c->pfnam, MAXPROC, DH_PROCDIR "/card%d/syncgps", icard);
+    if(access(c->pfnam, F_OK)) {
+      if(!nargs) continue;
+      fprintf(stderr, "Can't find %s: %s\n", c->pfnam, strerror(errno));
+      exit(-1);
+    }
+    c->icard = icard;
+    snprintf(name, sizeof(name), "card%d", icard);
+    c->live = ls_attach(LS_READGPS, icard, name);
+    if(doindex && (c->idx = gpsidx_create(icard, nom)) == NULL) {
+      fprintf(stderr, "Can't create GPS index for card %d: %s\n", icard, strerror(errno));
+      exit(-1);
+    }
+    ncards++;
+  }
+  if(ncards == 0) {
+    fprintf(stderr, "readgps: no DOR cards found.\n");
+    exit(-1);
+  }
+
+  signal(SIGQUIT, argghhhh);
+  signal(SIGINT,  argghhhh);
+  signal(SIGTERM, argghhhh);
+
+  uint64_t start = now_ms(), last_sum = start;
+  for(i=0; i<ncards; i++) {
+    int n = 0;
+    if(doflush) while(n++ < MAXFLUSH && read_ts(&cards[i], tsbuf) > 0) ;
+    cards[i].next_ms = cards[i].last_ms = start;
+  }
+  printf("time,card,gps,qual,dor,dt,freq_ppb,phase_ns,offset,adev1_ppb,flags\n");
+  fflush(stdout);
+
+  while(!die) {
+    uint64_t now = now_ms(), next = now + 1000;
+    if(runsecs > 0 && now - start >= runsecs*1000ULL) break;
+    if(sumsecs > 0 && now - last_sum >= sumsecs*1000ULL) {
+      summary(cards, ncards);
+      last_sum = now;
+    }
+    for(i=0; i<ncards; i++) {
+      struct gpscard *c = &cards[i];
+      int r, got = 0;
+      if(c->next_ms > now) {
+	if(c->next_ms < next) next = c->next_ms;
+	continue;
+      }
+      /* Take everything buffered; the driver gives one string per open */
+      while((r = read_ts(c, tsbuf)) > 0) {
+	long nerr = c->nbad + c->njump + c->nmiss;
+	new_ts(cards, i, tsbuf, nom, tol, skipdt);
+	ls_rx(c->live, TSBUFLEN, 0);
+	if(c->nbad + c->njump + c->nmiss != nerr) ls_error(c->live);
+	if(c->idx) gpsidx_add(c->idx, tsbuf);
+	got++;
+      }
+      if(r < 0) exit(-1);
+      if(got) {
+	/* A string which wasn't there last time just came in, so the next
+	   one is due a second from now */
+	if(c->empty) c->locked = 1;
+	c->last_ms = now;
+	c->stale   = 0;
+	c->next_ms = c->locked ? now + 1000 - EARLY_MS : now + POLL_MS;
+      } else {
+	if(!c->stale && now - c->last_ms > NOGPS_S*1000) {
+	  fprintf(stderr, "readgps ERROR: %s: no GPS data for %d s, check hardware/firmware setup.\n",
+		  c->pfnam, NOGPS_S);
+	  ls_error(c->live);
+	  c->stale  = 1;
+	  c->locked = 0;
+	}
+	c->next_ms = now + POLL_MS;
+	ls_retry(c->live, 1);
+      }
+      c->empty = !got;
+      if(c->next_ms < next) next = c->next_ms;
+    }
+    fflush(stdout);
+    now = now_ms();
+    if(next > now) usleep((next - now)*1000);
+  }
+  summary(cards, ncards);
+  for(i=0; i<ncards; i++) {
+    ls_finish(cards[i].live, LS_DONE);
+    gpsidx_close(cards[i].idx);
+  }
+  free(cards);
+  return 0;
+}
+
 int main(int argc, char ** argv) {
   int dodiff     = 0;
   int nretries   = 0;
@@ -105,9 +439,15 @@ int main(int argc, char ** argv) {
   int doflag     = 0;
   int had_bad_dt = 0;
   int doflush    = 0;
+  int domonitor  = 0;
+  double fmhz    = WANT_DT/1.E6;
+  long long tol  = 0;
+  int sumsecs    = 0;
+  int runsecs    = 0;
+  int doindex    = 0;
 
   while(1) {
-    char c = getopt(argc, argv, "dogchfsi:w:");
+    char c = getopt(argc, argv, "dogchfsmIi:w:F:t:S:T:");
     if (c == -1) break;
     switch(c) {
     case 'd': dodiff = 1; break;
@@ -118,23 +458,33 @@ int main(int argc, char ** argv) {
     case 'f': doflag = 1; break;
     case 'g': flaggps = 1; break;
     case 's': doflush = 1; break;
+    case 'm': domonitor = 1; break;
+    case 'I': doindex = 1; break;
+    case 'F': fmhz = atof(optarg); break;
+    case 't': tol = atoll(optarg); break;
+    case 'S': sumsecs = atoi(optarg); break;
+    case 'T': runsecs = atoi(optarg); break;
     case 'h':
     default:
       exit(usage());
     }
   }
 
+  if(domonitor)
+    exit(monitor(argc-optind, argv+optind, fmhz, tol, skipdt, doflush, sumsecs, runsecs,
+		 doindex));
+
   if(argc == optind) exit(usage());
 
   
   char pfnam[MAXPROC];
   if(isdigit_all(argv[optind], MAXPROC)) {
-    sprintf(pfnam, "/proc/driver/domhub/card%d/syncgps", atoi(argv[optind]));
+    dh_path(pfnam, MAXPROC, DH_PROCDIR "/card%d/syncgps", atoi(argv[optind]));
     icard = atoi(argv[optind]);
   } else {
     /* We have a fully-qualified name */
     strncpy(pfnam, argv[optind], MAXPROC);
-    icard = getcard(pfnam, MAXPROC);
+    icard = getcard((char *) dh_unroot(pfnam), MAXPROC);
   }
 
   if(icard < 0 || icard > MAXCARD) {
@@ -161,7 +511,7 @@ int main(int argc, char ** argv) {
     i = done = 0;
     /* Note: for driver reasons(?), have to open/close every loop */
     while (!done) {
-      fd = open(pfnam, O_RDONLY);
+      fd = dh_open_dev(pfnam, O_RDONLY);
       if(fd == -1) { 
 	fprintf(stderr,"Can't open file %s: %s\n", argv[optind], strerror(errno));
 	fprintf(stderr,"You may need a new driver revision: try V02-02-11 or higher.\n");
@@ -175,7 +525,7 @@ int main(int argc, char ** argv) {
 
   while(1) {
     if(die) break;
-    fd = open(pfnam, O_RDONLY);
+    fd = dh_open_dev(pfnam, O_RDONLY);
     if(fd == -1) { 
       fprintf(stderr,"Can't open file %s: %s\n", argv[optind], strerror(errno));
       fprintf(stderr,"You may need a new driver revision: try V02-02-11 or higher.\n");
@@ -226,7 +576,6 @@ int main(int argc, char ** argv) {
     if(dodiff && tscount > 0) {
       fprintf(stdout," dt=%llu ticks", dt);
     }
-#   define WANT_DT 20000000ULL
     if((doflag || dodt) && tscount > skipdt && dt != WANT_DT) {
       fprintf(stdout," BAD DT!!");
       had_bad_dt = 1;
@@ -8,6 +8,7 @@
    sure there are no errors.
 */
 
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -18,23 +19,53 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
-#define _GNU_SOURCE
 #include <getopt.h>
 #include <sys/poll.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "domhub.h"
+#include "lathist.h"
+#include "pktgen.h"
+#include "livestats.h"
+#include "uring.h"
 
 #define MAX_MSG_BYTES 8092
 
 #define NUMMSGS_DEFAULT 100
 #define MAX_WRITE_RETRIES 10000
 #define MAX_READ_RETRIES  4000
-#define NMSGBUF 128
+#define READ_TIMEOUT_MS   MAX_READ_RETRIES /* Old stuffing loop slept ~1 ms per retry */
+#define NMSGBUF 128           /* Default stuffing window (-W) */
+#define MAX_WINDOW (1<<20)
 #define WRITE_DELAY 100
 #define READ_DELAY  1000
 #define MIN_DT_BEFORE_KBCHECK 10
-
-static unsigned char txbuf[NMSGBUF][MAX_MSG_BYTES];
-static int pktlengths[NMSGBUF];
-static unsigned char rxbuf[NMSGBUF][MAX_MSG_BYTES];
+#define MULTI_WAIT_MS 100 /* Max. time between timeout checks in multi-DOM mode */
+#define MAX_URING_DEPTH 64
+
+/* One in-flight message.  Its contents are regenerated from the seed
+   when the reply is checked, so this is all that's kept per message. */
+struct msgdesc {
+  long     seq;
+  uint64_t seed;
+  uint64_t tsend;                 /* CLOCK_MONOTONIC write time, ns */
+  int      len;
+};
+
+static unsigned char txbuf[MAX_MSG_BYTES];
+static unsigned char rxbuf[MAX_MSG_BYTES];
+static unsigned char expbuf[MAX_MSG_BYTES]; /* Regenerated copy of the message being checked */
+static struct msgdesc *window;    /* In-flight messages, a ring of winsize */
+static int winsize = NMSGBUF;
+static struct rtthist rtt;        /* Round-trip times by message length */
+static struct pg_rng payrng;      /* Per-message payload seeds */
+static long nsyscalls;            /* poll/read/write/epoll/io_uring calls while stuffing */
+static long nwrtry, nwrfull;      /* Write attempts, and how many found the TX FIFO full */
 
 #define BATCHPRINT 1 /* Set to 0 for more interactive, fast display of stats */
 #define BATCHCOUNT 1000 /* Set larger for less frequent display of stats */
@@ -48,21 +79,36 @@ int usage(void) {
   fprintf(stderr, 
 	  "Usage:\n"
 	  "  readwrite HUB [options] <devfile> [num_messages] "
-	  "[inter_message_delay] [open_delay]\n");
+	  "[inter_message_delay] [open_delay]\n"
+	  "  readwrite HUB [options] -D <domset> [num_messages]\n");
   fprintf(stderr, "  HUB needed for backwards compatibility with scripts.\n");
-  fprintf(stderr, "  <devfile> is in the form 00a, 00A, or /dev/dhc0w0dA\n\n");
+  fprintf(stderr, "  <devfile> is in the form 00a, 00A, or /dev/dhc0w0dA\n");
+  fprintf(stderr, "  <domset> is 'all' or a list such as '00a 01b 3*' (quote it)\n\n");
   fprintf(stderr, 
 	  "  Options: [-s] Stuffing mode (stuff as many messages as possible into TX FIFO)\n"
 	  "           [-d <msec>] delay <msec> before each write\n"
 	  "           [-r <msec>] delay <msec> after last write returns -1 (TX full)\n"
 	  "           [-f] Test maximal flow-control (keep send buffer full at all times)\n"
 	  "           [-i] Use incremental test pattern data (1111222233334444....)\n"
+	  "           [-P <pattern>] test pattern: random (default), incr, prbs7, prbs15\n"
+	  "                or prbs31\n"
 	  "           [-m <maxpkt>] max message length, up to MB, below.\n"
 	  "           [-p <pktlen>] pktlen between 1 and MB bytes, else random message length.\n"
 	  "           [-k KB] require average bandwidth >= <KB> kilobytes/sec.\n"
 	  "           [-e] put DOM in echo-mode first.\n"
-	  "           [-w] wait for up to 1 second while draining stale messages"
-	  "           MB == /proc/driver/domhub/bufsiz\n\n");
+	  "           [-w] wait for up to 1 second while draining stale messages\n"
+	  "           [-W <depth>] keep up to <depth> messages in flight when stuffing\n"
+	  "                (default %d, max. %d)\n"
+	  "           [-D <domset>] Stuff all DOMs in <domset> from one process (implies -s)\n"
+	  "           [-U <depth>] stuff using io_uring, with up to <depth> reads and\n"
+	  "                writes in flight per DOM (max. %d); falls back to poll()\n"
+	  "                if io_uring isn't available\n"
+	  "           [-T] stuff with a writer and a reader thread per DOM\n"
+	  "           [-C <cpus>] with -T, pin threads to <cpus> (e.g. '0,2,4-7'), in the\n"
+	  "                order DOM 1 writer, DOM 1 reader, DOM 2 writer, ...\n"
+	  "           MB == /proc/driver/domhub/bufsiz\n"
+	  "  $DOMHUB_ROOT, if set, is prefixed to all /dev and /proc paths.\n\n",
+	  NMSGBUF, MAX_WINDOW, MAX_URING_DEPTH);
   return 0;
 }
 
@@ -73,12 +119,39 @@ int getDevFile(char *filename, int len, char *arg);
 void show_buffers_hex(unsigned char *rxbuf, unsigned char *txbuf, int nrx, int ntx);
 void randsleep(int usec);
 void show_fpga(int icard);
-void init_buffers(unsigned char *txbuf, unsigned char *rxbuf, int len);
-void init_tx_buf(unsigned char *txbuf, int len, int incformat);
+uint64_t init_buffers(unsigned char *txbuf, unsigned char *rxbuf, int len, int pattern);
+uint64_t init_tx_buf(unsigned char *txbuf, int len, int pattern);
 int perd(int icount);
 void showcomstat(char * f);
 int set_echo_mode(int filep, int bufsiz, float waitval);
 int drain_stale_messages(int filep, int bufsiz, int dowait, float waitval);
+double mono_seconds(void);
+double cpu_seconds(void);
+void report_mismatch(char *filename, unsigned char *rxbuf, unsigned char *txbuf,
+		     int nread, long msgs_ok);
+int check_reply(char *filename, struct msgdesc *m, int pattern, unsigned char *rxbuf,
+		unsigned char *expbuf, int nread, long itxpkt, long irxpkt, long msgs_ok);
+
+/* Settings shared with the multi-DOM engine */
+struct rwconf {
+  char *domset;
+  long  nummsgs;
+  int   bufsiz;
+  int   fixpkt, pktlen, maxpkt;
+  int   pattern;       /* PG_RANDOM, PG_INCR, ... */
+  int   winsize;       /* Max. messages in flight per DOM */
+  int   uring;         /* io_uring depth per DOM, or 0 to use epoll/poll */
+  int   threads;       /* Writer and reader thread per DOM */
+  int  *cpus, ncpus;   /* CPUs to pin the threads to, if ncpus > 0 */
+  int   dokb, kbmin;
+  int   verbose;
+  int   dowait, dosetecho;
+  float waitval;
+};
+
+int run_multi(struct rwconf *cf);
+int run_threads(struct rwconf *cf);
+int parse_cpulist(char *list, int **cpus);
 
 int main(int argc, char *argv[]) {
   int nread, gotreply, write_ok;
@@ -101,7 +174,6 @@ int main(int argc, char *argv[]) {
   int contents_errors = 0;
   int length_errors   = 0;
   int readtimeouts    = 0;
-  int read_retries    = 0;
   int verbose         = 0;
   int dowait          = 0;
   long read_try_sum   = 0;
@@ -114,19 +186,24 @@ int main(int argc, char *argv[]) {
   int maxpkt;
   int flowctrl  = 0;
   int rdelay    = 0;
-  int incformat = 0;
+  int pattern   = PG_RANDOM;
   int dosetecho = 0;
+  char *domset  = NULL;
+  int uring     = 0;
+  int threads   = 0;
+  char *cpulist = NULL;
   struct pollfd  pfd;
   struct timeval tstart, tlatest;
   float deltasec;
 
   /************* Process command arguments ******************/
 
-  int bufsiz=getBufSize("/proc/driver/domhub/bufsiz");
+  char bsfile[DH_PATHLEN];
+  int bufsiz=getBufSize(dh_path(bsfile, DH_PATHLEN, DH_PROCDIR "/bufsiz"));
   maxpkt = bufsiz;
 
   while(1) {
-    char c = getopt(argc, argv, "hsvwifed:m:r:p:k:");
+    char c = getopt(argc, argv, "hsvwifTed:m:r:p:k:D:P:W:U:C:");
     if (c == -1) break;
 
     switch(c) {
@@ -139,13 +216,27 @@ int main(int argc, char *argv[]) {
     case 'w': dowait    = 1; break;
     case 'v': verbose   = 1; break;
     case 's': stuff     = 1; break;
-    case 'i': incformat = 1; break;
+    case 'i': pattern   = PG_INCR; break;
+    case 'P':
+      if((pattern = pg_pattern(optarg)) < 0) exit(usage());
+      break;
     case 'f': flowctrl  = 1; break;
     case 'e': dosetecho = 1; break;
     case 'k': dokb = 1; kbmin = atoi(optarg); break;
     case 'm': maxpkt    = atoi(optarg); break;
     case 'd': mdelay    = atoi(optarg); break;
     case 'r': rdelay    = atoi(optarg); break;
+    case 'D': domset    = optarg; break;
+    case 'W':
+      winsize = atoi(optarg);
+      if(winsize < 1 || winsize > MAX_WINDOW) exit(usage());
+      break;
+    case 'U':
+      uring = atoi(optarg);
+      if(uring < 1 || uring > MAX_URING_DEPTH) exit(usage());
+      break;
+    case 'T': threads   = 1; break;
+    case 'C': cpulist   = optarg; break;
     case 'h':
     default: exit(usage());
     }
@@ -154,9 +245,61 @@ int main(int argc, char *argv[]) {
   /* Initialize random generator for delays */
   int pid = (int) getpid();
   srand(pid);
+  pg_seed(&payrng, pid);
+
+  window = malloc(winsize*sizeof(struct msgdesc));
+  if(window == NULL) {
+    fprintf(stderr, "Can't allocate %d message window.\n", winsize);
+    exit(-1);
+  }
 
   int argcount = argc-optind;
 
+  if(domset || (stuff && uring) || threads) {
+    /* Multi-DOM mode: readwrite HUB -D <domset> [num_messages].  The
+       io_uring and threaded backends live in the multi-DOM engine, so
+       stuffing one DOM with -U or -T goes there too, as a set of one. */
+    if(argcount < 1 || strncmp(argv[optind], "HUB", 3)) exit(usage());
+    if(mdelay || rdelay || flowctrl) {
+      fprintf(stderr, "-d, -r and -f can't be used with -D, -U or -T.\n");
+      exit(usage());
+    }
+    if(threads && uring) {
+      fprintf(stderr, "-T and -U can't be used together.\n");
+      exit(usage());
+    }
+    struct rwconf cf;
+    int iarg = optind+1;
+    if(!domset) {
+      if(argcount < 2) exit(usage());
+      domset = argv[iarg++];
+    }
+    cf.domset    = domset;
+    cf.nummsgs   = NUMMSGS_DEFAULT;
+    if(iarg < argc && atol(argv[iarg]) >= 0) cf.nummsgs = atol(argv[iarg]);
+    cf.bufsiz    = bufsiz;
+    cf.fixpkt    = fixpkt;
+    cf.pktlen    = fixpkt ? pktlen : 0;
+    cf.maxpkt    = maxpkt;
+    cf.pattern   = pattern;
+    cf.winsize   = winsize;
+    cf.uring     = uring;
+    cf.threads   = threads;
+    cf.cpus      = NULL;
+    cf.ncpus     = 0;
+    if(cpulist && (cf.ncpus = parse_cpulist(cpulist, &cf.cpus)) <= 0) {
+      fprintf(stderr, "Bad CPU list '%s'.\n", cpulist);
+      exit(usage());
+    }
+    cf.dokb      = dokb;
+    cf.kbmin     = dokb ? kbmin : 0;
+    cf.verbose   = verbose;
+    cf.dowait    = dowait;
+    cf.dosetecho = dosetecho;
+    cf.waitval   = 3.0;
+    exit(threads ? run_threads(&cf) : run_multi(&cf));
+  }
+
   if(argcount < 2) exit(usage());
 
   if(argcount < 3 || (nummsgs = atol(argv[optind+2])) < 0) {
@@ -179,18 +322,19 @@ int main(int argc, char *argv[]) {
   fprintf(stderr, "Will send/recv %ld messages to device %s.\n",
 	  nummsgs, filename);
 
-  int filep = open(filename, O_RDWR);
+  int filep = dh_open_dev(filename, O_RDWR);
   if(filep <= 0) {
     fprintf(stderr,"Can't open file %s ", filename);
     perror(":");
     exit(errno);
   }
 
-  sscanf(filename,"/dev/dhc%dw%dd%c", &icard, &ipair, &cdom);
+  sscanf(dh_unroot(filename),"/dev/dhc%dw%dd%c", &icard, &ipair, &cdom);
   idom = (cdom == 'A' ? 0 : 1);
+  struct ls_slot *live = ls_attach_dom(LS_READWRITE, icard, ipair, cdom);
 
   char comstat[BSIZ];
-  snprintf(comstat, BSIZ, "/proc/driver/domhub/card%d/pair%d/dom%c/comstat", icard, ipair, cdom);
+  dh_path(comstat, BSIZ, DH_PROCDIR "/card%d/pair%d/dom%c/comstat", icard, ipair, cdom);
 
   if(opendelay) usleep(opendelay);
 
@@ -216,74 +360,53 @@ int main(int argc, char *argv[]) {
     long itxpkt = 0;
     long irxpkt = 0;
     gettimeofday(&tstart, NULL); /* Reset time */
+    double cpu0      = cpu_seconds();
+    double tdeadline = mono_seconds() + READ_TIMEOUT_MS/1000.;
+    if(nummsgs == 0) {
+      fprintf(stderr, "%s: SUCCESS.\n", filename);
+      ls_finish(live, LS_DONE);
+      exit(0);
+    }
     while(1) {
-      /* Write as many records to FIFO as possible */
-      if(itxpkt < nummsgs) {
-	while(itxpkt < nummsgs && (itxpkt - irxpkt) < NMSGBUF) {
-	  if(fixpkt) {
-	    pktlengths[itxpkt%NMSGBUF] = pktlen;
-	  } else {
-	    pktlengths[itxpkt%NMSGBUF] = 
-	      1+(int)(((float) maxpkt)*rand()/(RAND_MAX+1.0));
-	  }
-	  if(mdelay) usleep(mdelay*1000);
-	  init_tx_buf(txbuf[itxpkt%NMSGBUF], pktlengths[itxpkt%NMSGBUF], incformat);
-
-	  pfd.events = POLLOUT;
-	  if(! poll(&pfd, 1, 0)) {
-	    if(rdelay) usleep(rdelay*1000); /* Wait before read as separate test */
-            break;       /* Do read cycle */
-	  }
-	  if(!(pfd.revents & POLLOUT)) fprintf(stderr,"POLL ERROR\n");
-	  nbyteswritten = write(filep,txbuf[itxpkt%NMSGBUF], pktlengths[itxpkt%NMSGBUF]);
-
-	  if(nbyteswritten <= 0) { 
-	    fprintf(stderr,"Write EAGAIN after POLLOUT!\n");
-	    exit(-1);
-	  }
-
-	  if(nbyteswritten != pktlengths[itxpkt%NMSGBUF]) {
-	    fprintf(stderr,"%s: Wanted to write %d bytes, but wrote %d.\n",
-		    filename, pktlengths[itxpkt%NMSGBUF], nbyteswritten);
-	    exit(-1);
-	  }
-
-	  msgs_written++;
-	  last_written = nbyteswritten;
-	  verbose && fprintf(stderr,"%s: pkt %ld idx %d; wrote %d bytes.\n", 
-			     filename, itxpkt, (int) itxpkt%NMSGBUF, pktlengths[itxpkt%NMSGBUF]);
-	  itxpkt++;
-	}
+      /* Sleep until the DOM can take another message or has a reply for
+	 us; only wait for replies as long as the read deadline allows. */
+      int window_open = itxpkt < nummsgs && (itxpkt - irxpkt) < winsize;
+      int tmo = -1;
+      if(itxpkt > irxpkt) {
+	tmo = (int) ((tdeadline - mono_seconds())*1000.) + 1;
+	if(tmo < 0) tmo = 0;
       }
-	
-      /* Read a reply */
-      errno = 0;
-      //fprintf(stderr,"%s: Trying read...\n", filename);
-      while(1) {
-	pfd.events = POLLIN;
-       	if(!poll(&pfd, 1, 0)) {
-	  read_retries++;
-	  if(read_retries > MAX_READ_RETRIES) {
-	    fprintf(stderr, "%s: Timeout (> %d retries) on read.\n", filename,
-		    MAX_READ_RETRIES);
-	    if(msgs_ok == 0) {
-	      fprintf(stderr, "%s: Didn't read any messages back.\n",filename);
-	    } else {
-	      fprintf(stderr, "%s: Only read %ld messages successfully.\n", filename, msgs_ok);
-	    }
-	    fprintf(stderr, "Contents of FPGA for card %d:\n", icard);
-	    show_fpga(icard);
-	    fprintf(stderr, "Contents of comstat proc file %s:\n", comstat);
-	    showcomstat(comstat);
-	    exit(-1);
-	  }
-
-	  break;
+      pfd.events = POLLIN | (window_open ? POLLOUT : 0);
+      nsyscalls++;
+      int np = poll(&pfd, 1, tmo);
+      if(np < 0) {
+	if(errno == EINTR) continue;
+	perror("poll");
+	exit(-1);
+      }
+      if(np == 0) {
+	if(mono_seconds() < tdeadline) continue;
+	ls_error(live);
+	fprintf(stderr, "%s: Timeout (> %d msec) on read.\n", filename,
+		READ_TIMEOUT_MS);
+	if(msgs_ok == 0) {
+	  fprintf(stderr, "%s: Didn't read any messages back.\n",filename);
+	} else {
+	  fprintf(stderr, "%s: Only read %ld messages successfully.\n", filename, msgs_ok);
 	}
-	if(!(pfd.revents & POLLIN)) fprintf(stderr, "POLLIN ERROR\n");
+	rtt_print_table(stderr, filename, &rtt);
+	fprintf(stderr, "Contents of FPGA for card %d:\n", icard);
+	show_fpga(icard);
+	fprintf(stderr, "Contents of comstat proc file %s:\n", comstat);
+	showcomstat(comstat);
+	exit(-1);
+      }
+      int revents = pfd.revents;
 
-	nread = read(filep, rxbuf[irxpkt%NMSGBUF], bufsiz);
-	//fprintf(stderr, "%s: read(%d,%d)\n", filename, nread, errno);
+      /* Drain every reply that's ready before refilling the TX window */
+      while(revents & (POLLIN|POLLERR|POLLHUP)) {
+	nsyscalls++;
+	nread = read(filep, rxbuf, bufsiz);
 	if(nread <= 0) {
 	  fprintf(stderr, "%s: read error after POLLIN! nread=%d errno=%d\n",filename, 
 		  nread, errno);
@@ -292,96 +415,122 @@ int main(int argc, char *argv[]) {
 	  fprintf(stderr, "Contents of comstat proc file %s:\n", comstat);
 	  showcomstat(comstat);
 	  exit(-1);
-	} else { 
-	  /* Check message contents */
-	  if(nread != pktlengths[irxpkt%NMSGBUF]) {
-	    fprintf(stderr, "%s: Message length mismatch (TXed %ld msgs, RXed %ld).  "
-		    "Wanted %d bytes, got %d.\n",
-		    filename, itxpkt, irxpkt, pktlengths[irxpkt%NMSGBUF], nread);
-	    show_buffers_hex(rxbuf[irxpkt%NMSGBUF], txbuf[irxpkt%NMSGBUF], nread,
-			     pktlengths[irxpkt%NMSGBUF]);
-	    exit(-1);
-	  }
-	  int mismatches = 0;
-	  int mmpos      = 0;
-	  for(i=0;i<nread;i++) {
-	    if(rxbuf[irxpkt%NMSGBUF][i] != txbuf[irxpkt%NMSGBUF][i]) {
-	      if(mismatches == 0) mmpos = i;
-	      mismatches++;
-	    }
-	  }
+	}
+	/* Check message contents */
+	if(irxpkt >= itxpkt) {
+	  fprintf(stderr, "%s: Got unexpected %d byte message (TXed %ld msgs, RXed %ld).\n",
+		  filename, nread, itxpkt, irxpkt);
+	  exit(-1);
+	}
+	struct msgdesc *m = &window[irxpkt%winsize];
+	if(check_reply(filename, m, pattern, rxbuf, expbuf, nread, itxpkt, irxpkt, msgs_ok)) {
+	  ls_error(live);
+	  close(filep);
+	  exit(-1);
+	}
 
-	  if(mismatches > 0) {
-	    fprintf(stderr, "%s: Message mismatch in %d place(s), first mismatch at "
-		    "position %d (of bytes 0..%d)... ",
-		    filename, mismatches, mmpos, pktlengths[irxpkt%NMSGBUF]-1);
-	    fprintf(stderr, "%ld messages were ok previous to this one.\n", msgs_ok);
-	    for(i=0;i<nread;i++) {
-	      fprintf(stderr, "%c", 
-		      rxbuf[irxpkt%NMSGBUF][i] == txbuf[irxpkt%NMSGBUF][i] ? '-' : '+');
-	      if(! (i%60)) fprintf(stderr, "\n");
-	    }
-	    fprintf(stderr, "\n");
-	    int nl=0;
-	    for(i=0;i<nread;i++) {
-	      if(rxbuf[irxpkt%NMSGBUF][i] != txbuf[irxpkt%NMSGBUF][i]) {
-		nl++;
-		fprintf(stderr, "(%d, %d)", rxbuf[irxpkt%NMSGBUF][i], txbuf[irxpkt%NMSGBUF][i]);
-		if(! (nl%10)) fprintf(stderr, "\n");
-	      }
-	    }
-
-	    fprintf(stderr, "\n");
-	    close(filep);
-	    exit(-1);
-	  }
+	uint64_t lat = lh_now_ns() - m->tsend;
+	rtt_record(&rtt, nread, lat);
+	ls_rx(live, nread, lat);
+
+	/* Display statistics */
+	if(verbose) fprintf(stderr, "%s: Read msg %ld (idx %d); %d bytes.\n", filename,
+			    msgs_ok, (int) (irxpkt%winsize), nread);
+	totbytes += nread*2;
+	last_read = nread;
+	msgs_ok++;
+	irxpkt++;
+	tdeadline = mono_seconds() + READ_TIMEOUT_MS/1000.;
+	gettimeofday(&tlatest, NULL);
+	deltasec = (tlatest.tv_sec - tstart.tv_sec) + 1.E-6*(tlatest.tv_usec - tstart.tv_usec);
+	kbps = (((float) totbytes)/1000.) / deltasec;
+	if (dokb && (deltasec > MIN_DT_BEFORE_KBCHECK) && (kbps < (double) kbmin)) {
+	  fprintf(stderr, "%s: Data rate (%2.2f kB/s) dropped below minimum (%d kB/s)!\n",
+		  filename, kbps, kbmin);
+	  close(filep);
+	  exit(-1);
+	}
 
-	  /* Display statistics */
-	  verbose && fprintf(stderr, "%s: Read msg %ld (idx %d); %d bytes.\n", filename, msgs_ok, 
-			     (int) irxpkt%NMSGBUF, nread);
-	  totbytes += nread*2;
-	  last_read = nread;
-	  //printf("totbytes %llu\n", totbytes);
-	  read_retries = 0;
-	  msgs_ok++;
-	  irxpkt++;
-	  gettimeofday(&tlatest, NULL);
-	  deltasec = (tlatest.tv_sec - tstart.tv_sec) + 1.E-6*(tlatest.tv_usec - tstart.tv_usec);
-	  kbps = (((float) totbytes)/1000.) / deltasec;
-	  if (dokb && (deltasec > MIN_DT_BEFORE_KBCHECK) && (kbps < (double) kbmin)) {
-	    fprintf(stderr, "%s: Data rate (%2.2f kB/s) dropped below minimum (%d kB/s)!\n",
-		    filename, kbps, kbmin);
-	    close(filep);
-            exit(-1);
-          }
-
-	  if(verbose || perd(msgs_ok) || msgs_ok >= nummsgs) {
-
-	    //printf("totbytes %llu\n", totbytes);
-	    totmb = ((float) totbytes) / (1024.*1024.);
-
-	    fprintf(stderr,
-		    "%s: %ld msgs "
-		    "(last %dB, %2.2lf MB tot, %2.2lf sec, %2.2lf kB/sec, ARR=%ld)\n",
-		    filename,
-		    msgs_ok, last_read, totmb, deltasec,
-		    kbps, 
-		    read_try_sum/msgs_ok);
-
-	    //fprintf(stderr, "%s: Total of %ld bytes transferred.\n", filename, totbytes);
-	    //fprintf(stderr, "%s: Total of %2.6lf MB transferred.\n", filename, totmb);
-	    //fprintf(stderr, "%s: Data rate of %2.6lf kB/sec.\n", filename, kbps);
-	    //fprintf(stderr, "%s: Got %ld messages.\n", filename, nummsgs);
-	  }
+	if(verbose || perd(msgs_ok) || msgs_ok >= nummsgs) {
+	  totmb = ((float) totbytes) / (1024.*1024.);
 	  if(msgs_ok >= nummsgs) {
-	    fprintf(stderr, "%s: SUCCESS.\n", filename);
-	    exit(0);
+	    rtt_print_table(stderr, filename, &rtt);
+	  } else {
+	    rtt_print_line(stderr, filename, &rtt);
 	  }
-	  if(flowctrl) break; /* Do one read only before stuffing write */
+	  fprintf(stderr,
+		  "%s: %ld msgs "
+		  "(last %dB, %2.2lf MB tot, %2.2lf sec, %2.2lf kB/sec, "
+		  "CPU=%2.4lf s/MB, SYS=%.2f/msg, TXFULL=%.1f%%)\n",
+		  filename,
+		  msgs_ok, last_read, totmb, deltasec,
+		  kbps, 
+		  (cpu_seconds() - cpu0)/totmb,
+		  (double) nsyscalls/msgs_ok,
+		  nwrtry ? 100.*nwrfull/nwrtry : 0.);
 	}
-      } 
-      //fprintf(stderr, "%s: Switching back to write...\n", filename);
-      usleep(1000);
+	if(msgs_ok >= nummsgs) {
+	  fprintf(stderr, "%s: SUCCESS.\n", filename);
+	  ls_finish(live, LS_DONE);
+	  exit(0);
+	}
+	if(flowctrl) break; /* Do one read only before stuffing write */
+	pfd.events = POLLIN;
+	nsyscalls++;
+	if(poll(&pfd, 1, 0) <= 0) break;
+	revents = pfd.revents;
+      }
+
+      /* Write as many records to FIFO as possible */
+      int first = 1;
+      while(itxpkt < nummsgs && (itxpkt - irxpkt) < winsize) {
+	struct msgdesc *m = &window[itxpkt%winsize];
+	m->seq = itxpkt;
+	if(fixpkt) {
+	  m->len = pktlen;
+	} else {
+	  m->len = 1+(int)(((float) maxpkt)*rand()/(RAND_MAX+1.0));
+	}
+	if(mdelay) usleep(mdelay*1000);
+	m->seed = init_tx_buf(txbuf, m->len, pattern);
+
+	/* The poll above already told us about the first write */
+	nwrtry++;
+	if(!first || !(revents & POLLOUT)) {
+	  pfd.events = POLLOUT;
+	  nsyscalls++;
+	  if(poll(&pfd, 1, 0) <= 0) {
+	    nwrfull++;
+	    ls_retry(live, 1);
+	    if(rdelay) usleep(rdelay*1000); /* Wait before read as separate test */
+	    break;       /* Do read cycle */
+	  }
+	}
+	first = 0;
+	nsyscalls++;
+	nbyteswritten = write(filep, txbuf, m->len);
+
+	if(nbyteswritten <= 0) { 
+	  fprintf(stderr,"Write EAGAIN after POLLOUT!\n");
+	  exit(-1);
+	}
+
+	if(nbyteswritten != m->len) {
+	  fprintf(stderr,"%s: Wanted to write %d bytes, but wrote %d.\n",
+		  filename, m->len, nbyteswritten);
+	  exit(-1);
+	}
+
+	m->tsend = lh_now_ns();
+	ls_tx(live, nbyteswritten);
+	/* Start the read clock when the pipeline goes from empty to busy */
+	if(itxpkt == irxpkt) tdeadline = mono_seconds() + READ_TIMEOUT_MS/1000.;
+	msgs_written++;
+	last_written = nbyteswritten;
+	if(verbose) fprintf(stderr,"%s: pkt %ld idx %d; wrote %d bytes.\n", 
+			    filename, itxpkt, (int) (itxpkt%winsize), m->len);
+	itxpkt++;
+      }
     }
     return 0;
   }
@@ -391,32 +540,36 @@ int main(int argc, char *argv[]) {
   while(1) {
     ipkt = 0;
     if(fixpkt) {
-      pktlengths[ipkt] = pktlen;
+      window[ipkt].len = pktlen;
     } else {
-      pktlengths[ipkt] = 1+(int)(((float) bufsiz)*rand()/(RAND_MAX+1.0));
-      //pktlengths[ipkt] = 1+(int)(((float) 4)*rand()/(RAND_MAX+1.0));
-      //pktlengths[ipkt] = 108;
-      //pktlengths[ipkt] = 1;
-      //printf("%s: %d byte message.\n", filename, pktlengths[ipkt]);
+      window[ipkt].len = 1+(int)(((float) bufsiz)*rand()/(RAND_MAX+1.0));
+      //window[ipkt].len = 1+(int)(((float) 4)*rand()/(RAND_MAX+1.0));
+      //window[ipkt].len = 108;
+      //window[ipkt].len = 1;
+      //printf("%s: %d byte message.\n", filename, window[ipkt].len);
 
     }
 
-    if(bufsiz < pktlengths[ipkt]) {
+    if(bufsiz < window[ipkt].len) {
       fprintf(stderr, "Buffer overflow.\n");
       exit(-1);
     }
 
-    init_buffers(txbuf[ipkt], rxbuf[ipkt], pktlengths[ipkt]);
+    window[ipkt].seq  = msgs_written;
+    window[ipkt].seed = init_buffers(txbuf, rxbuf, window[ipkt].len, pattern);
   
     write_ok = 0;
     for(icnt = 0; icnt < MAX_WRITE_RETRIES; icnt++) {
       if(mdelay) usleep(mdelay*1000);
-      nbyteswritten = write(filep,txbuf[ipkt], pktlengths[ipkt]);
+      nbyteswritten = write(filep,txbuf, window[ipkt].len);
       // usleep(100);
       if(nbyteswritten <= 0) {
 	//fprintf(stderr,"%s: EAGAIN\n", filename);
+	ls_retry(live, 1);
 	randsleep(WRITE_DELAY);
       } else {
+	window[ipkt].tsend = lh_now_ns();
+	ls_tx(live, nbyteswritten);
 	if(firstmsg) {
 	  firstmsg = 0;
 	  t1 = time(NULL);
@@ -442,10 +595,11 @@ int main(int argc, char *argv[]) {
     gotreply = 0;
     for(icnt = 0; icnt < MAX_READ_RETRIES; icnt++) {
       read_try_sum++;
-      nread = read(filep, rxbuf[ipkt], bufsiz);
+      nread = read(filep, rxbuf, bufsiz);
       if(nread == -1){ 
 	if(errno == EAGAIN) {
 	  //randsleep(READ_DELAY);
+	  ls_retry(live, 1);
 	  randsleep(READ_DELAY);
 	  continue;
 	} else if(errno == EIO) {
@@ -467,9 +621,12 @@ int main(int argc, char *argv[]) {
 		"wrote %d, read %d bytes.\n",
 		filename, msgs_ok,
 		nbyteswritten, nread);
-	show_buffers_hex(rxbuf[ipkt], txbuf[ipkt], nread, nbyteswritten);
+	show_buffers_hex(rxbuf, txbuf, nread, nbyteswritten);
 	exit(-1);
       } else {
+	uint64_t lat = lh_now_ns() - window[ipkt].tsend;
+	rtt_record(&rtt, nread, lat);
+	ls_rx(live, nread, lat);
 	gotreply = 1;
 	break;
       }
@@ -478,16 +635,14 @@ int main(int argc, char *argv[]) {
     if(check_data) {
       if(gotreply) {
 	//      fprintf(stderr, "\nGot %d byte reply from DOM!\n", nread);
-	for(i=0;i<nread;i++) {
-	  if(rxbuf[ipkt][i] != txbuf[ipkt][i]) {
-	    fprintf(stderr, "Message mismatch after %ld messages "
-		    "on %s at position %d.\n",
-		    msgs_ok,
-		    filename,
-		    i);
-	    show_buffers_hex(rxbuf[ipkt], txbuf[ipkt], nread, nbyteswritten);
-	    exit(-1);
-	  }
+	if((i = pg_mismatch(rxbuf, txbuf, nread)) >= 0) {
+	  fprintf(stderr, "Message mismatch after %ld messages "
+		  "on %s at position %d.\n",
+		  msgs_ok,
+		  filename,
+		  i);
+	  show_buffers_hex(rxbuf, txbuf, nread, nbyteswritten);
+	  exit(-1);
 	}
 	//fprintf(stderr,"\n");
 	
@@ -521,6 +676,7 @@ int main(int argc, char *argv[]) {
 
     if(verbose || perd(msgs_ok) || msgs_ok >= nummsgs) {
       next_cnt *= 2;
+      rtt_print_line(stderr, filename, &rtt);
       fprintf(stderr,
 	      "%s: %ld msgs "
 	      "(last %dB, %2.2lf MB tot, %2.2lf sec, %2.2lf kB/sec, avg_rd_retries %ld)",
@@ -537,6 +693,7 @@ int main(int argc, char *argv[]) {
     }
     if(msgs_written >= nummsgs) break;
   }
+  rtt_print_table(stderr, filename, &rtt);
   fprintf(stderr,
 	  "%s: %ld msgs "
 	  "(last %dB, %2.2lf MB tot, %2.2lf sec, %2.2lf kB/sec, %d:%d:%d errors)  ",
@@ -546,12 +703,951 @@ int main(int argc, char *argv[]) {
 	  length_errors, contents_errors, readtimeouts);
   fprintf(stderr,"\nClosing file.\n");
   close(filep);
+  ls_finish(live, LS_DONE);
   fprintf(stderr, "SUCCESS\n");
   fprintf(stderr, "Done.\n");
   
   return 0;
 }
 
+void report_mismatch(char *filename, unsigned char *rxbuf, unsigned char *txbuf,
+		     int nread, long msgs_ok) {
+  /* Show where RX and TX copies of a message differ */
+  int i;
+  int mismatches = 0;
+  int mmpos      = pg_mismatch(rxbuf, txbuf, nread);
+  for(i=mmpos;i<nread;i++) if(rxbuf[i] != txbuf[i]) mismatches++;
+  fprintf(stderr, "%s: Message mismatch in %d place(s), first mismatch at "
+	  "position %d (of bytes 0..%d)... ",
+	  filename, mismatches, mmpos, nread-1);
+  fprintf(stderr, "%ld messages were ok previous to this one.\n", msgs_ok);
+  for(i=0;i<nread;i++) {
+    fprintf(stderr, "%c", rxbuf[i] == txbuf[i] ? '-' : '+');
+    if(! (i%60)) fprintf(stderr, "\n");
+  }
+  fprintf(stderr, "\n");
+  int nl=0;
+  for(i=0;i<nread;i++) {
+    if(rxbuf[i] != txbuf[i]) {
+      nl++;
+      fprintf(stderr, "(%d, %d)", rxbuf[i], txbuf[i]);
+      if(! (nl%10)) fprintf(stderr, "\n");
+    }
+  }
+  fprintf(stderr, "\n");
+}
+
+int check_reply(char *filename, struct msgdesc *m, int pattern, unsigned char *rxbuf,
+		unsigned char *expbuf, int nread, long itxpkt, long irxpkt, long msgs_ok) {
+  /* Regenerate message m into expbuf and compare the reply with it.
+     Returns nonzero, after showing the damage, if they differ. */
+  pg_fill(expbuf, m->len, pattern, m->seed);
+  if(nread != m->len) {
+    fprintf(stderr, "%s: Message length mismatch (TXed %ld msgs, RXed %ld).  "
+	    "Wanted %d bytes, got %d.\n",
+	    filename, itxpkt, irxpkt, m->len, nread);
+    show_buffers_hex(rxbuf, expbuf, nread, m->len);
+    return 1;
+  }
+  if(pg_mismatch(rxbuf, expbuf, nread) >= 0) {
+    report_mismatch(filename, rxbuf, expbuf, nread, msgs_ok);
+    return 1;
+  }
+  return 0;
+}
+
+/************* Multi-DOM (-D) stuffing engine ******************/
+
+/* Per-DOM state.  Each DOM gets its own window of message
+   descriptors; the TX and RX buffers are shared by all DOMs since
+   messages are written as soon as they are made and checked as soon
+   as they are read.  The io_uring backend is the exception: the
+   kernel fills and drains its buffers later, so each DOM has its own. */
+struct rwdom {
+  struct dh_dom dom;
+  char   comstat[DH_PATHLEN];
+  int    fd;
+  int    done, failed;
+  long   itxpkt, irxpkt, msgs_ok;
+  int    last_read;
+  unsigned long long totbytes;
+  struct timeval tlast;             /* Time of last reply (or of start) */
+  unsigned int   events;            /* epoll events currently registered */
+  struct rtthist rtt;
+  struct msgdesc *window;           /* cf->winsize in-flight messages */
+  unsigned char  *urbuf;            /* io_uring read buffers, then write buffers */
+  int    nrd, nwr;                  /* io_uring reads/writes left in current chains */
+  long   wrfirst;                   /* Message number of the current write chain's first */
+  struct ls_slot *live;             /* moatstat counters */
+};
+
+static float tvdiff(struct timeval *t1, struct timeval *t0) {
+  return (t1->tv_sec - t0->tv_sec) + 1.E-6*(t1->tv_usec - t0->tv_usec);
+}
+
+static void multi_fail(int epfd, struct rwdom *d, int *nactive) {
+  /* Dump diagnostics for a failed DOM and take it out of the loop;
+     the remaining DOMs keep running.  epfd is -1 for io_uring. */
+  rtt_print_table(stderr, d->dom.devfile, &d->rtt);
+  if(d->dom.icard >= 0) {
+    fprintf(stderr, "Contents of FPGA for card %d:\n", d->dom.icard);
+    show_fpga(d->dom.icard);
+    fprintf(stderr, "Contents of comstat proc file %s:\n", d->comstat);
+    showcomstat(d->comstat);
+  }
+  if(epfd >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, d->fd, NULL);
+  close(d->fd);
+  ls_error(d->live);
+  ls_finish(d->live, LS_FAILED);
+  d->done = d->failed = 1;
+  (*nactive)--;
+}
+
+static void multi_finish(int epfd, struct rwdom *d, int *nactive) {
+  if(epfd >= 0) epoll_ctl(epfd, EPOLL_CTL_DEL, d->fd, NULL);
+  close(d->fd);
+  ls_finish(d->live, LS_DONE);
+  d->done = 1;
+  (*nactive)--;
+}
+
+static void multi_update_events(int epfd, struct rwdom *d, struct rwconf *cf) {
+  /* Only ask for POLLOUT while there is room in the TX window */
+  unsigned int want = EPOLLIN;
+  if(d->itxpkt < cf->nummsgs && (d->itxpkt - d->irxpkt) < cf->winsize) want |= EPOLLOUT;
+  if(want == d->events) return;
+  struct epoll_event ev;
+  ev.events   = want;
+  ev.data.ptr = d;
+  nsyscalls++;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, d->fd, &ev);
+  d->events = want;
+}
+
+static struct msgdesc *multi_next_msg(struct rwdom *d, struct rwconf *cf,
+				      unsigned char *buf) {
+  /* Make d's next message in buf and enter it in d's window */
+  struct msgdesc *m = &d->window[d->itxpkt%cf->winsize];
+  m->seq = d->itxpkt;
+  if(cf->fixpkt) {
+    m->len = cf->pktlen;
+  } else {
+    m->len = 1+(int)(((float) cf->maxpkt)*rand()/(RAND_MAX+1.0));
+  }
+  m->seed = init_tx_buf(buf, m->len, cf->pattern);
+  return m;
+}
+
+static int multi_write(struct rwdom *d, struct rwconf *cf) {
+  /* Write as many messages as the TX FIFO and window will take.
+     Returns nonzero on failure. */
+  struct pollfd pfd;
+  pfd.fd = d->fd;
+  int first = 1;
+  while(d->itxpkt < cf->nummsgs && (d->itxpkt - d->irxpkt) < cf->winsize) {
+    nwrtry++;
+    if(!first) {
+      pfd.events = POLLOUT;
+      nsyscalls++;
+      if(!poll(&pfd, 1, 0)) {
+	nwrfull++;
+	ls_retry(d->live, 1);
+	break;
+      }
+    }
+    first = 0;
+    struct msgdesc *m = multi_next_msg(d, cf, txbuf);
+    nsyscalls++;
+    int nw = write(d->fd, txbuf, m->len);
+    if(nw < 0 && errno == EAGAIN) {
+      nwrfull++;
+      ls_retry(d->live, 1);
+      break;
+    }
+    if(nw <= 0) {
+      fprintf(stderr, "%s: Write failed after POLLOUT (%d %s)!\n", d->dom.devfile,
+	      errno, strerror(errno));
+      return 1;
+    }
+    if(nw != m->len) {
+      fprintf(stderr,"%s: Wanted to write %d bytes, but wrote %d.\n",
+	      d->dom.devfile, m->len, nw);
+      return 1;
+    }
+    m->tsend = lh_now_ns();
+    ls_tx(d->live, nw);
+    if(cf->verbose) fprintf(stderr,"%s: pkt %ld idx %d; wrote %d bytes.\n",
+	    d->dom.devfile, d->itxpkt, (int) (d->itxpkt%cf->winsize), nw);
+    d->itxpkt++;
+  }
+  return 0;
+}
+
+static int multi_reply(struct rwdom *d, struct rwconf *cf, unsigned char *rxbuf,
+		       int nread, struct timeval *tstart) {
+  /* Check and account for one reply.  Returns nonzero on failure. */
+  if(d->irxpkt >= d->itxpkt) {
+    fprintf(stderr, "%s: Got unexpected %d byte message (TXed %ld msgs, RXed %ld).\n",
+	    d->dom.devfile, nread, d->itxpkt, d->irxpkt);
+    return 1;
+  }
+  struct msgdesc *m = &d->window[d->irxpkt%cf->winsize];
+  if(check_reply(d->dom.devfile, m, cf->pattern, rxbuf, expbuf, nread, d->itxpkt,
+		 d->irxpkt, d->msgs_ok)) return 1;
+
+  uint64_t lat = lh_now_ns() - m->tsend;
+  rtt_record(&d->rtt, nread, lat);
+  ls_rx(d->live, nread, lat);
+  d->totbytes += nread*2;
+  d->last_read = nread;
+  d->msgs_ok++;
+  d->irxpkt++;
+  gettimeofday(&d->tlast, NULL);
+  float deltasec = tvdiff(&d->tlast, tstart);
+  double kbps = (((float) d->totbytes)/1000.) / deltasec;
+  if(cf->dokb && (deltasec > MIN_DT_BEFORE_KBCHECK) && (kbps < (double) cf->kbmin)) {
+    fprintf(stderr, "%s: Data rate (%2.2f kB/s) dropped below minimum (%d kB/s)!\n",
+	    d->dom.devfile, kbps, cf->kbmin);
+    return 1;
+  }
+  if(cf->verbose || perd(d->msgs_ok) || d->msgs_ok >= cf->nummsgs) {
+    if(d->msgs_ok >= cf->nummsgs) {
+      rtt_print_table(stderr, d->dom.devfile, &d->rtt);
+    } else {
+      rtt_print_line(stderr, d->dom.devfile, &d->rtt);
+    }
+    fprintf(stderr,
+	    "%s: %ld msgs "
+	    "(last %dB, %2.2lf MB tot, %2.2lf sec, %2.2lf kB/sec)\n",
+	    d->dom.devfile, d->msgs_ok, d->last_read,
+	    ((float) d->totbytes) / (1024.*1024.), deltasec, kbps);
+  }
+  return 0;
+}
+
+static int multi_read(struct rwdom *d, struct rwconf *cf, unsigned char *rxbuf,
+		      struct timeval *tstart) {
+  /* Read and check one reply.  Returns nonzero on failure. */
+  nsyscalls++;
+  int nread = read(d->fd, rxbuf, cf->bufsiz);
+  if(nread < 0 && errno == EAGAIN) return 0;
+  if(nread <= 0) {
+    fprintf(stderr, "%s: read error after POLLIN! nread=%d errno=%d\n",
+	    d->dom.devfile, nread, errno);
+    return 1;
+  }
+  return multi_reply(d, cf, rxbuf, nread, tstart);
+}
+
+static void multi_check_timeouts(struct rwdom *dl, int ndoms, int epfd, int *nactive) {
+  /* Time out DOMs which have owed us a reply for too long */
+  struct timeval tnow;
+  int i;
+  gettimeofday(&tnow, NULL);
+  for(i=0; i<ndoms; i++) {
+    struct rwdom *d = &dl[i];
+    if(d->done || d->itxpkt == d->irxpkt) continue;
+    if(tvdiff(&tnow, &d->tlast)*1000. > READ_TIMEOUT_MS) {
+      fprintf(stderr, "%s: Timeout (> %d msec) on read.\n", d->dom.devfile,
+	      READ_TIMEOUT_MS);
+      if(d->msgs_ok == 0) {
+	fprintf(stderr, "%s: Didn't read any messages back.\n", d->dom.devfile);
+      } else {
+	fprintf(stderr, "%s: Only read %ld messages successfully.\n", d->dom.devfile,
+		d->msgs_ok);
+      }
+      multi_fail(epfd, d, nactive);
+    }
+  }
+}
+
+static int multi_poll_loop(struct rwdom *dl, int ndoms, struct rwconf *cf,
+			   struct timeval *tstart) {
+  /* epoll backend: read whatever is ready, then write until the TX
+     FIFO or window is full */
+  struct epoll_event *evs = calloc(ndoms, sizeof(struct epoll_event));
+  if(evs == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  int epfd = epoll_create(ndoms);
+  if(epfd == -1) {
+    perror("epoll_create");
+    return -1;
+  }
+
+  int i;
+  int nactive = 0;
+  for(i=0; i<ndoms; i++) {
+    struct rwdom *d = &dl[i];
+    struct epoll_event ev;
+    ev.events   = d->events = EPOLLIN;
+    ev.data.ptr = d;
+    if(epoll_ctl(epfd, EPOLL_CTL_ADD, d->fd, &ev)) {
+      fprintf(stderr, "%s: ", d->dom.devfile);
+      perror("epoll_ctl");
+      return -1;
+    }
+    nactive++;
+    if(cf->nummsgs == 0) {
+      multi_finish(epfd, d, &nactive);
+    } else {
+      multi_update_events(epfd, d, cf);
+    }
+  }
+
+  while(nactive > 0) {
+    nsyscalls++;
+    int nev = epoll_wait(epfd, evs, ndoms, MULTI_WAIT_MS);
+    if(nev < 0 && errno != EINTR) {
+      perror("epoll_wait");
+      return -1;
+    }
+    for(i=0; i<nev; i++) {
+      struct rwdom *d = evs[i].data.ptr;
+      if(d->done) continue;
+      if(evs[i].events & (EPOLLIN|EPOLLERR|EPOLLHUP)) {
+	if(multi_read(d, cf, rxbuf, tstart)) {
+	  multi_fail(epfd, d, &nactive);
+	  continue;
+	}
+	if(d->msgs_ok >= cf->nummsgs) {
+	  fprintf(stderr, "%s: SUCCESS.\n", d->dom.devfile);
+	  multi_finish(epfd, d, &nactive);
+	  continue;
+	}
+      }
+      if(evs[i].events & EPOLLOUT) {
+	if(multi_write(d, cf)) {
+	  multi_fail(epfd, d, &nactive);
+	  continue;
+	}
+      }
+      multi_update_events(epfd, d, cf);
+    }
+    multi_check_timeouts(dl, ndoms, epfd, &nactive);
+  }
+  close(epfd);
+  free(evs);
+  return 0;
+}
+
+/* io_uring backend.  Each DOM has at most one chain of poll+read pairs
+   and one chain of poll+write pairs in flight.  The chains are
+   hard-linked, so messages go out and are read back in order, and a
+   short read doesn't cancel the rest of its chain; a new chain is
+   started once the last one has completed.  Completions for all DOMs
+   are reaped in a batch, and the next chains go in with the same
+   io_uring_enter() that waits for more. */
+
+#define UR_RDPOLL  0
+#define UR_READ    1
+#define UR_WRPOLL  2
+#define UR_WRITE   3
+#define UR_TIMEOUT (~0ULL)
+#define UR_DATA(idom, slot, op) (((uint64_t) (idom) << 16) | ((slot) << 2) | (op))
+
+static void ur_chain_pair(struct uring *ur, int fd, int op, unsigned events,
+			  unsigned char *buf, int len, uint64_t data, int last) {
+  /* Queue poll-then-op, linked to whatever follows unless last; the
+     caller has ur_reserve()d room for the whole chain */
+  struct io_uring_sqe *sqe = ur_get_sqe(ur);
+  ur_prep_poll(sqe, fd, events,
+	       (data & ~3ULL) | (op == IORING_OP_WRITE ? UR_WRPOLL : UR_RDPOLL));
+  sqe->flags = IOSQE_IO_HARDLINK;
+  sqe = ur_get_sqe(ur);
+  ur_prep_rw(sqe, op, fd, buf, len, data);
+  if(!last) sqe->flags = IOSQE_IO_HARDLINK;
+}
+
+static int ur_arm_timeout(struct uring *ur, struct __kernel_timespec *wait) {
+  int err = ur_reserve(ur, 1);
+  if(err) {
+    fprintf(stderr, "io_uring: can't queue timeout (%s).\n", strerror(-err));
+    return -1;
+  }
+  ur_prep_timeout(ur_get_sqe(ur), wait, UR_TIMEOUT);
+  return 0;
+}
+
+static int multi_uring_loop(struct rwdom *dl, int ndoms, struct rwconf *cf,
+			    struct timeval *tstart) {
+  /* Returns 1, having done nothing, if io_uring isn't usable here */
+  struct uring ur;
+  int depth = cf->uring < cf->winsize ? cf->uring : cf->winsize;
+  int err   = ur_init(&ur, 4*depth*ndoms + 1);
+  int i, k;
+  if(err) {
+    fprintf(stderr, "io_uring isn't available (%s); using poll.\n", strerror(-err));
+    return 1;
+  }
+
+  int nactive = ndoms;
+  for(i=0; i<ndoms; i++) {
+    struct rwdom *d = &dl[i];
+    d->urbuf = malloc((size_t) 2*depth*cf->bufsiz);
+    if(d->urbuf == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    if(cf->nummsgs == 0) multi_finish(-1, d, &nactive);
+  }
+
+  /* Wake up regularly to check for timeouts */
+  struct __kernel_timespec wait = { 0, MULTI_WAIT_MS*1000000LL };
+  if(ur_arm_timeout(&ur, &wait)) return -1;
+
+  while(nactive > 0) {
+    for(i=0; i<ndoms; i++) {
+      struct rwdom *d = &dl[i];
+      if(d->done) continue;
+      if(d->nrd == 0 && d->irxpkt < cf->nummsgs) {
+	int n = cf->nummsgs - d->irxpkt < depth ? cf->nummsgs - d->irxpkt : depth;
+	if((err = ur_reserve(&ur, 2*n)) != 0) {
+	  fprintf(stderr, "%s: can't queue reads (%s)!\n", d->dom.devfile, strerror(-err));
+	  multi_fail(-1, d, &nactive);
+	  continue;
+	}
+	for(k=0; k<n; k++) {
+	  ur_chain_pair(&ur, d->fd, IORING_OP_READ, POLLIN, d->urbuf + k*cf->bufsiz,
+			cf->bufsiz, UR_DATA(i, k, UR_READ), k == n-1);
+	}
+	d->nrd = n;
+      }
+      if(d->nwr == 0) {
+	int n = depth;
+	if(n > cf->nummsgs - d->itxpkt) n = cf->nummsgs - d->itxpkt;
+	if(n > cf->winsize - (d->itxpkt - d->irxpkt)) n = cf->winsize - (d->itxpkt - d->irxpkt);
+	if((err = ur_reserve(&ur, 2*n)) != 0) {
+	  fprintf(stderr, "%s: can't queue writes (%s)!\n", d->dom.devfile, strerror(-err));
+	  multi_fail(-1, d, &nactive);
+	  continue;
+	}
+	d->wrfirst = d->itxpkt;
+	for(k=0; k<n; k++) {
+	  unsigned char *buf = d->urbuf + (depth+k)*cf->bufsiz;
+	  struct msgdesc *m = multi_next_msg(d, cf, buf);
+	  ur_chain_pair(&ur, d->fd, IORING_OP_WRITE, POLLOUT, buf, m->len,
+			UR_DATA(i, k, UR_WRITE), k == n-1);
+	  d->itxpkt++;
+	}
+	d->nwr = n;
+      }
+    }
+
+    nsyscalls++;
+    err = ur_submit_and_wait(&ur, 1);
+    if(err < 0 && err != -EINTR) {
+      fprintf(stderr, "io_uring_enter: %s\n", strerror(-err));
+      return -1;
+    }
+
+    struct io_uring_cqe *cqe;
+    while((cqe = ur_peek_cqe(&ur)) != NULL) {
+      uint64_t data = cqe->user_data;
+      int res = cqe->res;
+      ur_cqe_seen(&ur);
+      if(data == UR_TIMEOUT) {
+	if(ur_arm_timeout(&ur, &wait)) return -1;
+	continue;
+      }
+      struct rwdom *d = &dl[data >> 16];
+      int slot = (data >> 2) & 0x3FFF;
+      int op   = data & 3;
+      if(op == UR_READ)  d->nrd--;
+      if(op == UR_WRITE) d->nwr--;
+      if(d->done) continue;
+      if(op == UR_RDPOLL || op == UR_WRPOLL) {
+	if(res < 0) {
+	  fprintf(stderr, "%s: poll failed (%s)!\n", d->dom.devfile, strerror(-res));
+	  multi_fail(-1, d, &nactive);
+	}
+      } else if(op == UR_READ) {
+	if(res <= 0) {
+	  fprintf(stderr, "%s: read error after POLLIN! nread=%d errno=%d\n",
+		  d->dom.devfile, res < 0 ? -1 : 0, res < 0 ? -res : 0);
+	  multi_fail(-1, d, &nactive);
+	} else if(multi_reply(d, cf, d->urbuf + slot*cf->bufsiz, res, tstart)) {
+	  multi_fail(-1, d, &nactive);
+	} else if(d->msgs_ok >= cf->nummsgs) {
+	  fprintf(stderr, "%s: SUCCESS.\n", d->dom.devfile);
+	  multi_finish(-1, d, &nactive);
+	}
+      } else {
+	struct msgdesc *m = &d->window[(d->wrfirst + slot)%cf->winsize];
+	if(res != m->len) {
+	  if(res < 0) {
+	    fprintf(stderr, "%s: Write failed after POLLOUT (%d %s)!\n", d->dom.devfile,
+		    -res, strerror(-res));
+	  } else {
+	    fprintf(stderr,"%s: Wanted to write %d bytes, but wrote %d.\n",
+		    d->dom.devfile, m->len, res);
+	  }
+	  multi_fail(-1, d, &nactive);
+	} else {
+	  /* Timed from when the write is done, as the other backends do,
+	     not from when it was queued behind a full FIFO */
+	  m->tsend = lh_now_ns();
+	  ls_tx(d->live, res);
+	  if(cf->verbose) fprintf(stderr,"%s: pkt %ld idx %d; wrote %d bytes.\n",
+				  d->dom.devfile, m->seq, (int) (m->seq%cf->winsize), res);
+	}
+      }
+    }
+    multi_check_timeouts(dl, ndoms, -1, &nactive);
+  }
+
+  ur_exit(&ur); /* Cancels what's left, so the buffers can go */
+  for(i=0; i<ndoms; i++) free(dl[i].urbuf);
+  return 0;
+}
+
+static struct rwdom *multi_open(struct rwconf *cf, int *ndomsp) {
+  /* Open every DOM in cf->domset, set echo mode if asked and drain
+     stale messages.  Returns NULL, having said why, on failure. */
+  struct dh_dom doms[DH_MAXDOMS];
+  int ndoms = dh_parse_domset(cf->domset, doms, DH_MAXDOMS);
+  if(ndoms < 0) {
+    fprintf(stderr, "Bad DOM set '%s'.\n", cf->domset);
+    usage();
+    return NULL;
+  }
+  if(ndoms == 0) {
+    fprintf(stderr, "No DOMs found for DOM set '%s'.\n", cf->domset);
+    return NULL;
+  }
+  if(cf->bufsiz <= 0 || cf->bufsiz > MAX_MSG_BYTES) {
+    fprintf(stderr, "Bad buffer size %d.\n", cf->bufsiz);
+    return NULL;
+  }
+  if(cf->maxpkt < 1 || cf->maxpkt > cf->bufsiz) cf->maxpkt = cf->bufsiz;
+
+  struct rwdom *dl = calloc(ndoms, sizeof(struct rwdom));
+  if(dl == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return NULL;
+  }
+
+  fprintf(stderr, "Will send/recv %ld messages to each of %d devices.\n",
+	  cf->nummsgs, ndoms);
+
+  int i;
+  for(i=0; i<ndoms; i++) {
+    struct rwdom *d = &dl[i];
+    d->dom = doms[i];
+    dh_path(d->comstat, DH_PATHLEN, DH_PROCDIR "/card%d/pair%d/dom%c/comstat",
+	    d->dom.icard, d->dom.ipair, d->dom.cdom);
+    d->fd = dh_open_dev(d->dom.devfile, O_RDWR);
+    if(d->fd < 0) {
+      fprintf(stderr,"Can't open file %s ", d->dom.devfile);
+      perror(":");
+      return NULL;
+    }
+    d->window = malloc(cf->winsize*sizeof(struct msgdesc));
+    if(d->window == NULL) {
+      fprintf(stderr, "Out of memory.\n");
+      return NULL;
+    }
+    if(d->dom.icard >= 0)
+      d->live = ls_attach_dom(LS_READWRITE, d->dom.icard, d->dom.ipair, d->dom.cdom);
+    if(cf->dosetecho) {
+      char em[] = "echo-mode\r";
+      if(write(d->fd, em, strlen(em)) != strlen(em)) {
+	fprintf(stderr, "%s: Couldn't set echo mode, write failed.\n", d->dom.devfile);
+	return NULL;
+      }
+    }
+  }
+
+  /* Drain stale messages from all DOMs at once, rather than waiting
+     out each DOM in turn */
+  struct timeval tstart, tnow;
+  gettimeofday(&tstart, NULL);
+  do {
+    for(i=0; i<ndoms; i++) drain_stale_messages(dl[i].fd, cf->bufsiz, 0, cf->waitval);
+    gettimeofday(&tnow, NULL);
+  } while((cf->dowait || cf->dosetecho) && tvdiff(&tnow, &tstart) < cf->waitval);
+
+  *ndomsp = ndoms;
+  return dl;
+}
+
+static int multi_summary(struct rwdom *dl, int ndoms, struct timeval *tstart, double cpu0,
+			 const char *backend) {
+  /* Per DOM and aggregate results; frees dl.  Returns 0 if every DOM
+     succeeded. */
+  struct timeval tnow;
+  gettimeofday(&tnow, NULL);
+  float deltasec = tvdiff(&tnow, tstart);
+  unsigned long long totbytes = 0;
+  long totmsgs = 0;
+  int nfailed  = 0;
+  int i;
+  for(i=0; i<ndoms; i++) {
+    struct rwdom *d = &dl[i];
+    float dsec = tvdiff(&d->tlast, tstart);
+    fprintf(stderr, "%s: %ld msgs, %2.2lf MB tot, %2.2lf sec, %2.2lf kB/sec%s\n",
+	    d->dom.devfile, d->msgs_ok, ((float) d->totbytes) / (1024.*1024.), dsec,
+	    dsec > 0 ? (((float) d->totbytes)/1000.) / dsec : 0.,
+	    d->failed ? " FAILED" : "");
+    totbytes += d->totbytes;
+    totmsgs  += d->msgs_ok;
+    nfailed  += d->failed;
+    free(d->window);
+  }
+  double totmb = ((float) totbytes) / (1024.*1024.);
+  char txfull[32] = "";
+  if(nwrtry > 0) snprintf(txfull, sizeof(txfull), ", TXFULL=%.1f%%", 100.*nwrfull/nwrtry);
+  fprintf(stderr, "ALL: %d DOMs (%d failed), %ld msgs, %2.2lf MB tot, %2.2lf sec, "
+	  "%2.2lf kB/sec, CPU=%2.4lf s/MB, SYS=%.2f/msg%s (%s)\n",
+	  ndoms, nfailed, totmsgs, totmb, deltasec,
+	  deltasec > 0 ? (((float) totbytes)/1000.) / deltasec : 0.,
+	  totmb > 0 ? (cpu_seconds() - cpu0)/totmb : 0.,
+	  totmsgs > 0 ? (double) nsyscalls/totmsgs : 0., txfull, backend);
+  free(dl);
+  if(nfailed) {
+    fprintf(stderr, "FAILURE\n");
+    return -1;
+  }
+  fprintf(stderr, "SUCCESS\n");
+  return 0;
+}
+
+int run_multi(struct rwconf *cf) {
+  int i, ndoms;
+  struct rwdom *dl = multi_open(cf, &ndoms);
+  if(dl == NULL) return -1;
+
+  struct timeval tstart;
+  double cpu0 = cpu_seconds();
+  gettimeofday(&tstart, NULL);
+  for(i=0; i<ndoms; i++) dl[i].tlast = tstart;
+
+  const char *backend = "io_uring";
+  int rc = 1;
+  if(cf->uring) rc = multi_uring_loop(dl, ndoms, cf, &tstart);
+  if(rc > 0) {
+    backend = "poll";
+    rc = multi_poll_loop(dl, ndoms, cf, &tstart);
+  }
+  if(rc < 0) return -1;
+  return multi_summary(dl, ndoms, &tstart, cpu0, backend);
+}
+
+/************* Threaded (-T) engine ******************/
+
+/* A writer and a reader thread per DOM, so the TX FIFO is refilled
+   while replies are being checked.  They share the DOM's window as a
+   lock-free single-producer, single-consumer ring: the writer fills in
+   a descriptor, writes the message and then publishes it by advancing
+   head, and the reader releases it by advancing tail once the reply
+   has been checked.  A writer with a full window sleeps on the wake
+   futex, which the reader bumps after advancing tail if it sees the
+   writer waiting; otherwise the reader makes no system call for it. */
+struct mdring {
+  struct msgdesc *slot;
+  long size;
+  long head __attribute__((aligned(64)));   /* Written by the writer only */
+  long tail __attribute__((aligned(64)));   /* Written by the reader only */
+  uint32_t wake;                            /* Futex word, bumped by the reader */
+  int  wwait;                               /* Writer is (about to be) asleep */
+};
+
+static void ring_wait(struct mdring *r, long itx) {
+  /* Writer: sleep until the reader frees a slot, or MULTI_WAIT_MS so
+     the caller can check for a stop.  wwait is set before tail is
+     looked at again, and the reader advances tail before looking at
+     wwait, so one of them sees the other. */
+  struct timespec ts = { 0, MULTI_WAIT_MS*1000000L };
+  uint32_t seen = __atomic_load_n(&r->wake, __ATOMIC_ACQUIRE);
+  __atomic_store_n(&r->wwait, 1, __ATOMIC_SEQ_CST);
+  if(itx - __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) >= r->size)
+    syscall(SYS_futex, &r->wake, FUTEX_WAIT_PRIVATE, seen, &ts, NULL, 0);
+  __atomic_store_n(&r->wwait, 0, __ATOMIC_RELAXED);
+}
+
+static void ring_release(struct mdring *r, long irx) {
+  /* Reader: free slot irx, waking the writer if it's waiting for one */
+  __atomic_store_n(&r->tail, irx+1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&r->wwait, __ATOMIC_SEQ_CST)) {
+    __atomic_add_fetch(&r->wake, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &r->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+  }
+}
+
+struct rwthr {
+  struct rwdom  *d;
+  struct rwconf *cf;
+  struct timeval *tstart;
+  struct mdring ring;
+  struct pg_rng rng;                /* Writer's payload seeds and lengths */
+  pthread_t wr, rd;
+  int    cpu_wr, cpu_rd;            /* -1 if not pinned */
+  volatile int stop;                /* Set by either thread when it gives up */
+  int    wrdone;                    /* Writer has returned */
+  long   nsys_wr, nsys_rd;
+  long   nwrtry, nwrfull;
+  unsigned char txbuf[MAX_MSG_BYTES];
+  unsigned char rxbuf[MAX_MSG_BYTES];
+  unsigned char expbuf[MAX_MSG_BYTES];
+};
+
+static void pin_thread(int cpu) {
+  cpu_set_t set;
+  if(cpu < 0) return;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if(pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    fprintf(stderr, "Couldn't pin thread to CPU %d.\n", cpu);
+}
+
+static void *thr_writer(void *arg) {
+  struct rwthr  *t  = arg;
+  struct rwdom  *d  = t->d;
+  struct rwconf *cf = t->cf;
+  struct mdring *r  = &t->ring;
+  struct pollfd pfd;
+  long itx;
+  pin_thread(t->cpu_wr);
+  pfd.fd = d->fd;
+  pfd.events = POLLOUT;
+  for(itx=0; itx < cf->nummsgs && !t->stop; ) {
+    if(itx - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= r->size) {
+      t->nsys_wr++;
+      ring_wait(r, itx); /* Window full; wait for the reader */
+      continue;
+    }
+    struct msgdesc *m = &r->slot[itx%r->size];
+    m->seq  = itx;
+    m->seed = pg_next(&t->rng);
+    m->len  = cf->fixpkt ? cf->pktlen : 1 + (int) (pg_next(&t->rng)%cf->maxpkt);
+    pg_fill(t->txbuf, m->len, cf->pattern, m->seed);
+
+    /* Wait for room in the TX FIFO, noting whether we had to */
+    t->nwrtry++;
+    t->nsys_wr++;
+    if(poll(&pfd, 1, 0) <= 0) {
+      t->nwrfull++;
+      while(!t->stop) {
+	t->nsys_wr++;
+	if(poll(&pfd, 1, MULTI_WAIT_MS) > 0) break;
+      }
+      if(t->stop) break;
+    }
+    int nw;
+    do {
+      t->nsys_wr++;
+      nw = write(d->fd, t->txbuf, m->len);
+      if(nw < 0 && errno == EAGAIN) {
+	t->nwrfull++;
+	t->nsys_wr++;
+	poll(&pfd, 1, MULTI_WAIT_MS);
+      }
+    } while(nw < 0 && errno == EAGAIN && !t->stop);
+    if(t->stop) break;
+    if(nw != m->len) {
+      if(nw < 0) {
+	fprintf(stderr, "%s: Write failed after POLLOUT (%d %s)!\n", d->dom.devfile,
+		errno, strerror(errno));
+      } else {
+	fprintf(stderr,"%s: Wanted to write %d bytes, but wrote %d.\n",
+		d->dom.devfile, m->len, nw);
+      }
+      d->failed = 1;
+      t->stop   = 1;
+      break;
+    }
+    /* Timed from when the write is done, as the other backends do */
+    m->tsend = lh_now_ns();
+    __atomic_store_n(&r->head, itx+1, __ATOMIC_RELEASE);
+    if(cf->verbose) fprintf(stderr,"%s: pkt %ld idx %d; wrote %d bytes.\n",
+			    d->dom.devfile, itx, (int) (itx%r->size), nw);
+    itx++;
+  }
+  __atomic_store_n(&t->wrdone, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void *thr_reader(void *arg) {
+  struct rwthr  *t  = arg;
+  struct rwdom  *d  = t->d;
+  struct rwconf *cf = t->cf;
+  struct mdring *r  = &t->ring;
+  struct pollfd pfd;
+  struct timeval tnow;
+  pin_thread(t->cpu_rd);
+  pfd.fd = d->fd;
+  pfd.events = POLLIN;
+  while(d->msgs_ok < cf->nummsgs && !t->stop) {
+    long irx  = r->tail;
+    long itx  = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    t->nsys_rd++;
+    int np = poll(&pfd, 1, MULTI_WAIT_MS);
+    if(np <= 0) {
+      gettimeofday(&tnow, NULL);
+      if(itx > irx && tvdiff(&tnow, &d->tlast)*1000. > READ_TIMEOUT_MS) {
+	fprintf(stderr, "%s: Timeout (> %d msec) on read.\n", d->dom.devfile,
+		READ_TIMEOUT_MS);
+	fprintf(stderr, "%s: Only read %ld messages successfully.\n", d->dom.devfile,
+		d->msgs_ok);
+	break;
+      }
+      continue;
+    }
+    t->nsys_rd++;
+    int nread = read(d->fd, t->rxbuf, cf->bufsiz);
+    if(nread < 0 && errno == EAGAIN) continue;
+    if(nread <= 0) {
+      fprintf(stderr, "%s: read error after POLLIN! nread=%d errno=%d\n",
+	      d->dom.devfile, nread, errno);
+      break;
+    }
+    /* A reply can beat the writer's publishing of its message, which
+       comes just after write() returns */
+    itx = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while(irx >= itx && !t->stop && !__atomic_load_n(&t->wrdone, __ATOMIC_ACQUIRE)) {
+      sched_yield();
+      itx = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    }
+    itx = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);   /* wrdone came after its last */
+    if(irx >= itx) {
+      fprintf(stderr, "%s: Got unexpected %d byte message (TXed %ld msgs, RXed %ld).\n",
+	      d->dom.devfile, nread, itx, irx);
+      break;
+    }
+    struct msgdesc *m = &r->slot[irx%r->size];
+    if(check_reply(d->dom.devfile, m, cf->pattern, t->rxbuf, t->expbuf, nread, itx, irx,
+		   d->msgs_ok)) break;
+    uint64_t lat = lh_now_ns() - m->tsend;
+    rtt_record(&d->rtt, nread, lat);
+    if(d->live) {
+      /* Only this thread writes the slot; what the writer has sent is
+	 taken from the ring */
+      ls_begin(d->live);
+      d->live->txmsgs   = itx;
+      d->live->txbytes += m->len;
+      d->live->rxmsgs++;
+      d->live->rxbytes += nread;
+      ls_lat(d->live, lat);
+      ls_end(d->live);
+    }
+    ring_release(r, irx);
+
+    d->totbytes += nread*2;
+    d->last_read = nread;
+    d->msgs_ok++;
+    gettimeofday(&d->tlast, NULL);
+    float deltasec = tvdiff(&d->tlast, t->tstart);
+    double kbps = (((float) d->totbytes)/1000.) / deltasec;
+    if(cf->dokb && (deltasec > MIN_DT_BEFORE_KBCHECK) && (kbps < (double) cf->kbmin)) {
+      fprintf(stderr, "%s: Data rate (%2.2f kB/s) dropped below minimum (%d kB/s)!\n",
+	      d->dom.devfile, kbps, cf->kbmin);
+      break;
+    }
+    if(cf->verbose || perd(d->msgs_ok) || d->msgs_ok >= cf->nummsgs) {
+      if(d->msgs_ok >= cf->nummsgs) {
+	rtt_print_table(stderr, d->dom.devfile, &d->rtt);
+      } else {
+	rtt_print_line(stderr, d->dom.devfile, &d->rtt);
+      }
+      fprintf(stderr,
+	      "%s: %ld msgs "
+	      "(last %dB, %2.2lf MB tot, %2.2lf sec, %2.2lf kB/sec)\n",
+	      d->dom.devfile, d->msgs_ok, d->last_read,
+	      ((float) d->totbytes) / (1024.*1024.), deltasec, kbps);
+    }
+  }
+  if(d->msgs_ok >= cf->nummsgs) {
+    fprintf(stderr, "%s: SUCCESS.\n", d->dom.devfile);
+  } else {
+    d->failed = 1;
+  }
+  t->stop = 1;
+  return NULL;
+}
+
+int parse_cpulist(char *list, int **cpus) {
+  /* "0,2,4-7" -> {0,2,4,5,6,7}; returns the count, or -1 if malformed */
+  int n = 0, lo, hi;
+  char *p = list, *end;
+  *cpus = NULL;
+  while(*p) {
+    lo = hi = (int) strtol(p, &end, 10);
+    if(end == p || lo < 0 || lo >= CPU_SETSIZE) return -1;
+    p = end;
+    if(*p == '-') {
+      hi = (int) strtol(++p, &end, 10);
+      if(end == p || hi < lo || hi >= CPU_SETSIZE) return -1;
+      p = end;
+    }
+    if(*p == ',') p++;
+    else if(*p) return -1;
+    int *c = realloc(*cpus, (n + hi - lo + 1)*sizeof(int));
+    if(c == NULL) return -1;
+    *cpus = c;
+    while(lo <= hi) (*cpus)[n++] = lo++;
+  }
+  return n;
+}
+
+int run_threads(struct rwconf *cf) {
+  int i, ndoms;
+  struct rwdom *dl = multi_open(cf, &ndoms);
+  if(dl == NULL) return -1;
+  struct rwthr *tl = calloc(ndoms, sizeof(struct rwthr));
+  if(tl == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+
+  struct timeval tstart;
+  double cpu0 = cpu_seconds();
+  gettimeofday(&tstart, NULL);
+  for(i=0; i<ndoms; i++) {
+    struct rwthr *t = &tl[i];
+    t->d         = &dl[i];
+    t->cf        = cf;
+    t->tstart    = &tstart;
+    t->ring.slot = dl[i].window;
+    t->ring.size = cf->winsize;
+    t->cpu_wr    = cf->ncpus ? cf->cpus[(2*i)%cf->ncpus]   : -1;
+    t->cpu_rd    = cf->ncpus ? cf->cpus[(2*i+1)%cf->ncpus] : -1;
+    pg_seed(&t->rng, pg_next(&payrng));   /* Each DOM its own stream */
+    dl[i].tlast  = tstart;
+    if(cf->nummsgs == 0) continue;
+    if(pthread_create(&t->rd, NULL, thr_reader, t) ||
+       pthread_create(&t->wr, NULL, thr_writer, t)) {
+      fprintf(stderr, "Can't start threads for %s.\n", dl[i].dom.devfile);
+      return -1;
+    }
+  }
+  for(i=0; i<ndoms; i++) {
+    struct rwthr *t = &tl[i];
+    if(cf->nummsgs > 0) {
+      pthread_join(t->wr, NULL);
+      pthread_join(t->rd, NULL);
+    }
+    if(dl[i].failed) {
+      rtt_print_table(stderr, dl[i].dom.devfile, &dl[i].rtt);
+      if(dl[i].dom.icard >= 0) {
+	fprintf(stderr, "Contents of FPGA for card %d:\n", dl[i].dom.icard);
+	show_fpga(dl[i].dom.icard);
+	fprintf(stderr, "Contents of comstat proc file %s:\n", dl[i].comstat);
+	showcomstat(dl[i].comstat);
+      }
+    }
+    ls_retry(dl[i].live, t->nwrfull);
+    if(dl[i].failed) ls_error(dl[i].live);
+    ls_finish(dl[i].live, dl[i].failed ? LS_FAILED : LS_DONE);
+    close(dl[i].fd);
+    nsyscalls += t->nsys_wr + t->nsys_rd;
+    nwrtry    += t->nwrtry;
+    nwrfull   += t->nwrfull;
+  }
+  free(tl);
+  return multi_summary(dl, ndoms, &tstart, cpu0, "threads");
+}
+
 int getBufSize(char * procFile) {
   int bufsiz;
   FILE *bs;
@@ -582,9 +1678,9 @@ int getDevFile(char * filename, int len, char *arg) {
     if(icard < 0 || icard > 7) return 1;
     if(ipair < 0 || ipair > 3) return 1;
     if(cdom != 'A' && cdom != 'B') return 1;
-    snprintf(filename, len, "/dev/dhc%dw%dd%c", icard, ipair, cdom);
+    dh_path(filename, len, "/dev/dhc%dw%dd%c", icard, ipair, cdom);
   } else {
-    memcpy(filename, arg, strlen(arg));
+    snprintf(filename, len, "%s", arg);
   }
   return 0;
 }
@@ -648,32 +1744,38 @@ void show_fpga(int icard) {
   /* In case of hardware timeout from the driver, show the DOR FPGA for the appropriate DOR
      card */
   char cmdbuf[1024];
-  snprintf(cmdbuf,1024,"cat /proc/driver/domhub/card%d/fpga",icard);
+  snprintf(cmdbuf,1024,"cat %s" DH_PROCDIR "/card%d/fpga",dh_root(),icard);
   printf("Showing FPGA registers: %s.\n",cmdbuf);
   system(cmdbuf);
 }
 
-void init_buffers(unsigned char *txbuf, unsigned char *rxbuf, int len) {
-  /* Do srand() first! */
-  int i;
-  /* Initialize send and recv buffers */
-  for(i=0;i<len;i++) {
-    /* txbuf[i] = (i%255); */
-    txbuf[i] = (unsigned char) rand()%256;
-    rxbuf[i] = 0;
-  }
+uint64_t init_buffers(unsigned char *txbuf, unsigned char *rxbuf, int len, int pattern) {
+  /* Initialize send and recv buffers; seed payrng first!  Returns the
+     message seed. */
+  uint64_t seed = init_tx_buf(txbuf, len, pattern);
+  memset(rxbuf, 0, len);
+  return seed;
 }
 
-void init_tx_buf(unsigned char *txbuf, int len, int incformat) {
-  /* Init TX buffer only (stuffing case) */
-  /* Do srand() first! */
-  int i;
-  /* Initialize send buffer */
-  if(incformat) {
-    for(i=0; i<len; i++) txbuf[i] = (i/4)%255+1; /* Never 0 */ 
-  } else {
-    for(i=0;i<len;i++) txbuf[i] = (unsigned char) rand()%256;
-  }
+uint64_t init_tx_buf(unsigned char *txbuf, int len, int pattern) {
+  /* Init TX buffer only (stuffing case); seed payrng first!  Returns
+     the message seed, from which check_reply() can regenerate it. */
+  uint64_t seed = pg_next(&payrng);
+  pg_fill(txbuf, len, pattern, seed);
+  return seed;
+}
+
+double mono_seconds(void) { /* Monotonic clock, for deadlines */
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + 1.E-9*ts.tv_nsec;
+}
+
+double cpu_seconds(void) { /* User + system CPU time used so far */
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec + 1.E-6*ru.ru_utime.tv_usec
+    +    ru.ru_stime.tv_sec + 1.E-6*ru.ru_stime.tv_usec;
 }
 
 int perd(int icount) { /* Return true if appropriate interval for printing stats to screen */
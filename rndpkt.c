@@ -1,10 +1,17 @@
 /* rndpkt.c - John Jacobsen, john@johnj.com, for LBNL/IceCube, Mar. 2003 
    Send small request for larger packets; make sure packets are correct.
    C.f. echo-pkt-mode in Iceboot. 
-   Use echo-pkt-mode.pl to prep DOMs (send Iceboot command) first */
+   Use echo-pkt-mode.pl to prep DOMs (send Iceboot command) first
+
+   Requests can be pipelined (-N): each carries its own seed, which the
+   DOM uses to start the reply's LCG stream, so a reply is matched to
+   its request by recovering the seed from its first word.  -S sweeps
+   the reply size up to the hub's buffer size to measure sustained
+   DOM-to-hub readout rather than round-trip latency. */
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/poll.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
@@ -12,25 +19,53 @@
 #include <time.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <getopt.h>
+
+#include "domhub.h"
+#include "lathist.h"
+#include "pktgen.h"
+#include "livestats.h"
 
 #define MAX_SEND_MSG_BYTES   8
 #define MAX_RECV_MSG_BYTES   4096
 #define MAX_PKT_DEFAULT      100
 #define NUMMSGS_DEFAULT      100
-#define MAX_WRITE_RETRIES    100000
-#define MAX_READ_RETRIES     1000
-#define WRITE_DELAY          100
-#define READ_DELAY           100
+#define MAX_DEPTH            1024
+#define READ_TIMEOUT_MS      10000
+#define POLL_MS              100
 
 #define BATCHPRINT 1 /* Set to 0 for more interactive, fast display of stats */
 #define BATCHCOUNT 1000 /* Set larger for less frequent display of stats */
 
-static char usage[]="Usage: rndpkt <devfile> [num_messages] [max_pkt_len]\n";
-
-#define HUB 1
-#define DOM 2
-#define pfprintf(...)
-#define pprintf(...)
+static char usage[]="Usage: rndpkt [-N <depth>] [-S] [-v] <devfile> [num_messages] "
+  "[max_pkt_len] [open_delay]\n"
+  "  <devfile> is in the form 00a, 00A, or /dev/dhc0w0dA\n"
+  "  max_pkt_len is in 32-bit words (default 100, max. bufsiz/4)\n"
+  "  -N <depth>  keep up to <depth> requests outstanding (default 1, max. 1024)\n"
+  "  -S          size sweep: num_messages replies each of 1, 2, 4, ... words,\n"
+  "              up to max_pkt_len (default bufsiz/4); table on stdout\n"
+  "  -v          show every request and reply\n"
+  "  $DOMHUB_ROOT, if set, is prefixed to all /dev and /proc paths.\n";
+
+struct pktreq {
+  uint32_t seed;
+  int      nwords;
+  int      busy;
+  uint64_t tsend;
+};
+
+struct pktstats {
+  long   msgs;
+  double txbytes, rxbytes;
+  double secs;
+  int    last;                  /* Length of the last reply */
+  struct rtthist rtt;
+};
+
+static int verbose = 0;
+static uint32_t nextseed = 0;   /* Unique across a sweep's runs */
+static struct ls_slot *live;    /* This DOM's moatstat counters */
 
 int is_printable(char c) {
   if(c >= 32 && c <= 126) return 1;
@@ -55,224 +90,305 @@ void show_buffers(char *rxbuf, char *txbuf, int n) {
 
 }
 
-void randsleep(int usec) {
-  int j;
-  j=1+(int)(((float) usec)*rand()/(RAND_MAX+1.0));
-  //printf("Delay %d, j %d.\n", usec, j);
-  usleep(j);
+int getBufSize(void) {
+  char bsfile[DH_PATHLEN];
+  int bufsiz = -1;
+  FILE *bs = fopen(dh_path(bsfile, DH_PATHLEN, DH_PROCDIR "/bufsiz"), "r");
+  if(bs == NULL) return -1;
+  if(fscanf(bs, "%d", &bufsiz) != 1) bufsiz = -1;
+  fclose(bs);
+  return bufsiz;
 }
 
-int main(int argc, char *argv[]) {
+static void show_progress(char *domfile, struct pktstats *st) {
+  double totmb = (st->txbytes + st->rxbytes)/(1024.*1024.);
+  fprintf(stderr,
+	  "%s: %ld msgs "
+	  "(last %dB, %2.2lf MB tot, %2.2lf sec, %2.2lf kB/sec, readout %2.2lf kB/sec)\n",
+	  domfile, st->msgs, st->last, totmb, st->secs,
+	  st->secs > 0 ? (totmb*1024.)/st->secs : 0.,
+	  st->secs > 0 ? st->rxbytes/1024./st->secs : 0.);
+}
+
+static int got_reply(char *domfile, unsigned char *rxbuf, int nread, struct pktreq *req,
+		     int depth, struct pktstats *st) {
+  /* Match a reply to its request and check it; returns 0 if it's good */
+  if(nread < 4 || nread%4) {
+    fprintf(stderr, "%s: Got %d byte reply, not a whole number of words.\n",
+	    domfile, nread);
+    return 1;
+  }
+  uint32_t seed = pg_lcg_seed(rxbuf);
+  struct pktreq *r = &req[seed%depth];
+  if(!r->busy || r->seed != seed) {
+    /* Probably a bad first word; DOMs reply in order, so check it
+       against the oldest request to say where else it's bad */
+    int i;
+    fprintf(stderr, "%s: %d byte reply (first word seed %u) matches no outstanding "
+	    "request.\n", domfile, nread, seed);
+    for(i=0, r=NULL; i<depth; i++) {
+      if(req[i].busy && (r == NULL || nextseed - req[i].seed > nextseed - r->seed))
+	r = &req[i];
+    }
+    if(r == NULL) return 1;
+    seed = r->seed;
+    fprintf(stderr, "%s: Checking it against the oldest request (seed %u).\n",
+	    domfile, seed);
+  }
+  if(nread != r->nwords*4) {
+    fprintf(stderr, "Read/write mismatch: expected %d, read %d bytes (seed %u).\n",
+	    r->nwords*4, nread, seed);
+    return 1;
+  }
+  /* Regenerate the DOM's LCG stream (32-bit, x' = 69069*x + 1) and compare */
+  int ibad = pg_check_lcg(rxbuf, r->nwords, seed);
+  if(ibad >= 0) {
+    uint32_t ul = rxbuf[ibad*4] | (rxbuf[ibad*4+1] << 8) | (rxbuf[ibad*4+2] << 16)
+      | ((uint32_t) rxbuf[ibad*4+3] << 24);
+    uint32_t an, cn;
+    pg_lcg_jump(ibad+1, &an, &cn);
+    fprintf(stderr,"packet word %d: got %u, wanted %u.\n", ibad, ul, an*seed + cn);
+    fprintf(stderr,"Packet with seed %u: error from %s.\n", seed, domfile);
+    return 1;
+  }
+  if(verbose) fprintf(stderr, "%s: seed %u: got %d byte reply.\n", domfile, seed, nread);
+  uint64_t lat = lh_now_ns() - r->tsend;
+  rtt_record(&st->rtt, nread, lat);
+  ls_rx(live, nread, lat);
+  r->busy = 0;
+  st->msgs++;
+  st->rxbytes += nread;
+  st->last = nread;
+  return 0;
+}
+
+int run_pkts(int file, char *domfile, long nummsgs, int minw, int maxw, int depth,
+	     int bufsiz, int progress, struct pktstats *st) {
+  /* Send nummsgs requests for replies of minw..maxw words, keeping up
+     to depth outstanding, and check the replies.  Returns 0 if they all
+     came back intact. */
   unsigned char txbuf[MAX_SEND_MSG_BYTES];
+  unsigned char *rxbuf = malloc(bufsiz);
+  struct pktreq *req   = calloc(depth, sizeof(struct pktreq));
+  struct pollfd pfd;
+  long ntx = 0;
+  int  blocked = 0;
+  if(rxbuf == NULL || req == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(-1);
+  }
+  memset(st, 0, sizeof(*st));
+  pfd.fd = file;
+  uint64_t t0    = lh_now_ns();
+  uint64_t tlast = t0;
+
+  while(st->msgs < nummsgs) {
+    /* Fill the pipeline */
+    while(!blocked && ntx < nummsgs && ntx - st->msgs < depth) {
+      struct pktreq *r = &req[nextseed%depth];
+      if(r->busy) break; /* Replies out of order; wait for this one */
+      int pktlen = minw == maxw ? minw : minw + rand()%(maxw - minw + 1);
+      txbuf[0] = nextseed & 0xFF;
+      txbuf[1] = (nextseed>>8) & 0xFF;
+      txbuf[2] = (nextseed>>16) & 0xFF;
+      txbuf[3] = (nextseed>>24) & 0xFF;
+      txbuf[4] = pktlen & 0xFF;
+      txbuf[5] = (pktlen>>8) & 0xFF;
+      txbuf[6] = txbuf[7] = 0;
+      r->tsend = lh_now_ns();
+      int nw = write(file, txbuf, MAX_SEND_MSG_BYTES);
+      if(nw < 0 && errno == EAGAIN) {
+	ls_retry(live, 1);
+	blocked = 1;
+	break;
+      }
+      if(nw != MAX_SEND_MSG_BYTES) {
+	fprintf(stderr, "%s: Write failed (%d %s).\n", domfile, nw,
+		nw < 0 ? strerror(errno) : "short write");
+	return 1;
+      }
+      if(verbose) fprintf(stderr, "%s: seed %u: requested %d words.\n", domfile,
+			  nextseed, pktlen);
+      r->seed   = nextseed++;
+      r->nwords = pktlen;
+      r->busy   = 1;
+      ls_tx(live, nw);
+      st->txbytes += nw;
+      ntx++;
+    }
+
+    pfd.events = POLLIN;
+    if(blocked) pfd.events |= POLLOUT;
+    int np = poll(&pfd, 1, POLL_MS);
+    uint64_t now = lh_now_ns();
+    if(np <= 0 || !(pfd.revents & (POLLIN|POLLOUT))) {
+      if(np < 0 && errno != EINTR) {
+	fprintf(stderr, "%s: poll failed (%s).\n", domfile, strerror(errno));
+	return 1;
+      }
+      if(now - tlast > READ_TIMEOUT_MS*1000000ULL) {
+	fprintf(stderr, "%s: Timeout expecting reply from DOM (%ld requests "
+		"outstanding).\n", domfile, ntx - st->msgs);
+	return 1;
+      }
+      continue;
+    }
+    if(pfd.revents & POLLOUT) blocked = 0;
+    if(!(pfd.revents & POLLIN)) continue;
+
+    int nread = read(file, rxbuf, bufsiz);
+    if(nread < 0 && errno == EAGAIN) continue;
+    if(nread <= 0) {
+      fprintf(stderr, "%s: read error after POLLIN (nread=%d, %s).\n", domfile, nread,
+	      nread < 0 ? strerror(errno) : "EOF");
+      return 1;
+    }
+    if(got_reply(domfile, rxbuf, nread, req, depth, st)) return 1;
+    tlast = lh_now_ns();
+    st->secs = (tlast - t0)*1.E-9;
+    if(progress && (!BATCHPRINT || !(st->msgs % BATCHCOUNT))) show_progress(domfile, st);
+  }
+  st->secs = (lh_now_ns() - t0)*1.E-9;
+  free(rxbuf);
+  free(req);
+  return 0;
+}
+
+static void sweep_line(int nwords, struct pktstats *st) {
+  struct lathist all;
+  int i;
+  memset(&all, 0, sizeof(all));
+  for(i=0; i<LH_NLEN; i++) lh_merge(&all, &st->rtt.len[i]);
+  printf("%7d %7d %10.0f %12.1f %9.1f %9.1f %9.1f\n", nwords, nwords*4,
+	 st->msgs/st->secs, st->rxbytes/1024./st->secs,
+	 all.count ? all.sum/1000./all.count : 0.,
+	 lh_percentile(&all, 0.5)/1000., lh_percentile(&all, 0.99)/1000.);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
   unsigned char rxbuf[MAX_RECV_MSG_BYTES];
   int file;
-  int nread, gotreply, write_ok;
-  int nbyteswritten;
-  long next_cnt = 1;
-  int i, icnt;
-  int nummsgs;
+  int icnt;
+  long nummsgs;
   char *domfile;
-  long msgs_written;
-  double totmb;
-  time_t t1, t2, delt;
-  int firstmsg  = 1;
-  int maxpkt  = MAX_PKT_DEFAULT;
+  struct dh_dom dom;
+  struct pktstats st;
+  int maxpkt    = MAX_PKT_DEFAULT;
   int opendelay = 0;
-  int contents_errors = 0;
-  int length_errors   = 0;
-  int readtimeouts    = 0;
+  int depth     = 1;
+  int sweep     = 0;
   int pid;
-  int pktok;
-  unsigned long ul, lastul, expectul, a=69069, c=1;
-  unsigned int pktlen;
-  unsigned long seed = 0;
 
-  /* Initialize random generator for delays */
+  /* Initialize random generator for lengths */
   pid = (int) getpid();
-  //printf("Pid is %d.\n", pid);
   srand(pid);
 
+  while(1) {
+    int c = getopt(argc, argv, "hvSN:");
+    if(c == -1) break;
+    switch(c) {
+    case 'v': verbose = 1; break;
+    case 'S': sweep   = 1; break;
+    case 'N':
+      depth = atoi(optarg);
+      if(depth < 1 || depth > MAX_DEPTH) {
+	fprintf(stderr,usage);
+	exit(-1);
+      }
+      break;
+    case 'h':
+    default:
+      fprintf(stderr,usage);
+      exit(-1);
+    }
+  }
+  argc -= optind-1;
+  argv += optind-1;
+
   if(argc < 2) {
     fprintf(stderr,usage);
     exit(-1);
   }
 
-  if(argc < 3 || (nummsgs = atoi(argv[2])) <= 0) {
+  if(argc < 3 || (nummsgs = atol(argv[2])) <= 0) {
     nummsgs = NUMMSGS_DEFAULT;
   }
 
-  if(argc < 4 || (maxpkt = atoi(argv[3])) < 0) {
-    maxpkt = MAX_PKT_DEFAULT;
-  } else if(maxpkt > MAX_PKT_DEFAULT) {
-    fprintf(stderr, "Sorry, can't have packet size > %d longwords (yet).\n",
-	    MAX_PKT_DEFAULT);
-    exit(-1);
+  /* Replies are limited by the hub's buffer size, not ours */
+  int bufsiz = getBufSize();
+  if(bufsiz <= 0) bufsiz = MAX_RECV_MSG_BYTES;
+  int maxwords = bufsiz/4;
+  if(sweep) maxpkt = maxwords;
+  if(argc >= 4 && atoi(argv[3]) > 0) {
+    maxpkt = atoi(argv[3]);
+    if(maxpkt > maxwords) {
+      fprintf(stderr, "Sorry, can't have packet size > %d longwords (bufsiz %d).\n",
+	      maxwords, bufsiz);
+      exit(-1);
+    }
   }
 
   if(argc < 5 || (opendelay = atoi(argv[4])) < 0) {
     opendelay = 0;
   }
 
-  domfile = argv[1];
-  fprintf(stderr, "Will send/recv %d messages to device %s.\n",
-	  nummsgs, domfile);
+  if(dh_parse_dom(&dom, argv[1])) {
+    fprintf(stderr,usage);
+    exit(-1);
+  }
+  domfile = dom.devfile;
+  fprintf(stderr, "Will send/recv %ld messages%s to device %s, %d outstanding.\n",
+	  nummsgs, sweep ? " per size" : "", domfile, depth);
+  live = ls_attach_dom(LS_RNDPKT, dom.icard, dom.ipair, dom.cdom);
    
-  file = open(domfile, O_RDWR);
+  file = dh_open_dev(domfile, O_RDWR);
   if(file <= 0) {
     fprintf(stderr,"Can't open file %s ", domfile);
     perror(":");
     exit(errno);
   }
-   
 
   if(opendelay) usleep(opendelay);
   
-  totmb   = 0.0;
-  msgs_written = 0;
-  firstmsg = 1;
-   
   // HUB mode only:
 
   // Try to drain old messages first:
+  struct pollfd pfd;
+  pfd.fd = file;
+  pfd.events = POLLIN;
   for(icnt = 0; icnt < 1000000; icnt++) {
-    nread = read(file, rxbuf, MAX_RECV_MSG_BYTES);
-    if(nread <= 0) {
-      //fprintf(stderr, "No stale message left in driver.\n");
-      break;
-    }
-    //fprintf(stderr, 
-    //"Read stale message (%d bytes) from driver before starting test.\n",nread);
+    if(poll(&pfd, 1, 0) <= 0) break;
+    if(read(file, rxbuf, MAX_RECV_MSG_BYTES) <= 0) break;
   }
 
-  lastul = 0;
-
-  while(1) {
-
-    /* Initialize send buffer */
-
-    pktlen   = 1+(int)(((float) maxpkt)*rand()/(RAND_MAX+1.0));
-
-    pfprintf(stderr,"pktlen=%d.\n",pktlen);
-    seed     = msgs_written;
-    lastul   = seed;
-    txbuf[0] = seed & 0xFF;
-    txbuf[1] = (seed>>8) & 0xFF;
-    txbuf[2] = (seed>>16) & 0xFF;
-    txbuf[3] = (seed>>24) & 0xFF;
-    //txbuf[1] = txbuf[2] = txbuf[3] = 0;
-    txbuf[4] = pktlen & 0xFF;
-    txbuf[5] = (pktlen>>8) & 0xFF;
-    txbuf[6] = txbuf[7] = 0;
-
-
-    write_ok = 0;
-    for(icnt = 0; icnt < MAX_WRITE_RETRIES; icnt++) {
-      nbyteswritten = write(file,txbuf, MAX_SEND_MSG_BYTES);
-      // usleep(100);
-      if(nbyteswritten <= 0) {
-	randsleep(WRITE_DELAY);
-      } else {
-	if(firstmsg) {
-	  firstmsg = 0;
-	  t1 = time(NULL);
-	}
-	msgs_written++;
-	write_ok = 1;
-	//fprintf(stderr,"Wrote a message to the DOM.\n");
-	break;
-      }
-
-    }
-
-    if(!write_ok) {
-      fprintf(stderr,"%s: Write failed (timeout).\n", domfile);
-      exit(-1);
-    }
-
-    gotreply = 0;
-    for(icnt = 0; icnt < MAX_READ_RETRIES; icnt++) {
-      nread = read(file, rxbuf, MAX_RECV_MSG_BYTES);
-      if(nread <= 0) {
-	randsleep(READ_DELAY);
-	continue;
-      } else if(nread != pktlen*4) {
-	fprintf(stderr, "Read/write mismatch: expected %d, read %d bytes.\n",
-		pktlen*4, nread);
+  if(sweep) {
+    int nwords = 1;
+    printf("# %s: %ld msgs per size, %d outstanding\n", domfile, nummsgs, depth);
+    printf("#  words   bytes     msgs/s  readout kB/s   mean(us)  p50(us)   p99(us)\n");
+    while(1) {
+      if(run_pkts(file, domfile, nummsgs, nwords, nwords, depth, bufsiz, 0, &st)) {
+	fprintf(stderr, "%s: Failed at %d words after %ld msgs.\n", domfile, nwords,
+		st.msgs);
+	ls_error(live);
 	exit(-1);
-	// length_errors++;
-      } else {
-	gotreply = 1;
-	pfprintf(stderr, "Read/write ok: wrote %d, read %d bytes.\n",
-		nbyteswritten, nread);
-	break;
       }
+      sweep_line(nwords, &st);
+      if(nwords == maxpkt) break;
+      nwords = nwords*2 < maxpkt ? nwords*2 : maxpkt;
     }
-
-    if(gotreply) {
-      pktok = 1;
-      for(i=0; i<pktlen; i++) {
-	ul = rxbuf[i*4] + (rxbuf[i*4+1] << 8) + (rxbuf[i*4+2] << 16) + (rxbuf[i*4+3] << 24);
-	expectul = a*lastul + c;
-	pfprintf(stderr,"pktlen=%d expectul=%ld ul=%ld lastul=%ld a=%ld c=%ld\n",
-	       pktlen, expectul, ul, lastul, a, c);
-	if(ul != expectul) {
-	  fprintf(stderr,"packet word %d: got %lu, wanted %lu.\n", i, ul, expectul);
-	  pktok = 0;
-	  break;
-	}
-	lastul = ul;
-      }
-      if(! pktok) {
-	fprintf(stderr,"%ldth packet: error from %s.\n", msgs_written-1, domfile);
-	exit(-1);
-      }
-
-      // fprintf(stderr,"\n");
-      
-    } else {
-      fprintf(stderr, "%s: Timeout expecting %d byte reply from DOM.\n", 
-	      domfile,nbyteswritten);
-      readtimeouts++;
-      fprintf(stderr, "\n\n");
-
-      //system("cat /proc/driver/domhub/card0/fpga");
-      //fprintf(stderr, "WARNING: FPGA proc file name hardcoded (card 0 may not correspond"
-      //" to %s).\n",domfile);
-      return 1;
-    }
-
-    //show_buffers(rxbuf, txbuf, nread);
-
-    totmb += (nbyteswritten + nread)/(1024.*1024.);
-    t2 = time(NULL);
-    delt = (int) t2 - (int) t1;
-    if(delt > 0 && (!BATCHPRINT || !(msgs_written % BATCHCOUNT))) { // && msgs_written >= next_cnt) {
-      next_cnt *= 2;
-      fprintf(stderr,
-	      "\r%s: %ld msgs "
-	      "(last %dB, %2.2lf MB tot, %d sec, %2.2lf kB/sec, %d:%d:%d errors)  ",
-	      domfile, 
-	      msgs_written, nbyteswritten, totmb, (int) delt, 
-	      (totmb*1024.)/((double) delt),
-	      length_errors, contents_errors, readtimeouts);
-
-      if(BATCHPRINT) fprintf(stderr,"\n"); 
-
-    } else {
-      //fprintf(stderr,"\r%d messages sent (%d bytes total).",
-      //msgs_written, totbytes);
+  } else {
+    if(run_pkts(file, domfile, nummsgs, 1, maxpkt, depth, bufsiz, 1, &st)) {
+      fprintf(stderr, "%ldth packet: error from %s.\n", st.msgs, domfile);
+      ls_error(live);
+      exit(-1);
     }
-    if(msgs_written >= nummsgs) break;
+    rtt_print_table(stderr, domfile, &st.rtt);
+    show_progress(domfile, &st);
   }
-  fprintf(stderr,
-	  "\r%s: %ld msgs "
-	  "(last %dB, %2.2lf MB tot, %d sec, %2.2lf kB/sec, %d:%d:%d errors)  ",
-	  domfile, 
-	  msgs_written, nbyteswritten, totmb, (int) delt, 
-	  (totmb*1024.)/((double) delt),
-	  length_errors, contents_errors, readtimeouts);
-  fprintf(stderr,"\nClosing file.\n");
+  fprintf(stderr,"Closing file.\n");
   close(file);
+  ls_finish(live, LS_DONE);
   fprintf(stderr,"Done.\n");
   
   return 0;
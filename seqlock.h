@@ -0,0 +1,57 @@
+/* seqlock.h
+   The sequence count behind the shared file segments (livestats,
+   gpsidx, stwatch.map).  Each record has one writer, which makes the
+   count odd, updates the record with plain stores and makes it even
+   again.  Readers, in any process, copy the record and retry if the
+   count was odd or moved meanwhile.  A writer that dies mid-update
+   leaves the count odd for good, so readers give up after SEQ_TRIES.
+*/
+
+#ifndef __SEQLOCK_H__
+#define __SEQLOCK_H__
+
+#include <stdint.h>
+#include <string.h>
+
+#define SEQ_TRIES 1000          /* Reader retries before calling a record torn */
+
+/************* Writer ******************/
+
+static inline void seq_begin(uint32_t *seq) {
+  __atomic_store_n(seq, *seq+1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seq_end(uint32_t *seq) {
+  __atomic_store_n(seq, *seq+1, __ATOMIC_RELEASE);
+}
+
+/************* Reader ******************/
+
+/* Count to pass to seq_read_retry(); odd means try again */
+static inline uint32_t seq_read_begin(const uint32_t *seq) {
+  return __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+}
+
+/* Non-zero if what was read since seq_read_begin() may be torn */
+static inline int seq_read_retry(const uint32_t *seq, uint32_t start) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(seq, __ATOMIC_RELAXED) != start;
+}
+
+/* Consistent copy of the size bytes at rec, guarded by *seq.  Returns
+   0, or -1 (with whatever was there copied) if it stayed mid-update. */
+static inline int seq_snapshot(const uint32_t *seq, const void *rec, void *copy,
+			       size_t size) {
+  int i;
+  for(i=0; i<SEQ_TRIES; i++) {
+    uint32_t start = seq_read_begin(seq);
+    if(start & 1) continue;
+    memcpy(copy, rec, size);
+    if(!seq_read_retry(seq, start)) return 0;
+  }
+  memcpy(copy, rec, size);
+  return -1;
+}
+
+#endif /* __SEQLOCK_H__ */
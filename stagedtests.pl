@@ -5,6 +5,7 @@
 
 use strict;
 use Getopt::Long;
+use POSIX ":sys_wait_h";
 use constant ENTER       => 13;
 use constant ESC         =>  7;
 use constant CTRL_L      => 12;
@@ -46,6 +47,10 @@ my $gpsskip       = 15;
 my $gpsticks      = 20000000;
 my $useReadwrite  = 0;
 my $loopback;
+my $lane          = 0;
+my @jobs;         # Long-term test processes we started
+my $watcher;      # stwatch, following their output files
+my $mainpid = $$;
 sub usage { return <<EOF;
 
 Usage: $0 [st.in]
@@ -69,6 +74,10 @@ Usage: $0 [st.in]
                                  - don't softboot DOMs
 	  [-b|-useconfigboot]  Use configboot firmware for echo test
 	  [-a|-usedomapp]      Use domapp firmware for echo test
+	  [-L|-lane]           Run as one of several concurrent lanes (moat -L):
+	                         - leave module power to the caller
+	                         - only look for, and kill, our own test jobs
+	                         - GPS tests only on the cards of our DOMs
 st.in should be a file formatted e.g. as:
 0 0 A
 0 0 B
@@ -89,7 +98,18 @@ sub kill_running_processes;               sub lasterr;
 sub clear_lasterr;                        sub softboot;
 sub softboot_all;                         sub echo_mode_all;
 sub iceboot_all;                          sub reset_comm_stats;
-sub test_single_gps;
+sub test_single_gps;                      sub spawn;
+sub gps_procs;                            sub domset;
+sub start_watcher;                        sub stop_watcher;
+sub watched_logs;                         sub map_watcher;
+sub stop_stale_watcher;
+
+END {
+    # However we leave, the watcher goes too; not from a spawned child
+    # whose exec failed, though
+    local $?;
+    stop_watcher() if $$ == $mainpid;
+}
 
 GetOptions("help|h"          => \$help,
 	   "moni|m"          => \$moni,
@@ -108,6 +128,7 @@ GetOptions("help|h"          => \$help,
 	   "usedomapp|a"     => \$usedomapp,
 	   "skipkbcheck|i"   => \$skipkbchk,
 	   "loopback|o"      => \$loopback,
+	   "lane|L"          => \$lane,
 	   "skiptcal|x"      => \$skiptcal) || die usage;
 
 $loopback=1 if defined $loopback;
@@ -147,7 +168,7 @@ if($kill) {
     exit;
 }
 
-if(!$moni) {
+if(!$moni && !$lane) {
     check_for_running_processes;
 }
 
@@ -165,12 +186,12 @@ while(!$moni && !defined $dorfreq) {
 
 die "Can only test GPS if DOR freq. is 10 MHz!\n" if($dorfreq != 10 && $testgps);
 
-if($testgps) {
+if($testgps && !$lane) {
     dochoice("[t]est acquire single GPS time string/DOR time pair", 't', FALLTHRU_OK, 
 	     \&test_single_gps);
 }
 
-if(!$moni && !$loopback) {    
+if(!$moni && !$loopback && !$lane) {    
     dochoice("[p]ower off modules", 'p', FALLTHRU_OK, \&power_off_modules);
     dochoice("power [o]n modules", 'o', FALLTHRU_OK, \&power_on_modules);
 }
@@ -230,6 +251,11 @@ if($moni) {
     exit;
 }
 
+if($testgps && $lane) { # Now that we know our cards
+    dochoice("[t]est acquire single GPS time string/DOR time pair", 't', FALLTHRU_OK, 
+	     \&test_single_gps);
+}
+
 print "Will test:\n";
 for(keys %dom) {
     print "$_: Card $card{$_} pair $pair{$_} dom $dom{$_}.\n";
@@ -329,29 +355,28 @@ my $longjobs = 0;
 my $ifgps = $testgps? "/GPS readout" : "";
 dochoice("Start [l]ong-term echo/tcalib$ifgps tests", 'l', FALLTHRU_OK, sub {
     my @domlist;
+    start_watcher;
     for($i=0; $i<$ndoms; $i++) {
 	my $echoout = "echo_results_c$card{$i}"."w$pair{$i}"."d$dom{$i}.out";
 	my $tcalout;
-	my $tcaldata;
+	my $tcalarch = "";
 	$tcalout = "tcal_results_c$card{$i}"."w$pair{$i}"."d$dom{$i}.out";
-	if($savetcal) { 
-	    $tcaldata = "tcal_data_c$card{$i}"."w$pair{$i}"."d$dom{$i}.out";
-	} else {
-	    $tcaldata = "/dev/null";
+	if($savetcal) { # Binary archive; tcal2txt gives the old text form
+	    $tcalarch = "-a tcal_data_c$card{$i}"."w$pair{$i}"."d$dom{$i}.tca";
 	}
 
 	if($useReadwrite && $nmsgs > 0) { # Single process for each DOM
 	    my $rwcmd = "$bindir/readwrite HUB $kbchkarg $devfiles{$i} ".($stuffmode?"-s":"")
-		.       " $nmsgs >& $echoout &";
+		.       " $nmsgs >& $echoout";
 	    print "Running $rwcmd...\n";
-	    system $rwcmd;
+	    spawn $rwcmd;
 	}
 
-	my $tccmd = "$bindir/tcaltest  -d $dorfreq  $tprocfiles{$i} $ntcals "
-	    .($savetcal?"":"noshow")." 2>$tcalout 1>$tcaldata &";
+	my $tccmd = "$bindir/tcaltest  -d $dorfreq $tcalarch $tprocfiles{$i} $ntcals "
+	    ."noshow 2>$tcalout 1>/dev/null";
 	if($ntcals > 0 && ! $skiptcal) {
 	    print "Running $tccmd...\n";
-	    system $tccmd;
+	    spawn $tccmd;
 	}
 	
 	push @domlist, "$card{$i}$pair{$i}$dom{$i}";
@@ -359,20 +384,19 @@ dochoice("Start [l]ong-term echo/tcalib$ifgps tests", 'l', FALLTHRU_OK, sub {
 
     if(! $useReadwrite && $nmsgs > 0) { # Single process for all DOMs
 	my $domsarg = join " ", @domlist;
-	my $echocmd = "$echoloop -n $nmsgs $domsarg >& echo_results_all.out &";
+	my $echocmd = "$echoloop -n $nmsgs $domsarg >& echo_results_all.out";
 	print "Running $echocmd...\n";
-	system $echocmd;
+	spawn $echocmd;
     }
 
     if($testgps) {
-	my @pfs = </proc/driver/domhub/card*/syncgps>;
-	for(@pfs) {
+	for(gps_procs) {
 	    m|/proc/driver/domhub/card(\d+)/syncgps|;
 	    my $fout = "card$1_gps.out";
 	    my $chk = ($checkgps ? "-e $gpsskip,$gpsticks" : "");
-	    my $gpscmd = "/usr/local/bin/readgps -f -g -d $_ >&$fout $chk &";
+	    my $gpscmd = "/usr/local/bin/readgps -f -g -d $_ >&$fout $chk";
 	    print "Running $gpscmd...\n";
-	    system $gpscmd;
+	    spawn $gpscmd;
 	}
     }
     $longjobs = 1;
@@ -393,6 +417,7 @@ if($timedrun) {
 	    kill_running_processes;
 	    sleep 1;
 	    show_comm_stats("commstats_after");
+	    stop_watcher;
 	    print "Showing last log files now....\n";
 	    if(check_log_files) {
 		print "Stagedtests.pl FAILED.\n";
@@ -470,7 +495,102 @@ sub killall {
     die "Couldn't kill all processes matching \"$argname\"...\n" unless $done;	
 }
 
+sub spawn {
+    # Start a long-term test job in the background, remembering it
+    my $cmd = shift;
+    my $pid = fork;
+    die "Can't fork for $cmd: $!\n" unless defined $pid;
+    if($pid == 0) {
+	exec "/bin/sh", "-c", "exec $cmd";
+	die "Can't run $cmd: $!\n";
+    }
+    push @jobs, $pid;
+}
+
+sub kill_own_jobs {
+    # Lanes share the hub, so only our own jobs are fair game
+    kill 'TERM', @jobs;
+    foreach my $pid (@jobs) {
+	my $trial;
+	for($trial=0; $trial<100; $trial++) {
+	    last if waitpid($pid, WNOHANG) != 0;
+	    select undef,undef,undef,0.2;
+	}
+	if($trial == 100) {
+	    kill 'KILL', $pid;
+	    waitpid $pid, 0;
+	}
+    }
+    @jobs = ();
+}
+
+sub start_watcher {
+    # Follow the output files as the jobs write them, so check_log_files
+    # needn't read them again each time
+    return if defined $watcher || ! -x "$bindir/stwatch";
+    stop_stale_watcher;
+    $watcher = fork;
+    die "Can't fork for stwatch: $!\n" unless defined $watcher;
+    if($watcher == 0) {
+	exec "$bindir/stwatch", ".";
+	die "Can't run $bindir/stwatch: $!\n";
+    }
+}
+
+sub stop_watcher {
+    # It reads what the jobs last wrote before it exits; what it kept
+    # stays for check_log_files
+    return unless $watcher;
+    kill 'TERM', $watcher;
+    waitpid $watcher, 0;
+    $watcher = 0;
+}
+
+sub watched_logs {
+    # Last line and [count, first error] of each output file, from the
+    # stwatch following this directory, which may have been started by
+    # another stagedtests (-m watches someone else's run); false if
+    # there isn't one.  A stopped one's record is only current if it
+    # was ours.
+    my ($last, $err) = @_;
+    return 0 unless -x "$bindir/stwatch";
+    my @lines = `$bindir/stwatch -q . 2>/dev/null`;
+    return 0 if $? || ! @lines;
+    return 0 unless $lines[0] =~ /^# stwatch \d+ running/ || defined $watcher;
+    for(@lines) {
+	if(/^(\S+) last (.*)$/) {
+	    $last->{$1} = "$2\n";
+	} elsif(/^(\S+) err (\d+) (.*)$/) {
+	    $err->{$1} = [$2, $3];
+	}
+    }
+    return 1;
+}
+
+sub map_watcher {
+    # Pid of the stwatch keeping ./stwatch.map, if it's still running
+    return undef unless -x "$bindir/stwatch";
+    my @lines = `$bindir/stwatch -q . 2>/dev/null`;
+    return undef if $? || ! @lines;
+    return $lines[0] =~ /^# stwatch (\d+) running/ ? $1 : undef;
+}
+
+sub stop_stale_watcher {
+    # One left here by an earlier stagedtests; ours is stop_watcher's
+    my $pid = map_watcher;
+    return unless defined $pid && (! $watcher || $pid != $watcher);
+    kill 'TERM', $pid;
+    for(my $trial=0; $trial<50 && kill(0, $pid); $trial++) {
+	select undef,undef,undef,0.1;
+    }
+}
+
 sub kill_running_processes {
+    stop_stale_watcher;
+    if($lane) {
+	kill_own_jobs;
+	return;
+    }
     killall "readwrite";
     killall "echo-loop";
     killall "echo-test";
@@ -660,17 +780,22 @@ sub clear_lasterr {
     }
 }
 
-sub softboot_all {
+sub domset {
     my $i;
-    my $sbcmd = "$bindir/sb.pl ";
+    my @doms;
     for($i=0; $i<$ndoms; $i++) {
-	$sbcmd .= $card{$i}.$pair{$i}.$dom{$i}." ";
+	push @doms, $card{$i}.$pair{$i}.$dom{$i};
     }
+    return "'".join(' ', @doms)."'";
+}
+
+sub softboot_all {
+    my $sbcmd = "$bindir/domse ".domset." softboot";
     my $tf = "/tmp/st$$"."_sb.tmp";
     system "$sbcmd 2>&1 | tee $tf";
     my $result = `cat $tf`;
     unlink $tf;
-    if($result !~ /ok/i) {
+    if($result !~ /SUCCESS/) {
 	print "Softboot failed.  Later.\n";
 	print "stagedtests FAILURE.\n";
 	exit;
@@ -679,13 +804,7 @@ sub softboot_all {
 
 
 sub iceboot_all {
-    my $i;
-    my $secmd = "$bindir/se.pl ";
-    for($i=0; $i<$ndoms; $i++) {
-        $secmd .= $card{$i}.$pair{$i}.$dom{$i}." ";
-    }
-    $secmd .= "r r.+\\\?\\\>";
-    # $secmd .= ".+\\>" unless $loopback;
+    my $secmd = "$bindir/domse ".domset." r 'r.+>'";
     print "$secmd...\n";
     my $tf = "/tmp/st$$"."_se.tmp";
     system "$secmd 2>&1 | tee $tf";
@@ -701,17 +820,13 @@ sub iceboot_all {
 
 sub echo_mode_all {
 # Put DOMs in echo mode (if not already)
-    my $i;
-    my $seprecmd = "$bindir/se.pl ";
-    for($i=0; $i<$ndoms; $i++) {
-        $seprecmd .= $card{$i}.$pair{$i}.$dom{$i}." ";
-    }
+    my $seprecmd = "$bindir/domse ".domset." ";
     my $fwname;
     $fwname = "configboot.sbi" if $useconfigboot;
     $fwname = "domapp.sbi"     if $usedomapp;
     if($useconfigboot || $usedomapp) {
 	# Start configboot or domapp firmware on DOM
-	my $emstr = "s\\\"\\\ $fwname\\\"\\\ find\\\ if\\\ fpga\\\ endif s\\\".+\\\>";
+	my $emstr = "'s\" $fwname\" find if fpga endif' 's\".+>'";
 	my $secmd = $seprecmd . $emstr;
 	print "$secmd\n";
 	my $tf = "/tmp/st$$"."_se.tmp";
@@ -754,18 +869,32 @@ sub check_log_files {
 	    }
 	}
     }
+    my (%last, %err);
+    my $watched = watched_logs(\%last, \%err);
     if($nmsgs > 0) {
 	if($useReadwrite) {
 	    for($i=0; $i<$ndoms; $i++) {
 		my $echoout = "echo_results_c$card{$i}"."w$pair{$i}"."d$dom{$i}.out";
-		my $tail = `tail -1 $echoout`;
+		my $tail = defined $last{$echoout} ? $last{$echoout} : `tail -1 $echoout`;
 		print $tail;
-# /dev/dhc0w0dA: 1000 msgs (last 188B, 1.19 MB tot, 27.11 sec, 45.86 kB/sec, ARR=0)
+		print "First of $err{$echoout}[0] errors in $echoout: $err{$echoout}[1]\n"
+		    if $err{$echoout};
+# /dev/dhc0w0dA: 1000 msgs (last 188B, 1.19 MB tot, 27.11 sec, 45.86 kB/sec)
 		if($tail !~ m|/dev/dhc\d+w\d+d\S: \d+ msgs \(last|) {
                     print "Unexpected result in $echoout: $tail\n";
 		    $retval = 1;
 		}
 	    }
+	} elsif($watched && defined $last{"echo_results_all.out"}) {
+	    # Where each DOM has got to, rather than the whole history
+	    foreach my $key (sort grep /^echo_results_all\.out:/, keys %last) {
+		print $last{$key};
+	    }
+	    if($err{"echo_results_all.out"}) {
+		my ($n, $line) = @{$err{"echo_results_all.out"}};
+		print "Unexpected result echo_results_all.out ($n lines, first): $line\n";
+		$retval = 1;
+	    }
 	} else {
 	    my @lines = `cat echo_results_all.out`;
 	    for(@lines) {
@@ -781,8 +910,11 @@ sub check_log_files {
     if($ntcals > 0 && ! $skiptcal) {
 	for($i=0; $i<$ndoms; $i++) {
 	    my $tcalout = "tcal_results_c$card{$i}"."w$pair{$i}"."d$dom{$i}.out";
-	    my $tail = `grep -v RETRY $tcalout | tail -1 2>&1`;
+	    my $tail = defined $last{$tcalout} ? $last{$tcalout}
+		:      `grep -v RETRY $tcalout | tail -1 2>&1`;
 	    print $tail;
+	    print "First of $err{$tcalout}[0] errors in $tcalout: $err{$tcalout}[1]\n"
+		if $err{$tcalout};
 # /proc/driver/domhub/card0/pair0/domB/tcalib: 2380 tcals, 0 rdtimeouts, 0 wrtimeouts.
 	    if($tail !~ m|/proc/driver/domhub/card\d+/pair\d+/dom\S/tcalib: \d+ tcals|) {
                 print "Unexpected result in $tcalout - $tail\n";
@@ -791,16 +923,24 @@ sub check_log_files {
 	}
     }
     if($testgps) {
-	my @pfs = </proc/driver/domhub/card*/syncgps>;
-	for(@pfs) {
+	for(gps_procs) {
 	    m|/proc/driver/domhub/card(\d+)/syncgps|;
 	    my $outfile = "card$1_gps.out";
-	    my $tail = `tail -1 $outfile`;
+	    my $tail = defined $last{$outfile} ? $last{$outfile} : `tail -1 $outfile`;
 # GPS 320:19:31:11 TQUAL(' ' exclnt.,<1us) DOR 0000000056bd138c
 	    if($tail !~ /GPS.+?TQUAL.+?DOR/ || $tail =~ /fail/i) {
 		print "$outfile: $tail\n";
 		$retval = 1;
 	    }
+	    if($watched && defined $last{$outfile}) {
+		if($err{$outfile}) {
+		    my ($n, $line) = @{$err{$outfile}};
+		    print "$outfile: $line\n";
+		    print "$outfile: ...and ".($n-1)." more bad dt lines\n" if $n > 1;
+		    $retval = 1;
+		}
+		next;
+	    }
 	    my @grep = `grep -i 'bad dt' $outfile`;
 	    foreach my $line(@grep) {
 		chomp $line;
@@ -839,9 +979,17 @@ sub show_comm_stats {
     close F;
 }
 
-sub test_single_gps {
+sub gps_procs {
+    # Every card's GPS proc file, or as one lane of several only those
+    # of our DOMs' cards
     my @pfs = </proc/driver/domhub/card*/syncgps>;
-    for(@pfs) {
+    return @pfs unless $lane;
+    my %ours = map { $_ => 1 } values %card;
+    return grep { m|/card(\d+)/syncgps| && $ours{$1} } @pfs;
+}
+
+sub test_single_gps {
+    for(gps_procs) {
 	m|/proc/driver/domhub/card(\d+)/syncgps|;
 	print "Card $1: ";
 	my $result = `/usr/local/bin/readgps -o $_ 2>&1`;
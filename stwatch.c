@@ -0,0 +1,483 @@
+/* stwatch.c
+   Follow the output files of a stagedtests.pl run as they grow, so
+   that its monitoring and final check don't have to re-read them.
+
+   The watcher takes one inotify watch on the run directory and, when
+   a readwrite, tcaltest, echo-loop or readgps output file changes,
+   reads only the bytes appended since last time.  For each file it
+   keeps the latest counters, the last line (what 'tail -1' would
+   show; tcaltest's RETRY lines don't count) and the first error, in a
+   file-backed segment stwatch.map in the same directory, updated like
+   the livestats slots (see seqlock.h).  stwatch -q prints that
+   segment, which takes no time however long the files have got, and
+   still works after the watcher has gone.
+
+   A file which shrinks was rewritten (stagedtests truncates its
+   output files when it starts the jobs) and is read from the start
+   again.  SIGTERM or SIGINT makes the watcher read what was last
+   appended and exit.
+
+   Usage: stwatch [-q [-c]] [<dir>]
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <getopt.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <regex.h>
+#include <poll.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "seqlock.h"
+
+#define SW_MAGIC   0x53545743 /* "STWC" */
+#define SW_VERSION 1
+#define SW_NENT    512        /* Files, plus echo-loop's DOMs */
+#define SW_NAME    48
+#define SW_LINE    200        /* Longer lines are kept truncated */
+#define SW_MAPNAME "stwatch.map"
+#define SW_CHUNK   65536
+
+enum { K_READWRITE, K_TCALTEST, K_ECHOLOOP, K_ECHODOM, K_READGPS, K_NKIND };
+static const char *kindname[K_NKIND] = {
+  "readwrite", "tcaltest", "echo-loop", "echo-dom", "readgps"
+};
+static const char *kindpat[K_NKIND] = {
+  "echo_results_c*w*d?.out", "tcal_results_c*w*d?.out", "echo_results_all.out", NULL,
+  "card*_gps.out"
+};
+
+struct sw_ent {
+  uint32_t seq;                 /* Odd while being updated */
+  uint32_t kind;
+  char     name[SW_NAME];       /* File name; "echo_results_all.out:00A" for echo-dom */
+  uint64_t update_ns;           /* CLOCK_REALTIME */
+  uint64_t bytes, lines, errors;
+  uint64_t count[3];            /* msgs; tcals, rdtimeouts, wrtimeouts; GPS strings */
+  char     last[SW_LINE];
+  char     err[SW_LINE];
+} __attribute__((aligned(64)));
+
+struct sw_map {
+  uint32_t magic, version, nent;
+  int32_t  pid;                 /* Of the watcher */
+  uint32_t running;
+  char     pad[44];
+  struct sw_ent ent[SW_NENT];
+};
+
+int usage(void) {
+  fprintf(stderr,
+	  "Usage: stwatch [-q [-c]] [<dir>]\n"
+	  "  Watches the stagedtests output files in <dir> (default .) and keeps\n"
+	  "  each one's counters, last line and first error in <dir>/" SW_MAPNAME ",\n"
+	  "  until killed.\n"
+	  "  -q  print what the watcher has (or had) for <dir>, and exit:\n"
+	  "        <file> last <last line>\n"
+	  "        <file> err <count> <first error>\n"
+	  "  -c  with -q, CSV counters instead\n");
+  return -1;
+}
+
+static volatile int die = 0;
+void argghhhh() { die = 1; }
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/************* Watcher ******************/
+
+struct sw_file {
+  char   name[SW_NAME];
+  int    kind, fd, dirty;
+  off_t  off;
+  int    ncarry, skipping;      /* Partial last line; dropping an overlong one's rest */
+  char   carry[SW_LINE];
+  struct sw_ent *e;
+};
+
+static struct sw_map *map;
+static struct sw_file files[SW_NENT];
+static int nfile = 0;
+static regex_t re_rw, re_tc, re_chunk, re_dom, re_gps, re_baddt, re_err;
+
+static void sw_begin(struct sw_ent *e) {
+  seq_begin(&e->seq);
+}
+
+static void sw_end(struct sw_ent *e) {
+  e->update_ns = now_ns();
+  seq_end(&e->seq);
+}
+
+static struct sw_ent *new_ent(int kind, const char *name) {
+  if(map->nent == SW_NENT) return NULL;
+  struct sw_ent *e = &map->ent[map->nent];
+  e->kind = kind;
+  snprintf(e->name, SW_NAME, "%s", name);
+  __atomic_store_n(&map->nent, map->nent+1, __ATOMIC_RELEASE);
+  return e;
+}
+
+static void clear_ent(struct sw_ent *e) {
+  sw_begin(e);
+  e->bytes = e->lines = e->errors = 0;
+  memset(e->count, 0, sizeof(e->count));
+  e->last[0] = e->err[0] = '\0';
+  sw_end(e);
+}
+
+static void compile(regex_t *re, const char *pat, int flags) {
+  if(regcomp(re, pat, REG_EXTENDED|flags)) {
+    fprintf(stderr, "stwatch: bad pattern '%s'.\n", pat);
+    exit(-1);
+  }
+}
+
+static void compile_all(void) {
+  /* The same checks as stagedtests.pl's check_log_files */
+  compile(&re_rw,    "/dev/dhc[0-9]+w[0-9]+d[^[:space:]]: ([0-9]+) msgs \\(last", 0);
+  compile(&re_tc,    "/proc/driver/domhub/card[0-9]+/pair[0-9]+/dom[^[:space:]]/tcalib: "
+	  "([0-9]+) tcals(, ([0-9]+) [a-z]+, ([0-9]+))?", 0);
+  compile(&re_chunk, "^([0-9]+) msgs:$", 0);
+  compile(&re_dom,   "^[0-9][0-9][^[:space:]][[:space:]]+[0-9]+[[:space:]]+"
+	  "[^[:space:]]+[[:space:]]+[0-9]+$", REG_NOSUB);
+  compile(&re_gps,   "GPS.+TQUAL.+DOR", REG_NOSUB);
+  compile(&re_baddt, "[[:space:]]+BAD[[:space:]]+DT", REG_NOSUB|REG_ICASE);
+  compile(&re_err,   "timeout|error|fail|mismatch|unexpected|dropped below|overflow|"
+	  "strange|can't", REG_NOSUB|REG_ICASE);
+}
+
+static int kind_of(const char *name) {
+  int k;
+  for(k=0; k<K_NKIND; k++) {
+    if(kindpat[k] && !fnmatch(kindpat[k], name, 0)) return k;
+  }
+  return -1;
+}
+
+static struct sw_file *find_file(const char *name) {
+  int i;
+  for(i=0; i<nfile; i++) if(!strcmp(files[i].name, name)) return &files[i];
+  return NULL;
+}
+
+static struct sw_file *add_file(const char *name) {
+  struct sw_file *f = find_file(name);
+  if(f) return f;
+  int kind = kind_of(name);
+  if(kind < 0 || strlen(name) >= SW_NAME) return NULL;
+  struct sw_ent *e = new_ent(kind, name);
+  if(e == NULL) {
+    fprintf(stderr, "stwatch: too many files, not following %s.\n", name);
+    return NULL;
+  }
+  f = &files[nfile++];
+  snprintf(f->name, SW_NAME, "%s", name);
+  f->kind = kind;
+  f->fd   = -1;
+  f->e    = e;
+  return f;
+}
+
+/* Start a file over: it was truncated, or replaced by a new one */
+static void reset_file(struct sw_file *f) {
+  int i;
+  f->off = 0;
+  f->ncarry = f->skipping = 0;
+  clear_ent(f->e);
+  if(f->kind != K_ECHOLOOP) return;
+  for(i=0; i<map->nent; i++) {
+    struct sw_ent *d = &map->ent[i];
+    if(d->kind == K_ECHODOM && !strncmp(d->name, f->name, strlen(f->name))) clear_ent(d);
+  }
+}
+
+static void keep(char *to, const char *line) {
+  snprintf(to, SW_LINE, "%s", line);
+}
+
+static void first_error(struct sw_ent *e, const char *line) {
+  if(e->errors++ == 0) keep(e->err, line);
+}
+
+static uint64_t match_num(const char *line, const regmatch_t *m) {
+  return m->rm_so < 0 ? 0 : strtoull(line + m->rm_so, NULL, 10);
+}
+
+static void echo_dom(struct sw_file *f, const char *line) {
+  char name[SW_NAME];
+  int i;
+  snprintf(name, SW_NAME, "%.40s:%.3s", f->name, line);
+  struct sw_ent *d = NULL;
+  for(i=0; i<map->nent && d == NULL; i++) {
+    if(map->ent[i].kind == K_ECHODOM && !strcmp(map->ent[i].name, name)) d = &map->ent[i];
+  }
+  if(d == NULL && (d = new_ent(K_ECHODOM, name)) == NULL) return;
+  sw_begin(d);
+  d->lines++;
+  d->count[0]++;
+  keep(d->last, line);
+  sw_end(d);
+}
+
+/* One complete line of f; its entry is mid-update */
+static void do_line(struct sw_file *f, char *line) {
+  struct sw_ent *e = f->e;
+  regmatch_t m[5];
+  int n = strlen(line);
+  if(n > 0 && line[n-1] == '\r') line[--n] = '\0';
+  e->lines++;
+  switch(f->kind) {
+  case K_READWRITE:
+    keep(e->last, line);
+    if(!regexec(&re_rw, line, 2, m, 0))    e->count[0] = match_num(line, &m[1]);
+    else if(!regexec(&re_err, line, 0, NULL, 0)) first_error(e, line);
+    break;
+  case K_TCALTEST:
+    if(strstr(line, "RETRY")) break;
+    keep(e->last, line);
+    if(!regexec(&re_tc, line, 5, m, 0)) {
+      e->count[0] = match_num(line, &m[1]);
+      e->count[1] = match_num(line, &m[3]);
+      e->count[2] = match_num(line, &m[4]);
+    } else if(!regexec(&re_err, line, 0, NULL, 0)) {
+      first_error(e, line);
+    }
+    break;
+  case K_ECHOLOOP:
+    keep(e->last, line);
+    if(!regexec(&re_chunk, line, 2, m, 0))     e->count[0] += match_num(line, &m[1]);
+    else if(!regexec(&re_dom, line, 0, NULL, 0)) echo_dom(f, line);
+    else first_error(e, line);   /* stagedtests calls any other line unexpected */
+    break;
+  case K_READGPS:
+    keep(e->last, line);
+    if(!regexec(&re_gps, line, 0, NULL, 0)) e->count[0]++;
+    if(!regexec(&re_baddt, line, 0, NULL, 0)) first_error(e, line);
+    break;
+  }
+}
+
+/* Read and parse whatever was appended to f since last time */
+static void catch_up(struct sw_file *f) {
+  static char buf[SW_CHUNK];
+  struct stat st;
+  f->dirty = 0;
+  if(f->fd == -1 && (f->fd = open(f->name, O_RDONLY|O_CLOEXEC)) == -1) return;
+  if(fstat(f->fd, &st)) return;
+  if(st.st_size < f->off) reset_file(f);
+  while(f->off < st.st_size) {
+    ssize_t nr = pread(f->fd, buf, sizeof(buf), f->off);
+    if(nr <= 0) break;
+    f->off += nr;
+    sw_begin(f->e);
+    f->e->bytes = f->off;
+    char *p = buf, *end = buf + nr;
+    while(p < end) {
+      char *nl = memchr(p, '\n', end - p);
+      int len = (nl ? nl : end) - p;
+      if(!f->skipping) {
+	int room = SW_LINE-1 - f->ncarry;
+	if(len > room) {
+	  memcpy(f->carry + f->ncarry, p, room);
+	  f->ncarry += room;
+	  f->skipping = 1;
+	} else {
+	  memcpy(f->carry + f->ncarry, p, len);
+	  f->ncarry += len;
+	}
+      }
+      if(nl == NULL) break;
+      f->carry[f->ncarry] = '\0';
+      do_line(f, f->carry);
+      f->ncarry = f->skipping = 0;
+      p = nl + 1;
+    }
+    sw_end(f->e);
+  }
+}
+
+static void scan_dir(void) {
+  DIR *d = opendir(".");
+  struct dirent *de;
+  if(d == NULL) return;
+  while((de = readdir(d)) != NULL) {
+    struct sw_file *f = add_file(de->d_name);
+    if(f) f->dirty = 1;
+  }
+  closedir(d);
+}
+
+static struct sw_map *create_map(void) {
+  int fd = open(SW_MAPNAME, O_RDWR|O_CREAT|O_TRUNC, 0644);
+  if(fd == -1 || ftruncate(fd, sizeof(struct sw_map))) {
+    fprintf(stderr, "stwatch: can't create %s: %s\n", SW_MAPNAME, strerror(errno));
+    exit(-1);
+  }
+  struct sw_map *m = mmap(NULL, sizeof(struct sw_map), PROT_READ|PROT_WRITE, MAP_SHARED,
+			  fd, 0);
+  close(fd);
+  if(m == MAP_FAILED) {
+    fprintf(stderr, "stwatch: can't map %s: %s\n", SW_MAPNAME, strerror(errno));
+    exit(-1);
+  }
+  m->version = SW_VERSION;
+  m->pid     = getpid();
+  m->running = 1;
+  __atomic_store_n(&m->magic, SW_MAGIC, __ATOMIC_RELEASE);
+  return m;
+}
+
+static int watch(void) {
+  static char evbuf[SW_CHUNK] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct sigaction sa;
+  sigset_t block, waitmask;
+  int i;
+
+  compile_all();
+  map = create_map();
+
+  /* The signals are only let in while waiting in ppoll(), so one
+     which comes while we're reading can't be missed before we sleep */
+  sigemptyset(&block);
+  sigaddset(&block, SIGINT);
+  sigaddset(&block, SIGTERM);
+  sigprocmask(SIG_BLOCK, &block, &waitmask);
+  sigdelset(&waitmask, SIGINT);
+  sigdelset(&waitmask, SIGTERM);
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = argghhhh;
+  sigaction(SIGINT,  &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  int ifd = inotify_init1(IN_CLOEXEC);
+  if(ifd == -1 || inotify_add_watch(ifd, ".", IN_MODIFY|IN_CLOSE_WRITE|IN_CREATE
+				    |IN_MOVED_TO) == -1) {
+    fprintf(stderr, "stwatch: can't watch directory: %s\n", strerror(errno));
+    exit(-1);
+  }
+  scan_dir();   /* After the watch, so nothing created in between is missed */
+
+  while(1) {
+    for(i=0; i<nfile; i++) if(files[i].dirty) catch_up(&files[i]);
+    if(die) break;
+    struct pollfd pfd = { ifd, POLLIN, 0 };
+    if(ppoll(&pfd, 1, NULL, &waitmask) <= 0) continue;
+    ssize_t nr = read(ifd, evbuf, sizeof(evbuf));
+    if(nr <= 0) continue;
+    /* Just note which files changed: a burst of events for one file
+       costs a single read of it */
+    char *p;
+    for(p = evbuf; p < evbuf + nr; ) {
+      struct inotify_event *ev = (struct inotify_event *) p;
+      p += sizeof(*ev) + ev->len;
+      if(ev->mask & IN_Q_OVERFLOW) {
+	for(i=0; i<nfile; i++) files[i].dirty = 1;
+	scan_dir();
+	continue;
+      }
+      if(ev->len == 0) continue;
+      struct sw_file *f = add_file(ev->name);
+      if(f == NULL) continue;
+      if((ev->mask & (IN_CREATE|IN_MOVED_TO)) && f->fd != -1) {
+	close(f->fd);   /* A new file by the same name */
+	f->fd = -1;
+	reset_file(f);
+      }
+      f->dirty = 1;
+    }
+  }
+
+  /* Pick up the jobs' last words */
+  for(i=0; i<nfile; i++) catch_up(&files[i]);
+  __atomic_store_n(&map->running, 0, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/************* Query ******************/
+
+static int snapshot(const struct sw_ent *e, struct sw_ent *copy) {
+  return seq_snapshot(&e->seq, e, copy, sizeof(*copy));
+}
+
+static int query(int csv) {
+  struct stat st;
+  int i;
+  int fd = open(SW_MAPNAME, O_RDONLY);
+  if(fd == -1 || fstat(fd, &st) || st.st_size < sizeof(struct sw_map)) {
+    fprintf(stderr, "stwatch: no %s here: %s\n", SW_MAPNAME,
+	    fd == -1 ? strerror(errno) : "too short");
+    return -1;
+  }
+  const struct sw_map *m = mmap(NULL, sizeof(struct sw_map), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED || m->magic != SW_MAGIC || m->version != SW_VERSION) {
+    fprintf(stderr, "stwatch: %s isn't from this version.\n", SW_MAPNAME);
+    return -1;
+  }
+  uint64_t t = now_ns();
+  uint32_t nent = __atomic_load_n(&m->nent, __ATOMIC_ACQUIRE);
+  if(nent > SW_NENT) nent = SW_NENT;
+  int running = m->running && !(kill(m->pid, 0) == -1 && errno == ESRCH);
+
+  if(csv) {
+    printf("file,kind,bytes,lines,count0,count1,count2,errors,age_s\n");
+  } else {
+    printf("# stwatch %d %s, %u entries\n", m->pid, running ? "running" : "stopped", nent);
+  }
+  for(i=0; i<nent; i++) {
+    struct sw_ent e;
+    int torn = snapshot(&m->ent[i], &e);
+    if(e.lines == 0) continue;
+    double age = e.update_ns && t > e.update_ns ? (t - e.update_ns)*1.E-9 : 0;
+    if(csv) {
+      printf("%s,%s,%llu,%llu,%llu,%llu,%llu,%llu,%.1f\n", e.name,
+	     e.kind < K_NKIND ? kindname[e.kind] : "?", (unsigned long long) e.bytes,
+	     (unsigned long long) e.lines, (unsigned long long) e.count[0],
+	     (unsigned long long) e.count[1], (unsigned long long) e.count[2],
+	     (unsigned long long) e.errors, age);
+      continue;
+    }
+    if(torn) printf("%s torn\n", e.name);
+    printf("%s last %s\n", e.name, e.last);
+    if(e.errors) printf("%s err %llu %s\n", e.name, (unsigned long long) e.errors, e.err);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int q = 0, csv = 0;
+
+  while(1) {
+    char c = getopt(argc, argv, "hqc");
+    if(c == -1) break;
+    switch(c) {
+    case 'q': q   = 1; break;
+    case 'c': csv = 1; break;
+    case 'h':
+    default:
+      exit(usage());
+    }
+  }
+  if(argc - optind > 1 || (csv && !q)) exit(usage());
+  if(optind < argc && chdir(argv[optind])) {
+    fprintf(stderr, "stwatch: can't chdir to %s: %s\n", argv[optind], strerror(errno));
+    exit(-1);
+  }
+  exit(q ? query(csv) : watch());
+}
@@ -0,0 +1,144 @@
+/* tcal2txt.c
+   Print the records in a tcaltest -a archive in tcaltest's text form,
+   so that the scripts which read saved tcal data keep working:
+
+     tcal2txt tcal_data_c0w0dA.tca > tcal_data_c0w0dA.out
+
+   Uses the archive's index to start at a given host time or trial
+   number without reading what comes before.
+*/
+
+#include <sys/types.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include <linux/types.h>
+#include "tcalarch.h"
+
+int usage(void) {
+  fprintf(stderr,
+	  "Usage: tcal2txt [options] <archive>\n"
+	  "  Options: [-d <dom>]    only DOM <dom> (e.g. 00a)\n"
+	  "           [-t <trial>]  start at trial number <trial>\n"
+	  "           [-s <time>]   start at host time <time> (seconds since the epoch)\n"
+	  "           [-n <count>]  print at most <count> records\n"
+	  "           [-b]          only records which failed the quality check\n"
+	  "           [-l]          describe the archive instead\n");
+  return -1;
+}
+
+static void dom_name(char *buf, int len, int idom) {
+  if(idom < 0 || idom >= DH_MAXDOMS) {
+    snprintf(buf, len, "???");
+    return;
+  }
+  snprintf(buf, len, "%d%d%c", idom/(DH_NPAIR*DH_NDOM), (idom/DH_NDOM)%DH_NPAIR,
+	   'A' + idom%DH_NDOM);
+}
+
+static void describe(const char *path, struct tca_reader *r) {
+  struct tca_rec rec;
+  long nrec[DH_MAXDOMS+1], nbad = 0, nindex = 0, i;
+  uint64_t tfirst = 0, tlast = 0;
+  char name[8];
+  time_t t = r->hdr.created_ns/1000000000ULL;
+  memset(nrec, 0, sizeof(nrec));
+  for(i=0; i<r->nslot; i++) {
+    if(tca_get(r, i, &rec) == TCA_INDEX) {
+      nindex++;
+      continue;
+    }
+    nrec[rec.dom < DH_MAXDOMS ? rec.dom : DH_MAXDOMS]++;
+    if(rec.flags & TCA_BAD) nbad++;
+    if(tfirst == 0) tfirst = rec.host_ns;
+    tlast = rec.host_ns;
+  }
+  dom_name(name, sizeof(name), r->hdr.dom);
+  printf("%s: version %u, %u byte records, index every %u, DOR clock %u MHz\n", path,
+	 r->hdr.version, r->hdr.reclen, r->hdr.index_every, r->hdr.dor_clock);
+  printf("  written on %s for %s, created %s", r->hdr.host,
+	 r->hdr.dom == TCA_MULTI ? "several DOMs" : name, ctime(&t));
+  printf("  %ld slots, %ld index slots, %ld bad records, %.1f seconds\n", r->nslot,
+	 nindex, nbad, tlast > tfirst ? (tlast - tfirst)*1.E-9 : 0.);
+  for(i=0; i<=DH_MAXDOMS; i++) {
+    if(!nrec[i]) continue;
+    dom_name(name, sizeof(name), i);
+    printf("  %s: %ld records\n", name, nrec[i]);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  struct tca_reader r;
+  struct tca_rec rec;
+  struct dh_tcalib_t tcalrec;
+  struct dh_dom dom;
+  int idom = -1, list = 0, onlybad = 0;
+  long trial = -1, count = -1, i;
+  double tstart = -1;
+  char name[8];
+
+  while(1) {
+    int c = getopt(argc, argv, "hlbd:t:s:n:");
+    if(c == -1) break;
+    switch(c) {
+    case 'd':
+      if(dh_parse_dom(&dom, optarg) || dom.icard < 0) exit(usage());
+      idom = dh_dom_index(dom.icard, dom.ipair, dom.cdom);
+      break;
+    case 't': trial   = atol(optarg); break;
+    case 's': tstart  = atof(optarg); break;
+    case 'n': count   = atol(optarg); break;
+    case 'b': onlybad = 1; break;
+    case 'l': list    = 1; break;
+    case 'h':
+    default: exit(usage());
+    }
+  }
+  if(optind != argc-1) exit(usage());
+  if(tca_open_read(&r, argv[optind])) exit(-1);
+
+  if(list) {
+    describe(argv[optind], &r);
+    tca_close_read(&r);
+    return 0;
+  }
+
+  /* One DOM's records print just as tcaltest prints them; with several,
+     each is prefixed with its DOM, as tcaltest -D does */
+  int prefix = idom < 0 && r.hdr.dom == TCA_MULTI;
+  uint64_t tns = tstart > 0 ? (uint64_t) (tstart*1.E9) : 0;
+  long first = 0;
+  if(trial >= 0) first = tca_seek_trial(&r, idom, trial);
+  if(tns > 0) {
+    long f = tca_seek_time(&r, tns);
+    if(f > first) first = f;
+  }
+
+  for(i=first; i<r.nslot && count != 0; i++) {
+    if(tca_get(&r, i, &rec) != TCA_REC) continue;
+    if(idom >= 0 && rec.dom != idom) continue;
+    if(trial >= 0 && rec.trial < trial) continue;
+    if(rec.host_ns < tns) continue;
+    if(onlybad && !(rec.flags & TCA_BAD)) continue;
+    dh_tcalib_unpack(&tcalrec, rec.packed);
+    if(prefix) {
+      dom_name(name, sizeof(name), rec.dom);
+      printf("%s ", name);
+    }
+    printf("cal(%u) ", rec.trial);
+    show_tcalrec(stdout, &tcalrec);
+    printf("\n");
+    if(count > 0) count--;
+  }
+  tca_close_read(&r);
+  if(fflush(stdout)) {
+    fprintf(stderr, "tcal2txt: %s\n", strerror(errno));
+    exit(-1);
+  }
+  return 0;
+}
@@ -0,0 +1,336 @@
+/* tcalarch.c
+   Binary time calibration archive; see tcalarch.h.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/types.h>
+#include "tcalarch.h"
+
+static void put16(unsigned char *p, uint32_t v) { p[0] = v; p[1] = v >> 8; }
+static void put32(unsigned char *p, uint32_t v) { put16(p, v); put16(p+2, v >> 16); }
+static void put64(unsigned char *p, uint64_t v) { put32(p, v); put32(p+4, v >> 32); }
+static uint32_t get16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+static uint32_t get32(const unsigned char *p) { return get16(p) | (get16(p+2) << 16); }
+static uint64_t get64(const unsigned char *p) {
+  return get32(p) | ((uint64_t) get32(p+4) << 32);
+}
+
+uint64_t tca_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+static void encode_header(unsigned char *b, const struct tca_header *h) {
+  memset(b, 0, TCA_HDRLEN);
+  memcpy(b, TCA_MAGIC, 8);
+  put32(b+8,  h->version);
+  put32(b+12, h->slotlen);
+  put32(b+16, h->reclen);
+  put32(b+20, h->index_every);
+  put32(b+24, h->dor_clock);
+  put32(b+28, h->dom);
+  put64(b+32, h->created_ns);
+  memcpy(b+40, h->host, sizeof(h->host));
+}
+
+static int decode_header(const char *path, const unsigned char *b, size_t len,
+			 struct tca_header *h) {
+  if(len < TCA_HDRLEN || memcmp(b, TCA_MAGIC, 8)) {
+    fprintf(stderr, "%s isn't a tcal archive.\n", path);
+    return -1;
+  }
+  h->version     = get32(b+8);
+  h->slotlen     = get32(b+12);
+  h->reclen      = get32(b+16);
+  h->index_every = get32(b+20);
+  h->dor_clock   = get32(b+24);
+  h->dom         = get32(b+28);
+  h->created_ns  = get64(b+32);
+  memcpy(h->host, b+40, sizeof(h->host));
+  h->host[sizeof(h->host)-1] = '\0';
+  if(h->version != TCA_VERSION || h->reclen != DH_TCAL_STRUCT_LEN
+     || h->slotlen != TCA_SLOTLEN || h->index_every < 1) {
+    fprintf(stderr, "%s: unsupported tcal archive (version %u, %u byte records).\n",
+	    path, h->version, h->reclen);
+    return -1;
+  }
+  return 0;
+}
+
+static int decode_slot(const unsigned char *b, struct tca_rec *rec) {
+  int i;
+  rec->type    = b[0];
+  rec->flags   = b[1];
+  rec->dom     = get16(b+2);
+  rec->trial   = get32(b+4);
+  rec->host_ns = get64(b+8);
+  if(rec->type == TCA_INDEX) {
+    rec->nrec = get64(b+16);
+    for(i=0; i<DH_MAXDOMS; i++) rec->next_trial[i] = get32(b+24+4*i);
+  } else {
+    memcpy(rec->packed, b+TCA_PREFIXLEN, DH_TCAL_STRUCT_LEN);
+  }
+  return rec->type;
+}
+
+static int is_index_slot(const struct tca_header *h, long i) {
+  return i % (h->index_every+1) == 0;
+}
+
+/************* Writing ******************/
+
+static int write_slot(struct tca_writer *w, const unsigned char *b) {
+  if(fwrite(b, TCA_SLOTLEN, 1, w->fp) != 1) return -1;
+  w->nslot++;
+  return 0;
+}
+
+static int write_index(struct tca_writer *w, uint64_t host_ns) {
+  unsigned char b[TCA_SLOTLEN];
+  int i;
+  memset(b, 0, sizeof(b));
+  b[0] = TCA_INDEX;
+  put16(b+2, DH_MAXDOMS);
+  put64(b+8, host_ns);
+  put64(b+16, w->nrec);
+  for(i=0; i<DH_MAXDOMS; i++) put32(b+24+4*i, w->next_trial[i]);
+  if(write_slot(w, b)) return -1;
+  /* Get everything up to here onto disk now and then */
+  return fflush(w->fp) ? -1 : 0;
+}
+
+static int resume(struct tca_writer *w, const char *path, int fd, off_t size) {
+  /* Pick up the counts from the last index slot and the records after
+     it, and drop any partial slot at the end */
+  unsigned char b[TCA_SLOTLEN];
+  struct tca_rec rec;
+  long i;
+  w->nslot = (size - TCA_HDRLEN)/TCA_SLOTLEN;
+  if(ftruncate(fd, TCA_HDRLEN + (off_t) w->nslot*TCA_SLOTLEN)) {
+    fprintf(stderr, "Can't truncate %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  if(w->nslot == 0) return 0;
+  for(i = (w->nslot-1) - (w->nslot-1)%(w->hdr.index_every+1); i < w->nslot; i++) {
+    if(pread(fd, b, TCA_SLOTLEN, TCA_HDRLEN + (off_t) i*TCA_SLOTLEN) != TCA_SLOTLEN) {
+      fprintf(stderr, "Can't read %s: %s\n", path, strerror(errno));
+      return -1;
+    }
+    if(decode_slot(b, &rec) == TCA_INDEX) {
+      w->nrec = rec.nrec;
+      memcpy(w->next_trial, rec.next_trial, sizeof(w->next_trial));
+    } else {
+      w->nrec++;
+      if(rec.dom < DH_MAXDOMS) w->next_trial[rec.dom] = rec.trial+1;
+    }
+  }
+  return 0;
+}
+
+int tca_open_write(struct tca_writer *w, const char *path, int dom, int dor_clock) {
+  unsigned char b[TCA_HDRLEN];
+  struct stat st;
+  memset(w, 0, sizeof(*w));
+  int fd = open(path, O_RDWR|O_CREAT, 0644);
+  if(fd < 0 || fstat(fd, &st)) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    if(fd >= 0) close(fd);
+    return -1;
+  }
+  if(st.st_size > 0) {
+    if(pread(fd, b, TCA_HDRLEN, 0) != TCA_HDRLEN
+       || decode_header(path, b, TCA_HDRLEN, &w->hdr)) {
+      close(fd);
+      return -1;
+    }
+    if(w->hdr.dom != (uint32_t) dom) {
+      fprintf(stderr, "%s was written for a different DOM (set).\n", path);
+      close(fd);
+      return -1;
+    }
+    if(resume(w, path, fd, st.st_size)) {
+      close(fd);
+      return -1;
+    }
+  } else {
+    w->hdr.version     = TCA_VERSION;
+    w->hdr.slotlen     = TCA_SLOTLEN;
+    w->hdr.reclen      = DH_TCAL_STRUCT_LEN;
+    w->hdr.index_every = TCA_INDEX_EVERY;
+    w->hdr.dor_clock   = dor_clock;
+    w->hdr.dom         = dom;
+    w->hdr.created_ns  = tca_now_ns();
+    gethostname(w->hdr.host, sizeof(w->hdr.host)-1);
+    encode_header(b, &w->hdr);
+    if(pwrite(fd, b, TCA_HDRLEN, 0) != TCA_HDRLEN) {
+      fprintf(stderr, "Can't write %s: %s\n", path, strerror(errno));
+      close(fd);
+      return -1;
+    }
+  }
+  w->fp = fdopen(fd, "r+");
+  if(w->fp == NULL || fseeko(w->fp, 0, SEEK_END)) {
+    fprintf(stderr, "Can't write %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return 0;
+}
+
+int tca_append(struct tca_writer *w, int dom, uint32_t trial, uint64_t host_ns, int flags,
+	       const unsigned char *packed) {
+  unsigned char b[TCA_SLOTLEN];
+  if(is_index_slot(&w->hdr, w->nslot) && write_index(w, host_ns)) return -1;
+  if(dom < 0 || dom >= DH_MAXDOMS) dom = TCA_NODOM;
+  b[0] = TCA_REC;
+  b[1] = flags;
+  put16(b+2, dom);
+  put32(b+4, trial);
+  put64(b+8, host_ns);
+  memcpy(b+TCA_PREFIXLEN, packed, DH_TCAL_STRUCT_LEN);
+  if(write_slot(w, b)) return -1;
+  w->nrec++;
+  if(dom != TCA_NODOM) w->next_trial[dom] = trial+1;
+  return 0;
+}
+
+int tca_close(struct tca_writer *w) {
+  if(w->fp == NULL) return 0;
+  int err = ferror(w->fp);
+  if(fclose(w->fp)) err = 1;
+  w->fp = NULL;
+  return err ? -1 : 0;
+}
+
+/************* Reading ******************/
+
+int tca_open_read(struct tca_reader *r, const char *path) {
+  struct stat st;
+  memset(r, 0, sizeof(*r));
+  r->fd = open(path, O_RDONLY);
+  if(r->fd < 0 || fstat(r->fd, &st)) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    return -1;
+  }
+  r->len = st.st_size;
+  if(r->len < TCA_HDRLEN) {
+    fprintf(stderr, "%s isn't a tcal archive.\n", path);
+    close(r->fd);
+    return -1;
+  }
+  r->map = mmap(NULL, r->len, PROT_READ, MAP_SHARED, r->fd, 0);
+  if(r->map == MAP_FAILED) {
+    fprintf(stderr, "Can't map %s: %s\n", path, strerror(errno));
+    close(r->fd);
+    return -1;
+  }
+  if(decode_header(path, r->map, r->len, &r->hdr)) {
+    tca_close_read(r);
+    return -1;
+  }
+  madvise((void *) r->map, r->len, MADV_SEQUENTIAL);
+  r->nslot = (r->len - TCA_HDRLEN)/TCA_SLOTLEN;
+  return 0;
+}
+
+void tca_close_read(struct tca_reader *r) {
+  if(r->map && r->map != MAP_FAILED) munmap((void *) r->map, r->len);
+  if(r->fd >= 0) close(r->fd);
+  r->map = NULL;
+  r->fd  = -1;
+}
+
+int tca_get(const struct tca_reader *r, long i, struct tca_rec *rec) {
+  if(i < 0 || i >= r->nslot) return -1;
+  return decode_slot(r->map + TCA_HDRLEN + (size_t) i*TCA_SLOTLEN, rec);
+}
+
+int tca_peek(const struct tca_reader *r, long i, int *dom, uint32_t *trial,
+	     const unsigned char **packed) {
+  const unsigned char *b;
+  if(i < 0 || i >= r->nslot) return -1;
+  b = r->map + TCA_HDRLEN + (size_t) i*TCA_SLOTLEN;
+  if(b[0] == TCA_REC) {
+    *dom    = get16(b+2);
+    *trial  = get32(b+4);
+    *packed = b + TCA_PREFIXLEN;
+  }
+  return b[0];
+}
+
+static long last_index_before(const struct tca_reader *r,
+			      int (*before)(const unsigned char *, const void *),
+			      const void *arg) {
+  /* Binary search the index slots for the last one where before() is
+     true; before() must be true up to some slot and false after it */
+  long every = r->hdr.index_every+1;
+  long lo = 0, hi = (r->nslot + every - 1)/every - 1;
+  if(hi < 0) return 0;
+  while(lo < hi) {
+    long mid = (lo + hi + 1)/2;
+    if(before(r->map + TCA_HDRLEN + (size_t) mid*every*TCA_SLOTLEN, arg)) lo = mid;
+    else hi = mid-1;
+  }
+  return lo*every;
+}
+
+static int time_before(const unsigned char *b, const void *arg) {
+  return get64(b+8) < *(const uint64_t *) arg;
+}
+
+long tca_seek_time(const struct tca_reader *r, uint64_t ns) {
+  return last_index_before(r, time_before, &ns);
+}
+
+struct trialkey {
+  int dom;
+  uint32_t trial;
+};
+
+static int trial_before(const unsigned char *b, const void *arg) {
+  /* Nothing at or past the trial has been written before this slot */
+  const struct trialkey *k = arg;
+  int i;
+  if(k->dom >= 0) return get32(b+24+4*k->dom) <= k->trial;
+  for(i=0; i<DH_MAXDOMS; i++) if(get32(b+24+4*i) > k->trial) return 0;
+  return 1;
+}
+
+long tca_seek_trial(const struct tca_reader *r, int dom, uint32_t trial) {
+  struct trialkey k;
+  k.dom   = dom < DH_MAXDOMS ? dom : -1;
+  k.trial = trial;
+  return last_index_before(r, trial_before, &k);
+}
+
+/************* Text form ******************/
+
+void show_tcalrec(FILE *fp, struct dh_tcalib_t * tcalrec) {
+  int i;
+  fprintf(fp, "dor_tx(0x%llx) ", (unsigned long long) tcalrec->dor_t0);
+  fprintf(fp, "dor_rx(0x%llx) ", (unsigned long long) tcalrec->dor_t3);
+  fprintf(fp, "dom_rx(0x%llx) ", (unsigned long long) tcalrec->dom_t1);
+  fprintf(fp, "dom_tx(0x%llx)\n", (unsigned long long) tcalrec->dom_t2);
+  fprintf(fp, "dor_wf(");
+  for(i=0; i < DH_MAX_TCAL_WF_LEN-1; i++) {
+    fprintf(fp, "%d, ", tcalrec->dorwf[i]);
+  }
+  fprintf(fp, "%d)\n", tcalrec->dorwf[DH_MAX_TCAL_WF_LEN-1]);
+
+  fprintf(fp, "dom_wf(");
+  for(i=0; i < DH_MAX_TCAL_WF_LEN-1; i++) {
+    fprintf(fp, "%d, ", tcalrec->domwf[i]);
+  }
+  fprintf(fp, "%d)\n", tcalrec->domwf[DH_MAX_TCAL_WF_LEN-1]);
+}
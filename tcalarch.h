@@ -0,0 +1,123 @@
+/* tcalarch.h
+   Append-only binary archive of time calibration records, written by
+   tcaltest -a and turned back into tcaltest's text form by tcal2txt.
+
+   Layout (all integers little-endian):
+     header   TCA_HDRLEN bytes: magic "MOATTCAL", version, slot and
+	      record lengths, index interval, DOR clock, creation time,
+	      the DOM (or TCA_MULTI), host name
+     slots    TCA_SLOTLEN bytes each, back to back.  Slot 0 and every
+	      (index_every+1)th slot after it is an index slot; the rest
+	      are records.
+   A record is a 16 byte prefix (type, flags, DOM index, trial number,
+   host time in ns) followed by the DH_TCAL_STRUCT_LEN packed tcal.  An
+   index slot holds the host time, the number of records so far and
+   each DOM's next trial number, so a reader can binary search the
+   index slots by time or by trial and scan at most index_every
+   records.  A partial slot at the end (a crash while writing) is
+   ignored, and is overwritten when the archive is appended to.
+
+   Must include <linux/types.h> first.
+*/
+
+#ifndef __TCALARCH_H__
+#define __TCALARCH_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "dh_tcalib.h"
+#include "domhub.h"
+
+#define TCA_MAGIC      "MOATTCAL"
+#define TCA_VERSION    1
+#define TCA_HDRLEN     64
+#define TCA_PREFIXLEN  16
+#define TCA_SLOTLEN    (TCA_PREFIXLEN + DH_TCAL_STRUCT_LEN)
+#define TCA_INDEX_EVERY 1024
+#define TCA_MULTI      0xFFFF      /* Header DOM for multi-DOM archives */
+#define TCA_NODOM      0xFFFF      /* Record DOM when it isn't a hub DOM */
+
+#define TCA_REC        1           /* Slot types */
+#define TCA_INDEX      2
+
+#define TCA_BAD        0x01        /* Record flag: failed the quality check */
+
+struct tca_header {
+  uint32_t version;
+  uint32_t slotlen;
+  uint32_t reclen;                 /* DH_TCAL_STRUCT_LEN when written */
+  uint32_t index_every;
+  uint32_t dor_clock;              /* MHz */
+  uint32_t dom;                    /* dh_dom_index(), or TCA_MULTI */
+  uint64_t created_ns;             /* CLOCK_REALTIME */
+  char     host[24];
+};
+
+struct tca_rec {
+  int      type;                   /* TCA_REC or TCA_INDEX */
+  int      flags;
+  int      dom;
+  uint32_t trial;
+  uint64_t host_ns;
+  unsigned char packed[DH_TCAL_STRUCT_LEN];
+  /* Index slots only */
+  uint64_t nrec;
+  uint32_t next_trial[DH_MAXDOMS];
+};
+
+struct tca_writer {
+  FILE    *fp;
+  struct tca_header hdr;
+  long     nslot;
+  uint64_t nrec;
+  uint32_t next_trial[DH_MAXDOMS];
+};
+
+struct tca_reader {
+  int      fd;
+  const unsigned char *map;
+  size_t   len;
+  struct tca_header hdr;
+  long     nslot;
+};
+
+/* Host time now, ns since the epoch */
+uint64_t tca_now_ns(void);
+
+/* Create an archive, or append to an existing one (whose DOM and
+   layout must match).  dom is a dh_dom_index() or TCA_MULTI.  Returns
+   0, or -1 with a message on stderr. */
+int tca_open_write(struct tca_writer *w, const char *path, int dom, int dor_clock);
+
+/* Append one record; dom is a dh_dom_index() or TCA_NODOM.  Returns 0
+   or -1 on a write error. */
+int tca_append(struct tca_writer *w, int dom, uint32_t trial, uint64_t host_ns, int flags,
+	       const unsigned char *packed);
+
+/* Flush and close; returns -1 if anything failed to reach the file */
+int tca_close(struct tca_writer *w);
+
+/* Map an archive for reading.  Returns 0, or -1 with a message. */
+int tca_open_read(struct tca_reader *r, const char *path);
+void tca_close_read(struct tca_reader *r);
+
+/* Decode slot i; returns its type, or -1 if i is out of range */
+int tca_get(const struct tca_reader *r, long i, struct tca_rec *rec);
+
+/* Slot i in place, without copying: its type and, for a record, the
+   DOM, trial and packed tcal (valid until tca_close_read()).  The
+   packed tcals of slots i, i+1, ... are TCA_SLOTLEN bytes apart. */
+int tca_peek(const struct tca_reader *r, long i, int *dom, uint32_t *trial,
+	     const unsigned char **packed);
+
+/* First slot to scan from for records at or after host time ns, or for
+   the given DOM's trial (dom < 0: any DOM's).  Records after the
+   returned slot may still be earlier; the caller skips those. */
+long tca_seek_time(const struct tca_reader *r, uint64_t ns);
+long tca_seek_trial(const struct tca_reader *r, int dom, uint32_t trial);
+
+/* tcaltest's text form of a tcal */
+void show_tcalrec(FILE *fp, struct dh_tcalib_t *tcalrec);
+
+#endif /* __TCALARCH_H__ */
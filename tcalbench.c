@@ -0,0 +1,146 @@
+/* tcalbench.c
+   Check and micro-benchmark the time calibration waveform kernel in
+   tcalwf.c: every implementation must agree with the others, and with
+   the threshold scan tcaltest used to do, on synthetic pulses; then
+   how many records per second each analyzes per core.  No DOR hardware
+   needed.
+
+   Usage: tcalbench [seconds_per_kernel]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/types.h>
+#include "tcalwf.h"
+
+#define SECS_DEFAULT 0.5
+#define NREC         4096   /* About 1 MB of records, more than L1 and L2 */
+#define BATCH        32
+#define THRESH       50
+
+static struct dh_tcalib_t *recs;
+static struct tw_result *res;
+static volatile float sink;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec*1.E-9;
+}
+
+/* A pulse like the ones the DOR and DOM digitize, at a random place
+   and height; sometimes flat, sometimes with odd values */
+static void make_pulse(u16 *wf, unsigned int *seed) {
+  static const int shape[] = { 4, 10, 22, 40, 55, 53, 42, 28, 17, 10, 6, 3, 2, 1 };
+  int i, base = 90 + rand_r(seed)%40, t0 = rand_r(seed)%70 - 4;
+  int height = rand_r(seed)%4 == 0 ? rand_r(seed)%20 : 2 + rand_r(seed)%12;
+  for(i=0; i<DH_MAX_TCAL_WF_LEN; i++) {
+    int k = i - t0, v = base + rand_r(seed)%5 - 2;
+    if(k >= 0 && k < sizeof(shape)/sizeof(shape[0])) v += height*shape[k];
+    wf[i] = v;
+  }
+  switch(rand_r(seed)%50) {
+  case 0: for(i=0; i<DH_MAX_TCAL_WF_LEN; i++) wf[i] = 0;      break;
+  case 1: wf[rand_r(seed)%DH_MAX_TCAL_WF_LEN] = 0xFFFF;        break;
+  case 2: for(i=0; i<4; i++) wf[i] = 0xFFF0;                   break;
+  case 3: wf[DH_MAX_TCAL_WF_LEN-1] = 0x8000;                   break;
+  }
+}
+
+/* What tcaltest's waveform check used to do */
+static int old_check(const u16 *wf, int rounded) {
+  int i, baseline = rounded ? (int) ((wf[0] + wf[1] + wf[2] + wf[3])/4.0 + 0.5)
+    : (wf[0] + wf[1] + wf[2] + wf[3])/4;
+  for(i=0; i<DH_MAX_TCAL_WF_LEN; i++)
+    if(wf[i] - baseline > THRESH) return 1;
+  return 0;
+}
+
+static int same(const struct tw_pulse *a, const struct tw_pulse *b) {
+  return a->baseline == b->baseline && a->peak == b->peak && a->ipeak == b->ipeak
+    && a->edge == b->edge;
+}
+
+static int check(void) {
+  struct tw_result *r2 = malloc(NREC*sizeof(struct tw_result));
+  int i, bad = 0;
+  tw_analyze_scalar(recs, NREC, THRESH, THRESH, res);
+  if(tw_have_avx2()) tw_analyze_avx2(recs, NREC, THRESH, THRESH, r2);
+  else memcpy(r2, res, NREC*sizeof(struct tw_result));
+  for(i=0; i<NREC && bad < 10; i++) {
+    const struct tw_pulse *p[2] = { &res[i].dor, &res[i].dom };
+    const u16 *wf[2] = { recs[i].dorwf, recs[i].domwf };
+    int k;
+    if(!same(&res[i].dor, &r2[i].dor) || !same(&res[i].dom, &r2[i].dom)) {
+      fprintf(stderr, "Record %d: scalar and AVX2 kernels disagree!\n", i);
+      bad++;
+    }
+    for(k=0; k<2; k++) {
+      if((p[k]->edge >= 0) != old_check(wf[k], k == 0)) {
+	fprintf(stderr, "Record %d %s: edge %.2f but old check says %s!\n", i,
+		k ? "DOM" : "DOR", p[k]->edge, old_check(wf[k], k == 0) ? "pass" : "fail");
+	bad++;
+      }
+      if(p[k]->edge >= 0 && (p[k]->edge > p[k]->ipeak
+			     || wf[k][p[k]->ipeak] != p[k]->peak)) {
+	fprintf(stderr, "Record %d %s: edge %.2f, peak %d at %d don't fit!\n", i,
+		k ? "DOM" : "DOR", p[k]->edge, p[k]->peak, p[k]->ipeak);
+	bad++;
+      }
+    }
+  }
+  free(r2);
+  return bad;
+}
+
+static void bench(const char *name,
+		  void (*fn)(const struct dh_tcalib_t *, int, int, int, struct tw_result *),
+		  double secs) {
+  long n = 0;
+  int i;
+  double t0 = now(), dt;
+  do {
+    for(i=0; i<NREC; i += BATCH) fn(recs+i, BATCH, THRESH, THRESH, res+i);
+    n += NREC;
+  } while((dt = now() - t0) < secs);
+  sink = res[NREC-1].dom.edge;
+  printf("%-24s %8.2f M records/s %8.1f ns/record\n", name, n/dt*1.E-6, dt/n*1.E9);
+}
+
+int main(int argc, char *argv[]) {
+  double secs = SECS_DEFAULT;
+  unsigned int seed = 1;
+  int i, npass = 0;
+
+  if(argc > 1 && (secs = atof(argv[1])) <= 0) {
+    fprintf(stderr, "Usage: tcalbench [seconds_per_kernel]\n");
+    exit(-1);
+  }
+  recs = malloc(NREC*sizeof(struct dh_tcalib_t));
+  res  = malloc(NREC*sizeof(struct tw_result));
+  if(!recs || !res) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(-1);
+  }
+  memset(recs, 0, NREC*sizeof(struct dh_tcalib_t));
+  for(i=0; i<NREC; i++) {
+    make_pulse(recs[i].dorwf, &seed);
+    make_pulse(recs[i].domwf, &seed);
+  }
+
+  if(check()) exit(-1);
+  for(i=0; i<NREC; i++) npass += res[i].dor.edge >= 0 && res[i].dom.edge >= 0;
+  printf("%d records (%d pass), %d per batch, AVX2 %s\n", NREC, npass, BATCH,
+	 tw_have_avx2() ? "yes" : "no");
+
+  bench("waveforms scalar", tw_analyze_scalar, secs);
+  if(tw_have_avx2()) bench("waveforms avx2", tw_analyze_avx2, secs);
+  bench("waveforms (dispatched)", tw_analyze, secs);
+
+  free(res);
+  free(recs);
+  return 0;
+}
@@ -14,14 +14,28 @@
 #define _GNU_SOURCE
 #include <getopt.h>
 #include <signal.h>
+#include <stdint.h>
+#include <sys/poll.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <math.h>
 
 #include <linux/types.h>
 #include "dh_tcalib.h"
+#include "domhub.h"
+#include "tcalarch.h"
+#include "tcalwf.h"
+#include "clockfit.h"
+#include "gpsidx.h"
+#include "livestats.h"
 
 #define DOM_WF_THRESH 50
 #define DOR_WF_THRESH 50
 #define MAX_DOM_TSTAMP_DIFF 1000
 #define MAX_DOR_TSTAMP_DIFF 1600
+#define CLOCKBITS 48
+#define MASK      ((1LL << CLOCKBITS)-1)
+#define DOR_FREQ  20000000
 
 //#define DEBUG
 #ifdef DEBUG
@@ -32,39 +46,98 @@
 
 int usage(void) { 
   printf("Usage:  tcaltest [<card><pair><dom>|<procfile>] <ntrials>\n"
+	 "        tcaltest -D <domset> <ntrials>\n"
 	 "\t[-t <tcal_delay_usec>]\n"
 	 "\t[-s <skip_bytes>]\n"
 	 "\t[-f <data_file>]\n"
+	 "\t[-j <nthreads> : with -f, check the whole file (or the first <ntrials>\n"
+	 "\t\trecords) at once using <nthreads> threads (0: one per CPU) and\n"
+	 "\t\tsummarize; <data_file> may also be a -a archive]\n"
 	 "\t[-q : continue when data quality check fails]\n"
+	 "\t[-a <archive> : append every tcal to binary <archive> (see tcal2txt)]\n"
+	 "\t[-u : print the UTC of each tcal's DOR transmit time, from the index\n"
+	 "\t\tkept by readgps -m -I]\n"
+	 "\t[-c <window> : fit each DOM's clock against the DOR's over the last\n"
+	 "\t\t<window> good tcals (0: %d) and print the fit for each]\n"
+	 "\t[-D <domset> : calibrate every DOM in <domset> (e.g. 'all', '00a 01b',\n"
+	 "\t\t'3*') from one process, one tcal at a time per wire pair;\n"
+	 "\t\t-t is then the minimum time between a DOM's tcals (default 0)]\n"
 	 "\t[-d <dor_clock_mhz> (default 10)\n"
-	 "\t\tIMPORTANT: use -d 20 for non-DSB configurations\n");
+	 "\t\tIMPORTANT: use -d 20 for non-DSB configurations\n", CLK_WINDOW);
   return -1;
 }
 
 struct dh_tcalib_t tcalrec;
 
+/* Why a record failed the quality check */
+enum { TC_OK, TC_TXORDER, TC_RXORDER, TC_DORTS, TC_DOMTS, TC_RATIO, TC_DORWF, TC_DOMWF,
+       TC_NCHECK };
+
 int tcal_data_ok(int dor_clock, struct dh_tcalib_t *tcalrec, int itrial, u64 last_tx, u64 last_rx);
-void show_tcalrec(FILE *fp, struct dh_tcalib_t *tcalrec);
 int getProcFile(char *filename, int len, char *arg, int * icard, int * ipair, char * cdom);
 int chkpower(int icard, int ipair);
 
+/* Settings for the multi-DOM scheduler */
+struct tconf {
+  long ntrials;
+  unsigned long tdelay;
+  int  dor_clock;
+  int  no_show;
+  int  survive_dqfail;
+  int  clkwin;                    /* -c window, or -1 for no clock fit */
+};
+
+int run_multi(char *domset, struct tconf *cf);
+static uint64_t now_us(void);
+int run_offline(char *datafile, int skipbytes, long ntrials, int nthreads, struct tconf *cf);
+
 #define NS 512
 
 void dump_fpga(int icard) {
   char fpgacmd[NS];
   printf("Dumping FPGA proc file for card %d...\n", icard);
-  snprintf(fpgacmd, NS, "cat /proc/driver/domhub/card%d/fpga", icard);
+  snprintf(fpgacmd, NS, "cat %s" DH_PROCDIR "/card%d/fpga", dh_root(), icard);
   system(fpgacmd);
 }
 
 void dump_comstat(int icard, int ipair, char cdom) {
   char comstatcmd[NS];
   printf("Dumping comstat proc file for card %d pair %d DOM %c...\n", icard, ipair, cdom);
-  snprintf(comstatcmd, NS, "cat /proc/driver/domhub/card%d/pair%d/dom%c/comstat",
-	   icard, ipair, cdom);
+  snprintf(comstatcmd, NS, "cat %s" DH_PROCDIR "/card%d/pair%d/dom%c/comstat",
+	   dh_root(), icard, ipair, cdom);
   system(comstatcmd);
 }
 
+static struct tca_writer archive;
+static int archiving = 0;
+
+void archive_tcal(int idom, long trial, int bad, const unsigned char *packed) {
+  if(!archiving) return;
+  if(tca_append(&archive, idom, trial, tca_now_ns(), bad ? TCA_BAD : 0, packed)) {
+    fprintf(stderr, "Can't write tcal archive: %s\n", strerror(errno));
+    exit(-1);
+  }
+}
+
+/* -u: DOR time to UTC from readgps -m -I's index, per card */
+static struct gpsidx *utcidx[DH_MAXCARD];
+static int noidx[DH_MAXCARD];     /* gpsidx_open() failed; don't keep trying */
+static int showutc = 0;
+
+void show_utc(FILE *fp, int icard, u64 dor) {
+  struct timespec ts;
+  if(icard < 0 || icard >= DH_MAXCARD) {
+    fprintf(fp, "utc(unknown)");
+    return;
+  }
+  if(noidx[icard] || (!utcidx[icard] && !(utcidx[icard] = gpsidx_open(icard)))) {
+    noidx[icard] = 1;
+    fprintf(fp, "utc(no index; is readgps -m -I running?)");
+    return;
+  }
+  gpsidx_show(fp, gpsidx_utc(utcidx[icard], dor, &ts), &ts);
+}
+
 static int die=0;
 void argghhhh() { fprintf(stderr,"Caught signal, bye...\n"); die=1; }  
 
@@ -72,7 +145,7 @@ int main(int argc, char *argv[]) {
   //unsigned char tcalbuf[NTCAL];
   char single[] = "single\n";
   int no_show = 0;
-  int file, pid;
+  int file = -1, pid;
   int MAX_TCAL_TRIES = 3000;
   int nread, nwritten, ntrials = 1, itry;
   unsigned long icalib;
@@ -89,6 +162,11 @@ int main(int argc, char *argv[]) {
   int dor_clock = 10; /* 10 MHz (DSB) version is default */
   int skipbytes = 0;
   int survive_dqfail = 0;
+  char *domset = NULL;
+  char *arcfile = NULL;
+  int tdelay_set = 0;
+  int nthreads = -1;
+  int clkwin = -1;
   char c;
   static struct option long_options[] =
     {
@@ -103,7 +181,7 @@ int main(int argc, char *argv[]) {
   /************* Process command arguments ******************/
 
   while(1) {
-    c = getopt_long (argc, argv, "qht:f:s:d:o:",
+    c = getopt_long (argc, argv, "qhut:f:s:d:o:D:a:j:c:",
 		     long_options, &option_index);
     if (c == -1)
       break;
@@ -113,13 +191,14 @@ int main(int argc, char *argv[]) {
       exit(usage());
     case 't':
       tdelay = atol(optarg);
+      tdelay_set = 1;
       printf("Will use time delay of %ld microseconds between calibrations.\n",tdelay);
       break;
     case 'd':
       dor_clock = atol(optarg);
       break;
     case 'f':
-      strncpy(datafile,optarg,NS);
+      strncpy(datafile,optarg,NS-1); datafile[NS-1] = 0;
       fprintf(stderr, "Will take data from file %s....\n",datafile);
       dofile = 1;
       break;
@@ -132,6 +211,11 @@ int main(int argc, char *argv[]) {
       fprintf(stderr, "Will skip the first %d bytes...\n", skipbytes);
       break;
     case 'q': survive_dqfail = 1; break;
+    case 'D': domset = optarg; break;
+    case 'a': arcfile = optarg; break;
+    case 'j': nthreads = atoi(optarg); break;
+    case 'c': clkwin   = atoi(optarg); break;
+    case 'u': showutc  = 1; break;
     default:
       exit(usage());
     }
@@ -140,6 +224,54 @@ int main(int argc, char *argv[]) {
   argstart = optind;
   argcount = argc-optind;
 
+  if(domset) {
+    /* tcaltest -D <domset> <ntrials> [noshow] */
+    struct tconf cf;
+    if(dofile || argcount < 1) exit(usage());
+    cf.ntrials        = atol(argv[optind]);
+    cf.tdelay         = tdelay_set ? tdelay : 0;
+    cf.dor_clock      = dor_clock;
+    cf.no_show        = argcount >= 2 && !strncmp(argv[optind+1], "noshow", 6);
+    cf.survive_dqfail = survive_dqfail;
+    cf.clkwin         = clkwin;
+    if(cf.ntrials <= 0) exit(0);
+    if(arcfile) {
+      if(tca_open_write(&archive, arcfile, TCA_MULTI, dor_clock)) exit(-1);
+      archiving = 1;
+    }
+    signal(SIGQUIT, argghhhh);
+    signal(SIGINT,  argghhhh);
+    int rc = run_multi(domset, &cf);
+    if(archiving && tca_close(&archive)) {
+      fprintf(stderr, "Error writing %s.\n", arcfile);
+      rc = -1;
+    }
+    exit(rc);
+  }
+
+  if(nthreads >= 0) {
+    /* tcaltest -f <data_file> -j <nthreads> [<anything> <ntrials>] */
+    struct tconf cf;
+    if(!dofile) exit(usage());
+    memset(&cf, 0, sizeof(cf));
+    cf.dor_clock      = dor_clock;
+    cf.survive_dqfail = survive_dqfail;
+    cf.clkwin         = clkwin;
+    if(arcfile) {
+      if(tca_open_write(&archive, arcfile, TCA_MULTI, dor_clock)) exit(-1);
+      archiving = 1;
+    }
+    signal(SIGQUIT, argghhhh);
+    signal(SIGINT,  argghhhh);
+    int rc = run_offline(datafile, skipbytes, argcount >= 2 ? atol(argv[optind+1]) : -1,
+			 nthreads, &cf);
+    if(archiving && tca_close(&archive)) {
+      fprintf(stderr, "Error writing %s.\n", arcfile);
+      rc = -1;
+    }
+    exit(rc);
+  }
+
   if(!dofile && argcount < 1) exit(usage());
 
   if(argcount >= 2) ntrials = atoi(argv[optind+1]);
@@ -176,18 +308,32 @@ int main(int argc, char *argv[]) {
     if(getProcFile(datafile, NS, argv[optind], &icard, &ipair, &cdom)) exit(usage());
   }
 
+  int tcadom = dofile ? -1 : dh_dom_index(icard, ipair, cdom);
+  struct ls_slot *live = dofile ? NULL : ls_attach_dom(LS_TCALTEST, icard, ipair, cdom);
+  uint64_t twrite = 0;
+  if(arcfile) {
+    if(tca_open_write(&archive, arcfile, tcadom < 0 ? TCA_MULTI : tcadom, dor_clock))
+      exit(-1);
+    archiving = 1;
+  }
+
   signal(SIGQUIT, argghhhh); /* "Die, suckah..." */
   signal(SIGKILL, argghhhh);
   signal(SIGINT,  argghhhh);
 
-  u64 last_dor_tx, last_dor_rx;
+  u64 last_dor_tx = 0, last_dor_rx = 0;
+  struct clkfit clk;
+  if(clkwin >= 0 && clk_init(&clk, clkwin, dor_clock)) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(-1);
+  }
 
   for(icalib=0; icalib < ntrials; icalib++) {
 
     if(die) break; /* Signal handler argghhhh sets die so we quit */
 
-    /* Make sure power to this wire pair is on */
-    if(chkpower(icard, ipair)) {
+    /* Make sure power to this wire pair is on (no pair for -f) */
+    if(!dofile && chkpower(icard, ipair)) {
       fprintf(stderr, "%s: Can't perform tcalib, card %d pair %d not powered on.\n",
 	      datafile, icard, ipair);
       exit(-1);
@@ -199,7 +345,7 @@ int main(int argc, char *argv[]) {
     }
 
     if(!dofile) {
-      file = open(datafile, O_RDWR);
+      file = dh_open_dev(datafile, O_RDWR);
       if(file <= 0) {
 	fprintf(stderr,"Can't open file %s: %s\n", datafile, strerror(errno));
 	exit(errno);
@@ -211,6 +357,7 @@ int main(int argc, char *argv[]) {
 	nwritten = write(file, single, strlen(single));
 	if(nwritten != strlen(single)) {
 	  if(itry == MAX_TCAL_TRIES-1) {
+	    ls_error(live);
 	    printf("cal(%ld) WRITE FAILED: TIMEOUT\n", icalib);
 	    fprintf(stderr,"Time calibration write timeout in trial %ld.\n", icalib);
 	    dump_fpga(icard);
@@ -220,11 +367,14 @@ int main(int argc, char *argv[]) {
 	    if(! no_show) {
 	      printf("cal(%ld) WRITE RETRY(%d)\n",icalib, itry);
 	    }
+	    ls_retry(live, 1);
 	    usleep(2000);
 	    continue;
 	  }
 	} else {
 	  pprintf("cal(%ld) WRITE SUCCEEDED\n",icalib);
+	  ls_tx(live, nwritten);
+	  twrite = now_us();
 	  break;
 	}
       }
@@ -236,6 +386,7 @@ int main(int argc, char *argv[]) {
         nread = read(file, tcalrec_packed, DH_TCAL_STRUCT_LEN);        
         if(nread != DH_TCAL_STRUCT_LEN) {
             if(itry == MAX_TCAL_TRIES-1) {
+                ls_error(live);
                 printf("cal(%ld) READ FAILED: TIMEOUT!!!\n", icalib);
                 fprintf(stderr,"Time calibration read timeout in trial %ld.\n", icalib);
                 dump_fpga(icard);
@@ -245,32 +396,52 @@ int main(int argc, char *argv[]) {
                 if(! no_show) {
                     fprintf(stderr,"cal(%ld) READ RETRY(%d)\n", icalib, itry);
                 }
+                ls_retry(live, 1);
                 usleep(1000);
                 continue;
             }         
         } else {
+            int bad = 0;
+            ls_rx(live, nread, (now_us() - twrite)*1000);
             if (! dh_tcalib_unpack(&tcalrec, tcalrec_packed)) {
                 fprintf(stderr,"Error unpacking time calibiration data\n");
-                if(survive_dqfail)
-                    dqfail++;
-                else 
-                    exit(-1);
-            }
-            if(! tcal_data_ok(dor_clock, &tcalrec, icalib, last_dor_tx, last_dor_rx)) {
+                bad = 1;
+            } else if(! tcal_data_ok(dor_clock, &tcalrec, icalib, last_dor_tx, last_dor_rx)) {
                 fprintf(stderr,"Time calibration data failed quality check in trial %ld.\n",icalib);
-                if(survive_dqfail) {
-                    dqfail++;
-                } else 
-                    exit(-1);
+                bad = 1;
             } else {
                 last_dor_tx = tcalrec.dor_t0;
                 last_dor_rx = tcalrec.dor_t3;
             }
+            /* Bad ones too, so they can be looked at later */
+            archive_tcal(tcadom, icalib, bad, tcalrec_packed);
+            if(bad) {
+                ls_error(live);
+                if(survive_dqfail)
+                    dqfail++;
+                else 
+                    exit(-1);
+            }
             if(! no_show) {
                 printf("cal(%ld) ", icalib);
                 show_tcalrec(stdout, &tcalrec);
                 fflush(stdout);
             }
+            if(showutc && !dofile) {
+                printf("cal(%ld) ", icalib);
+                show_utc(stdout, icard, tcalrec.dor_t0);
+                printf("\n");
+                fflush(stdout);
+            }
+            if(clkwin >= 0 && !bad) {
+                struct clkres cr;
+                clk_update(&clk, tcalrec.dor_t0, tcalrec.dor_t3, tcalrec.dom_t1,
+                           tcalrec.dom_t2, &cr);
+                printf("cal(%ld) ", icalib);
+                clk_show(stdout, &cr);
+                printf("\n");
+                fflush(stdout);
+            }
             success++;
         }
         if(! no_show) {
@@ -283,123 +454,748 @@ int main(int argc, char *argv[]) {
   }
 
   if(dofile) close(file);
+  if(archiving && tca_close(&archive)) {
+    fprintf(stderr, "Error writing %s.\n", arcfile);
+    exit(-1);
+  }
 
+  ls_finish(live, LS_DONE);
   fprintf(stderr, "Done:\n");
   fprintf(stderr, "%s: %ld tcals, %ld rdtouts, %ld wrtouts, %ld bad.\n",
 	  datafile, success, rdtimeouts, wrtimeouts, dqfail);
+  if(clkwin >= 0) {
+    clk_report(stderr, datafile, &clk);
+    clk_free(&clk);
+  }
   return 0;
 
 }
 
-int tcal_data_ok(int dor_clock, struct dh_tcalib_t * tcalrec, int itrial,
-		 u64 last_dor_tx, u64 last_dor_rx) {
-  int dom_baseline, dor_baseline;
-  int iwf, foundthresh;
+/************* Multi-DOM (-D) scheduler ******************/
 
-#define CLOCKBITS 48
-#define MASK      ((1LL << CLOCKBITS)-1)
-#define DOR_FREQ  20000000
+/* Every DOM in the set from one loop, with the tcalib files kept open.
+   Only one tcal is in flight per wire pair at a time, alternating
+   between its A and B DOMs, and waits are driven by poll() and
+   per-DOM deadlines rather than fixed sleeps.  Proc files whose poll()
+   always says ready are found out on the first empty read and are
+   retried every RETRY_US instead. */
 
-  if(itrial > 0 && last_dor_tx > tcalrec->dor_t0 
-     && tcalrec->dor_t0 > 10*DOR_FREQ) { // Kludgy, but allow rollover if TXed value is
-                                         // within the first 10 seconds of rollover
-    fprintf(stderr, "Bad DOR TX timestamp order (cur=%lld, last=%lld)\n",
-	    (unsigned long long) tcalrec->dor_t0, (unsigned long long) last_dor_tx);
-    show_tcalrec(stderr, tcalrec);
-    return 0;
+#define MAX_TCAL_WAIT_US  3000000   /* About MAX_TCAL_TRIES x 1 ms, as above */
+#define RETRY_US          1000
+#define WRITE_RETRY_US    2000
+
+enum { TD_IDLE, TD_WRITE, TD_READ, TD_DONE };
+
+struct tpair;
+
+struct tdom {
+  char   procfile[NS];
+  char   name[16];                /* "00A" */
+  int    icard, ipair;
+  char   cdom;
+  int    fd;
+  int    state;
+  int    pollable;                /* Readiness from poll() can be trusted */
+  int    failed;
+  long   ntried, success, rdtimeouts, wrtimeouts, dqfail;
+  uint64_t tstart;                /* Start of current tcal, us */
+  uint64_t tnext;                 /* Next start (idle) or retry (write/read) */
+  uint64_t deadline;
+  u64    last_tx, last_rx;
+  struct clkfit clk;
+  struct tpair *pair;
+  struct ls_slot *live;           /* moatstat counters */
+};
+
+struct tpair {
+  struct tdom *dom[DH_NDOM];      /* A and B, NULL if not in the set */
+  struct tdom *busy;              /* DOM with a tcal in flight */
+  int    last;                    /* Index of the DOM which went last */
+};
+
+static uint64_t now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec*1000000ULL + ts.tv_nsec/1000;
+}
+
+static void tcal_release(struct tdom *d, struct tconf *cf, int *nleft) {
+  /* Current tcal is over, one way or the other; free the pair.  The
+     DOM's next one is due tdelay after this one started. */
+  d->pair->busy = NULL;
+  if(d->failed || d->ntried >= cf->ntrials) {
+    d->state = TD_DONE;
+    (*nleft)--;
+  } else {
+    d->state = TD_IDLE;
+    d->tnext = d->tstart + cf->tdelay;
   }
+}
 
-  if(itrial > 0 && last_dor_rx > tcalrec->dor_t3
-     && tcalrec->dor_t3 > 10*DOR_FREQ) {
-    fprintf(stderr, "Bad DOR RX timestamp order (cur=%lld, last=%lld)\n",
-            (unsigned long long) tcalrec->dor_t3, (unsigned long long) last_dor_rx);
-    show_tcalrec(stderr, tcalrec);
-    return 0;
+static void tcal_fail(struct tdom *d, const char *what) {
+  printf("%s cal(%ld) %s FAILED: TIMEOUT\n", d->name, d->ntried-1, what);
+  fprintf(stderr, "%s: Time calibration %s timeout in trial %ld.\n", d->procfile, what,
+	  d->ntried-1);
+  if(chkpower(d->icard, d->ipair))
+    fprintf(stderr, "%s: card %d pair %d is not powered on.\n", d->procfile, d->icard,
+	    d->ipair);
+  dump_fpga(d->icard);
+  dump_comstat(d->icard, d->ipair, d->cdom);
+  ls_error(d->live);
+  d->failed = 1;
+}
+
+static void tcal_write(struct tdom *d, uint64_t now) {
+  static const char single[] = "single\n";
+  int nwritten = write(d->fd, single, strlen(single));
+  if(nwritten == strlen(single)) {
+    ls_tx(d->live, nwritten);
+    d->state = TD_READ;
+    d->tnext = now + RETRY_US;
+    return;
   }
+  ls_retry(d->live, 1);
+  d->tnext = now + WRITE_RETRY_US;
+}
 
-  if(((tcalrec->dor_t3 - tcalrec->dor_t0)&MASK) > MAX_DOR_TSTAMP_DIFF) {
-    fprintf(stderr, "Bad DOR timestamps (wrong order or diff. to big):\n");
-    show_tcalrec(stderr, tcalrec);
+static int tcal_read(struct tdom *d, struct tconf *cf, uint64_t now, int polled) {
+  /* Returns 1 if the tcal is over (good, bad or failed) */
+  unsigned char tcalrec_packed[DH_TCAL_STRUCT_LEN];
+  int nread = read(d->fd, tcalrec_packed, DH_TCAL_STRUCT_LEN);
+  if(nread != DH_TCAL_STRUCT_LEN) {
+    if(polled && nread >= 0) d->pollable = 0; /* poll() lied; it's a plain proc file */
+    ls_retry(d->live, 1);
+    d->tnext = now + RETRY_US;
     return 0;
   }
+  ls_rx(d->live, nread, (now - d->tstart)*1000);
+  int bad = 0;
+  if(!dh_tcalib_unpack(&tcalrec, tcalrec_packed)) {
+    fprintf(stderr, "%s: Error unpacking time calibiration data\n", d->procfile);
+    bad = 1;
+  } else if(!tcal_data_ok(cf->dor_clock, &tcalrec, d->success + d->dqfail,
+			  d->last_tx, d->last_rx)) {
+    fprintf(stderr, "%s: Time calibration data failed quality check in trial %ld.\n",
+	    d->procfile, d->ntried-1);
+    bad = 1;
+  } else {
+    d->last_tx = tcalrec.dor_t0;
+    d->last_rx = tcalrec.dor_t3;
+  }
+  archive_tcal(dh_dom_index(d->icard, d->ipair, d->cdom), d->ntried-1, bad,
+	       tcalrec_packed);
+  if(bad) {
+    ls_error(d->live);
+    d->dqfail++;
+    if(!cf->survive_dqfail) d->failed = 1;
+  }
+  if(!cf->no_show) {
+    printf("%s cal(%ld) ", d->name, d->ntried-1);
+    show_tcalrec(stdout, &tcalrec);
+    printf("\n");
+    fflush(stdout);
+  }
+  if(showutc) {
+    printf("%s cal(%ld) ", d->name, d->ntried-1);
+    show_utc(stdout, d->icard, tcalrec.dor_t0);
+    printf("\n");
+    fflush(stdout);
+  }
+  if(cf->clkwin >= 0 && !bad) {
+    struct clkres cr;
+    clk_update(&d->clk, tcalrec.dor_t0, tcalrec.dor_t3, tcalrec.dom_t1, tcalrec.dom_t2, &cr);
+    printf("%s cal(%ld) ", d->name, d->ntried-1);
+    clk_show(stdout, &cr);
+    printf("\n");
+    fflush(stdout);
+  }
+  if(!bad) d->success++;
+  return 1;
+}
 
-  if(((tcalrec->dom_t2 - tcalrec->dom_t1)&MASK) > MAX_DOM_TSTAMP_DIFF) {
-    fprintf(stderr, "Bad DOM timestamps (wrong order or diff. to big):\n");
-    show_tcalrec(stderr, tcalrec);
-    return 0;
+static void tcal_totals(const char *name, struct tdom *dl, int ndoms, int icard,
+			double secs) {
+  long ok = 0, rd = 0, wr = 0, bad = 0;
+  int i, n = 0;
+  for(i=0; i<ndoms; i++) {
+    if(icard >= 0 && dl[i].icard != icard) continue;
+    ok += dl[i].success;
+    rd += dl[i].rdtimeouts;
+    wr += dl[i].wrtimeouts;
+    bad += dl[i].dqfail;
+    n++;
   }
+  fprintf(stderr, "%s: %d DOMs, %ld tcals, %ld rdtouts, %ld wrtouts, %ld bad, "
+	  "%.1f tcals/s.\n", name, n, ok, rd, wr, bad, secs > 0 ? ok/secs : 0.);
+}
 
-  /* Consistency check to timestamps: */
-  float dor_dom_ratio = (float) dor_clock / 40.0;
+int run_multi(char *domset, struct tconf *cf) {
+  struct dh_dom doms[DH_MAXDOMS];
+  struct tpair  pairs[DH_MAXCARD*DH_NPAIR];
+  struct tdom  *dl;
+  struct pollfd pfd[DH_MAXDOMS];
+  struct tdom  *pdom[DH_MAXDOMS];
+  int i, k, ndoms, nleft, anyfail = 0;
 
-  if((float) ((tcalrec->dor_t3 - tcalrec->dor_t0)&MASK) < 
-     dor_dom_ratio * ((float) ((tcalrec->dom_t2 - tcalrec->dom_t1)&MASK))) {
-    fprintf(stderr, "DOR or DOM timestamp problem (delta_dor < (%2.1f)*delta_dom:\n",
-	    dor_dom_ratio);
-    show_tcalrec(stderr, tcalrec);
-    return 0;
+  ndoms = dh_parse_domset(domset, doms, DH_MAXDOMS);
+  if(ndoms < 0) {
+    fprintf(stderr, "Bad DOM set '%s'.\n", domset);
+    return usage();
   }
+  if(ndoms == 0) {
+    fprintf(stderr, "No DOMs in '%s'.\n", domset);
+    return -1;
+  }
+  dl = calloc(ndoms, sizeof(struct tdom));
+  if(dl == NULL) {
+    fprintf(stderr, "Out of memory.\n");
+    return -1;
+  }
+  memset(pairs, 0, sizeof(pairs));
 
-#if DH_MAX_TCAL_WF_LEN < 4
-#error DH_MAX_TCAL_WF_LEN too small
-#endif
+  uint64_t t0 = now_us();
+  for(i=0; i<ndoms; i++) {
+    struct tdom *d = &dl[i];
+    if(doms[i].icard < 0) {
+      fprintf(stderr, "%s isn't a DOM device name.\n", doms[i].devfile);
+      return usage();
+    }
+    d->icard = doms[i].icard;
+    d->ipair = doms[i].ipair;
+    d->cdom  = doms[i].cdom;
+    snprintf(d->name, sizeof(d->name), "%d%d%c", d->icard, d->ipair, d->cdom);
+    dh_path(d->procfile, NS, DH_PROCDIR "/card%d/pair%d/dom%c/tcalib",
+	    d->icard, d->ipair, d->cdom);
+    d->pair = &pairs[d->icard*DH_NPAIR + d->ipair];
+    d->pair->dom[d->cdom == 'A' ? 0 : 1] = d;
+    d->pollable = 1;
+    d->tnext    = t0;
+    d->state    = TD_IDLE;
+    if(cf->clkwin >= 0 && clk_init(&d->clk, cf->clkwin, cf->dor_clock)) {
+      fprintf(stderr, "Out of memory.\n");
+      return -1;
+    }
+    if(chkpower(d->icard, d->ipair)) {
+      fprintf(stderr, "%s: Can't perform tcalib, card %d pair %d not powered on.\n",
+	      d->procfile, d->icard, d->ipair);
+      exit(-1);
+    }
+    d->fd = dh_open_dev(d->procfile, O_RDWR);
+    if(d->fd <= 0) {
+      fprintf(stderr, "Can't open file %s: %s\n", d->procfile, strerror(errno));
+      exit(errno);
+    }
+    d->live = ls_attach_dom(LS_TCALTEST, d->icard, d->ipair, d->cdom);
+  }
+  nleft = ndoms;
+  fprintf(stderr, "Will do %ld tcals on each of %d DOMs.\n", cf->ntrials, ndoms);
 
-  /* Establish DOR WF baseline */
-  dor_baseline = (int) 
-    ((tcalrec->dorwf[0] + tcalrec->dorwf[1] + tcalrec->dorwf[2] + tcalrec->dorwf[3])/4.0 + 0.5);
+  uint64_t tlast_report = t0;
+  while(!die && nleft > 0) {
+    uint64_t now = now_us();
 
-  /* Verify that some part of DOR waveform is DOR_WF_THRESH counts above baseline */
-  foundthresh = 0;
-  for(iwf=0; iwf < DH_MAX_TCAL_WF_LEN; iwf++) {
-    if(tcalrec->dorwf[iwf] - dor_baseline > DOR_WF_THRESH) {
-      foundthresh++;
+    /* Start a tcal on every idle pair, taking turns between A and B */
+    for(i=0; i<DH_MAXCARD*DH_NPAIR; i++) {
+      struct tpair *p = &pairs[i];
+      if(p->busy) continue;
+      for(k=1; k<=DH_NDOM; k++) {
+	int j = (p->last + k) % DH_NDOM;
+	struct tdom *d = p->dom[j];
+	if(d == NULL || d->state != TD_IDLE || now < d->tnext) continue;
+	p->busy  = d;
+	p->last  = j;
+	d->state = TD_WRITE;
+	d->ntried++;
+	d->tstart   = now;
+	d->deadline = now + MAX_TCAL_WAIT_US;
+	tcal_write(d, now);
+	break;
+      }
+    }
+
+    /* Wait for a record, or for the next retry, start or report */
+    uint64_t next = tlast_report + 1000000;
+    int np = 0;
+    for(i=0; i<ndoms; i++) {
+      struct tdom *d = &dl[i];
+      if(d->state == TD_DONE || (d->state == TD_IDLE && d->pair->busy)) continue;
+      if(d->state == TD_READ && d->pollable) {
+	pfd[np].fd     = d->fd;
+	pfd[np].events = POLLIN;
+	pdom[np++]     = d;
+	if(d->deadline < next) next = d->deadline;
+      } else if(d->tnext < next) {
+	next = d->tnext;
+      }
+    }
+    int tmo = next > now ? (int) ((next - now + 999)/1000) : 0;
+    int nev = poll(pfd, np, tmo);
+    if(nev < 0 && errno != EINTR) {
+      perror("poll");
       break;
     }
+
+    now = now_us();
+    for(i=0; i<np; i++) {
+      struct tdom *d = pdom[i];
+      if(!(pfd[i].revents & (POLLIN|POLLERR|POLLHUP|POLLNVAL))) continue;
+      if(tcal_read(d, cf, now, 1)) tcal_release(d, cf, &nleft);
+    }
+    for(i=0; i<ndoms; i++) {
+      struct tdom *d = &dl[i];
+      if(d->state != TD_WRITE && d->state != TD_READ) continue;
+      if(d->state == TD_WRITE && now >= d->tnext) tcal_write(d, now);
+      else if(d->state == TD_READ && !d->pollable && now >= d->tnext &&
+	      tcal_read(d, cf, now, 0)) {
+	tcal_release(d, cf, &nleft);
+	continue;
+      }
+      if(now >= d->deadline) {
+	if(d->state == TD_WRITE) d->wrtimeouts++; else d->rdtimeouts++;
+	tcal_fail(d, d->state == TD_WRITE ? "WRITE" : "READ");
+	tcal_release(d, cf, &nleft);
+      }
+    }
+    if(now - tlast_report >= 1000000) {
+      tlast_report = now;
+      tcal_totals("ALL", dl, ndoms, -1, (now - t0)*1.E-6);
+    }
+  }
+
+  double secs = (now_us() - t0)*1.E-6;
+  fprintf(stderr, "Done:\n");
+  for(i=0; i<ndoms; i++) {
+    struct tdom *d = &dl[i];
+    close(d->fd);
+    ls_finish(d->live, d->failed ? LS_FAILED : LS_DONE);
+    if(d->failed) anyfail = 1;
+    fprintf(stderr, "%s: %ld tcals, %ld rdtouts, %ld wrtouts, %ld bad, %.1f tcals/s%s.\n",
+	    d->procfile, d->success, d->rdtimeouts, d->wrtimeouts, d->dqfail,
+	    secs > 0 ? d->success/secs : 0., d->failed ? " (FAILED)" : "");
   }
-  if(!foundthresh) {
+  for(i=0; i<ndoms && cf->clkwin >= 0; i++) {
+    clk_report(stderr, dl[i].name, &dl[i].clk);
+    clk_free(&dl[i].clk);
+  }
+  for(i=0; i<DH_MAXCARD; i++) {
+    char name[16];
+    for(k=0; k<ndoms && dl[k].icard != i; k++) ;
+    if(k == ndoms) continue;
+    snprintf(name, sizeof(name), "card %d", i);
+    tcal_totals(name, dl, ndoms, i, secs);
+  }
+  tcal_totals("ALL", dl, ndoms, -1, secs);
+  free(dl);
+  return anyfail ? -1 : 0;
+}
+
+/* Cross-record check: DOR timestamps mustn't go backwards.  Kludgy, but
+   allow rollover if the new value is within the first 10 seconds. */
+static int tcal_order(u64 dor_t0, u64 dor_t3, u64 last_dor_tx, u64 last_dor_rx) {
+  if(last_dor_tx > dor_t0 && dor_t0 > 10*DOR_FREQ) return TC_TXORDER;
+  if(last_dor_rx > dor_t3 && dor_t3 > 10*DOR_FREQ) return TC_RXORDER;
+  return TC_OK;
+}
+
+/* Checks on one record by itself, given its timestamps and its
+   waveforms' tw_analyze() result */
+static int tcal_shape(int dor_clock, u64 dor_t0, u64 dor_t3, u64 dom_t1, u64 dom_t2,
+		      const struct tw_result *wf) {
+  if(((dor_t3 - dor_t0)&MASK) > MAX_DOR_TSTAMP_DIFF) return TC_DORTS;
+  if(((dom_t2 - dom_t1)&MASK) > MAX_DOM_TSTAMP_DIFF) return TC_DOMTS;
+
+  /* Consistency check to timestamps: */
+  float dor_dom_ratio = (float) dor_clock / 40.0;
+
+  if((float) ((dor_t3 - dor_t0)&MASK) < 
+     dor_dom_ratio * ((float) ((dom_t2 - dom_t1)&MASK))) return TC_RATIO;
+
+  /* Some part of each waveform must be *_WF_THRESH counts above the
+     baseline, i.e. the pulse must have a leading edge */
+  if(wf->dor.edge < 0) return TC_DORWF;
+  if(wf->dom.edge < 0) return TC_DOMWF;
+
+  return TC_OK;
+}
+
+/* Say why a record failed */
+static void tcal_complain(int why, int dor_clock, struct dh_tcalib_t *tcalrec,
+			  u64 last_dor_tx, u64 last_dor_rx) {
+  switch(why) {
+  case TC_TXORDER:
+    fprintf(stderr, "Bad DOR TX timestamp order (cur=%lld, last=%lld)\n",
+	    (unsigned long long) tcalrec->dor_t0, (unsigned long long) last_dor_tx);
+    break;
+  case TC_RXORDER:
+    fprintf(stderr, "Bad DOR RX timestamp order (cur=%lld, last=%lld)\n",
+            (unsigned long long) tcalrec->dor_t3, (unsigned long long) last_dor_rx);
+    break;
+  case TC_DORTS:
+    fprintf(stderr, "Bad DOR timestamps (wrong order or diff. to big):\n");
+    break;
+  case TC_DOMTS:
+    fprintf(stderr, "Bad DOM timestamps (wrong order or diff. to big):\n");
+    break;
+  case TC_RATIO:
+    fprintf(stderr, "DOR or DOM timestamp problem (delta_dor < (%2.1f)*delta_dom:\n",
+	    (float) dor_clock / 40.0);
+    break;
+  case TC_DORWF:
     fprintf(stderr, "Bad DOR waveform (never exceeds threshold):\n");
-    show_tcalrec(stderr, tcalrec);
-    return 0;
+    break;
+  case TC_DOMWF:
+    fprintf(stderr, "Bad DOM waveform (never exceeds threshold):\n");    
+    break;
+  }
+  show_tcalrec(stderr, tcalrec);
+}
+
+int tcal_data_ok(int dor_clock, struct dh_tcalib_t * tcalrec, int itrial,
+		 u64 last_dor_tx, u64 last_dor_rx) {
+  struct tw_result wf;
+  int why = TC_OK;
+  if(itrial > 0) why = tcal_order(tcalrec->dor_t0, tcalrec->dor_t3, last_dor_tx, last_dor_rx);
+  if(why == TC_OK) {
+    tw_analyze(tcalrec, 1, DOR_WF_THRESH, DOM_WF_THRESH, &wf);
+    why = tcal_shape(dor_clock, tcalrec->dor_t0, tcalrec->dor_t3, tcalrec->dom_t1,
+		     tcalrec->dom_t2, &wf);
   }
+  if(why == TC_OK) return 1;
+  tcal_complain(why, dor_clock, tcalrec, last_dor_tx, last_dor_rx);
+  return 0;
+}
 
-  /* Establish DOM WF baseline */
-  dom_baseline = (tcalrec->domwf[0] + tcalrec->domwf[1] + tcalrec->domwf[2] + tcalrec->domwf[3])/4;
+/************* Offline (-f -j) reanalysis ******************/
 
-  /* Verify that some part of DOM waveform is DOM_WF_THRESH counts above baseline */
-  foundthresh = 0;
-  for(iwf=0; iwf < DH_MAX_TCAL_WF_LEN; iwf++) {
-    if(tcalrec->domwf[iwf] - dom_baseline > DOM_WF_THRESH) {
-      foundthresh++;
-      break;
+/* The data file (packed records back to back, or a tcal archive) is
+   mapped and taken OFFLINE_ROUND records per thread at a time.  The
+   threads unpack and check each record by itself; then one pass, in
+   file order, does the ordering checks on dor_t0/dor_t3 against the
+   last good record from the same DOM, says why records failed (just as
+   the serial -f loop does), archives them and adds up the statistics.
+   The waveforms are done OFFLINE_BATCH records at a time by
+   tw_analyze(). */
+
+#define OFFLINE_ROUND 16384
+#define OFFLINE_BATCH 32
+
+struct ofrec {
+  u64      t0, t3, t1, t2;
+  uint32_t rtt, turn;             /* DOR round trip, DOM turnaround, ticks */
+  float    dor_edge, dom_edge;    /* Leading edges, samples */
+  uint32_t trial;
+  uint16_t dom;
+  uint8_t  why;
+  uint8_t  skip;                  /* Archive index slot */
+};
+
+struct offline {
+  const unsigned char *base;      /* Raw file: first record */
+  struct tca_reader *tca;         /* Or the archive */
+  long     nrec;
+  int      dor_clock;
+  long     first;                 /* This round */
+  struct ofrec *res;
+};
+
+struct ofjob {
+  struct offline *of;
+  long lo, hi;
+  pthread_t tid;
+};
+
+struct ofstat {
+  long     n, bad, why[TC_NCHECK];
+  double   srtt, srtt2, sturn, sturn2;
+  double   sdor, sdor2, sdom, sdom2;
+  uint32_t rttmin, rttmax, turnmin, turnmax;
+  u64      last_tx, last_rx;
+  struct clkfit clk;
+};
+
+static const char *tc_names[TC_NCHECK] = {
+  "ok", "DOR TX order", "DOR RX order", "DOR timestamps", "DOM timestamps",
+  "DOR/DOM ratio", "DOR waveform", "DOM waveform"
+};
+
+/* Packed record i in place, with its DOM and trial, or NULL for an
+   index slot */
+static const unsigned char *of_peek(struct offline *of, long i, int *dom, uint32_t *trial) {
+  const unsigned char *p;
+  if(of->tca) return tca_peek(of->tca, i, dom, trial, &p) == TCA_REC ? p : NULL;
+  *dom   = TCA_NODOM;
+  *trial = i;
+  return of->base + i*DH_TCAL_STRUCT_LEN;
+}
+
+static void *of_work(void *arg) {
+  struct ofjob *j = arg;
+  struct offline *of = j->of;
+  u64 t0[OFFLINE_BATCH], t3[OFFLINE_BATCH], t1[OFFLINE_BATCH], t2[OFFLINE_BATCH];
+  u16 dorwf[OFFLINE_BATCH*DH_MAX_TCAL_WF_LEN], domwf[OFFLINE_BATCH*DH_MAX_TCAL_WF_LEN];
+  struct dh_tcal_soa soa = { t0, t3, t1, t2, dorwf, domwf };
+  struct tw_result wf[OFFLINE_BATCH];
+  long stride = of->tca ? TCA_SLOTLEN : DH_TCAL_STRUCT_LEN;
+  long i, ibatch = 0;
+  int k, n;
+  for(i=j->lo; i<j->hi; ) {
+    /* A run of records; batches stop at archive index slots */
+    const unsigned char *p0 = NULL;
+    for(n=0; n<OFFLINE_BATCH && i<j->hi; i++) {
+      struct ofrec *r = &of->res[i - of->first];
+      int dom;
+      const unsigned char *p = of_peek(of, i, &dom, &r->trial);
+      r->skip = p == NULL;
+      if(r->skip) {
+	i++;
+	break;
+      }
+      r->dom = dom;
+      if(n++ == 0) {
+	p0 = p;
+	ibatch = i;
+      }
+    }
+    if(n == 0) continue;
+    dh_tcalib_unpack_soa(&soa, 0, p0, stride, n);
+    tw_analyze_soa(&soa, 0, n, DOR_WF_THRESH, DOM_WF_THRESH, wf);
+    for(k=0; k<n; k++) {
+      struct ofrec *o = &of->res[ibatch + k - of->first];
+      o->t0       = t0[k];
+      o->t3       = t3[k];
+      o->t1       = t1[k];
+      o->t2       = t2[k];
+      o->rtt      = (t3[k] - t0[k])&MASK;
+      o->turn     = (t2[k] - t1[k])&MASK;
+      o->dor_edge = wf[k].dor.edge;
+      o->dom_edge = wf[k].dom.edge;
+      o->why      = tcal_shape(of->dor_clock, t0[k], t3[k], t1[k], t2[k], &wf[k]);
     }
   }
-  if(!foundthresh) {
-    fprintf(stderr, "Bad DOM waveform (never exceeds threshold):\n");    
-    show_tcalrec(stderr, tcalrec);
-    return 0;
+  return NULL;
+}
+
+/* A stream's name: its DOM, or the file for raw records */
+static const char *of_name(char *buf, int len, int idom, const char *datafile) {
+  if(idom >= DH_MAXDOMS) return datafile;
+  snprintf(buf, len, "%d%d%c", idom/(DH_NPAIR*DH_NDOM), (idom/DH_NDOM)%DH_NPAIR,
+	   'A' + idom%DH_NDOM);
+  return buf;
+}
+
+static void of_add(struct ofstat *st, struct ofrec *o) {
+  if(st->n - st->bad == 0) {
+    st->rttmin  = st->rttmax  = o->rtt;
+    st->turnmin = st->turnmax = o->turn;
   }
+  st->srtt  += o->rtt;  st->srtt2  += (double) o->rtt*o->rtt;
+  st->sturn += o->turn; st->sturn2 += (double) o->turn*o->turn;
+  st->sdor  += o->dor_edge; st->sdor2 += o->dor_edge*o->dor_edge;
+  st->sdom  += o->dom_edge; st->sdom2 += o->dom_edge*o->dom_edge;
+  if(o->rtt  < st->rttmin)  st->rttmin  = o->rtt;
+  if(o->rtt  > st->rttmax)  st->rttmax  = o->rtt;
+  if(o->turn < st->turnmin) st->turnmin = o->turn;
+  if(o->turn > st->turnmax) st->turnmax = o->turn;
+}
 
+static void of_merge(struct ofstat *tot, struct ofstat *st) {
+  int k;
+  if(st->n == st->bad) {
+    tot->n += st->n; tot->bad += st->bad;
+    for(k=0; k<TC_NCHECK; k++) tot->why[k] += st->why[k];
+    return;
+  }
+  if(tot->n == tot->bad) {
+    tot->rttmin  = st->rttmin;  tot->rttmax  = st->rttmax;
+    tot->turnmin = st->turnmin; tot->turnmax = st->turnmax;
+  }
+  if(st->rttmin  < tot->rttmin)  tot->rttmin  = st->rttmin;
+  if(st->rttmax  > tot->rttmax)  tot->rttmax  = st->rttmax;
+  if(st->turnmin < tot->turnmin) tot->turnmin = st->turnmin;
+  if(st->turnmax > tot->turnmax) tot->turnmax = st->turnmax;
+  tot->n += st->n; tot->bad += st->bad;
+  tot->srtt  += st->srtt;  tot->srtt2  += st->srtt2;
+  tot->sturn += st->sturn; tot->sturn2 += st->sturn2;
+  tot->sdor  += st->sdor;  tot->sdor2  += st->sdor2;
+  tot->sdom  += st->sdom;  tot->sdom2  += st->sdom2;
+  for(k=0; k<TC_NCHECK; k++) tot->why[k] += st->why[k];
+}
 
-  return 1;
+static void of_report(const char *name, struct ofstat *st) {
+  long ngood = st->n - st->bad;
+  int k;
+  fprintf(stderr, "%s: %ld tcals, 0 rdtouts, 0 wrtouts, %ld bad.\n", name, st->n, st->bad);
+  if(ngood > 0) {
+    double mrtt = st->srtt/ngood, mturn = st->sturn/ngood;
+    double vrtt = st->srtt2/ngood - mrtt*mrtt, vturn = st->sturn2/ngood - mturn*mturn;
+    fprintf(stderr, "  DOR round trip %.1f +- %.1f ticks (%u-%u), "
+	    "DOM turnaround %.1f +- %.1f ticks (%u-%u)\n",
+	    mrtt, vrtt > 0 ? sqrt(vrtt) : 0., st->rttmin, st->rttmax,
+	    mturn, vturn > 0 ? sqrt(vturn) : 0., st->turnmin, st->turnmax);
+    double mdor = st->sdor/ngood, mdom = st->sdom/ngood;
+    double vdor = st->sdor2/ngood - mdor*mdor, vdom = st->sdom2/ngood - mdom*mdom;
+    fprintf(stderr, "  leading edge DOR %.2f +- %.2f, DOM %.2f +- %.2f samples\n",
+	    mdor, vdor > 0 ? sqrt(vdor) : 0., mdom, vdom > 0 ? sqrt(vdom) : 0.);
+  }
+  if(st->bad) {
+    fprintf(stderr, "  failed:");
+    for(k=1; k<TC_NCHECK; k++)
+      if(st->why[k]) fprintf(stderr, " %ld %s", st->why[k], tc_names[k]);
+    fprintf(stderr, "\n");
+  }
 }
 
-void show_tcalrec(FILE *fp, struct dh_tcalib_t * tcalrec) {
-  int i;
-  fprintf(fp, "dor_tx(0x%llx) ", (unsigned long long) tcalrec->dor_t0);
-  fprintf(fp, "dor_rx(0x%llx) ", (unsigned long long) tcalrec->dor_t3);
-  fprintf(fp, "dom_rx(0x%llx) ", (unsigned long long) tcalrec->dom_t1);
-  fprintf(fp, "dom_tx(0x%llx)\n", (unsigned long long) tcalrec->dom_t2);
-  fprintf(fp, "dor_wf(");
-  for(i=0; i < DH_MAX_TCAL_WF_LEN-1; i++) {
-    fprintf(fp, "%d, ", tcalrec->dorwf[i]);
-  }
-  fprintf(fp, "%d)\n", tcalrec->dorwf[DH_MAX_TCAL_WF_LEN-1]);
-  
-  fprintf(fp, "dom_wf(");
-  for(i=0; i < DH_MAX_TCAL_WF_LEN-1; i++) {
-    fprintf(fp, "%d, ", tcalrec->domwf[i]);
-  }
-  fprintf(fp, "%d)\n", tcalrec->domwf[DH_MAX_TCAL_WF_LEN-1]);
+int run_offline(char *datafile, int skipbytes, long ntrials, int nthreads, struct tconf *cf) {
+  struct offline of;
+  struct tca_reader tca;
+  struct ofstat *stats, tot;
+  struct ofjob *jobs;
+  const unsigned char *packed;
+  uint32_t ptrial;
+  int pdom;
+  struct dh_tcalib_t t;
+  struct stat sb;
+  void *map = NULL;
+  int fd = -1, i, nstream = 0, failed = 0;
+  char name[16];
+  long ifirst, k;
+
+  memset(&of, 0, sizeof(of));
+  of.dor_clock = cf->dor_clock;
+  if(nthreads <= 0) nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(nthreads <= 0) nthreads = 1;
+
+  /* Archive, or raw records? */
+  fd = open(datafile, O_RDONLY);
+  if(fd < 0 || fstat(fd, &sb)) {
+    fprintf(stderr, "Can't open file %s: %s\n", datafile, strerror(errno));
+    exit(-1);
+  }
+  char magic[8];
+  if(sb.st_size >= TCA_HDRLEN && read(fd, magic, 8) == 8 && !memcmp(magic, TCA_MAGIC, 8)) {
+    close(fd);
+    fd = -1;
+    if(tca_open_read(&tca, datafile)) exit(-1);
+    of.tca  = &tca;
+    of.nrec = tca.nslot;
+    if(tca.hdr.dor_clock != cf->dor_clock)
+      fprintf(stderr, "Warning: %s was written with -d %u.\n", datafile, tca.hdr.dor_clock);
+  } else {
+    if(sb.st_size < skipbytes) sb.st_size = skipbytes;
+    of.nrec = (sb.st_size - skipbytes)/DH_TCAL_STRUCT_LEN;
+    if((sb.st_size - skipbytes) % DH_TCAL_STRUCT_LEN)
+      fprintf(stderr, "Ignoring %ld bytes after the last whole record.\n",
+	      (long) ((sb.st_size - skipbytes) % DH_TCAL_STRUCT_LEN));
+    if(sb.st_size > 0) {
+      map = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if(map == MAP_FAILED) {
+	fprintf(stderr, "Can't map %s: %s\n", datafile, strerror(errno));
+	exit(-1);
+      }
+      madvise(map, sb.st_size, MADV_SEQUENTIAL);
+    }
+    of.base = (unsigned char *) map + skipbytes;
+  }
+  if(ntrials >= 0 && ntrials < of.nrec) of.nrec = ntrials;
+
+  stats = calloc(DH_MAXDOMS+1, sizeof(struct ofstat));
+  jobs  = calloc(nthreads, sizeof(struct ofjob));
+  of.res = malloc((long) nthreads*OFFLINE_ROUND*sizeof(struct ofrec));
+  if(!stats || !jobs || !of.res) {
+    fprintf(stderr, "Out of memory.\n");
+    exit(-1);
+  }
+  fprintf(stderr, "Checking %ld records from %s with %d threads...\n", of.nrec, datafile,
+	  nthreads);
+
+  uint64_t tstart = now_us();
+  for(ifirst=0; ifirst < of.nrec && !die && !failed; ifirst += (long) nthreads*OFFLINE_ROUND) {
+    long n = of.nrec - ifirst;
+    if(n > (long) nthreads*OFFLINE_ROUND) n = (long) nthreads*OFFLINE_ROUND;
+    of.first = ifirst;
+    for(i=0; i<nthreads; i++) {
+      jobs[i].of = &of;
+      jobs[i].lo = ifirst + n*i/nthreads;
+      jobs[i].hi = ifirst + n*(i+1)/nthreads;
+      if(i > 0 && pthread_create(&jobs[i].tid, NULL, of_work, &jobs[i])) {
+	fprintf(stderr, "Can't start thread: %s\n", strerror(errno));
+	exit(-1);
+      }
+    }
+    of_work(&jobs[0]);
+    for(i=1; i<nthreads; i++) pthread_join(jobs[i].tid, NULL);
+
+    /* In order, from here on */
+    for(k=0; k<n; k++) {
+      struct ofrec *o = &of.res[k];
+      if(o->skip) continue;
+      struct ofstat *st = &stats[o->dom < DH_MAXDOMS ? o->dom : DH_MAXDOMS];
+      int why = st->n > 0 ? tcal_order(o->t0, o->t3, st->last_tx, st->last_rx) : TC_OK;
+      if(why == TC_OK) why = o->why;
+      if(why != TC_OK) {
+	dh_tcalib_unpack(&t, of_peek(&of, ifirst+k, &pdom, &ptrial));
+	tcal_complain(why, cf->dor_clock, &t, st->last_tx, st->last_rx);
+	fprintf(stderr, "Time calibration data failed quality check in trial %u.\n", o->trial);
+	st->bad++;
+	st->why[why]++;
+      } else {
+	of_add(st, o);
+	st->last_tx = o->t0;
+	st->last_rx = o->t3;
+	if(cf->clkwin >= 0) {
+	  /* Only the interesting points, there being so many */
+	  struct clkres cr;
+	  if(!st->clk.pt && clk_init(&st->clk, cf->clkwin, cf->dor_clock)) {
+	    fprintf(stderr, "Out of memory.\n");
+	    exit(-1);
+	  }
+	  if(clk_update(&st->clk, o->t0, o->t3, o->t1, o->t2, &cr)
+	     & (CLK_OUTLIER|CLK_DELAY|CLK_RESTART)) {
+	    if(o->dom < DH_MAXDOMS) printf("%s ", of_name(name, sizeof(name), o->dom, datafile));
+	    printf("cal(%u) ", o->trial);
+	    clk_show(stdout, &cr);
+	    printf("\n");
+	  }
+	}
+      }
+      st->n++;
+      if(archiving && (packed = of_peek(&of, ifirst+k, &pdom, &ptrial)))
+	archive_tcal(o->dom, o->trial, why != TC_OK, packed);
+      if(why != TC_OK && !cf->survive_dqfail) {
+	failed = 1;
+	break;
+      }
+    }
+  }
+  double secs = (now_us() - tstart)*1.E-6;
+
+  memset(&tot, 0, sizeof(tot));
+  for(i=0; i<=DH_MAXDOMS; i++) {
+    if(!stats[i].n) continue;
+    nstream++;
+    of_merge(&tot, &stats[i]);
+  }
+  fprintf(stderr, "Done:\n");
+  of_report(datafile, &tot);
+  if(nstream > 1) {
+    for(i=0; i<DH_MAXDOMS; i++)
+      if(stats[i].n) of_report(of_name(name, sizeof(name), i, datafile), &stats[i]);
+  }
+  for(i=0; i<=DH_MAXDOMS; i++) {
+    if(!stats[i].clk.pt) continue;
+    clk_report(stderr, of_name(name, sizeof(name), i, datafile), &stats[i].clk);
+    clk_free(&stats[i].clk);
+  }
+  fprintf(stderr, "%ld records in %.3f s, %.2f M/s, %d threads.\n", tot.n, secs,
+	  secs > 0 ? tot.n/secs*1.E-6 : 0., nthreads);
+
+  free(of.res);
+  free(jobs);
+  free(stats);
+  if(of.tca) tca_close_read(&tca);
+  if(map) munmap(map, sb.st_size);
+  if(fd >= 0) close(fd);
+  return failed ? -1 : 0;
 }
 
 int getProcFile(char * filename, int len, char *arg, int *icard, int *ipair, char *cdom) {
@@ -418,10 +1214,10 @@ int getProcFile(char * filename, int len, char *arg, int *icard, int *ipair, cha
     if(*icard < 0 || *icard > 7) return 1;
     if(*ipair < 0 || *ipair > 3) return 1;
     if(*cdom != 'A' && *cdom != 'B') return 1;
-    snprintf(filename, len, "/proc/driver/domhub/card%d/pair%d/dom%c/tcalib", 
-	     *icard, *ipair, *cdom);
+    dh_path(filename, len, DH_PROCDIR "/card%d/pair%d/dom%c/tcalib",
+	    *icard, *ipair, *cdom);
   } else {
-    if(sscanf(arg, "/proc/driver/domhub/card%d/pair%d/dom%c/tcalib",
+    if(sscanf(dh_unroot(arg), DH_PROCDIR "/card%d/pair%d/dom%c/tcalib",
 	      icard, ipair, cdom) != 3) {
       fprintf(stderr, "Couldn't parse proc file string %s, sorry.\n", arg);
       return 1;
@@ -434,7 +1230,7 @@ int getProcFile(char * filename, int len, char *arg, int *icard, int *ipair, cha
 int chkpower(int icard, int ipair) {
   char buf[1024];
   char target[1024];
-  snprintf(buf,    1024, "/proc/driver/domhub/card%d/pair%d/pwr", icard, ipair);
+  dh_path(buf,     1024, DH_PROCDIR "/card%d/pair%d/pwr", icard, ipair);
   snprintf(target, 1024, "Card %d Pair %d power status is on.\n", icard, ipair);
   int fp = open(buf, O_RDONLY);
   if(fp == -1) {
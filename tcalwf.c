@@ -0,0 +1,167 @@
+/* tcalwf.c
+   Time calibration waveform kernel; see tcalwf.h.
+*/
+
+#include <linux/types.h>
+#include <pthread.h>
+#include "tcalwf.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# define TW_X86 1
+# include <immintrin.h>
+#endif
+
+#if DH_MAX_TCAL_WF_LEN < 4
+#error DH_MAX_TCAL_WF_LEN too small
+#endif
+
+/* Baselines: DOR rounds to the nearest count, DOM truncates */
+#define DOR_ROUND 2
+#define DOM_ROUND 0
+
+/* Linear interpolation of the crossing of level between samples i-1
+   and i, where wf[i-1] <= level < wf[i] */
+static float edge_at(const u16 *wf, int i, int level) {
+  if(i == 0) return 0;
+  return (i-1) + (float) (level - wf[i-1])/(wf[i] - wf[i-1]);
+}
+
+static void pulse_scalar(const u16 *wf, int thresh, int rnd, struct tw_pulse *p) {
+  int i, peak = 0, ipeak, icross;
+  int baseline = (wf[0] + wf[1] + wf[2] + wf[3] + rnd)/4;
+  int level = baseline + thresh;
+  /* Separate simple loops, which the compiler does much better with
+     than one loop doing everything */
+  for(i=0; i<DH_MAX_TCAL_WF_LEN; i++) peak = wf[i] > peak ? wf[i] : peak;
+  for(ipeak=0; wf[ipeak] != peak; ipeak++) ;
+  for(icross=0; icross<DH_MAX_TCAL_WF_LEN && wf[icross] <= level; icross++) ;
+  p->baseline = baseline;
+  p->peak     = peak;
+  p->ipeak    = ipeak;
+  p->edge     = icross == DH_MAX_TCAL_WF_LEN ? -1 : edge_at(wf, icross, level);
+}
+
+/* The kernels work on n waveform pairs, stride samples apart: rows of
+   struct dh_tcalib_t, or of dh_tcal_soa matrices */
+typedef void (*tw_impl)(const u16 *dor, const u16 *dom, long stride, int n,
+			int dor_thresh, int dom_thresh, struct tw_result *res);
+
+#define REC_STRIDE ((long) (sizeof(struct dh_tcalib_t)/sizeof(u16)))
+
+static void analyze_scalar(const u16 *dor, const u16 *dom, long stride, int n,
+			   int dor_thresh, int dom_thresh, struct tw_result *res) {
+  int i;
+  for(i=0; i<n; i++, dor += stride, dom += stride) {
+    pulse_scalar(dor, dor_thresh, DOR_ROUND, &res[i].dor);
+    pulse_scalar(dom, dom_thresh, DOM_ROUND, &res[i].dom);
+  }
+}
+
+void tw_analyze_scalar(const struct dh_tcalib_t *recs, int n, int dor_thresh, int dom_thresh,
+		       struct tw_result *res) {
+  if(n > 0) analyze_scalar(recs->dorwf, recs->domwf, REC_STRIDE, n, dor_thresh, dom_thresh, res);
+}
+
+#ifdef TW_X86
+
+#if DH_MAX_TCAL_WF_LEN != 64
+#error tw_analyze_avx2 assumes 64 sample waveforms
+#endif
+
+/* Bit i set for each of the 64 16-bit lanes of v0..v3 where e is set */
+__attribute__((target("avx2")))
+static uint64_t lanes(__m256i e0, __m256i e1, __m256i e2, __m256i e3) {
+  /* Packing the 16-bit masks to bytes interleaves 128-bit halves;
+     permute them back into order */
+  __m256i b01 = _mm256_permute4x64_epi64(_mm256_packs_epi16(e0, e1), 0xD8);
+  __m256i b23 = _mm256_permute4x64_epi64(_mm256_packs_epi16(e2, e3), 0xD8);
+  return (uint32_t) _mm256_movemask_epi8(b01)
+    | ((uint64_t) (uint32_t) _mm256_movemask_epi8(b23) << 32);
+}
+
+__attribute__((target("avx2")))
+static void pulse_avx2(const u16 *wf, int thresh, int rnd, struct tw_pulse *p) {
+  __m256i v0 = _mm256_loadu_si256((const __m256i *) wf);
+  __m256i v1 = _mm256_loadu_si256((const __m256i *) (wf+16));
+  __m256i v2 = _mm256_loadu_si256((const __m256i *) (wf+32));
+  __m256i v3 = _mm256_loadu_si256((const __m256i *) (wf+48));
+  int baseline = (wf[0] + wf[1] + wf[2] + wf[3] + rnd)/4;
+  int level = baseline + thresh;
+
+  /* Peak: max of the four, then across lanes with minpos on the
+     complement */
+  __m256i m = _mm256_max_epu16(_mm256_max_epu16(v0, v1), _mm256_max_epu16(v2, v3));
+  __m128i h = _mm_max_epu16(_mm256_castsi256_si128(m), _mm256_extracti128_si256(m, 1));
+  __m128i lo = _mm_minpos_epu16(_mm_xor_si128(h, _mm_set1_epi16(-1)));
+  int peak = 0xFFFF - (_mm_cvtsi128_si32(lo) & 0xFFFF);
+  __m256i vp = _mm256_set1_epi16((short) peak);
+  uint64_t atpeak = lanes(_mm256_cmpeq_epi16(v0, vp), _mm256_cmpeq_epi16(v1, vp),
+			  _mm256_cmpeq_epi16(v2, vp), _mm256_cmpeq_epi16(v3, vp));
+
+  /* Samples above level, compared as signed after flipping the top bit */
+  uint64_t above = 0;
+  if(level < 0) {
+    above = ~0ULL;
+  } else if(level < peak) {
+    __m256i bias = _mm256_set1_epi16((short) 0x8000);
+    __m256i vl = _mm256_set1_epi16((short) (level ^ 0x8000));
+    above = lanes(_mm256_cmpgt_epi16(_mm256_xor_si256(v0, bias), vl),
+		  _mm256_cmpgt_epi16(_mm256_xor_si256(v1, bias), vl),
+		  _mm256_cmpgt_epi16(_mm256_xor_si256(v2, bias), vl),
+		  _mm256_cmpgt_epi16(_mm256_xor_si256(v3, bias), vl));
+  }
+
+  p->baseline = baseline;
+  p->peak     = peak;
+  p->ipeak    = __builtin_ctzll(atpeak);
+  p->edge     = above ? edge_at(wf, __builtin_ctzll(above), level) : -1;
+}
+
+__attribute__((target("avx2")))
+static void analyze_avx2(const u16 *dor, const u16 *dom, long stride, int n,
+			 int dor_thresh, int dom_thresh, struct tw_result *res) {
+  int i;
+  for(i=0; i<n; i++, dor += stride, dom += stride) {
+    pulse_avx2(dor, dor_thresh, DOR_ROUND, &res[i].dor);
+    pulse_avx2(dom, dom_thresh, DOM_ROUND, &res[i].dom);
+  }
+}
+
+int tw_have_avx2(void) { return __builtin_cpu_supports("avx2"); }
+
+#else /* No x86 SIMD */
+
+#define analyze_avx2 analyze_scalar
+int tw_have_avx2(void) { return 0; }
+
+#endif /* TW_X86 */
+
+void tw_analyze_avx2(const struct dh_tcalib_t *recs, int n, int dor_thresh, int dom_thresh,
+		     struct tw_result *res) {
+  if(n > 0) analyze_avx2(recs->dorwf, recs->domwf, REC_STRIDE, n, dor_thresh, dom_thresh, res);
+}
+
+/* Chosen once, whichever of tcaltest -j's workers gets here first */
+static pthread_once_t tw_once = PTHREAD_ONCE_INIT;
+static tw_impl impl;
+
+static void tw_init(void) {
+  impl = tw_have_avx2() ? analyze_avx2 : analyze_scalar;
+}
+
+static tw_impl choose(void) {
+  pthread_once(&tw_once, tw_init);
+  return impl;
+}
+
+void tw_analyze(const struct dh_tcalib_t *recs, int n, int dor_thresh, int dom_thresh,
+		struct tw_result *res) {
+  if(n > 0) choose()(recs->dorwf, recs->domwf, REC_STRIDE, n, dor_thresh, dom_thresh, res);
+}
+
+void tw_analyze_soa(const struct dh_tcal_soa *soa, int first, int n, int dor_thresh,
+		    int dom_thresh, struct tw_result *res) {
+  if(n > 0) choose()(soa->dorwf + (long) first*DH_MAX_TCAL_WF_LEN,
+		     soa->domwf + (long) first*DH_MAX_TCAL_WF_LEN,
+		     DH_MAX_TCAL_WF_LEN, n, dor_thresh, dom_thresh, res);
+}
@@ -0,0 +1,49 @@
+/* tcalwf.h
+   Waveform kernel for time calibration pulses, shared by tcaltest and
+   tcalbench.
+
+   For the DOR and the DOM pulse of each record: the baseline (mean of
+   the first 4 samples, rounded as tcaltest always has), the peak and
+   where it is, and the leading edge -- the time, in samples and
+   linearly interpolated, at which the pulse first rises more than the
+   threshold above baseline.  A pulse passes tcaltest's waveform check
+   exactly when it has a leading edge.
+
+   Must include <linux/types.h> first.
+*/
+
+#ifndef __TCALWF_H__
+#define __TCALWF_H__
+
+#include <stdint.h>
+#include <string.h>
+#include "dh_tcalib.h"
+
+struct tw_pulse {
+  int   baseline;
+  int   peak;
+  int   ipeak;                   /* First sample at the peak */
+  float edge;                    /* Leading edge in samples, or -1 if none */
+};
+
+struct tw_result {
+  struct tw_pulse dor, dom;
+};
+
+/* Analyze n records.  dor_thresh and dom_thresh are counts above
+   baseline.  Uses AVX2 when the CPU has it. */
+void tw_analyze(const struct dh_tcalib_t *recs, int n, int dor_thresh, int dom_thresh,
+		struct tw_result *res);
+
+/* The same for rows first..first+n-1 of a dh_tcalib_unpack_soa() batch */
+void tw_analyze_soa(const struct dh_tcal_soa *soa, int first, int n, int dor_thresh,
+		    int dom_thresh, struct tw_result *res);
+
+/* The individual implementations, for tcalbench */
+void tw_analyze_scalar(const struct dh_tcalib_t *recs, int n, int dor_thresh, int dom_thresh,
+		       struct tw_result *res);
+void tw_analyze_avx2(const struct dh_tcalib_t *recs, int n, int dor_thresh, int dom_thresh,
+		     struct tw_result *res);
+int tw_have_avx2(void);
+
+#endif /* __TCALWF_H__ */
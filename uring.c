@@ -0,0 +1,135 @@
+/* uring.c
+   Minimal io_uring wrapper; see uring.h.
+*/
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uring.h"
+
+#define UR_MAX_ENTRIES 32768
+
+static int probe_ops(int fd) {
+  /* Check that the ops readwrite uses are there (the probe itself
+     needs 5.6, as does IORING_OP_READ) */
+  static const int need[] = { IORING_OP_POLL_ADD, IORING_OP_READ, IORING_OP_WRITE,
+			      IORING_OP_TIMEOUT };
+  size_t len = sizeof(struct io_uring_probe) + 256*sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *p = calloc(1, len);
+  unsigned i;
+  if(p == NULL) return -ENOMEM;
+  if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, p, 256) < 0) {
+    int err = errno;
+    free(p);
+    return -err;
+  }
+  for(i=0; i<sizeof(need)/sizeof(need[0]); i++) {
+    if(need[i] > p->last_op || !(p->ops[need[i]].flags & IO_URING_OP_SUPPORTED)) {
+      free(p);
+      return -EOPNOTSUPP;
+    }
+  }
+  free(p);
+  return 0;
+}
+
+int ur_init(struct uring *r, unsigned entries) {
+  struct io_uring_params p;
+  unsigned n = 1;
+  int err;
+
+  while(n < entries) n <<= 1;
+  if(n > UR_MAX_ENTRIES) return -EINVAL;
+  memset(r, 0, sizeof(*r));
+  memset(&p, 0, sizeof(p));
+  p.flags      = IORING_SETUP_CQSIZE;
+  p.cq_entries = 2*n;
+  r->fd = syscall(__NR_io_uring_setup, n, &p);
+  if(r->fd < 0) return -errno;
+  if(!(p.features & IORING_FEAT_NODROP) || (err = probe_ops(r->fd))) {
+    close(r->fd);
+    return (p.features & IORING_FEAT_NODROP) ? err : -EOPNOTSUPP;
+  }
+
+  r->sq_entries = p.sq_entries;
+  r->cq_entries = p.cq_entries;
+  r->sq_ring_sz = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  r->cq_ring_sz = p.cq_off.cqes  + p.cq_entries*sizeof(struct io_uring_cqe);
+  r->sqes_sz    = p.sq_entries*sizeof(struct io_uring_sqe);
+  r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    r->fd, IORING_OFF_SQ_RING);
+  r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    r->fd, IORING_OFF_CQ_RING);
+  r->sqes    = mmap(NULL, r->sqes_sz, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE,
+		    r->fd, IORING_OFF_SQES);
+  if(r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+    err = -errno;
+    ur_exit(r);
+    return err;
+  }
+  r->sq_head  = (unsigned *) ((char *) r->sq_ring + p.sq_off.head);
+  r->sq_tail  = (unsigned *) ((char *) r->sq_ring + p.sq_off.tail);
+  r->sq_mask  = (unsigned *) ((char *) r->sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) ((char *) r->sq_ring + p.sq_off.array);
+  r->cq_head  = (unsigned *) ((char *) r->cq_ring + p.cq_off.head);
+  r->cq_tail  = (unsigned *) ((char *) r->cq_ring + p.cq_off.tail);
+  r->cq_mask  = (unsigned *) ((char *) r->cq_ring + p.cq_off.ring_mask);
+  r->cqes     = (struct io_uring_cqe *) ((char *) r->cq_ring + p.cq_off.cqes);
+  r->sq_local = *r->sq_tail;
+  return 0;
+}
+
+void ur_exit(struct uring *r) {
+  /* Closing the ring cancels anything still in flight */
+  if(r->sqes    && r->sqes    != MAP_FAILED) munmap(r->sqes, r->sqes_sz);
+  if(r->cq_ring && r->cq_ring != MAP_FAILED) munmap(r->cq_ring, r->cq_ring_sz);
+  if(r->sq_ring && r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_ring_sz);
+  if(r->fd >= 0) close(r->fd);
+  r->fd = -1;
+  r->sqes = NULL;
+  r->sq_ring = r->cq_ring = NULL;
+}
+
+struct io_uring_sqe *ur_get_sqe(struct uring *r) {
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if(r->sq_local - head >= r->sq_entries) return NULL;
+  unsigned idx = r->sq_local & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[idx] = idx;
+  r->sq_local++;
+  return sqe;
+}
+
+static unsigned sq_space(struct uring *r) {
+  return r->sq_entries - (r->sq_local - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE));
+}
+
+int ur_reserve(struct uring *r, unsigned n) {
+  if(sq_space(r) >= n) return 0;
+  int err = ur_submit_and_wait(r, 0);   /* The kernel takes the SQEs as it submits */
+  if(err < 0) return err;
+  return sq_space(r) >= n ? 0 : -EBUSY;
+}
+
+int ur_submit_and_wait(struct uring *r, unsigned wait_nr) {
+  unsigned nsub = r->sq_local - *r->sq_tail;
+  __atomic_store_n(r->sq_tail, r->sq_local, __ATOMIC_RELEASE);
+  r->nenter++;
+  int n = syscall(__NR_io_uring_enter, r->fd, nsub, wait_nr,
+		  wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  return n < 0 ? -errno : n;
+}
+
+struct io_uring_cqe *ur_peek_cqe(struct uring *r) {
+  unsigned head = *r->cq_head;
+  if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void ur_cqe_seen(struct uring *r) {
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
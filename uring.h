@@ -0,0 +1,76 @@
+/* uring.h
+   Minimal io_uring wrapper for readwrite's batched I/O backend, using
+   the raw system calls so no liburing is needed.  One submitter and
+   one reaper (the same thread).
+*/
+
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+struct uring {
+  int      fd;
+  unsigned sq_entries, cq_entries;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  unsigned sq_local;            /* Our SQ tail, ahead of *sq_tail until submitted */
+  void    *sq_ring, *cq_ring;
+  size_t   sq_ring_sz, cq_ring_sz, sqes_sz;
+  long     nenter;              /* io_uring_enter calls made */
+};
+
+/* Set up a ring with room for at least entries SQEs and twice as many
+   CQEs.  Returns 0, or -errno if the kernel can't do what we need
+   (no io_uring, or no POLL_ADD, READ, WRITE or TIMEOUT). */
+int ur_init(struct uring *r, unsigned entries);
+void ur_exit(struct uring *r);
+
+/* Next free SQE, zeroed, or NULL if the SQ is full */
+struct io_uring_sqe *ur_get_sqe(struct uring *r);
+
+/* Make sure the next n ur_get_sqe() calls succeed, submitting what's
+   queued if the SQ is too full for them, so a linked chain is never
+   split across submissions.  Returns 0, or -errno (-EBUSY if the SQ
+   is just too small). */
+int ur_reserve(struct uring *r, unsigned n);
+
+/* Submit everything queued and wait for at least wait_nr completions.
+   Returns the number submitted, or -errno. */
+int ur_submit_and_wait(struct uring *r, unsigned wait_nr);
+
+/* Oldest unseen completion, or NULL; ur_cqe_seen() releases it */
+struct io_uring_cqe *ur_peek_cqe(struct uring *r);
+void ur_cqe_seen(struct uring *r);
+
+static inline void ur_prep_rw(struct io_uring_sqe *sqe, int op, int fd, void *buf,
+			      unsigned len, uint64_t data) {
+  sqe->opcode    = op;
+  sqe->fd        = fd;
+  sqe->addr      = (uintptr_t) buf;
+  sqe->len       = len;
+  sqe->off       = (uint64_t) -1;   /* Current position, as for read()/write() */
+  sqe->user_data = data;
+}
+
+static inline void ur_prep_poll(struct io_uring_sqe *sqe, int fd, unsigned events,
+				uint64_t data) {
+  sqe->opcode        = IORING_OP_POLL_ADD;
+  sqe->fd            = fd;
+  sqe->poll32_events = events;
+  sqe->user_data     = data;
+}
+
+static inline void ur_prep_timeout(struct io_uring_sqe *sqe, struct __kernel_timespec *ts,
+				   uint64_t data) {
+  sqe->opcode    = IORING_OP_TIMEOUT;
+  sqe->fd        = -1;
+  sqe->addr      = (uintptr_t) ts;
+  sqe->len       = 1;
+  sqe->user_data = data;
+}
+
+#endif /* __URING_H__ */